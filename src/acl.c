@@ -24,6 +24,7 @@
 #include "main.h"
 
 #include "acl.h"
+#include "dns-cache.h"
 #include "heap.h"
 #include "log.h"
 #include "network.h"
@@ -214,7 +215,9 @@ insert_acl (char *location, acl_access_t access_type, vector_t *access_list)
 /*
  * This function is called whenever a "string" access control is found in
  * the ACL.  From here we do both a text based string comparison, along with
- * a reverse name lookup comparison of the IP addresses.
+ * a reverse name lookup comparison of the IP addresses.  The client's
+ * name is only looked up the first time it is needed, into
+ * string_address (which starts out empty.)
  *
  * Return: 0 if host is denied
  *         1 if host is allowed
@@ -222,16 +225,16 @@ insert_acl (char *location, acl_access_t access_type, vector_t *access_list)
  */
 static int
 acl_string_processing (struct acl_s *acl,
-                       const char *ip_address, const char *string_address)
+                       const char *ip_address, char *string_address)
 {
-        int match;
-        struct addrinfo hints, *res, *ressave;
+        struct dns_answer answer;
         size_t test_length, match_length;
-        char ipbuf[512];
+        char ipbuf[INET6_ADDRSTRLEN];
+        unsigned int i;
 
         assert (acl && acl->type == ACL_STRING);
         assert (ip_address && strlen (ip_address) > 0);
-        assert (string_address && strlen (string_address) > 0);
+        assert (string_address != NULL);
 
         /*
          * If the first character of the ACL string is a period, we need to
@@ -239,34 +242,25 @@ acl_string_processing (struct acl_s *acl,
          * lookup test as well.
          */
         if (acl->address.string[0] != '.') {
-                memset (&hints, 0, sizeof (struct addrinfo));
-                hints.ai_family = AF_UNSPEC;
-                hints.ai_socktype = SOCK_STREAM;
-                if (getaddrinfo (acl->address.string, NULL, &hints, &res) != 0)
+                if (dns_cache_resolve (acl->address.string, &answer) < 0)
                         goto STRING_TEST;
 
-                ressave = res;
-
-                match = FALSE;
-                do {
-                        get_ip_string (res->ai_addr, ipbuf, sizeof (ipbuf));
+                for (i = 0; i != answer.naddrs; i++) {
+                        inet_ntop (answer.addrs[i].family,
+                                   &answer.addrs[i].u, ipbuf, sizeof (ipbuf));
                         if (strcmp (ip_address, ipbuf) == 0) {
-                                match = TRUE;
-                                break;
+                                if (acl->access == ACL_DENY)
+                                        return 0;
+                                else
+                                        return 1;
                         }
-                } while ((res = res->ai_next) != NULL);
-
-                freeaddrinfo (ressave);
-
-                if (match) {
-                        if (acl->access == ACL_DENY)
-                                return 0;
-                        else
-                                return 1;
                 }
         }
 
 STRING_TEST:
+        if (string_address[0] == '\0')
+                getpeer_hostname (ip_address, string_address);
+
         test_length = strlen (string_address);
         match_length = strlen (acl->address.string);
 
@@ -329,14 +323,16 @@ static int check_numeric_acl (const struct acl_s *acl, const char *ip)
  *     1 if allowed
  *     0 if denied
  */
-int check_acl (const char *ip, const char *host, vector_t access_list)
+int check_acl (const char *ip, vector_t access_list)
 {
         struct acl_s *acl;
+        char host[HOSTNAME_LENGTH];
         int perm = 0;
         size_t i;
 
         assert (ip != NULL);
-        assert (host != NULL);
+
+        host[0] = '\0';
 
         /*
          * If there is no access list allow everything.
@@ -371,11 +367,38 @@ int check_acl (const char *ip, const char *host, vector_t access_list)
         /*
          * Deny all connections by default.
          */
-        log_message (LOG_NOTICE, "Unauthorized connection from \"%s\" [%s].",
-                     host, ip);
+        if (host[0] == '\0')
+                log_message (LOG_NOTICE, "Unauthorized connection from [%s].",
+                             ip);
+        else
+                log_message (LOG_NOTICE,
+                             "Unauthorized connection from \"%s\" [%s].",
+                             host, ip);
         return 0;
 }
 
+/*
+ * Does the access list have rules with host names?  Those need the
+ * client's name, and the rule's addresses, looked up while the client
+ * waits.
+ */
+int acl_has_names (vector_t access_list)
+{
+        struct acl_s *acl;
+        size_t i;
+
+        if (!access_list)
+                return FALSE;
+
+        for (i = 0; i != (size_t) vector_length (access_list); ++i) {
+                acl = (struct acl_s *) vector_getentry (access_list, i, NULL);
+                if (acl->type == ACL_STRING)
+                        return TRUE;
+        }
+
+        return FALSE;
+}
+
 void flush_access_list (vector_t access_list)
 {
         struct acl_s *acl;
@@ -16,13 +16,13 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
-/* The buffer used in each connection is a linked list of lines. As the lines
- * are read in and written out the buffer expands and contracts. Basically,
- * by using this method we can increase the buffer size dynamically. However,
- * we have a hard limit of 64 KB for the size of the buffer. The buffer can be
- * thought of as a queue were we act on both the head and tail. The various
- * functions act on each end (the names are taken from what Perl uses to act on
- * the ends of an array. :)
+/* The buffer used in each connection is a ring of MAXBUFFSIZE bytes. Data
+ * is read straight into the free space and written straight out of the
+ * filled region, so nothing is copied or allocated while relaying. Either
+ * region may wrap around the end of the ring, which is why they are read
+ * and written with scatter/gather I/O. The storage itself is only
+ * allocated once the buffer is used, since many connections never need
+ * it, and can be given back whenever the buffer is empty.
  */
 
 #include "main.h"
@@ -31,73 +31,91 @@
 #include "heap.h"
 #include "log.h"
 
-#define BUFFER_HEAD(x) (x)->head
-#define BUFFER_TAIL(x) (x)->tail
+#define BUFFER_CAPACITY MAXBUFFSIZE
 
-struct bufline_s {
-        unsigned char *string;  /* the actual string of data */
-        struct bufline_s *next; /* pointer to next in linked list */
-        size_t length;          /* length of the string of data */
-        size_t pos;             /* start sending from this offset */
+struct buffer_s {
+        unsigned char *data;    /* the ring, NULL until first used */
+        size_t head;            /* offset of the oldest byte */
+        size_t size;            /* number of bytes in the ring */
 };
 
 /*
- * The buffer structure points to the beginning and end of the buffer list
- * (and includes the total size)
+ * The rings are big enough that only a few spare ones are kept around.
  */
-struct buffer_s {
-        struct bufline_s *head; /* top of the buffer */
-        struct bufline_s *tail; /* bottom of the buffer */
-        size_t size;            /* total size of the buffer */
-};
+static struct pool_s buffer_pool =
+        POOL_INITIALIZER ("buffer", sizeof (struct buffer_s), 0);
+static struct pool_s ring_pool =
+        POOL_INITIALIZER ("buffer ring", BUFFER_CAPACITY, 16);
 
 /*
- * Take a string of data and a length and make a new line which can be added
- * to the buffer. The data IS copied, so make sure if you allocated your
- * data buffer on the heap, delete it because you now have TWO copies.
+ * Make sure the ring has been allocated.
  */
-static struct bufline_s *makenewline (unsigned char *data, size_t length)
+static int buffer_storage (struct buffer_s *buffptr)
 {
-        struct bufline_s *newline;
+        if (buffptr->data)
+                return 0;
 
-        assert (data != NULL);
-        assert (length > 0);
+        buffptr->data = (unsigned char *) pool_alloc (&ring_pool);
+        if (!buffptr->data)
+                return -ENOMEM;
 
-        newline = (struct bufline_s *) safemalloc (sizeof (struct bufline_s));
-        if (!newline)
-                return NULL;
+        return 0;
+}
 
-        newline->string = (unsigned char *) safemalloc (length);
-        if (!newline->string) {
-                safefree (newline);
-                return NULL;
-        }
+/*
+ * Describe the free space of the buffer, in the order it is to be filled.
+ * Returns the number of regions (0, 1 or 2.)
+ */
+static int free_regions (struct buffer_s *buffptr, struct iovec *iov)
+{
+        size_t tail;
+
+        if (buffptr->size == BUFFER_CAPACITY)
+                return 0;
 
-        memcpy (newline->string, data, length);
+        /* Start from the beginning again while it is empty */
+        if (buffptr->size == 0)
+                buffptr->head = 0;
 
-        newline->next = NULL;
-        newline->length = length;
+        tail = (buffptr->head + buffptr->size) % BUFFER_CAPACITY;
+        iov[0].iov_base = buffptr->data + tail;
 
-        /* Position our "read" pointer at the beginning of the data */
-        newline->pos = 0;
+        if (tail < buffptr->head) {
+                iov[0].iov_len = buffptr->head - tail;
+                return 1;
+        }
 
-        return newline;
+        iov[0].iov_len = BUFFER_CAPACITY - tail;
+        if (buffptr->head == 0)
+                return 1;
+
+        iov[1].iov_base = buffptr->data;
+        iov[1].iov_len = buffptr->head;
+        return 2;
 }
 
 /*
- * Free the allocated buffer line
+ * Describe the data in the buffer, oldest first.  Returns the number of
+ * regions (0, 1 or 2.)
  */
-static void free_line (struct bufline_s *line)
+static int filled_regions (struct buffer_s *buffptr, struct iovec *iov)
 {
-        assert (line != NULL);
+        size_t end = buffptr->head + buffptr->size;
 
-        if (!line)
-                return;
+        if (buffptr->size == 0)
+                return 0;
 
-        if (line->string)
-                safefree (line->string);
+        iov[0].iov_base = buffptr->data + buffptr->head;
 
-        safefree (line);
+        if (end <= BUFFER_CAPACITY) {
+                iov[0].iov_len = buffptr->size;
+                return 1;
+        }
+
+        iov[0].iov_len = BUFFER_CAPACITY - buffptr->head;
+        iov[1].iov_base = buffptr->data;
+        iov[1].iov_len = end - BUFFER_CAPACITY;
+        return 2;
 }
 
 /*
@@ -107,37 +125,43 @@ struct buffer_s *new_buffer (void)
 {
         struct buffer_s *buffptr;
 
-        buffptr = (struct buffer_s *) safemalloc (sizeof (struct buffer_s));
+        buffptr = (struct buffer_s *) pool_alloc (&buffer_pool);
         if (!buffptr)
                 return NULL;
 
-        /*
-         * Since the buffer is initially empty, set the HEAD and TAIL
-         * pointers to NULL since they can't possibly point anywhere at the
-         * moment.
-         */
-        BUFFER_HEAD (buffptr) = BUFFER_TAIL (buffptr) = NULL;
+        buffptr->data = NULL;
+        buffptr->head = 0;
         buffptr->size = 0;
 
         return buffptr;
 }
 
 /*
- * Delete all the lines in the buffer and the buffer itself
+ * Delete the buffer and the data in it
  */
 void delete_buffer (struct buffer_s *buffptr)
 {
-        struct bufline_s *next;
+        assert (buffptr != NULL);
 
+        pool_free (&ring_pool, buffptr->data);
+        pool_free (&buffer_pool, buffptr);
+}
+
+/*
+ * Give the ring back while the buffer is empty, so that a connection
+ * which is waiting does not hold on to it.  It is taken again from the
+ * pool when there is something to put into it.
+ */
+void buffer_release (struct buffer_s *buffptr)
+{
         assert (buffptr != NULL);
 
-        while (BUFFER_HEAD (buffptr)) {
-                next = BUFFER_HEAD (buffptr)->next;
-                free_line (BUFFER_HEAD (buffptr));
-                BUFFER_HEAD (buffptr) = next;
-        }
+        if (buffptr->size > 0 || !buffptr->data)
+                return;
 
-        safefree (buffptr);
+        pool_free (&ring_pool, buffptr->data);
+        buffptr->data = NULL;
+        buffptr->head = 0;
 }
 
 /*
@@ -149,93 +173,157 @@ size_t buffer_size (struct buffer_s *buffptr)
 }
 
 /*
- * Push a new line on to the end of the buffer.
+ * Append data to the end of the buffer.  Fails if there is not enough
+ * room left for all of it.
  */
 int add_to_buffer (struct buffer_s *buffptr, unsigned char *data, size_t length)
 {
-        struct bufline_s *newline;
+        struct iovec iov[2];
+        size_t len;
+        int n, i;
 
         assert (buffptr != NULL);
         assert (data != NULL);
         assert (length > 0);
 
-        /*
-         * Sanity check here. A buffer with a non-NULL head pointer must
-         * have a size greater than zero, and vice-versa.
-         */
-        if (BUFFER_HEAD (buffptr) == NULL)
-                assert (buffptr->size == 0);
-        else
-                assert (buffptr->size > 0);
+        if (buffer_storage (buffptr) < 0)
+                return -1;
 
-        /*
-         * Make a new line so we can add it to the buffer.
-         */
-        if (!(newline = makenewline (data, length)))
+        if (length > BUFFER_CAPACITY - buffptr->size)
                 return -1;
 
-        if (buffptr->size == 0)
-                BUFFER_HEAD (buffptr) = BUFFER_TAIL (buffptr) = newline;
-        else {
-                BUFFER_TAIL (buffptr)->next = newline;
-                BUFFER_TAIL (buffptr) = newline;
-        }
+        n = free_regions (buffptr, iov);
+        for (i = 0; i < n && length > 0; i++) {
+                len = min (length, iov[i].iov_len);
+                memcpy (iov[i].iov_base, data, len);
 
-        buffptr->size += length;
+                data += len;
+                length -= len;
+                buffptr->size += len;
+        }
 
         return 0;
 }
 
 /*
- * Remove the first line from the top of the buffer
+ * Copy up to length bytes, starting offset bytes into the buffer, without
+ * removing them.  Returns the number of bytes copied.
+ */
+size_t copy_from_buffer (struct buffer_s *buffptr, size_t offset,
+                         unsigned char *data, size_t length)
+{
+        size_t start, len, copied = 0;
+
+        assert (buffptr != NULL);
+
+        if (offset >= buffptr->size)
+                return 0;
+
+        length = min (length, buffptr->size - offset);
+        start = (buffptr->head + offset) % BUFFER_CAPACITY;
+
+        while (copied < length) {
+                len = min (length - copied, BUFFER_CAPACITY - start);
+                memcpy (data + copied, buffptr->data + start, len);
+                copied += len;
+                start = 0;
+        }
+
+        return copied;
+}
+
+/*
+ * Take up to length bytes off the front of the buffer, copying them to
+ * data.  Returns the number of bytes removed.
+ */
+size_t remove_from_buffer (struct buffer_s *buffptr, unsigned char *data,
+                           size_t length)
+{
+        length = copy_from_buffer (buffptr, 0, data, length);
+
+        buffptr->head = (buffptr->head + length) % BUFFER_CAPACITY;
+        buffptr->size -= length;
+
+        return length;
+}
+
+/*
+ * Look for the byte c in the buffer, starting offset bytes in.  Returns
+ * its offset from the front of the buffer, or -1 if it is not there.
  */
-static struct bufline_s *remove_from_buffer (struct buffer_s *buffptr)
+ssize_t buffer_find (struct buffer_s *buffptr, size_t offset, int c)
 {
-        struct bufline_s *line;
+        struct iovec iov[2];
+        unsigned char *found;
+        size_t base = 0;
+        int n, i;
 
         assert (buffptr != NULL);
-        assert (BUFFER_HEAD (buffptr) != NULL);
 
-        line = BUFFER_HEAD (buffptr);
-        BUFFER_HEAD (buffptr) = line->next;
+        n = filled_regions (buffptr, iov);
+        for (i = 0; i < n; i++) {
+                unsigned char *start = (unsigned char *) iov[i].iov_base;
+
+                if (offset < iov[i].iov_len) {
+                        found = (unsigned char *) memchr (start + offset, c,
+                                                          iov[i].iov_len
+                                                          - offset);
+                        if (found)
+                                return base + (found - start);
+                        offset = 0;
+                } else {
+                        offset -= iov[i].iov_len;
+                }
 
-        buffptr->size -= line->length;
+                base += iov[i].iov_len;
+        }
 
-        return line;
+        return -1;
 }
 
 /*
- * Reads the bytes from the socket, and adds them to the buffer.
- * Takes a connection and returns the number of bytes read.
+ * Reads the bytes from the socket straight into the free space of the
+ * buffer.  Takes a connection and returns the number of bytes read.
  */
-#define READ_BUFFER_SIZE (1024 * 2)
 ssize_t read_buffer (int fd, struct buffer_s * buffptr)
 {
+        return read_buffer_max (fd, buffptr, BUFFER_CAPACITY);
+}
+
+/*
+ * As read_buffer(), but read no more than max bytes, for when the bytes
+ * after them are not meant for this buffer.
+ */
+ssize_t read_buffer_max (int fd, struct buffer_s * buffptr, size_t max)
+{
+        struct iovec iov[2];
         ssize_t bytesin;
-        unsigned char *buffer;
+        int n;
 
         assert (fd >= 0);
         assert (buffptr != NULL);
+        assert (max > 0);
 
         /*
          * Don't allow the buffer to grow larger than MAXBUFFSIZE
          */
-        if (buffptr->size >= MAXBUFFSIZE)
+        if (buffptr->size >= BUFFER_CAPACITY)
                 return 0;
 
-        buffer = (unsigned char *) safemalloc (READ_BUFFER_SIZE);
-        if (!buffer) {
+        if (buffer_storage (buffptr) < 0)
                 return -ENOMEM;
-        }
 
-        bytesin = read (fd, buffer, READ_BUFFER_SIZE);
+        n = free_regions (buffptr, iov);
+        if (iov[0].iov_len >= max) {
+                iov[0].iov_len = max;
+                n = 1;
+        } else if (n == 2 && iov[0].iov_len + iov[1].iov_len > max) {
+                iov[1].iov_len = max - iov[0].iov_len;
+        }
+        bytesin = readv (fd, iov, n);
 
         if (bytesin > 0) {
-                if (add_to_buffer (buffptr, buffer, bytesin) < 0) {
-                        log_message (LOG_ERR,
-                                     "readbuff: add_to_buffer() error.");
-                        bytesin = -1;
-                }
+                buffptr->size += bytesin;
         } else if (bytesin == 0) {
                 /* connection was closed by client */
                 bytesin = -1;
@@ -260,38 +348,54 @@ ssize_t read_buffer (int fd, struct buffer_s * buffptr)
                 }
         }
 
-        safefree (buffer);
         return bytesin;
 }
 
 /*
- * Write the bytes in the buffer to the socket.
- * Takes a connection and returns the number of bytes written.
+ * Write the bytes in the buffer to the socket, both halves of a wrapped
+ * ring at once.  Takes a connection and returns the number of bytes
+ * written.
  */
 ssize_t write_buffer (int fd, struct buffer_s * buffptr)
 {
+        return write_buffer_max (fd, buffptr, BUFFER_CAPACITY);
+}
+
+/*
+ * As write_buffer(), but write no more than max bytes, for when the bytes
+ * after them are meant for somebody else.
+ */
+ssize_t write_buffer_max (int fd, struct buffer_s * buffptr, size_t max)
+{
+        struct iovec iov[2];
+        struct msghdr msg;
         ssize_t bytessent;
-        struct bufline_s *line;
 
         assert (fd >= 0);
         assert (buffptr != NULL);
+        assert (max > 0);
 
         if (buffptr->size == 0)
                 return 0;
 
-        /* Sanity check. It would be bad to be using a NULL pointer! */
-        assert (BUFFER_HEAD (buffptr) != NULL);
-        line = BUFFER_HEAD (buffptr);
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = filled_regions (buffptr, iov);
+        if (iov[0].iov_len >= max) {
+                iov[0].iov_len = max;
+                msg.msg_iovlen = 1;
+        } else if (msg.msg_iovlen == 2
+                   && iov[0].iov_len + iov[1].iov_len > max) {
+                iov[1].iov_len = max - iov[0].iov_len;
+        }
 
-        bytessent =
-            send (fd, line->string + line->pos, line->length - line->pos,
-                  MSG_NOSIGNAL);
+        /* sendmsg() rather than writev(), for MSG_NOSIGNAL */
+        bytessent = sendmsg (fd, &msg, MSG_NOSIGNAL);
 
         if (bytessent >= 0) {
                 /* bytes sent, adjust buffer */
-                line->pos += bytessent;
-                if (line->pos == line->length)
-                        free_line (remove_from_buffer (buffptr));
+                buffptr->head = (buffptr->head + bytessent) % BUFFER_CAPACITY;
+                buffptr->size -= bytessent;
                 return bytessent;
         } else {
                 switch (errno) {
@@ -26,15 +26,31 @@ struct buffer_s;
 
 extern struct buffer_s *new_buffer (void);
 extern void delete_buffer (struct buffer_s *buffptr);
+extern void buffer_release (struct buffer_s *buffptr);
 extern size_t buffer_size (struct buffer_s *buffptr);
 
 /*
- * Add a new line to the given buffer. The data IS copied into the structure.
+ * Add data to the end of the given buffer. The data IS copied into the
+ * structure. Fails if there is not enough room left for all of it.
  */
 extern int add_to_buffer (struct buffer_s *buffptr, unsigned char *data,
                           size_t length);
 
+/*
+ * Copy data out of the buffer, either leaving it there or taking it off
+ * the front of the buffer.
+ */
+extern size_t copy_from_buffer (struct buffer_s *buffptr, size_t offset,
+                                unsigned char *data, size_t length);
+extern size_t remove_from_buffer (struct buffer_s *buffptr,
+                                  unsigned char *data, size_t length);
+extern ssize_t buffer_find (struct buffer_s *buffptr, size_t offset, int c);
+
 extern ssize_t read_buffer (int fd, struct buffer_s *buffptr);
+extern ssize_t read_buffer_max (int fd, struct buffer_s *buffptr,
+                                size_t max);
 extern ssize_t write_buffer (int fd, struct buffer_s *buffptr);
+extern ssize_t write_buffer_max (int fd, struct buffer_s *buffptr,
+                                 size_t max);
 
 #endif /* __BUFFER_H_ */
@@ -22,115 +22,144 @@
 
 #include "main.h"
 
+#include <poll.h>
+
+#include "acl.h"
 #include "child.h"
 #include "daemon.h"
+#include "dns-cache.h"
+#include "event-worker.h"
 #include "filter.h"
 #include "heap.h"
 #include "log.h"
+#include "poller.h"
 #include "reqs.h"
+#include "server-pool.h"
 #include "sock.h"
+#include "text.h"
+#include "thread-worker.h"
 #include "utils.h"
 #include "conf.h"
 
 static vector_t listen_fds;
 
 /*
- * Stores the internal data needed for each child (connection)
+ * With ReusePort, the listening sockets of each event worker.
  */
-enum child_status_t { T_EMPTY, T_WAITING, T_CONNECTED };
-struct child_s {
-        pid_t tid;
-        unsigned int connects;
-        enum child_status_t status;
-};
+static vector_t *worker_listen_fds;
+static unsigned int nworker_listen_fds;
 
 /*
- * A pointer to an array of children. A certain number of children are
- * created when the program is started.
+ * A pointer to an array of children (the scoreboard, see child.h.) A
+ * certain number of children are created when the program is started.
  */
 static struct child_s *child_ptr;
 
+/*
+ * The scoreboard entry of the current child, NULL in the parent.
+ */
+static struct child_s *child_self;
+
+/*
+ * The number of entries in child_ptr, and the mode the children were
+ * started in.  These are kept apart from the configuration, which may
+ * change when it is reloaded.
+ */
+static unsigned int child_slots;
+static worker_mode_t child_mode;
+
+/*
+ * In the threaded worker mode, the scoreboard has one entry per thread
+ * instead.  There are two sets of thread_slots entries, used by turns, so
+ * a worker replaced on reload can finish its connections while the new
+ * one is already running.
+ */
+static struct child_s *thread_board;
+static unsigned int thread_slots;
+static unsigned int thread_generation;
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t scoreboard_key;
+#endif
+
 static struct child_config_s {
         unsigned int maxclients, maxrequestsperchild;
         unsigned int maxspareservers, minspareservers, startservers;
+        worker_mode_t workermode;
+        unsigned int workers;
+        unsigned int reuseport;
 } child_config;
 
-static unsigned int *servers_waiting;   /* servers waiting for a connection */
-
 /*
- * Lock/Unlock the "servers_waiting" variable so that two children cannot
- * modify it at the same time.
+ * The number of servers waiting for a connection.  This is shared by all
+ * the children, and only ever changed with atomic operations.
  */
-#define SERVER_COUNT_LOCK()   _child_lock_wait()
-#define SERVER_COUNT_UNLOCK() _child_lock_release()
-
-/* START OF LOCKING SECTION */
+static volatile unsigned int *servers_waiting;
 
 /*
- * These variables are required for the locking mechanism.  Also included
- * are the "private" functions for locking/unlocking.
+ * The number of spare children the parent wants to retire.  An idle child
+ * takes one off this count and exits.
  */
-static struct flock lock_it, unlock_it;
-static int lock_fd = -1;
+static volatile unsigned int *servers_retire;
 
-static void _child_lock_init (void)
-{
-        char lock_file[] = "/tmp/tinyproxy.servers.lock.XXXXXX";
+/*
+ * A pipe the children use to wake up the parent when they run short of
+ * spare servers.
+ */
+static int wake_pipe[2] = { -1, -1 };
 
-        /* Only allow u+rw bits. This may be required for some versions
-         * of glibc so that mkstemp() doesn't make us vulnerable.
-         */
-        umask (0177);
+/*
+ * How many children may be created at once, and how long there has to
+ * be a surplus of spare servers before any of them are retired.
+ */
+#define MAX_SPAWN_RATE   32
+#define RETIRE_DELAY     10
 
-        lock_fd = mkstemp (lock_file);
-        unlink (lock_file);
+static unsigned int spawn_rate = 1;
+static time_t surplus_since, last_retire;
 
-        lock_it.l_type = F_WRLCK;
-        lock_it.l_whence = SEEK_SET;
-        lock_it.l_start = 0;
-        lock_it.l_len = 0;
+#define SERVER_INC() do { \
+    __sync_add_and_fetch (servers_waiting, 1); \
+    DEBUG2("INC: servers_waiting: %d", *servers_waiting); \
+} while (0)
 
-        unlock_it.l_type = F_UNLCK;
-        unlock_it.l_whence = SEEK_SET;
-        unlock_it.l_start = 0;
-        unlock_it.l_len = 0;
-}
+#define SERVER_DEC() do { \
+    assert(*servers_waiting > 0); \
+    __sync_sub_and_fetch (servers_waiting, 1); \
+    DEBUG2("DEC: servers_waiting: %d", *servers_waiting); \
+} while (0)
 
-static void _child_lock_wait (void)
+/*
+ * Should this (idle) child exit, since there are too many spare servers?
+ */
+static int child_retire (void)
 {
-        int rc;
+        unsigned int retire;
 
-        while ((rc = fcntl (lock_fd, F_SETLKW, &lock_it)) < 0) {
-                if (errno == EINTR)
-                        continue;
-                else
-                        return;
+        while ((retire = *servers_retire) > 0) {
+                if (__sync_bool_compare_and_swap (servers_retire, retire,
+                                                  retire - 1)) {
+                        log_message (LOG_NOTICE,
+                                     "Waiting servers (%d) exceeds MaxSpareServers (%d). "
+                                     "Killing child.",
+                                     *servers_waiting,
+                                     child_config.maxspareservers);
+                        return TRUE;
+                }
         }
+
+        return FALSE;
 }
 
-static void _child_lock_release (void)
+static void child_wake_parent (void)
 {
-        if (fcntl (lock_fd, F_SETLKW, &unlock_it) < 0)
+        char c = 0;
+
+        /* If the pipe is full, the parent is about to wake up anyway */
+        if (write (wake_pipe[1], &c, 1) < 0)
                 return;
 }
 
-/* END OF LOCKING SECTION */
-
-#define SERVER_INC() do { \
-    SERVER_COUNT_LOCK(); \
-    ++(*servers_waiting); \
-    DEBUG2("INC: servers_waiting: %d", *servers_waiting); \
-    SERVER_COUNT_UNLOCK(); \
-} while (0)
-
-#define SERVER_DEC() do { \
-    SERVER_COUNT_LOCK(); \
-    assert(*servers_waiting > 0); \
-    --(*servers_waiting); \
-    DEBUG2("DEC: servers_waiting: %d", *servers_waiting); \
-    SERVER_COUNT_UNLOCK(); \
-} while (0)
-
 /*
  * Set the configuration values for the various child related settings.
  */
@@ -152,6 +181,15 @@ short int child_configure (child_config_t type, unsigned int val)
         case CHILD_MAXREQUESTSPERCHILD:
                 child_config.maxrequestsperchild = val;
                 break;
+        case CHILD_WORKERMODE:
+                child_config.workermode = (worker_mode_t) val;
+                break;
+        case CHILD_WORKERS:
+                child_config.workers = val;
+                break;
+        case CHILD_REUSEPORT:
+                child_config.reuseport = val;
+                break;
         default:
                 DEBUG2 ("Invalid type (%d)", type);
                 return -1;
@@ -160,6 +198,33 @@ short int child_configure (child_config_t type, unsigned int val)
         return 0;
 }
 
+/*
+ * The number of event workers to run.  Unless configured, start one per
+ * CPU.
+ */
+static unsigned int event_worker_count (void)
+{
+        if (child_config.workers == 0) {
+                long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+                child_config.workers = ncpus > 0 ? ncpus : 1;
+        }
+
+        return child_config.workers;
+}
+
+/*
+ * The number of connection threads in the threaded worker mode.  Unless
+ * configured, start as many as MaxClients.
+ */
+static unsigned int thread_worker_count (void)
+{
+        if (child_config.workers == 0)
+                child_config.workers = child_config.maxclients;
+
+        return child_config.workers;
+}
+
 /**
  * child signal handler for sighup
  */
@@ -186,8 +251,8 @@ static void child_main (struct child_s *ptr)
         int connfd;
         struct sockaddr *cliaddr;
         socklen_t clilen;
-        fd_set rfds;
-        int maxfd = 0;
+        struct poller *poller;
+        struct poller_event ev;
         ssize_t i;
         int ret;
 
@@ -203,11 +268,14 @@ static void child_main (struct child_s *ptr)
         srand(time(NULL));
 
         /*
-         * We have to wait for connections on multiple fds,
-         * so use select.
+         * We have to wait for connections on multiple fds.
          */
-
-        FD_ZERO(&rfds);
+        poller = poller_create (vector_length(listen_fds));
+        if (!poller) {
+                log_message (LOG_CRIT,
+                             "Could not allocate memory for the poller.");
+                exit (0);
+        }
 
         for (i = 0; i < vector_length(listen_fds); i++) {
                 int *fd = (int *) vector_getentry(listen_fds, i, NULL);
@@ -220,8 +288,12 @@ static void child_main (struct child_s *ptr)
                         exit(1);
                 }
 
-                FD_SET(*fd, &rfds);
-                maxfd = max(maxfd, *fd);
+                if (poller_set (poller, *fd, POLLER_READ) != 0) {
+                        log_message(LOG_ERR, "Failed to wait for the "
+                                    "listening socket %d: %s",
+                                    *fd, strerror(errno));
+                        exit(1);
+                }
         }
 
         while (!config.quit) {
@@ -231,53 +303,55 @@ static void child_main (struct child_s *ptr)
 
                 clilen = sizeof(struct sockaddr_storage);
 
-                ret = select(maxfd + 1, &rfds, NULL, NULL, NULL);
+                /*
+                 * Wake up every second to see whether the parent wants
+                 * some of the spare children to retire.
+                 */
+                ret = poller_wait (poller, &ev, 1, 1000);
                 if (ret == -1) {
                         if (errno == EINTR) {
                                 continue;
                         }
-                        log_message (LOG_ERR, "error calling select: %s",
-                                     strerror(errno));
+                        log_message (LOG_ERR, "error waiting for "
+                                     "connections: %s", strerror(errno));
                         exit(1);
                 } else if (ret == 0) {
-                        log_message (LOG_WARNING, "Strange: select returned 0 "
-                                     "but we did not specify a timeout...");
-                        continue;
-                }
-
-                for (i = 0; i < vector_length(listen_fds); i++) {
-                        int *fd = (int *) vector_getentry(listen_fds, i, NULL);
-
-                        if (FD_ISSET(*fd, &rfds)) {
-                                /*
-                                 * only accept the connection on the first
-                                 * fd that we find readable. - fair?
-                                 */
-                                listenfd = *fd;
+                        server_pool_expire ();
+                        if (child_retire ()) {
+                                SERVER_DEC ();
                                 break;
                         }
-                }
-
-                if (listenfd == -1) {
-                        log_message(LOG_WARNING, "Strange: None of our listen "
-                                    "fds was readable after select");
                         continue;
                 }
 
-                ret = socket_blocking(listenfd);
-                if (ret != 0) {
-                        log_message(LOG_ERR, "Failed to set listening "
-                                    "socket %d to blocking for accept: %s",
-                                    listenfd, strerror(errno));
-                        exit(1);
-                }
+                /*
+                 * Only one connection is accepted per wake up, on the fd
+                 * which was reported first.
+                 */
+                listenfd = ev.fd;
 
                 /*
                  * We have a socket that is readable.
                  * Continue handling this connection.
+                 *
+                 * The listening socket stays non-blocking, so if another
+                 * child got to the connection first, we are told so
+                 * right away and go back to waiting.  The connection
+                 * itself is handled in blocking mode.
                  */
 
+#ifdef HAVE_ACCEPT4
+                connfd = accept4 (listenfd, cliaddr, &clilen, 0);
+#else
                 connfd = accept (listenfd, cliaddr, &clilen);
+                if (connfd >= 0 && socket_blocking (connfd) != 0) {
+                        close (connfd);
+                        connfd = -1;
+                }
+#endif
+                if (connfd < 0 && (errno == EAGAIN || errno == EINTR
+                                   || errno == ECONNABORTED))
+                        continue;
 
 #ifndef NDEBUG
                 /*
@@ -305,12 +379,16 @@ static void child_main (struct child_s *ptr)
                         continue;
                 }
 
-                ptr->status = T_CONNECTED;
-
                 SERVER_DEC ();
 
+                /* Tell the parent if we are running short of spares */
+                if (*servers_waiting < child_config.minspareservers)
+                        child_wake_parent ();
+
+                child_scoreboard_open ();
                 handle_connection (connfd);
-                ptr->connects++;
+                dns_cache_prefetch ();
+                child_scoreboard_close ();
 
                 if (child_config.maxrequestsperchild != 0) {
                         DEBUG2 ("%u connections so far...", ptr->connects);
@@ -323,33 +401,32 @@ static void child_main (struct child_s *ptr)
                         }
                 }
 
-                SERVER_COUNT_LOCK ();
-                if (*servers_waiting > child_config.maxspareservers) {
-                        /*
-                         * There are too many spare children, kill ourself
-                         * off.
-                         */
-                        log_message (LOG_NOTICE,
-                                     "Waiting servers (%d) exceeds MaxSpareServers (%d). "
-                                     "Killing child.",
-                                     *servers_waiting,
-                                     child_config.maxspareservers);
-                        SERVER_COUNT_UNLOCK ();
+                SERVER_INC ();
 
+                if (child_retire ()) {
+                        SERVER_DEC ();
                         break;
-                } else {
-                        SERVER_COUNT_UNLOCK ();
                 }
-
-                SERVER_INC ();
         }
 
         ptr->status = T_EMPTY;
 
+        poller_delete (poller);
         safefree (cliaddr);
         exit (0);
 }
 
+static void scoreboard_reset (struct child_s *ptr)
+{
+        ptr->tid = getpid ();
+        ptr->connects = 0;
+        ptr->active = 0;
+        ptr->bytes = 0;
+        ptr->started = time (NULL);
+        ptr->request_started = 0;
+        ptr->request[0] = '\0';
+}
+
 /*
  * Fork a child "child" (or in our case a process) and then start up the
  * child_main() function.
@@ -368,10 +445,145 @@ static pid_t child_make (struct child_s *ptr)
         set_signal_handler (SIGTERM, SIG_DFL);
         set_signal_handler (SIGHUP, child_sighup_handler);
 
+        child_self = ptr;
+        scoreboard_reset (ptr);
+
+        if (child_mode == WORKER_MODE_THREAD) {
+                struct child_s *board =
+                        thread_board + (thread_generation % 2) * thread_slots;
+                unsigned int i;
+
+                thread_worker_main (listen_fds, board, thread_slots);
+
+                for (i = 0; i != thread_slots; i++)
+                        board[i].status = T_EMPTY;
+
+                /* The slot belongs to our replacement after a reload */
+                if (ptr->tid == getpid ())
+                        ptr->status = T_EMPTY;
+                exit (0);
+        }
+
+        if (child_mode == WORKER_MODE_EVENT) {
+                if (worker_listen_fds)
+                        event_worker_main (worker_listen_fds[ptr - child_ptr]);
+                else
+                        event_worker_main (listen_fds);
+                ptr->status = T_EMPTY;
+                exit (0);
+        }
+
         child_main (ptr);       /* never returns */
         return -1;
 }
 
+/*
+ * Start the event-driven or threaded workers.  There is no spare server
+ * accounting here: each worker handles as many connections as it is
+ * given, and the parent only replaces the workers which have exited.
+ */
+static short int workers_create (void)
+{
+        unsigned int i;
+
+        for (i = 0; i != child_slots; i++) {
+                child_ptr[i].status = T_WAITING;
+                child_ptr[i].tid = child_make (&child_ptr[i]);
+
+                if (child_ptr[i].tid < 0) {
+                        log_message (LOG_WARNING,
+                                     "Could not create worker number %d of %d",
+                                     i, child_slots);
+                        return -1;
+                }
+
+                log_message (LOG_INFO,
+                             "Creating worker number %d of %d ...",
+                             i + 1, child_slots);
+        }
+
+        log_message (LOG_INFO, "Finished creating all workers.");
+
+        return 0;
+}
+
+/*
+ * Replace the workers which have exited.
+ */
+static void workers_respawn (void)
+{
+        unsigned int i;
+
+        for (i = 0; i != child_slots; i++) {
+                if (child_ptr[i].status != T_EMPTY)
+                        continue;
+
+                log_message (LOG_NOTICE, "Worker %d exited. "
+                             "Creating new worker.", i + 1);
+
+                child_ptr[i].status = T_WAITING;
+                child_ptr[i].tid = child_make (&child_ptr[i]);
+                if (child_ptr[i].tid < 0) {
+                        log_message (LOG_NOTICE, "Could not create worker");
+                        child_ptr[i].status = T_EMPTY;
+                        break;
+                }
+        }
+}
+
+/*
+ * Start a new threaded worker with the reloaded configuration, and tell
+ * the old one to finish its connections and exit.  Both of them use the
+ * same listening sockets, so no connection is refused in between.
+ */
+static void thread_worker_replace (void)
+{
+        pid_t old = child_ptr[0].tid;
+        pid_t pid;
+
+        if (child_ptr[0].status == T_EMPTY)
+                return;
+
+        thread_generation++;
+        pid = child_make (&child_ptr[0]);
+        if (pid < 0) {
+                log_message (LOG_WARNING, "Could not create a new worker "
+                             "for the reloaded configuration: %s",
+                             strerror (errno));
+                thread_generation--;
+                return;
+        }
+
+        child_ptr[0].tid = pid;
+        kill (old, SIGHUP);
+}
+
+/*
+ * Allocate the per thread scoreboard of the threaded worker mode.
+ */
+static short int thread_board_create (void)
+{
+#ifdef HAVE_PTHREAD
+        if (pthread_key_create (&scoreboard_key, NULL) != 0) {
+                log_message (LOG_ERR, "Could not create the scoreboard key.");
+                return -1;
+        }
+#endif
+
+        thread_slots = thread_worker_count ();
+        thread_board =
+            (struct child_s *) calloc_shared_memory (2 * thread_slots,
+                                                     sizeof (struct child_s));
+        if (thread_board == MAP_FAILED) {
+                thread_board = NULL;
+                log_message (LOG_ERR,
+                             "Could not allocate memory for the threads.");
+                return -1;
+        }
+
+        return 0;
+}
+
 /*
  * Create a pool of children to handle incoming connections
  */
@@ -397,17 +609,34 @@ short int child_pool_create (void)
                 return -1;
         }
 
+        child_mode = child_config.workermode;
+        if (child_mode == WORKER_MODE_EVENT) {
+                /* The lookups would hold up every connection of a worker */
+                if (acl_has_names (config.access_list))
+                        log_message (LOG_WARNING, "Allow and Deny rules "
+                                     "with host names are looked up while "
+                                     "blocking the event workers; use "
+                                     "addresses with \"WorkerMode event\".");
+                child_slots = event_worker_count ();
+        } else if (child_mode == WORKER_MODE_THREAD) {
+                child_slots = 1;
+                if (thread_board_create () != 0)
+                        return -1;
+        } else {
+                child_slots = child_config.maxclients;
+        }
+
         child_ptr =
-            (struct child_s *) calloc_shared_memory (child_config.maxclients,
+            (struct child_s *) calloc_shared_memory (child_slots,
                                                      sizeof (struct child_s));
-        if (!child_ptr) {
+        if (child_ptr == MAP_FAILED) {
                 log_message (LOG_ERR,
                              "Could not allocate memory for children.");
                 return -1;
         }
 
         servers_waiting =
-            (unsigned int *) malloc_shared_memory (sizeof (unsigned int));
+            (volatile unsigned int *) malloc_shared_memory (sizeof (unsigned int));
         if (servers_waiting == MAP_FAILED) {
                 log_message (LOG_ERR,
                              "Could not allocate memory for child counting.");
@@ -415,11 +644,22 @@ short int child_pool_create (void)
         }
         *servers_waiting = 0;
 
-        /*
-         * Create a "locking" file for use around the servers_waiting
-         * variable.
-         */
-        _child_lock_init ();
+        servers_retire =
+            (volatile unsigned int *) malloc_shared_memory (sizeof (unsigned int));
+        if (servers_retire == MAP_FAILED) {
+                log_message (LOG_ERR,
+                             "Could not allocate memory for child counting.");
+                return -1;
+        }
+        *servers_retire = 0;
+
+        if (pipe (wake_pipe) < 0
+            || socket_nonblocking (wake_pipe[0]) < 0
+            || socket_nonblocking (wake_pipe[1]) < 0) {
+                log_message (LOG_ERR, "Could not create the wake up pipe: %s",
+                             strerror (errno));
+                return -1;
+        }
 
         if (child_config.startservers > child_config.maxclients) {
                 log_message (LOG_WARNING,
@@ -429,15 +669,24 @@ short int child_pool_create (void)
                 child_config.startservers = child_config.maxclients;
         }
 
-        for (i = 0; i != child_config.maxclients; i++) {
+        for (i = 0; i != child_slots; i++) {
                 child_ptr[i].status = T_EMPTY;
                 child_ptr[i].connects = 0;
         }
 
+        if (child_mode != WORKER_MODE_PREFORK)
+                return workers_create ();
+
         for (i = 0; i != child_config.startservers; i++) {
                 DEBUG2 ("Trying to create child %d of %d", i + 1,
                         child_config.startservers);
                 child_ptr[i].status = T_WAITING;
+
+                /*
+                 * Count the child as waiting before it starts, since it
+                 * may take a connection straight away.
+                 */
+                SERVER_INC ();
                 child_ptr[i].tid = child_make (&child_ptr[i]);
 
                 if (child_ptr[i].tid < 0) {
@@ -449,8 +698,6 @@ short int child_pool_create (void)
                         log_message (LOG_INFO,
                                      "Creating child number %d of %d ...",
                                      i + 1, child_config.startservers);
-
-                        SERVER_INC ();
                 }
         }
 
@@ -460,51 +707,149 @@ short int child_pool_create (void)
 }
 
 /*
- * Keep the proper number of servers running. This is the birth of the
- * servers. It monitors this at least once a second.
+ * The number of connections waiting to be accepted, summed over all the
+ * listening sockets.  Returns 0 where the kernel does not tell us.
  */
-void child_main_loop (void)
+static unsigned int accept_queue_depth (void)
 {
+        unsigned int depth = 0;
+#ifdef HAVE_STRUCT_TCP_INFO_TCPI_UNACKED
+        struct tcp_info info;
+        socklen_t len;
+        ssize_t i;
+
+        for (i = 0; i < vector_length(listen_fds); i++) {
+                int *fd = (int *) vector_getentry(listen_fds, i, NULL);
+
+                /* For a listening socket, this is the accept queue */
+                len = sizeof (info);
+                if (getsockopt (*fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+                        depth += info.tcpi_unacked;
+        }
+#endif
+
+        return depth;
+}
+
+/*
+ * Create the number of children needed to have MinSpareServers waiting
+ * again and to take on the connections queued up in the listen backlog.
+ * While the shortage persists, the number created at once doubles each
+ * time (up to MAX_SPAWN_RATE), so the pool catches up with a burst
+ * quickly.
+ */
+static void child_spawn_servers (unsigned int waiting, unsigned int queued)
+{
+        unsigned int wanted = 0, created = 0;
         unsigned int i;
 
-        while (1) {
-                if (config.quit)
-                        return;
+        if (waiting < child_config.minspareservers)
+                wanted = child_config.minspareservers - waiting;
+        if (queued > waiting)
+                wanted += queued - waiting;
 
-                /* If there are not enough spare servers, create more */
-                SERVER_COUNT_LOCK ();
-                if (*servers_waiting < child_config.minspareservers) {
-                        log_message (LOG_NOTICE,
-                                     "Waiting servers (%d) is less than MinSpareServers (%d). "
-                                     "Creating new child.",
-                                     *servers_waiting,
-                                     child_config.minspareservers);
+        if (wanted == 0) {
+                spawn_rate = 1;
+                return;
+        }
 
-                        SERVER_COUNT_UNLOCK ();
+        if (wanted > spawn_rate)
+                wanted = spawn_rate;
 
-                        for (i = 0; i != child_config.maxclients; i++) {
-                                if (child_ptr[i].status == T_EMPTY) {
-                                        child_ptr[i].status = T_WAITING;
-                                        child_ptr[i].tid =
-                                            child_make (&child_ptr[i]);
-                                        if (child_ptr[i].tid < 0) {
-                                                log_message (LOG_NOTICE,
-                                                             "Could not create child");
+        log_message (LOG_NOTICE,
+                     "Waiting servers (%d) is less than MinSpareServers (%d), "
+                     "%d connection(s) queued. Creating %d new children.",
+                     waiting, child_config.minspareservers, queued, wanted);
 
-                                                child_ptr[i].status = T_EMPTY;
-                                                break;
-                                        }
+        for (i = 0; i != child_slots && created != wanted; i++) {
+                if (child_ptr[i].status != T_EMPTY)
+                        continue;
 
-                                        SERVER_INC ();
+                child_ptr[i].status = T_WAITING;
+                SERVER_INC ();
+                child_ptr[i].tid = child_make (&child_ptr[i]);
+                if (child_ptr[i].tid < 0) {
+                        log_message (LOG_NOTICE, "Could not create child");
 
-                                        break;
-                                }
-                        }
-                } else {
-                        SERVER_COUNT_UNLOCK ();
+                        SERVER_DEC ();
+                        child_ptr[i].status = T_EMPTY;
+                        break;
                 }
 
-                sleep (5);
+                created++;
+        }
+
+        if (spawn_rate < MAX_SPAWN_RATE)
+                spawn_rate *= 2;
+}
+
+/*
+ * Adjust the number of children to the load.  Spare servers above
+ * MaxSpareServers are only retired once the surplus has lasted for
+ * RETIRE_DELAY seconds, and then one at a time, so a pool which is
+ * hovering around the limit does not keep forking and exiting children.
+ */
+static void child_spare_servers (void)
+{
+        unsigned int waiting = *servers_waiting;
+        time_t now = time (NULL);
+
+        if (waiting <= child_config.maxspareservers) {
+                surplus_since = 0;
+                *servers_retire = 0;
+                child_spawn_servers (waiting, accept_queue_depth ());
+                return;
+        }
+
+        spawn_rate = 1;
+
+        if (surplus_since == 0) {
+                surplus_since = now;
+                return;
+        }
+
+        if (difftime (now, surplus_since) >= RETIRE_DELAY
+            && difftime (now, last_retire) >= 1 && *servers_retire == 0) {
+                *servers_retire = 1;
+                last_retire = now;
+        }
+}
+
+/*
+ * Sleep for up to a second, or until a child tells us it is running
+ * short of spare servers.
+ */
+static void child_wait_for_demand (void)
+{
+        struct pollfd pfd;
+        char buf[64];
+
+        pfd.fd = wake_pipe[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll (&pfd, 1, 1000) > 0) {
+                while (read (wake_pipe[0], buf, sizeof (buf)) > 0)
+                        continue;
+        }
+}
+
+/*
+ * Keep the proper number of servers running. This is the birth of the
+ * servers. It monitors this at least once a second.
+ */
+void child_main_loop (void)
+{
+        while (1) {
+                if (config.quit)
+                        return;
+
+                if (child_mode != WORKER_MODE_PREFORK)
+                        workers_respawn ();
+                else
+                        child_spare_servers ();
+
+                child_wait_for_demand ();
 
                 /* Handle log rotation if it was requested */
                 if (received_sighup) {
@@ -519,13 +864,109 @@ void child_main_loop (void)
 #endif /* FILTER_ENABLE */
 
                         /* propagate filter reload to all children */
-                        child_kill_children (SIGHUP);
+                        if (child_mode == WORKER_MODE_THREAD)
+                                thread_worker_replace ();
+                        else
+                                child_kill_children (SIGHUP);
 
                         received_sighup = FALSE;
                 }
         }
 }
 
+/*
+ * The scoreboard entry of the current child, or of the current thread in
+ * the threaded worker mode.
+ */
+static struct child_s *scoreboard_self (void)
+{
+#ifdef HAVE_PTHREAD
+        if (thread_board)
+                return (struct child_s *) pthread_getspecific (scoreboard_key);
+#endif
+        return child_self;
+}
+
+/*
+ * Make entry the scoreboard entry of the calling thread.
+ */
+void child_scoreboard_attach (struct child_s *entry)
+{
+        scoreboard_reset (entry);
+        entry->status = T_WAITING;
+#ifdef HAVE_PTHREAD
+        pthread_setspecific (scoreboard_key, entry);
+#endif
+}
+
+/*
+ * Record in the scoreboard that the current child has started, or
+ * finished, handling a connection.
+ */
+void child_scoreboard_open (void)
+{
+        struct child_s *self = scoreboard_self ();
+
+        if (!self)
+                return;
+
+        self->connects++;
+        self->active++;
+        self->status = T_CONNECTED;
+}
+
+void child_scoreboard_close (void)
+{
+        struct child_s *self = scoreboard_self ();
+
+        if (!self)
+                return;
+
+        if (--self->active == 0) {
+                self->status = T_WAITING;
+                self->request_started = 0;
+                self->request[0] = '\0';
+        }
+}
+
+/*
+ * Record the request line of the request the current child is handling.
+ */
+void child_scoreboard_request (const char *request)
+{
+        struct child_s *self = scoreboard_self ();
+
+        if (!self)
+                return;
+
+        strlcpy (self->request, request, SCOREBOARD_REQUEST_LEN);
+        self->request_started = time (NULL);
+}
+
+void child_scoreboard_bytes (size_t bytes)
+{
+        struct child_s *self = scoreboard_self ();
+
+        if (self)
+                self->bytes += bytes;
+}
+
+/*
+ * Return the scoreboard and the number of entries in it.  The entries
+ * are changed by the children while they are being read, so a reader
+ * must allow for a request line which is being replaced.
+ */
+const struct child_s *child_scoreboard (unsigned int *slots)
+{
+        if (thread_board) {
+                *slots = 2 * thread_slots;
+                return thread_board;
+        }
+
+        *slots = child_slots;
+        return child_ptr;
+}
+
 /*
  * Go through all the non-empty children and cancel them.
  */
@@ -533,32 +974,22 @@ void child_kill_children (int sig)
 {
         unsigned int i;
 
-        for (i = 0; i != child_config.maxclients; i++) {
+        for (i = 0; i != child_slots; i++) {
                 if (child_ptr[i].status != T_EMPTY)
                         kill (child_ptr[i].tid, sig);
         }
 }
 
 
-/**
- * Listen on the various configured interfaces
+/*
+ * Listen on the configured interfaces, adding the sockets to fds.
  */
-int child_listening_sockets(vector_t listen_addrs, uint16_t port)
+static int listen_on_addrs (vector_t listen_addrs, uint16_t port,
+                            vector_t fds, int reuseport)
 {
         int ret;
         ssize_t i;
 
-        assert (port > 0);
-
-        if (listen_fds == NULL) {
-                listen_fds = vector_create();
-                if (listen_fds == NULL) {
-                        log_message (LOG_ERR, "Could not create the list "
-                                     "of listening fds");
-                        return -1;
-                }
-        }
-
         if ((listen_addrs == NULL) ||
             (vector_length(listen_addrs) == 0))
         {
@@ -566,7 +997,7 @@ int child_listening_sockets(vector_t listen_addrs, uint16_t port)
                  * no Listen directive:
                  * listen on the wildcard address(es)
                  */
-                ret = listen_sock(NULL, port, listen_fds);
+                ret = listen_sock(NULL, port, fds, reuseport);
                 return ret;
         }
 
@@ -580,7 +1011,7 @@ int child_listening_sockets(vector_t listen_addrs, uint16_t port)
                         continue;
                 }
 
-                ret = listen_sock(addr, port, listen_fds);
+                ret = listen_sock(addr, port, fds, reuseport);
                 if (ret != 0) {
                         return ret;
                 }
@@ -589,16 +1020,99 @@ int child_listening_sockets(vector_t listen_addrs, uint16_t port)
         return 0;
 }
 
-void child_close_sock (void)
+/**
+ * Listen on the various configured interfaces
+ */
+int child_listening_sockets(vector_t listen_addrs, uint16_t port)
+{
+        unsigned int i;
+
+        assert (port > 0);
+
+        if (child_config.reuseport
+            && child_config.workermode != WORKER_MODE_EVENT) {
+                log_message (LOG_WARNING, "ReusePort is only used with "
+                             "\"WorkerMode event\". Ignoring it.");
+                child_config.reuseport = FALSE;
+        }
+#ifndef SO_REUSEPORT
+        if (child_config.reuseport) {
+                log_message (LOG_WARNING, "SO_REUSEPORT is not supported "
+                             "on this platform. Ignoring ReusePort.");
+                child_config.reuseport = FALSE;
+        }
+#endif
+
+        if (!child_config.reuseport) {
+                if (listen_fds == NULL) {
+                        listen_fds = vector_create();
+                        if (listen_fds == NULL) {
+                                log_message (LOG_ERR, "Could not create the list "
+                                             "of listening fds");
+                                return -1;
+                        }
+                }
+
+                return listen_on_addrs (listen_addrs, port, listen_fds,
+                                        FALSE);
+        }
+
+        /*
+         * Every event worker gets its own set of SO_REUSEPORT sockets.
+         * They are all created here, since we may not be allowed to bind
+         * to the port any more once the privileges are dropped.
+         */
+        nworker_listen_fds = event_worker_count ();
+        worker_listen_fds = (vector_t *) safecalloc (nworker_listen_fds,
+                                                     sizeof (vector_t));
+        if (worker_listen_fds == NULL) {
+                log_message (LOG_ERR, "Could not create the list "
+                             "of listening fds");
+                return -1;
+        }
+
+        for (i = 0; i != nworker_listen_fds; i++) {
+                worker_listen_fds[i] = vector_create();
+                if (worker_listen_fds[i] == NULL) {
+                        log_message (LOG_ERR, "Could not create the list "
+                                     "of listening fds");
+                        return -1;
+                }
+
+                if (listen_on_addrs (listen_addrs, port,
+                                     worker_listen_fds[i], TRUE) != 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+static void close_listen_fds (vector_t fds)
 {
         ssize_t i;
 
-        for (i = 0; i < vector_length(listen_fds); i++) {
-                int *fd = (int *) vector_getentry(listen_fds, i, NULL);
+        for (i = 0; i < vector_length(fds); i++) {
+                int *fd = (int *) vector_getentry(fds, i, NULL);
                 close (*fd);
         }
 
-        vector_delete(listen_fds);
+        vector_delete(fds);
+}
+
+void child_close_sock (void)
+{
+        unsigned int i;
+
+        if (listen_fds) {
+                close_listen_fds (listen_fds);
+                listen_fds = NULL;
+        }
+
+        for (i = 0; i != nworker_listen_fds; i++) {
+                if (worker_listen_fds[i])
+                        close_listen_fds (worker_listen_fds[i]);
+        }
 
-        listen_fds = NULL;
+        safefree (worker_listen_fds);
+        nworker_listen_fds = 0;
 }
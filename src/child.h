@@ -28,9 +28,43 @@ typedef enum {
         CHILD_MAXSPARESERVERS,
         CHILD_MINSPARESERVERS,
         CHILD_STARTSERVERS,
-        CHILD_MAXREQUESTSPERCHILD
+        CHILD_MAXREQUESTSPERCHILD,
+        CHILD_WORKERMODE,
+        CHILD_WORKERS,
+        CHILD_REUSEPORT
 } child_config_t;
 
+/*
+ * How the connections are spread across the children: one connection at
+ * a time per child, many connections per event-driven worker, or one
+ * connection at a time per thread of a single worker process.
+ */
+typedef enum {
+        WORKER_MODE_PREFORK,
+        WORKER_MODE_EVENT,
+        WORKER_MODE_THREAD
+} worker_mode_t;
+
+/*
+ * The scoreboard: one entry per child (or per thread in the threaded
+ * worker mode), kept in shared memory.  An entry is only written by its
+ * own child or thread (and by the parent before the child is started),
+ * and is read by the parent and the stats page without any locking.
+ */
+#define SCOREBOARD_REQUEST_LEN 128
+
+enum child_status_t { T_EMPTY, T_WAITING, T_CONNECTED };
+struct child_s {
+        pid_t tid;
+        unsigned int connects;          /* connections handled */
+        unsigned int active;            /* connections currently open */
+        volatile enum child_status_t status;
+        unsigned long bytes;            /* bytes relayed */
+        time_t started;                 /* when the child was started */
+        time_t request_started;         /* when the current request arrived */
+        char request[SCOREBOARD_REQUEST_LEN];   /* the current request line */
+};
+
 extern short int child_pool_create (void);
 extern int child_listening_sockets (vector_t listen_addrs, uint16_t port);
 extern void child_close_sock (void);
@@ -39,4 +73,11 @@ extern void child_kill_children (int sig);
 
 extern short int child_configure (child_config_t type, unsigned int val);
 
+extern void child_scoreboard_attach (struct child_s *entry);
+extern void child_scoreboard_open (void);
+extern void child_scoreboard_close (void);
+extern void child_scoreboard_request (const char *request);
+extern void child_scoreboard_bytes (size_t bytes);
+extern const struct child_s *child_scoreboard (unsigned int *slots);
+
 #endif
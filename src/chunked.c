@@ -0,0 +1,199 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A streaming decoder for the chunked transfer coding.  The body is fed
+ * through it piece by piece, as it is relayed, and the decoder keeps just
+ * enough state to know where it is: in a chunk header, in the chunk data,
+ * or in the trailer.  This tells the relay exactly where the body ends,
+ * without holding on to any of it.
+ *
+ * The data can be passed on as it is, or with the framing stripped off,
+ * for a client which does not understand the coding.  chunked_head()
+ * does the opposite, for relaying a body of unknown length in chunks.
+ */
+
+#include "main.h"
+
+#include "chunked.h"
+
+enum chunked_state {
+        CHUNK_START,            /* the first hex digit of the chunk size */
+        CHUNK_SIZE,             /* the rest of them */
+        CHUNK_EXT,              /* chunk extensions, ignored */
+        CHUNK_SIZE_LF,          /* the end of the chunk header */
+        CHUNK_DATA,
+        CHUNK_DATA_CR,          /* the line break after the data */
+        CHUNK_DATA_LF,
+        CHUNK_TRAILER,          /* the start of a trailer line */
+        CHUNK_TRAILER_LINE,
+        CHUNK_TRAILER_LF,       /* the empty line ending the trailer */
+        CHUNK_DONE
+};
+
+void chunked_init (struct chunked *c)
+{
+        c->state = CHUNK_START;
+        c->size = 0;
+}
+
+/*
+ * Has the whole body gone through the decoder?
+ */
+int chunked_done (struct chunked *c)
+{
+        return c->state == CHUNK_DONE;
+}
+
+static int hex_value (char ch)
+{
+        if (ch >= '0' && ch <= '9')
+                return ch - '0';
+        if (ch >= 'a' && ch <= 'f')
+                return ch - 'a' + 10;
+        if (ch >= 'A' && ch <= 'F')
+                return ch - 'A' + 10;
+        return -1;
+}
+
+/*
+ * Feed the next len bytes of a chunked body through the decoder.  Only
+ * the chunk data is kept if strip is set: it is moved to the front of
+ * data.  Otherwise the data is left as it is.  *out is set to the number
+ * of bytes at the front of data to pass on.
+ *
+ * Returns the number of bytes which belong to the body; anything after
+ * its end is not looked at.  Returns -1 if the body is malformed.
+ */
+ssize_t chunked_parse (struct chunked *c, char *data, size_t len,
+                       int strip, size_t *out)
+{
+        size_t i = 0, n, kept = 0;
+        int digit;
+
+        while (i < len && c->state != CHUNK_DONE) {
+                switch (c->state) {
+                case CHUNK_START:
+                        /* A size line needs at least one digit */
+                        digit = hex_value (data[i]);
+                        if (digit < 0)
+                                return -1;
+                        c->size = digit;
+                        c->state = CHUNK_SIZE;
+                        i++;
+                        break;
+
+                case CHUNK_SIZE:
+                        digit = hex_value (data[i]);
+                        if (digit >= 0) {
+                                if (c->size > (~0UL >> 4))
+                                        return -1;
+                                c->size = (c->size << 4) | digit;
+                        } else if (data[i] == ';' || data[i] == ' '
+                                   || data[i] == '\t') {
+                                c->state = CHUNK_EXT;
+                        } else if (data[i] == '\r') {
+                                c->state = CHUNK_SIZE_LF;
+                        } else if (data[i] == '\n') {
+                                c->state = c->size ? CHUNK_DATA
+                                                   : CHUNK_TRAILER;
+                        } else {
+                                return -1;
+                        }
+                        i++;
+                        break;
+
+                case CHUNK_EXT:
+                        if (data[i] == '\r')
+                                c->state = CHUNK_SIZE_LF;
+                        else if (data[i] == '\n')
+                                c->state = c->size ? CHUNK_DATA
+                                                   : CHUNK_TRAILER;
+                        i++;
+                        break;
+
+                case CHUNK_SIZE_LF:
+                        if (data[i] != '\n')
+                                return -1;
+                        c->state = c->size ? CHUNK_DATA : CHUNK_TRAILER;
+                        i++;
+                        break;
+
+                case CHUNK_DATA:
+                        n = min (len - i, c->size);
+                        if (strip && kept != i)
+                                memmove (data + kept, data + i, n);
+                        kept += n;
+                        i += n;
+                        c->size -= n;
+                        if (c->size == 0)
+                                c->state = CHUNK_DATA_CR;
+                        break;
+
+                case CHUNK_DATA_CR:
+                        if (data[i] == '\r')
+                                c->state = CHUNK_DATA_LF;
+                        else if (data[i] == '\n')
+                                c->state = CHUNK_START;
+                        else
+                                return -1;
+                        i++;
+                        break;
+
+                case CHUNK_DATA_LF:
+                        if (data[i] != '\n')
+                                return -1;
+                        c->state = CHUNK_START;
+                        i++;
+                        break;
+
+                case CHUNK_TRAILER:
+                        if (data[i] == '\r')
+                                c->state = CHUNK_TRAILER_LF;
+                        else if (data[i] == '\n')
+                                c->state = CHUNK_DONE;
+                        else
+                                c->state = CHUNK_TRAILER_LINE;
+                        i++;
+                        break;
+
+                case CHUNK_TRAILER_LINE:
+                        if (data[i] == '\n')
+                                c->state = CHUNK_TRAILER;
+                        i++;
+                        break;
+
+                case CHUNK_TRAILER_LF:
+                        if (data[i] != '\n')
+                                return -1;
+                        c->state = CHUNK_DONE;
+                        i++;
+                        break;
+                }
+        }
+
+        *out = strip ? kept : i;
+        return i;
+}
+
+/*
+ * Write the header of a chunk of len bytes into buf, which has room for
+ * CHUNK_OVERHEAD bytes.  Returns its length.
+ */
+size_t chunked_head (char *buf, size_t len)
+{
+        return snprintf (buf, CHUNK_OVERHEAD, "%lx\r\n", (unsigned long) len);
+}
@@ -0,0 +1,45 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'chunked.c' for detailed information. */
+
+#ifndef TINYPROXY_CHUNKED_H
+#define TINYPROXY_CHUNKED_H
+
+#include "common.h"
+
+/*
+ * The most a chunk header ("<hex size>\r\n") and the line break after the
+ * chunk data add to the data, as written by chunked_head().
+ */
+#define CHUNK_OVERHEAD 24
+
+/*
+ * Where the decoder is in a chunked body.
+ */
+struct chunked {
+        unsigned int state;
+        unsigned long size;     /* bytes left in the current chunk */
+};
+
+extern void chunked_init (struct chunked *c);
+extern int chunked_done (struct chunked *c);
+extern ssize_t chunked_parse (struct chunked *c, char *data, size_t len,
+                              int strip, size_t *out);
+extern size_t chunked_head (char *buf, size_t len);
+
+#endif
@@ -64,11 +64,13 @@
 #  include	<inttypes.h>
 #  include      <sys/resource.h>
 #  include	<netinet/in.h>
+#  include	<netinet/tcp.h>
 #  include      <assert.h>
 #  include	<arpa/inet.h>
 #  include	<grp.h>
 #  include	<pwd.h>
 #  include      <regex.h>
+#  include      <sched.h>
 
 /* rest - some oddball headers */
 #ifdef HAVE_VALUES_H
@@ -95,6 +97,14 @@
 #  include	<sysexits.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#  include	<sys/epoll.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#  include	<pthread.h>
+#endif
+
 /*
  * If MSG_NOSIGNAL is not defined, define it to be zero so that it doesn't
  * cause any problems.
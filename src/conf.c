@@ -123,9 +123,17 @@ static HANDLE_FUNC (handle_basicauth);
 static HANDLE_FUNC (handle_anonymous);
 static HANDLE_FUNC (handle_bind);
 static HANDLE_FUNC (handle_bindsame);
+static HANDLE_FUNC (handle_connectattemptdelay);
 static HANDLE_FUNC (handle_connectport);
+static HANDLE_FUNC (handle_connecttimeout);
 static HANDLE_FUNC (handle_defaulterrorfile);
 static HANDLE_FUNC (handle_deny);
+static HANDLE_FUNC (handle_dnscachesize);
+static HANDLE_FUNC (handle_dnscachettl);
+static HANDLE_FUNC (handle_dnsnegativettl);
+static HANDLE_FUNC (handle_dnsport);
+static HANDLE_FUNC (handle_dnsserver);
+static HANDLE_FUNC (handle_dnsstaletime);
 static HANDLE_FUNC (handle_errorfile);
 static HANDLE_FUNC (handle_addheader);
 #ifdef FILTER_ENABLE
@@ -136,10 +144,12 @@ static HANDLE_FUNC (handle_filterextended);
 static HANDLE_FUNC (handle_filterurls);
 #endif
 static HANDLE_FUNC (handle_group);
+static HANDLE_FUNC (handle_keepalivetimeout);
 static HANDLE_FUNC (handle_listen);
 static HANDLE_FUNC (handle_logfile);
 static HANDLE_FUNC (handle_loglevel);
 static HANDLE_FUNC (handle_maxclients);
+static HANDLE_FUNC (handle_maxkeepaliverequests);
 static HANDLE_FUNC (handle_maxrequestsperchild);
 static HANDLE_FUNC (handle_maxspareservers);
 static HANDLE_FUNC (handle_minspareservers);
@@ -151,6 +161,10 @@ static HANDLE_FUNC (handle_reversemagic);
 static HANDLE_FUNC (handle_reverseonly);
 static HANDLE_FUNC (handle_reversepath);
 #endif
+static HANDLE_FUNC (handle_reuseport);
+static HANDLE_FUNC (handle_serveridletimeout);
+static HANDLE_FUNC (handle_serverpoolperhost);
+static HANDLE_FUNC (handle_serverpoolsize);
 static HANDLE_FUNC (handle_startservers);
 static HANDLE_FUNC (handle_statfile);
 static HANDLE_FUNC (handle_stathost);
@@ -159,6 +173,8 @@ static HANDLE_FUNC (handle_timeout);
 
 static HANDLE_FUNC (handle_user);
 static HANDLE_FUNC (handle_viaproxyname);
+static HANDLE_FUNC (handle_workermode);
+static HANDLE_FUNC (handle_workers);
 static HANDLE_FUNC (handle_disableviaheader);
 static HANDLE_FUNC (handle_xtinyproxy);
 
@@ -214,6 +230,7 @@ struct {
         STDCONF ("syslog", BOOL, handle_syslog),
         STDCONF ("bindsame", BOOL, handle_bindsame),
         STDCONF ("disableviaheader", BOOL, handle_disableviaheader),
+        STDCONF ("reuseport", BOOL, handle_reuseport),
         /* integer arguments */
         STDCONF ("port", INT, handle_port),
         STDCONF ("maxclients", INT, handle_maxclients),
@@ -221,13 +238,27 @@ struct {
         STDCONF ("minspareservers", INT, handle_minspareservers),
         STDCONF ("startservers", INT, handle_startservers),
         STDCONF ("maxrequestsperchild", INT, handle_maxrequestsperchild),
+        STDCONF ("workers", INT, handle_workers),
         STDCONF ("timeout", INT, handle_timeout),
+        STDCONF ("keepalivetimeout", INT, handle_keepalivetimeout),
+        STDCONF ("maxkeepaliverequests", INT, handle_maxkeepaliverequests),
+        STDCONF ("serverpoolsize", INT, handle_serverpoolsize),
+        STDCONF ("serverpoolperhost", INT, handle_serverpoolperhost),
+        STDCONF ("serveridletimeout", INT, handle_serveridletimeout),
+        STDCONF ("dnscachesize", INT, handle_dnscachesize),
+        STDCONF ("dnscachettl", INT, handle_dnscachettl),
+        STDCONF ("dnsnegativettl", INT, handle_dnsnegativettl),
+        STDCONF ("dnsstaletime", INT, handle_dnsstaletime),
+        STDCONF ("dnsport", INT, handle_dnsport),
+        STDCONF ("connectattemptdelay", INT, handle_connectattemptdelay),
+        STDCONF ("connecttimeout", INT, handle_connecttimeout),
         STDCONF ("connectport", INT, handle_connectport),
         /* alphanumeric arguments */
         STDCONF ("user", ALNUM, handle_user),
         STDCONF ("group", ALNUM, handle_group),
         /* ip arguments */
         STDCONF ("listen", "(" IP "|" IPV6 ")", handle_listen),
+        STDCONF ("dnsserver", "(" IP "|" IPV6 ")", handle_dnsserver),
         STDCONF ("allow", "(" "(" IPMASK "|" IPV6MASK ")" "|" ALNUM ")",
                  handle_allow),
         STDCONF ("deny", "(" "(" IPMASK "|" IPV6MASK ")" "|" ALNUM ")",
@@ -265,6 +296,7 @@ struct {
                 END, handle_upstream, NULL
         },
 #endif
+        STDCONF ("workermode", "(prefork|event|thread)", handle_workermode),
         /* loglevel */
         STDCONF ("loglevel", "(critical|error|warning|notice|connect|info)",
                  handle_loglevel)
@@ -297,6 +329,7 @@ static void free_config (struct config_s *conf)
         safefree (conf->group);
         vector_delete(conf->listen_addrs);
         vector_delete(conf->basicauth_list);
+        vector_delete (conf->dns_servers);
 #ifdef FILTER_ENABLE
         safefree (conf->filter);
 #endif                          /* FILTER_ENABLE */
@@ -520,6 +553,18 @@ static void initialize_with_defaults (struct config_s *conf,
         }
 
         conf->idletimeout = defaults->idletimeout;
+        conf->keepalive_timeout = defaults->keepalive_timeout;
+        conf->max_keepalive_requests = defaults->max_keepalive_requests;
+        conf->server_pool_size = defaults->server_pool_size;
+        conf->server_pool_per_host = defaults->server_pool_per_host;
+        conf->server_idle_timeout = defaults->server_idle_timeout;
+        conf->dns_cache_size = defaults->dns_cache_size;
+        conf->dns_cache_ttl = defaults->dns_cache_ttl;
+        conf->dns_negative_ttl = defaults->dns_negative_ttl;
+        conf->dns_stale_time = defaults->dns_stale_time;
+        conf->dns_port = defaults->dns_port;
+        conf->connect_attempt_delay = defaults->connect_attempt_delay;
+        conf->connect_timeout = defaults->connect_timeout;
 
         if (defaults->bind_address) {
                 conf->bind_address = safestrdup (defaults->bind_address);
@@ -836,11 +881,122 @@ static HANDLE_FUNC (handle_maxrequestsperchild)
         return 0;
 }
 
+static HANDLE_FUNC (handle_workermode)
+{
+        char *arg = get_string_arg (line, &match[2]);
+
+        if (!strcasecmp (arg, "event")) {
+                safefree (arg);
+#ifdef HAVE_SYS_EPOLL_H
+                child_configure (CHILD_WORKERMODE, WORKER_MODE_EVENT);
+                return 0;
+#else
+                fprintf (stderr,
+                         "WorkerMode event is not supported on this platform\n");
+                return 1;
+#endif
+        }
+
+        if (!strcasecmp (arg, "thread")) {
+                safefree (arg);
+#ifdef HAVE_PTHREAD
+                child_configure (CHILD_WORKERMODE, WORKER_MODE_THREAD);
+                return 0;
+#else
+                fprintf (stderr,
+                         "WorkerMode thread is not supported on this platform\n");
+                return 1;
+#endif
+        }
+
+        safefree (arg);
+        child_configure (CHILD_WORKERMODE, WORKER_MODE_PREFORK);
+        return 0;
+}
+
+static HANDLE_FUNC (handle_reuseport)
+{
+        unsigned int reuseport;
+        int r = set_bool_arg (&reuseport, line, &match[2]);
+
+        if (r)
+                return r;
+
+        child_configure (CHILD_REUSEPORT, reuseport);
+        return 0;
+}
+
+static HANDLE_FUNC (handle_workers)
+{
+        child_configure (CHILD_WORKERS, get_long_arg (line, &match[2]));
+        return 0;
+}
+
 static HANDLE_FUNC (handle_timeout)
 {
         return set_int_arg (&conf->idletimeout, line, &match[2]);
 }
 
+static HANDLE_FUNC (handle_keepalivetimeout)
+{
+        return set_int_arg (&conf->keepalive_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_maxkeepaliverequests)
+{
+        return set_int_arg (&conf->max_keepalive_requests, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_serverpoolsize)
+{
+        return set_int_arg (&conf->server_pool_size, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_serverpoolperhost)
+{
+        return set_int_arg (&conf->server_pool_per_host, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_serveridletimeout)
+{
+        return set_int_arg (&conf->server_idle_timeout, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnscachesize)
+{
+        return set_int_arg (&conf->dns_cache_size, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnscachettl)
+{
+        return set_int_arg (&conf->dns_cache_ttl, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnsnegativettl)
+{
+        return set_int_arg (&conf->dns_negative_ttl, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnsstaletime)
+{
+        return set_int_arg (&conf->dns_stale_time, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_dnsport)
+{
+        return set_int_arg (&conf->dns_port, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_connectattemptdelay)
+{
+        return set_int_arg (&conf->connect_attempt_delay, line, &match[2]);
+}
+
+static HANDLE_FUNC (handle_connecttimeout)
+{
+        return set_int_arg (&conf->connect_timeout, line, &match[2]);
+}
+
 static HANDLE_FUNC (handle_connectport)
 {
         add_connect_port_allowed (get_long_arg (line, &match[2]),
@@ -913,6 +1069,27 @@ static HANDLE_FUNC (handle_listen)
         return 0;
 }
 
+static HANDLE_FUNC (handle_dnsserver)
+{
+        char *arg = get_string_arg (line, &match[2]);
+
+        if (arg == NULL)
+                return -1;
+
+        if (conf->dns_servers == NULL) {
+                conf->dns_servers = vector_create ();
+                if (conf->dns_servers == NULL) {
+                        safefree (arg);
+                        return -1;
+                }
+        }
+
+        vector_append (conf->dns_servers, arg, strlen (arg) + 1);
+
+        safefree (arg);
+        return 0;
+}
+
 static HANDLE_FUNC (handle_errorfile)
 {
         /*
@@ -68,6 +68,54 @@ struct config_s {
 #endif                          /* UPSTREAM_SUPPORT */
         char *pidpath;
         unsigned int idletimeout;
+
+        /*
+         * How long a client connection is kept open for the next
+         * request (0 closes it after every response), and for how many
+         * requests at most (0 for no limit.)
+         */
+        unsigned int keepalive_timeout;
+        unsigned int max_keepalive_requests;
+
+        /*
+         * How many idle connections to servers each worker keeps for
+         * reuse (0 for none), how many of them for any one server (0
+         * for no limit), and for how many seconds.
+         */
+        unsigned int server_pool_size;
+        unsigned int server_pool_per_host;
+        unsigned int server_idle_timeout;
+
+        /*
+         * How many hostnames the DNS cache holds (0 for no cache), for
+         * how many seconds an answer is used, and a hostname which does
+         * not exist is remembered, and for how many seconds more an
+         * expired answer may be used when the resolver fails.
+         */
+        unsigned int dns_cache_size;
+        unsigned int dns_cache_ttl;
+        unsigned int dns_negative_ttl;
+        unsigned int dns_stale_time;
+
+        /*
+         * The name servers to ask instead of those in resolv.conf, and
+         * their port.
+         */
+        vector_t dns_servers;
+        unsigned int dns_port;
+
+        /*
+         * Milliseconds to wait for a server address to connect before
+         * the next one is tried as well.
+         */
+        unsigned int connect_attempt_delay;
+
+        /*
+         * Seconds an address is given to connect before it is given up
+         * on (0 leaves it to the kernel.)
+         */
+        unsigned int connect_timeout;
+
         char *bind_address;
         unsigned int bindsame;
 
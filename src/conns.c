@@ -26,12 +26,17 @@
 
 #include "buffer.h"
 #include "conns.h"
+#include "dns-cache.h"
 #include "heap.h"
 #include "log.h"
+#include "server-pool.h"
+#include "sock.h"
 #include "stats.h"
 
+static struct pool_s conn_pool =
+        POOL_INITIALIZER ("connection", sizeof (struct conn_s), 0);
+
 struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
-                                const char *string_addr,
                                 const char *sock_ipaddr)
 {
         struct conn_s *connptr;
@@ -51,7 +56,7 @@ struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
         /*
          * Allocate the space for the conn_s structure itself.
          */
-        connptr = (struct conn_s *) safemalloc (sizeof (struct conn_s));
+        connptr = (struct conn_s *) pool_alloc (&conn_pool);
         if (!connptr)
                 goto error_exit;
 
@@ -62,6 +67,10 @@ struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
         connptr->sbuffer = sbuffer;
 
         connptr->request_line = NULL;
+        iolist_init (&connptr->request_head);
+        ostream_init (&connptr->client_out, client_fd);
+        ostream_init (&connptr->server_out, -1);
+        connptr->socks_state = SOCKS_NONE;
 
         /* These store any error strings */
         connptr->error_variables = NULL;
@@ -69,17 +78,29 @@ struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
         connptr->error_number = -1;
 
         connptr->connect_method = FALSE;
+        connptr->head_method = FALSE;
         connptr->show_stats = FALSE;
 
+        connptr->keep_alive = FALSE;
+        connptr->requests = 0;
+
+        connptr->request_framed = FALSE;
+        connptr->request_body = FALSE;
+        connptr->expect_continue = FALSE;
+        connptr->server_keep_alive = FALSE;
+        connptr->server_reused = FALSE;
+        connptr->server_key = NULL;
+
         connptr->protocol.major = connptr->protocol.minor = 0;
 
         /* There is _no_ content length initially */
         connptr->content_length.server = connptr->content_length.client = -1;
+        connptr->relay_mode = RELAY_PLAIN;
 
         connptr->server_ip_addr = (sock_ipaddr ?
                                    safestrdup (sock_ipaddr) : NULL);
         connptr->client_ip_addr = safestrdup (ipaddr);
-        connptr->client_string_addr = safestrdup (string_addr);
+        connptr->client_string_addr = NULL;
 
         connptr->upstream_proxy = NULL;
 
@@ -103,6 +124,36 @@ error_exit:
         return NULL;
 }
 
+/*
+ * Done with the server connection.  It is kept in the pool if the server
+ * keeps it open, and the request and the response have both gone through
+ * to their very end, and closed otherwise.
+ */
+static void release_server (struct conn_s *connptr)
+{
+        if (connptr->server_fd != -1) {
+                if (connptr->server_keep_alive
+                    && connptr->content_length.server == 0
+                    && connptr->content_length.client <= 0)
+                        server_pool_put (connptr->server_key,
+                                         connptr->server_fd);
+                else if (close (connptr->server_fd) < 0)
+                        log_message (LOG_INFO, "Server (%d) close message: %s",
+                                     connptr->server_fd, strerror (errno));
+                connptr->server_fd = -1;
+        }
+
+        if (connptr->server_key) {
+                safefree (connptr->server_key);
+                connptr->server_key = NULL;
+        }
+        ostream_free (&connptr->server_out);
+        ostream_init (&connptr->server_out, -1);
+        connptr->socks_state = SOCKS_NONE;
+        connptr->server_keep_alive = FALSE;
+        connptr->server_reused = FALSE;
+}
+
 void destroy_conn (struct conn_s *connptr)
 {
         assert (connptr != NULL);
@@ -111,10 +162,7 @@ void destroy_conn (struct conn_s *connptr)
                 if (close (connptr->client_fd) < 0)
                         log_message (LOG_INFO, "Client (%d) close message: %s",
                                      connptr->client_fd, strerror (errno));
-        if (connptr->server_fd != -1)
-                if (close (connptr->server_fd) < 0)
-                        log_message (LOG_INFO, "Server (%d) close message: %s",
-                                     connptr->server_fd, strerror (errno));
+        release_server (connptr);
 
         if (connptr->cbuffer)
                 delete_buffer (connptr->cbuffer);
@@ -123,6 +171,8 @@ void destroy_conn (struct conn_s *connptr)
 
         if (connptr->request_line)
                 safefree (connptr->request_line);
+        iolist_free (&connptr->request_head);
+        ostream_free (&connptr->client_out);
 
         if (connptr->error_variables)
                 hashmap_delete (connptr->error_variables);
@@ -142,7 +192,81 @@ void destroy_conn (struct conn_s *connptr)
                 safefree (connptr->reversepath);
 #endif
 
-        safefree (connptr);
+        pool_free (&conn_pool, connptr);
 
         update_stats (STAT_CLOSE);
 }
+
+/*
+ * Forget about the last request of a persistent client connection, and
+ * let go of the connection to its server, so the next request can be
+ * read.
+ * Whatever the client has sent after the request stays in the buffer.
+ */
+void reset_conn (struct conn_s *connptr)
+{
+        assert (connptr != NULL);
+
+        release_server (connptr);
+
+        /* The buffers are given back until the next request needs them */
+        buffer_release (connptr->cbuffer);
+        buffer_release (connptr->sbuffer);
+
+        if (connptr->request_line) {
+                safefree (connptr->request_line);
+                connptr->request_line = NULL;
+        }
+        iolist_free (&connptr->request_head);
+
+        if (connptr->error_variables) {
+                hashmap_delete (connptr->error_variables);
+                connptr->error_variables = NULL;
+        }
+        if (connptr->error_string) {
+                safefree (connptr->error_string);
+                connptr->error_string = NULL;
+        }
+        connptr->error_number = -1;
+
+        connptr->connect_method = FALSE;
+        connptr->head_method = FALSE;
+        connptr->show_stats = FALSE;
+        connptr->keep_alive = FALSE;
+        connptr->request_framed = FALSE;
+        connptr->request_body = FALSE;
+        connptr->expect_continue = FALSE;
+
+        connptr->protocol.major = connptr->protocol.minor = 0;
+        connptr->content_length.server = connptr->content_length.client = -1;
+        connptr->relay_mode = RELAY_PLAIN;
+
+        connptr->upstream_proxy = NULL;
+
+#ifdef REVERSE_SUPPORT
+        if (connptr->reversepath) {
+                safefree (connptr->reversepath);
+                connptr->reversepath = NULL;
+        }
+#endif
+}
+
+/*
+ * The client's hostname, if it is already known (an ACL rule may have had
+ * it looked up), or else its IP address.  This never waits on the
+ * resolver: only the ACL rules which name hosts are worth that.
+ */
+const char *get_client_hostname (struct conn_s *connptr)
+{
+        char name[HOSTNAME_LENGTH];
+
+        if (!connptr->client_string_addr) {
+                if (!dns_cache_ptr_lookup (connptr->client_ip_addr, name))
+                        return connptr->client_ip_addr;
+                connptr->client_string_addr = safestrdup (name);
+                if (!connptr->client_string_addr)
+                        return connptr->client_ip_addr;
+        }
+
+        return connptr->client_string_addr;
+}
@@ -22,7 +22,34 @@
 #define TINYPROXY_CONNS_H
 
 #include "main.h"
+#include "chunked.h"
 #include "hashmap.h"
+#include "network.h"
+
+/*
+ * How the body of a response is relayed (see read_server_body.)
+ */
+typedef enum {
+        RELAY_PLAIN,            /* as it is, up to its length or the end */
+        RELAY_CHUNKED,          /* chunked on both sides */
+        RELAY_DECHUNK,          /* chunked from the server, but not to the
+                                 * client */
+        RELAY_ENCHUNK           /* up to the end from the server, chunked
+                                 * to the client */
+} relay_mode_t;
+
+/*
+ * How far the negotiation with a SOCKS upstream proxy has got (see
+ * socks_step.)
+ */
+typedef enum {
+        SOCKS_NONE,             /* not started */
+        SOCKS4_REPLY,           /* waiting for the reply to the request */
+        SOCKS5_METHOD,          /* waiting for the method to be picked */
+        SOCKS5_AUTH,            /* waiting for the answer to the login */
+        SOCKS5_REPLY,           /* waiting for the reply to the request */
+        SOCKS_DONE              /* the proxy has connected to the server */
+} socks_state_t;
 
 /*
  * Connection Definition
@@ -37,10 +64,63 @@ struct conn_s {
         /* The request line (first line) from the client */
         char *request_line;
 
+        /*
+         * The request line and headers for the server, put together
+         * until they are sent in one go (see process_client_headers.)
+         */
+        struct iolist request_head;
+
+        /*
+         * The responses tinyproxy makes up itself for the client, and
+         * what a non-blocking socket has not taken yet of the response
+         * headers.
+         */
+        struct ostream client_out;
+
+        /*
+         * What a non-blocking socket has not taken yet of the request
+         * headers, or of the SOCKS negotiation, for the server.
+         */
+        struct ostream server_out;
+        socks_state_t socks_state;
+
         /* Booleans */
         unsigned int connect_method;
+        unsigned int head_method;
         unsigned int show_stats;
 
+        /*
+         * Whether the client connection stays open for another request
+         * once the response is finished, and how many requests have been
+         * read from it so far.
+         */
+        unsigned int keep_alive;        /* boolean */
+        unsigned int requests;
+
+        /*
+         * Whether the end of the request is known, so that nothing the
+         * client sends after it is for this server.  This is not the
+         * case for a chunked request body, or a CONNECT tunnel.
+         */
+        unsigned int request_framed;    /* boolean */
+
+        /*
+         * Whether the request has a body, and whether the client waits
+         * for a 100 (Continue) response before it sends the body.
+         */
+        unsigned int request_body;      /* boolean */
+        unsigned int expect_continue;   /* boolean */
+
+        /*
+         * Whether the server connection can be used for another request
+         * once the response has been read to its end, and whether it
+         * already has been (see server-pool.c.)  server_key names the
+         * server in the pool.
+         */
+        unsigned int server_keep_alive; /* boolean */
+        unsigned int server_reused;     /* boolean */
+        char *server_key;
+
         /*
          * This structure stores key -> value mappings for substitution
          * in the error HTML files.
@@ -50,19 +130,30 @@ struct conn_s {
         int error_number;
         char *error_string;
 
-        /* A Content-Length value from the remote server */
+        /*
+         * The Content-Length values from the client and the remote
+         * server.  The client's count goes down as the request body is
+         * sent to the server.  The server's count goes down as the
+         * response is relayed, and reaches 0 once all of the response
+         * has been read, however it is framed.
+         */
         struct {
                 long int server;
                 long int client;
         } content_length;
 
+        /* How the response body is relayed, and where the chunks are */
+        relay_mode_t relay_mode;
+        struct chunked chunked;
+
         /*
          * Store the server's IP (for BindSame)
          */
         char *server_ip_addr;
 
         /*
-         * Store the client's IP and hostname information
+         * Store the client's IP and hostname information.  The hostname
+         * is NULL until it is found, with get_client_hostname().
          */
         char *client_ip_addr;
         char *client_string_addr;
@@ -92,8 +183,9 @@ struct conn_s {
  * Functions for the creation and destruction of a connection structure.
  */
 extern struct conn_s *initialize_conn (int client_fd, const char *ipaddr,
-                                       const char *string_addr,
                                        const char *sock_ipaddr);
 extern void destroy_conn (struct conn_s *connptr);
+extern void reset_conn (struct conn_s *connptr);
+extern const char *get_client_hostname (struct conn_s *connptr);
 
 #endif
@@ -0,0 +1,703 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The addresses of the servers connected to, kept for as long as their
+ * TTL says (but no longer than DNSCacheTTL seconds), so that the same
+ * hostname is not looked up again for every request.
+ * The cache is in shared memory, next to the statistics, so all the
+ * workers look it up and fill it in together.
+ *
+ * A hostname which does not exist, or which the resolver failed to look
+ * up, is remembered as well, for the shorter DNSNegativeTTL, so that a
+ * burst of requests for it does not wait on the resolver every time.  An
+ * answer which has expired is still kept for DNSStaleTime seconds more,
+ * and served if the resolver fails in the meantime (as RFC 8767
+ * suggests.)  An answer which is asked for often
+ * is looked up again shortly before it expires, by whichever worker is
+ * next between connections, so that busy hostnames never have to wait
+ * for the resolver.
+ *
+ * The names of the clients' addresses are kept in a second table, in the
+ * same way, for the rare occasions they are needed (see
+ * getpeer_hostname().)
+ *
+ * The tables are split into small sets of entries; a hostname can only be
+ * in the set its hash picks, and pushes out the least recently used
+ * entry there.  Each set has a spin lock of its own, which is only held
+ * while an entry is copied in or out, never while resolving.  The lock
+ * holds the process id of its owner, so that it can be taken back from a
+ * worker which died holding it.
+ */
+
+#include "main.h"
+
+#include "conf.h"
+#include "dns-cache.h"
+#include "dns-resolver.h"
+#include "heap.h"
+#include "log.h"
+#include "text.h"
+
+#define DNS_WAYS 4              /* entries in each set */
+
+/*
+ * An entry is looked up again ahead of its expiry in the last tenth of
+ * its time, if it has been asked for this many times since it was last
+ * looked up.  A worker which takes longer than DNS_REFRESH_TIME to do
+ * so is assumed to have died.
+ */
+#define DNS_PREFETCH_HITS 2
+#define DNS_REFRESH_TIME 30
+
+/* How often a worker waiting on a lock checks that its owner is alive */
+#define DNS_LOCK_SPINS 64
+
+struct dns_entry {
+        char host[DNS_HOST_LEN];        /* empty if the entry is free */
+        uint32_t hash;
+        int error;              /* EAI_ error of a negative entry, or 0 */
+        time_t expires;
+        time_t stale_until;
+        time_t used;
+        time_t refreshing;      /* when a worker started on it, or 0 */
+        unsigned int ttl;       /* of the answer, in seconds */
+        unsigned int hits;      /* since it was last looked up */
+        unsigned int prefetch;  /* boolean: to be looked up again */
+        struct dns_answer answer;
+};
+
+struct dns_set {
+        volatile pid_t lock;
+        struct dns_entry entries[DNS_WAYS];
+};
+
+/*
+ * The name of a client address, or the address itself if it has none.
+ */
+struct dns_ptr_entry {
+        char addr[INET6_ADDRSTRLEN];    /* empty if the entry is free */
+        char name[DNS_HOST_LEN];
+        uint32_t hash;
+        time_t expires;
+        time_t used;
+};
+
+struct dns_ptr_set {
+        volatile pid_t lock;
+        struct dns_ptr_entry entries[DNS_WAYS];
+};
+
+struct dns_cache {
+        volatile unsigned long int hits;
+        volatile unsigned long int misses;
+        volatile unsigned long int stale;
+        volatile unsigned long int prefetches;
+        volatile unsigned long int ptr_hits;
+        volatile unsigned long int ptr_misses;
+
+        volatile int prefetch_pending;  /* boolean */
+
+        unsigned int nsets;
+        struct dns_set *sets;
+        struct dns_ptr_set *ptr_sets;   /* as many as sets */
+};
+
+static struct dns_cache *cache;
+
+/*
+ * Take the lock of a set, whose entries are size bytes long.  Every so
+ * often while waiting, check that the owner is still alive.  If it is not,
+ * take the lock over, and drop the entries it may have been half way
+ * through writing.  (The threads of a worker share its process id, but
+ * they only die with it.)
+ */
+static void
+spin_lock (volatile pid_t *lock, void *entries, size_t size)
+{
+        pid_t self = getpid (), owner;
+        unsigned int spins = 0;
+
+        while ((owner = __sync_val_compare_and_swap (lock, 0, self)) != 0) {
+                if (++spins % DNS_LOCK_SPINS == 0 && owner != self
+                    && kill (owner, 0) < 0 && errno == ESRCH
+                    && __sync_bool_compare_and_swap (lock, owner, self)) {
+                        memset (entries, 0, size);
+                        log_message (LOG_WARNING, "Took over a DNS cache "
+                                     "lock from worker %ld, which died "
+                                     "holding it", (long) owner);
+                        return;
+                }
+                sched_yield ();
+        }
+}
+
+static void spin_unlock (volatile pid_t *lock)
+{
+        __sync_lock_release (lock);
+}
+
+/*
+ * Set up the cache in shared memory, before the workers are started.
+ * The cache stays off if DNSCacheSize is 0, or there is no memory for it.
+ */
+void dns_cache_init (void)
+{
+        unsigned int nsets;
+        size_t size;
+        void *ptr;
+
+        if (config.dns_cache_size == 0)
+                return;
+
+        nsets = (config.dns_cache_size + DNS_WAYS - 1) / DNS_WAYS;
+        size = sizeof (struct dns_cache) + nsets * (sizeof (struct dns_set)
+                                                    + sizeof (struct dns_ptr_set));
+
+        ptr = calloc_shared_memory (1, size);
+        if (ptr == MAP_FAILED) {
+                log_message (LOG_WARNING, "Could not allocate %lu bytes for "
+                             "the DNS cache, not caching", (unsigned long) size);
+                return;
+        }
+
+        cache = (struct dns_cache *) ptr;
+        cache->nsets = nsets;
+        cache->sets = (struct dns_set *) (cache + 1);
+        cache->ptr_sets = (struct dns_ptr_set *) (cache->sets + nsets);
+}
+
+/*
+ * Dan Bernstein's hash, without regard to case (as in hashmap.c.)
+ */
+static uint32_t host_hash (const char *host)
+{
+        uint32_t hash = 5381;
+
+        for (; *host != '\0'; host++)
+                hash = ((hash << 5) + hash) ^ (*host | 0x20);
+
+        return hash;
+}
+
+/*
+ * Is the error one which says the hostname does not exist, rather than
+ * that the resolver could not find out?
+ */
+static int negative_error (int error)
+{
+#ifdef EAI_NODATA
+        if (error == EAI_NODATA)
+                return TRUE;
+#endif
+        return error == EAI_NONAME;
+}
+
+/*
+ * Find the entry for the host in its set, which must be locked.
+ */
+static struct dns_entry *find_entry (struct dns_set *set, const char *host,
+                                     uint32_t hash)
+{
+        int i;
+
+        for (i = 0; i != DNS_WAYS; i++) {
+                struct dns_entry *entry = &set->entries[i];
+
+                if (entry->host[0] != '\0' && entry->hash == hash
+                    && strcasecmp (entry->host, host) == 0)
+                        return entry;
+        }
+
+        return NULL;
+}
+
+/*
+ * Store what the resolver said about the host: its addresses, or the
+ * error it failed with, to be kept for ttl seconds, but no longer than
+ * DNSCacheTTL (or DNSNegativeTTL.)  It takes the place of the old entry for the host, or
+ * of a free one, or of the one used least recently.
+ *
+ * Returns the address family which connected to the host the last time,
+ * which is kept from the old entry, or AF_UNSPEC.
+ */
+static int store_entry (struct dns_set *set, const char *host,
+                         uint32_t hash, int error,
+                         const struct dns_answer *answer, unsigned int ttl,
+                         time_t now)
+{
+        struct dns_entry *entry;
+        int i, family;
+
+        spin_lock (&set->lock, set->entries, sizeof (set->entries));
+
+        entry = find_entry (set, host, hash);
+        if (entry) {
+                family = entry->answer.family;
+        } else {
+                family = AF_UNSPEC;
+                entry = &set->entries[0];
+                for (i = 0; i != DNS_WAYS; i++) {
+                        if (set->entries[i].host[0] == '\0') {
+                                entry = &set->entries[i];
+                                break;
+                        }
+                        if (set->entries[i].used < entry->used)
+                                entry = &set->entries[i];
+                }
+
+                strlcpy (entry->host, host, DNS_HOST_LEN);
+                entry->hash = hash;
+                entry->used = now;
+        }
+
+        if (ttl > (error ? config.dns_negative_ttl : config.dns_cache_ttl))
+                ttl = error ? config.dns_negative_ttl : config.dns_cache_ttl;
+
+        entry->error = error;
+        entry->ttl = ttl;
+        if (error) {
+                entry->expires = entry->stale_until = now + ttl;
+                entry->answer.naddrs = 0;
+        } else {
+                entry->expires = now + ttl;
+                entry->stale_until = entry->expires + config.dns_stale_time;
+                memcpy (&entry->answer, answer, sizeof (*answer));
+        }
+        entry->answer.family = family;
+        entry->hits = 0;
+        entry->prefetch = FALSE;
+        entry->refreshing = 0;
+
+        spin_unlock (&set->lock);
+        return family;
+}
+
+/*
+ * Is somebody else already looking the entry up again?
+ */
+static int being_refreshed (struct dns_entry *entry, time_t now)
+{
+        return entry->refreshing != 0
+            && difftime (now, entry->refreshing) < DNS_REFRESH_TIME;
+}
+
+/*
+ * Look the host up in the cache, and mark it to be looked up again ahead
+ * of its expiry if it is in demand.
+ *
+ * Returns 1 if the cache had a current answer, which is then in *answer
+ * (or, if the host does not exist, *error), and 0 otherwise.
+ */
+static int cached_answer (struct dns_set *set, const char *host,
+                          uint32_t hash, time_t now,
+                          struct dns_answer *answer, int *error)
+{
+        struct dns_entry *entry;
+        time_t window;
+        int found = 0;
+
+        spin_lock (&set->lock, set->entries, sizeof (set->entries));
+
+        entry = find_entry (set, host, hash);
+        if (entry && now < entry->expires) {
+                entry->used = now;
+                entry->hits++;
+
+                window = entry->ttl / 10;
+                if (window == 0)
+                        window = 1;
+                if (!entry->error && !entry->prefetch
+                    && entry->hits >= DNS_PREFETCH_HITS
+                    && difftime (entry->expires, now) <= window
+                    && !being_refreshed (entry, now)) {
+                        entry->prefetch = TRUE;
+                        cache->prefetch_pending = TRUE;
+                }
+
+                *error = entry->error;
+                memcpy (answer, &entry->answer, sizeof (*answer));
+                found = 1;
+        }
+
+        spin_unlock (&set->lock);
+        return found;
+}
+
+/*
+ * The resolver failed: serve the expired answer, if it is not too old,
+ * and hold on to it for another DNSNegativeTTL seconds before the
+ * resolver is asked again.
+ *
+ * Returns 1 if there was an answer to serve, and 0 otherwise.
+ */
+static int stale_answer (struct dns_set *set, const char *host,
+                         uint32_t hash, time_t now,
+                         struct dns_answer *answer)
+{
+        struct dns_entry *entry;
+        int found = 0;
+
+        spin_lock (&set->lock, set->entries, sizeof (set->entries));
+
+        entry = find_entry (set, host, hash);
+        if (entry && !entry->error && now < entry->stale_until) {
+                entry->used = now;
+                entry->expires = now + config.dns_negative_ttl;
+                memcpy (answer, &entry->answer, sizeof (*answer));
+                found = 1;
+        }
+
+        spin_unlock (&set->lock);
+        return found;
+}
+
+/*
+ * The set the host belongs in, or NULL if it is not cached at all.
+ * Numeric addresses are not worth it.
+ */
+static struct dns_set *host_set (const char *host, uint32_t *hash)
+{
+        struct in6_addr numeric;
+
+        if (!cache || strlen (host) >= DNS_HOST_LEN
+            || inet_pton (AF_INET, host, &numeric) == 1
+            || inet_pton (AF_INET6, host, &numeric) == 1)
+                return NULL;
+
+        *hash = host_hash (host);
+        return &cache->sets[*hash % cache->nsets];
+}
+
+/*
+ * Look the host up in the cache.
+ *
+ * Returns 0 if its addresses are in *answer, -1 if it is known not to
+ * have any, and 1 if it has to be looked up (see dns_cache_store().)
+ */
+int dns_cache_lookup (const char *host, struct dns_answer *answer)
+{
+        struct dns_set *set;
+        uint32_t hash;
+        int error;
+
+        assert (host != NULL);
+        assert (answer != NULL);
+
+        set = host_set (host, &hash);
+        if (!set)
+                return 1;
+
+        if (cached_answer (set, host, hash, time (NULL), answer, &error)) {
+                __sync_add_and_fetch (&cache->hits, 1);
+                return error ? -1 : 0;
+        }
+
+        __sync_add_and_fetch (&cache->misses, 1);
+        return 1;
+}
+
+/*
+ * Store what the resolver said about a host which was not in the cache:
+ * error 0 and the addresses in *answer, which may be kept for ttl
+ * seconds, or the EAI_ error the lookup failed with.  If the resolver
+ * failed, an expired answer may still be used, and is put in *answer.
+ *
+ * Returns 0 if there are addresses in *answer, and -1 otherwise.
+ */
+int dns_cache_store (const char *host, int error, struct dns_answer *answer,
+                     unsigned int ttl)
+{
+        struct dns_set *set;
+        uint32_t hash;
+        time_t now;
+
+        set = host_set (host, &hash);
+        if (!set)
+                return error ? -1 : 0;
+
+        now = time (NULL);
+
+        if (error && !negative_error (error)
+            && stale_answer (set, host, hash, now, answer)) {
+                __sync_add_and_fetch (&cache->stale, 1);
+                log_message (LOG_WARNING, "Could not look up %s (%s), "
+                             "using the expired addresses",
+                             host, gai_strerror (error));
+                return 0;
+        }
+
+        answer->family = store_entry (set, host, hash, error, answer, ttl,
+                                      now);
+        return error ? -1 : 0;
+}
+
+/*
+ * Find the addresses of a host, from the cache if they are there, and
+ * from the resolver otherwise.
+ *
+ * Returns 0, or -1 if the host has no addresses (or could not be looked
+ * up.)
+ */
+int dns_cache_resolve (const char *host, struct dns_answer *answer)
+{
+        unsigned int ttl;
+        int ret, error;
+
+        ret = dns_cache_lookup (host, answer);
+        if (ret != 1)
+                return ret;
+
+        error = dns_resolve (host, answer, &ttl);
+        return dns_cache_store (host, error, answer, ttl);
+}
+
+/*
+ * Remember the address family which the last connection to the host was
+ * made over, so that the next one tries it first.
+ */
+void dns_cache_connected (const char *host, int family)
+{
+        struct dns_entry *entry;
+        struct dns_set *set;
+        uint32_t hash;
+
+        set = host_set (host, &hash);
+        if (!set)
+                return;
+
+        spin_lock (&set->lock, set->entries, sizeof (set->entries));
+
+        entry = find_entry (set, host, hash);
+        if (entry && !entry->error)
+                entry->answer.family = family;
+
+        spin_unlock (&set->lock);
+}
+
+/*
+ * Take the next entry marked to be looked up again out of the set, and
+ * copy its hostname.  Returns 1 if there was one, and 0 otherwise.
+ */
+static int claim_prefetch (struct dns_set *set, char *host, time_t now)
+{
+        int i, found = 0;
+
+        spin_lock (&set->lock, set->entries, sizeof (set->entries));
+
+        for (i = 0; i != DNS_WAYS; i++) {
+                struct dns_entry *entry = &set->entries[i];
+
+                if (!entry->prefetch)
+                        continue;
+
+                entry->prefetch = FALSE;
+                if (being_refreshed (entry, now))
+                        continue;
+
+                entry->refreshing = now;
+                strlcpy (host, entry->host, DNS_HOST_LEN);
+                found = 1;
+                break;
+        }
+
+        spin_unlock (&set->lock);
+        return found;
+}
+
+/*
+ * Find the next hostname to be looked up again ahead of its expiry, and
+ * copy it into host, which holds DNS_HOST_LEN bytes.  The caller looks it
+ * up and passes the result to dns_cache_refreshed().
+ *
+ * Returns 1 if there is one, and 0 otherwise.
+ */
+int dns_cache_next_prefetch (char *host)
+{
+        unsigned int i;
+        time_t now;
+
+        if (!cache
+            || !__sync_bool_compare_and_swap (&cache->prefetch_pending,
+                                              TRUE, FALSE))
+                return 0;
+
+        now = time (NULL);
+        for (i = 0; i != cache->nsets; i++) {
+                if (claim_prefetch (&cache->sets[i], host, now)) {
+                        /* There may be more */
+                        cache->prefetch_pending = TRUE;
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Store the result of looking a hostname up ahead of its expiry.  A
+ * failed lookup leaves the entry as it is.
+ */
+void dns_cache_refreshed (const char *host, int error,
+                          const struct dns_answer *answer, unsigned int ttl)
+{
+        struct dns_set *set;
+        struct dns_entry *entry;
+        uint32_t hash;
+
+        set = host_set (host, &hash);
+        if (!set)
+                return;
+
+        if (error == 0 || negative_error (error)) {
+                store_entry (set, host, hash, error, answer, ttl,
+                             time (NULL));
+                __sync_add_and_fetch (&cache->prefetches, 1);
+                return;
+        }
+
+        spin_lock (&set->lock, set->entries, sizeof (set->entries));
+        entry = find_entry (set, host, hash);
+        if (entry)
+                entry->refreshing = 0;
+        spin_unlock (&set->lock);
+}
+
+/*
+ * Look up the entries in demand which are about to expire again, waiting
+ * for the resolver.  The workers call this between connections; only one
+ * of them finds any work to do.
+ */
+void dns_cache_prefetch (void)
+{
+        char host[DNS_HOST_LEN];
+        struct dns_answer answer;
+        unsigned int ttl;
+        int error;
+
+        while (dns_cache_next_prefetch (host)) {
+                error = dns_resolve (host, &answer, &ttl);
+                dns_cache_refreshed (host, error, &answer, ttl);
+        }
+}
+
+/*
+ * The set the client address belongs in, or NULL if there is no cache.
+ */
+static struct dns_ptr_set *ptr_set (const char *addr, uint32_t *hash)
+{
+        if (!cache || strlen (addr) >= INET6_ADDRSTRLEN)
+                return NULL;
+
+        *hash = host_hash (addr);
+        return &cache->ptr_sets[*hash % cache->nsets];
+}
+
+/*
+ * Look up the name of the client address (as text) in the cache.
+ *
+ * Returns 1 if it was there, and has been copied to name (which has room
+ * for DNS_HOST_LEN characters), and 0 otherwise.
+ */
+int dns_cache_ptr_lookup (const char *addr, char *name)
+{
+        struct dns_ptr_set *set;
+        struct dns_ptr_entry *entry;
+        uint32_t hash;
+        time_t now;
+        int i, found = 0;
+
+        set = ptr_set (addr, &hash);
+        if (!set)
+                return 0;
+
+        now = time (NULL);
+        spin_lock (&set->lock, set->entries, sizeof (set->entries));
+
+        for (i = 0; i != DNS_WAYS; i++) {
+                entry = &set->entries[i];
+                if (entry->hash == hash && now < entry->expires
+                    && strcmp (entry->addr, addr) == 0) {
+                        entry->used = now;
+                        strlcpy (name, entry->name, DNS_HOST_LEN);
+                        found = 1;
+                        break;
+                }
+        }
+
+        spin_unlock (&set->lock);
+
+        __sync_add_and_fetch (found ? &cache->ptr_hits : &cache->ptr_misses,
+                              1);
+        return found;
+}
+
+/*
+ * Store the name found for the client address, for DNSCacheTTL seconds,
+ * or the address itself, if it has none (error is not 0), for
+ * DNSNegativeTTL seconds.  The resolver does not say how long a name is
+ * good for.
+ */
+void dns_cache_ptr_store (const char *addr, int error, const char *name)
+{
+        struct dns_ptr_set *set;
+        struct dns_ptr_entry *entry;
+        uint32_t hash;
+        time_t now;
+        int i;
+
+        set = ptr_set (addr, &hash);
+        if (!set)
+                return;
+
+        now = time (NULL);
+        spin_lock (&set->lock, set->entries, sizeof (set->entries));
+
+        entry = &set->entries[0];
+        for (i = 0; i != DNS_WAYS; i++) {
+                if (set->entries[i].hash == hash
+                    && strcmp (set->entries[i].addr, addr) == 0) {
+                        entry = &set->entries[i];
+                        break;
+                }
+                if (set->entries[i].used < entry->used)
+                        entry = &set->entries[i];
+        }
+
+        strlcpy (entry->addr, addr, INET6_ADDRSTRLEN);
+        strlcpy (entry->name, name, DNS_HOST_LEN);
+        entry->hash = hash;
+        entry->used = now;
+        entry->expires = now + (error ? config.dns_negative_ttl
+                                      : config.dns_cache_ttl);
+
+        spin_unlock (&set->lock);
+}
+
+void dns_cache_stats (struct dns_cache_stats *stats)
+{
+        if (!cache) {
+                memset (stats, 0, sizeof (*stats));
+                return;
+        }
+
+        stats->hits = cache->hits;
+        stats->misses = cache->misses;
+        stats->stale = cache->stale;
+        stats->prefetches = cache->prefetches;
+        stats->ptr_hits = cache->ptr_hits;
+        stats->ptr_misses = cache->ptr_misses;
+}
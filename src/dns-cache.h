@@ -0,0 +1,77 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'dns-cache.c' for detailed information. */
+
+#ifndef TINYPROXY_DNS_CACHE_H
+#define TINYPROXY_DNS_CACHE_H
+
+#include "common.h"
+
+/*
+ * The most addresses kept for one hostname.
+ */
+#define DNS_MAX_ADDRS 8
+
+/*
+ * The longest hostname cached, with its terminating NUL.
+ */
+#define DNS_HOST_LEN 256
+
+struct dns_addr {
+        int family;             /* AF_INET or AF_INET6 */
+        union {
+                struct in_addr v4;
+                struct in6_addr v6;
+        } u;
+};
+
+struct dns_answer {
+        int family;             /* that connected last time, or AF_UNSPEC */
+        unsigned int naddrs;
+        struct dns_addr addrs[DNS_MAX_ADDRS];
+};
+
+/*
+ * The counters shown on the statistics page.
+ */
+struct dns_cache_stats {
+        unsigned long int hits;
+        unsigned long int misses;
+        unsigned long int stale;        /* expired answers served */
+        unsigned long int prefetches;
+        unsigned long int ptr_hits;     /* client names */
+        unsigned long int ptr_misses;
+};
+
+extern void dns_cache_init (void);
+extern int dns_cache_lookup (const char *host, struct dns_answer *answer);
+extern int dns_cache_store (const char *host, int error,
+                            struct dns_answer *answer, unsigned int ttl);
+extern int dns_cache_resolve (const char *host, struct dns_answer *answer);
+extern int dns_cache_next_prefetch (char *host);
+extern void dns_cache_refreshed (const char *host, int error,
+                                 const struct dns_answer *answer,
+                                 unsigned int ttl);
+extern void dns_cache_connected (const char *host, int family);
+extern void dns_cache_prefetch (void);
+extern int dns_cache_ptr_lookup (const char *addr, char *name);
+extern void dns_cache_ptr_store (const char *addr, int error,
+                                 const char *name);
+extern void dns_cache_stats (struct dns_cache_stats *stats);
+
+#endif
@@ -0,0 +1,1132 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A stub resolver, which asks the name servers itself instead of going
+ * through getaddrinfo(), so that a lookup can be waited for along with
+ * everything else, and a name server which does not answer only holds
+ * up the connections which need it.
+ *
+ * The name servers, search domains and the timeout:, attempts: and
+ * ndots: options are read from /etc/resolv.conf when Tinyproxy starts,
+ * unless the name servers are given with DNSServer.  The hosts file is
+ * looked at before the name servers.
+ *
+ * The A and AAAA questions for a name are sent together, over UDP, and
+ * sent again to the next name server if they are not both answered in
+ * time.  A truncated answer is asked for again over TCP.  A name which
+ * does not exist is tried with the search domains, as the C library
+ * does.  The TTL of the answer is passed on to the DNS cache.
+ */
+
+#include "main.h"
+
+#include "conf.h"
+#include "dns-resolver.h"
+#include "heap.h"
+#include "log.h"
+#include "poller.h"
+#include "sock.h"
+#include "text.h"
+
+#define RESOLV_CONF "/etc/resolv.conf"
+#define HOSTS_FILE "/etc/hosts"
+
+#define DNS_MAX_SERVERS 3
+#define DNS_MAX_SEARCH 6
+#define DNS_NAME_LEN 256
+
+/*
+ * The defaults of the resolv.conf options.
+ */
+#define DNS_TIMEOUT 5
+#define DNS_ATTEMPTS 2
+#define DNS_NDOTS 1
+
+#define DNS_HEADER_LEN 12
+#define DNS_QUERY_LEN (2 + DNS_HEADER_LEN + DNS_NAME_LEN + 4)
+#define DNS_UDP_LEN 512
+#define DNS_TCP_LEN (2 + 65535)
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+#define DNS_CLASS_IN 1
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_OPCODE(flags) (((flags) >> 11) & 0x0f)
+#define DNS_RCODE(flags) ((flags) & 0x0f)
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+/*
+ * The questions asked for every name.
+ */
+#define QUERY_A 0
+#define QUERY_AAAA 1
+#define NQUERIES 2
+
+static const uint16_t query_types[NQUERIES] = { DNS_TYPE_A, DNS_TYPE_AAAA };
+
+static struct {
+        struct sockaddr_storage servers[DNS_MAX_SERVERS];
+        socklen_t server_lens[DNS_MAX_SERVERS];
+        unsigned int nservers;
+
+        char search[DNS_MAX_SEARCH][DNS_NAME_LEN];
+        unsigned int nsearch;
+
+        unsigned int timeout;   /* seconds for each try */
+        unsigned int attempts;  /* tries of each name server */
+        unsigned int ndots;
+} resolver;
+
+static int random_fd = -1;
+
+struct dns_query {
+        char host[DNS_NAME_LEN];
+        unsigned int absolute;  /* boolean: not tried with the domains */
+        unsigned int name;      /* the number of the name being tried */
+        char qname[DNS_NAME_LEN];
+
+        /* The questions, with the length in front for TCP */
+        unsigned char packets[NQUERIES][DNS_QUERY_LEN];
+        size_t packet_lens[NQUERIES];
+        uint16_t ids[NQUERIES];
+        unsigned int pending;   /* bit for each question not answered */
+        struct dns_answer found[NQUERIES];
+
+        int fd;
+        int fd_server;          /* the server the socket is for, or -1 */
+        unsigned int tcp;       /* boolean */
+        unsigned int connecting;        /* boolean */
+        unsigned char *tcpbuf;
+        size_t tcplen;
+
+        unsigned int server;
+        unsigned int tries;
+        struct timeval deadline;
+
+        unsigned int done;      /* boolean */
+        int error;
+        unsigned int ttl;
+        unsigned int negative_ttl;
+};
+
+static int add_server (const char *addr, unsigned int port)
+{
+        struct sockaddr_storage *ss;
+        unsigned int i = resolver.nservers;
+
+        if (i == DNS_MAX_SERVERS)
+                return -1;
+
+        ss = &resolver.servers[i];
+        memset (ss, 0, sizeof (*ss));
+
+        if (inet_pton (AF_INET, addr,
+                       &((struct sockaddr_in *) ss)->sin_addr) == 1) {
+                ((struct sockaddr_in *) ss)->sin_family = AF_INET;
+                ((struct sockaddr_in *) ss)->sin_port = htons (port);
+                resolver.server_lens[i] = sizeof (struct sockaddr_in);
+        } else if (inet_pton (AF_INET6, addr,
+                              &((struct sockaddr_in6 *) ss)->sin6_addr) == 1) {
+                ((struct sockaddr_in6 *) ss)->sin6_family = AF_INET6;
+                ((struct sockaddr_in6 *) ss)->sin6_port = htons (port);
+                resolver.server_lens[i] = sizeof (struct sockaddr_in6);
+        } else {
+                return -1;
+        }
+
+        resolver.nservers++;
+        return 0;
+}
+
+static void add_search (const char *domain)
+{
+        size_t len;
+
+        if (resolver.nsearch == DNS_MAX_SEARCH)
+                return;
+
+        len = strlcpy (resolver.search[resolver.nsearch], domain,
+                       DNS_NAME_LEN);
+        if (len == 0 || len >= DNS_NAME_LEN)
+                return;
+
+        /* An absolute domain is only written with the final dot */
+        if (resolver.search[resolver.nsearch][len - 1] == '.')
+                resolver.search[resolver.nsearch][len - 1] = '\0';
+
+        resolver.nsearch++;
+}
+
+/*
+ * Split off the next word of the line, or return NULL at its end.
+ */
+static char *next_word (char **line)
+{
+        char *word = *line;
+
+        word += strspn (word, " \t\r\n");
+        if (*word == '\0')
+                return NULL;
+
+        *line = word + strcspn (word, " \t\r\n");
+        if (**line != '\0')
+                *(*line)++ = '\0';
+
+        return word;
+}
+
+static void read_options (char *options)
+{
+        char *option;
+
+        while ((option = next_word (&options))) {
+                if (strncmp (option, "timeout:", 8) == 0)
+                        resolver.timeout = atoi (option + 8);
+                else if (strncmp (option, "attempts:", 9) == 0)
+                        resolver.attempts = atoi (option + 9);
+                else if (strncmp (option, "ndots:", 6) == 0)
+                        resolver.ndots = atoi (option + 6);
+        }
+}
+
+/*
+ * Read the name servers, search domains and options from resolv.conf.
+ * The name servers are only used if none were configured.
+ */
+static void read_resolv_conf (int use_servers)
+{
+        char line[1024], *p, *keyword, *arg;
+        FILE *fp;
+
+        fp = fopen (RESOLV_CONF, "r");
+        if (!fp)
+                return;
+
+        while (fgets (line, sizeof (line), fp)) {
+                p = line;
+                keyword = next_word (&p);
+                if (!keyword || *keyword == '#' || *keyword == ';')
+                        continue;
+
+                if (strcmp (keyword, "nameserver") == 0) {
+                        arg = next_word (&p);
+                        if (arg && use_servers)
+                                add_server (arg, DNS_PORT);
+                } else if (strcmp (keyword, "domain") == 0
+                           || strcmp (keyword, "search") == 0) {
+                        /* The last of them wins */
+                        resolver.nsearch = 0;
+                        while ((arg = next_word (&p)))
+                                add_search (arg);
+                } else if (strcmp (keyword, "options") == 0) {
+                        read_options (p);
+                }
+        }
+
+        fclose (fp);
+}
+
+/*
+ * Set up the resolver from the configuration and resolv.conf.  This is
+ * done once, before the workers are started.
+ */
+void dns_resolver_init (void)
+{
+        ssize_t i;
+
+        resolver.nservers = resolver.nsearch = 0;
+        resolver.timeout = DNS_TIMEOUT;
+        resolver.attempts = DNS_ATTEMPTS;
+        resolver.ndots = DNS_NDOTS;
+
+        for (i = 0; i < vector_length (config.dns_servers); i++) {
+                char *addr = (char *) vector_getentry (config.dns_servers,
+                                                       i, NULL);
+
+                if (add_server (addr, config.dns_port) < 0)
+                        log_message (LOG_WARNING, "Ignoring DNS server %s: "
+                                     "at most %d are used", addr,
+                                     DNS_MAX_SERVERS);
+        }
+
+        read_resolv_conf (resolver.nservers == 0);
+
+        /* The C library asks the local host when nothing is configured */
+        if (resolver.nservers == 0)
+                add_server ("127.0.0.1", DNS_PORT);
+
+        if (resolver.timeout == 0)
+                resolver.timeout = 1;
+        if (resolver.attempts == 0)
+                resolver.attempts = 1;
+
+        if (random_fd < 0)
+                random_fd = open ("/dev/urandom", O_RDONLY);
+}
+
+static uint16_t random_id (void)
+{
+        uint16_t id;
+
+        if (random_fd >= 0 && read (random_fd, &id, sizeof (id)) == sizeof (id))
+                return id;
+
+        return (uint16_t) rand ();
+}
+
+static uint16_t get16 (const unsigned char *p)
+{
+        return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static uint32_t get32 (const unsigned char *p)
+{
+        return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+            | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put16 (unsigned char *p, unsigned int value)
+{
+        p[0] = (value >> 8) & 0xff;
+        p[1] = value & 0xff;
+}
+
+/*
+ * Build the question for the name, with its length in front as it is
+ * sent over TCP.
+ *
+ * Returns the length of it all, or -1 if the name is not valid.
+ */
+static ssize_t build_query (unsigned char *buf, const char *name,
+                            uint16_t id, uint16_t type)
+{
+        unsigned char *p = buf + 2;
+        const char *label, *dot;
+        size_t len;
+
+        memset (p, 0, DNS_HEADER_LEN);
+        put16 (p, id);
+        put16 (p + 2, DNS_FLAG_RD);
+        put16 (p + 4, 1);       /* one question */
+        p += DNS_HEADER_LEN;
+
+        for (label = name; *label != '\0'; label = dot + 1) {
+                dot = strchr (label, '.');
+                if (!dot)
+                        dot = label + strlen (label);
+
+                len = dot - label;
+                if (len == 0 || len > 63
+                    || p + 1 + len - (buf + 2 + DNS_HEADER_LEN) > 254)
+                        return -1;
+
+                *p++ = len;
+                memcpy (p, label, len);
+                p += len;
+
+                if (*dot == '\0')
+                        break;
+        }
+
+        *p++ = 0;
+        put16 (p, type);
+        put16 (p + 2, DNS_CLASS_IN);
+        p += 4;
+
+        put16 (buf, p - buf - 2);
+        return p - buf;
+}
+
+/*
+ * Read the name at *offset in the message, following the compression
+ * pointers, and move the offset past it.  The name is not stored if out
+ * is NULL.
+ *
+ * Returns 0, or -1 if the message is malformed.
+ */
+static int read_name (const unsigned char *msg, size_t len, size_t *offset,
+                      char *out, size_t outlen)
+{
+        size_t pos = *offset, n = 0;
+        unsigned int jumps = 0, label;
+        int jumped = FALSE;
+
+        for (;;) {
+                if (pos >= len)
+                        return -1;
+
+                label = msg[pos];
+                if (label == 0) {
+                        pos++;
+                        break;
+                }
+
+                if ((label & 0xc0) == 0xc0) {
+                        if (pos + 1 >= len || ++jumps > 32)
+                                return -1;
+                        if (!jumped)
+                                *offset = pos + 2;
+                        jumped = TRUE;
+                        pos = ((label & 0x3f) << 8) | msg[pos + 1];
+                        continue;
+                }
+
+                if ((label & 0xc0) != 0 || pos + 1 + label > len)
+                        return -1;
+
+                if (out) {
+                        if (n + label + 2 > outlen)
+                                return -1;
+                        if (n > 0)
+                                out[n++] = '.';
+                        memcpy (out + n, msg + pos + 1, label);
+                        n += label;
+                }
+                pos += 1 + label;
+        }
+
+        if (!jumped)
+                *offset = pos;
+        if (out)
+                out[n] = '\0';
+
+        return 0;
+}
+
+static void get_time (struct timeval *tv)
+{
+        gettimeofday (tv, NULL);
+}
+
+/*
+ * Replace the socket of the query.  The new one is opened before the old
+ * one is closed, so that its number is different, and the callers which
+ * keep the descriptor registered can tell it has changed.
+ */
+static void set_socket (struct dns_query *query, int fd, int server)
+{
+        if (query->fd >= 0)
+                close (query->fd);
+
+        query->fd = fd;
+        query->fd_server = server;
+}
+
+/*
+ * Open a socket to the current name server, and start connecting it.
+ */
+static int open_socket (struct dns_query *query)
+{
+        struct sockaddr *addr =
+            (struct sockaddr *) &resolver.servers[query->server];
+        socklen_t addrlen = resolver.server_lens[query->server];
+        int fd;
+
+        fd = socket (addr->sa_family, query->tcp ? SOCK_STREAM : SOCK_DGRAM,
+                     0);
+        if (fd < 0)
+                return -1;
+
+        if (socket_nonblocking (fd) != 0) {
+                close (fd);
+                return -1;
+        }
+
+        query->connecting = FALSE;
+        if (connect (fd, addr, addrlen) < 0) {
+                if (errno != EINPROGRESS || !query->tcp) {
+                        close (fd);
+                        return -1;
+                }
+                query->connecting = TRUE;
+        }
+
+        set_socket (query, fd, query->server);
+        return 0;
+}
+
+static void finish (struct dns_query *query, int error)
+{
+        query->done = TRUE;
+        query->error = error;
+
+        set_socket (query, -1, -1);
+        safefree (query->tcpbuf);
+        query->tcplen = 0;
+}
+
+/*
+ * Send the questions not answered yet.  Over TCP, this has to wait until
+ * the connection is up.
+ */
+static int send_queries (struct dns_query *query)
+{
+        unsigned char buf[NQUERIES * DNS_QUERY_LEN];
+        size_t len = 0;
+        unsigned int i;
+
+        for (i = 0; i != NQUERIES; i++) {
+                if (!(query->pending & (1 << i)))
+                        continue;
+
+                if (query->tcp) {
+                        memcpy (buf + len, query->packets[i],
+                                query->packet_lens[i]);
+                        len += query->packet_lens[i];
+                } else if (send (query->fd, query->packets[i] + 2,
+                                 query->packet_lens[i] - 2, 0) < 0) {
+                        return -1;
+                }
+        }
+
+        /* A fresh connection takes the few hundred bytes at once */
+        if (query->tcp && send (query->fd, buf, len, MSG_NOSIGNAL)
+            != (ssize_t) len)
+                return -1;
+
+        return 0;
+}
+
+static void try_next_server (struct dns_query *query);
+
+/*
+ * Ask the current name server, and give it until the deadline to answer.
+ */
+static void ask_server (struct dns_query *query)
+{
+        get_time (&query->deadline);
+        query->deadline.tv_sec += resolver.timeout;
+
+        if (query->tcp || query->fd < 0
+            || query->fd_server != (int) query->server) {
+                if (open_socket (query) < 0) {
+                        try_next_server (query);
+                        return;
+                }
+        }
+
+        if (!query->connecting && send_queries (query) < 0)
+                try_next_server (query);
+}
+
+/*
+ * The current name server has failed, or not answered in time: ask the
+ * next one, unless they have all been asked often enough.  Whatever has
+ * been found so far is used then.
+ */
+static void try_next_server (struct dns_query *query)
+{
+        unsigned int i;
+
+        if (++query->tries >= resolver.attempts * resolver.nservers) {
+                for (i = 0; i != NQUERIES; i++) {
+                        if (query->found[i].naddrs > 0) {
+                                finish (query, 0);
+                                return;
+                        }
+                }
+                finish (query, EAI_AGAIN);
+                return;
+        }
+
+        query->server = (query->server + 1) % resolver.nservers;
+        ask_server (query);
+}
+
+/*
+ * Work out the next name to try: the host itself, and the host in each
+ * of the search domains.  A host with at least ndots dots is tried on its
+ * own first, and any other host last.
+ *
+ * Returns 0, or -1 if all the names have been tried.
+ */
+static int next_name (struct dns_query *query)
+{
+        unsigned int nnames, dots = 0, own;
+        const char *p;
+
+        nnames = query->absolute ? 1 : 1 + resolver.nsearch;
+
+        for (p = query->host; *p != '\0'; p++) {
+                if (*p == '.')
+                        dots++;
+        }
+        own = dots >= resolver.ndots ? 0 : nnames - 1;
+
+        for (; query->name < nnames; query->name++) {
+                unsigned int search = query->name - (query->name > own);
+
+                if (query->name == own) {
+                        strlcpy (query->qname, query->host, DNS_NAME_LEN);
+                        return 0;
+                }
+
+                if (snprintf (query->qname, DNS_NAME_LEN, "%s.%s",
+                              query->host, resolver.search[search])
+                    < DNS_NAME_LEN)
+                        return 0;
+        }
+
+        return -1;
+}
+
+/*
+ * Ask for the next name, if there is one left.
+ */
+static void ask_next_name (struct dns_query *query)
+{
+        ssize_t len;
+        unsigned int i;
+
+        for (;; query->name++) {
+                if (next_name (query) < 0) {
+                        finish (query, EAI_NONAME);
+                        return;
+                }
+
+                for (i = 0; i != NQUERIES; i++) {
+                        query->ids[i] = random_id ();
+                        len = build_query (query->packets[i], query->qname,
+                                           query->ids[i], query_types[i]);
+                        if (len < 0)
+                                break;
+                        query->packet_lens[i] = len;
+                }
+                if (i == NQUERIES)
+                        break;
+        }
+
+        query->pending = (1 << NQUERIES) - 1;
+        memset (query->found, 0, sizeof (query->found));
+        query->server = 0;
+        query->tries = 0;
+
+        /* The answers for the host itself may have been too large */
+        query->tcp = FALSE;
+        safefree (query->tcpbuf);
+        query->tcplen = 0;
+
+        ask_server (query);
+}
+
+/*
+ * Note the TTL of the SOA record in the authority section, which says
+ * for how long the name (or the type of address) is known to be missing.
+ */
+static void read_negative_ttl (struct dns_query *query,
+                               const unsigned char *msg, size_t len,
+                               size_t offset, unsigned int count)
+{
+        uint32_t ttl, minimum;
+        size_t rdlen;
+
+        while (count-- > 0) {
+                if (read_name (msg, len, &offset, NULL, 0) < 0
+                    || offset + 10 > len)
+                        return;
+
+                ttl = get32 (msg + offset + 4);
+                rdlen = get16 (msg + offset + 8);
+                offset += 10;
+                if (offset + rdlen > len)
+                        return;
+
+                if (get16 (msg + offset - 10) == DNS_TYPE_SOA && rdlen >= 20) {
+                        minimum = get32 (msg + offset + rdlen - 4);
+                        if (minimum < ttl)
+                                ttl = minimum;
+                        if (ttl < query->negative_ttl)
+                                query->negative_ttl = ttl;
+                }
+
+                offset += rdlen;
+        }
+}
+
+/*
+ * Take the addresses out of an answer to question i.  The records for
+ * the aliases the name has are part of the answer, and their TTLs count
+ * as well.
+ *
+ * Returns 0, or -1 if the answer is malformed.
+ */
+static int read_answers (struct dns_query *query, unsigned int i,
+                         const unsigned char *msg, size_t len,
+                         size_t *offset, unsigned int count)
+{
+        struct dns_answer *answer = &query->found[i];
+        uint16_t type, class;
+        uint32_t ttl;
+        size_t rdlen;
+
+        while (count-- > 0) {
+                if (read_name (msg, len, offset, NULL, 0) < 0
+                    || *offset + 10 > len)
+                        return -1;
+
+                type = get16 (msg + *offset);
+                class = get16 (msg + *offset + 2);
+                ttl = get32 (msg + *offset + 4);
+                rdlen = get16 (msg + *offset + 8);
+                *offset += 10;
+                if (*offset + rdlen > len)
+                        return -1;
+
+                if (class == DNS_CLASS_IN && ttl < query->ttl)
+                        query->ttl = ttl;
+
+                if (class == DNS_CLASS_IN && type == query_types[i]
+                    && answer->naddrs < DNS_MAX_ADDRS) {
+                        struct dns_addr *addr =
+                            &answer->addrs[answer->naddrs];
+
+                        if (type == DNS_TYPE_A && rdlen == 4) {
+                                addr->family = AF_INET;
+                                memcpy (&addr->u.v4, msg + *offset, 4);
+                                answer->naddrs++;
+                        } else if (type == DNS_TYPE_AAAA && rdlen == 16) {
+                                addr->family = AF_INET6;
+                                memcpy (&addr->u.v6, msg + *offset, 16);
+                                answer->naddrs++;
+                        }
+                }
+
+                *offset += rdlen;
+        }
+
+        return 0;
+}
+
+/*
+ * Handle a message from the name server.  Messages which are not the
+ * answer to one of the questions still pending are ignored.
+ */
+static void handle_answer (struct dns_query *query,
+                           const unsigned char *msg, size_t len)
+{
+        char name[DNS_NAME_LEN];
+        uint16_t id, flags;
+        size_t offset = DNS_HEADER_LEN;
+        unsigned int i;
+
+        if (len < DNS_HEADER_LEN)
+                return;
+
+        id = get16 (msg);
+        flags = get16 (msg + 2);
+
+        for (i = 0; i != NQUERIES; i++) {
+                if ((query->pending & (1 << i)) && query->ids[i] == id)
+                        break;
+        }
+        if (i == NQUERIES || !(flags & DNS_FLAG_QR) || DNS_OPCODE (flags) != 0
+            || get16 (msg + 4) != 1)
+                return;
+
+        if (read_name (msg, len, &offset, name, sizeof (name)) < 0
+            || offset + 4 > len || strcasecmp (name, query->qname) != 0
+            || get16 (msg + offset) != query_types[i]
+            || get16 (msg + offset + 2) != DNS_CLASS_IN)
+                return;
+        offset += 4;
+
+        if (flags & DNS_FLAG_TC) {
+                if (query->tcp) {
+                        try_next_server (query);
+                        return;
+                }
+
+                query->tcp = TRUE;
+                query->tcpbuf = (unsigned char *) safemalloc (DNS_TCP_LEN);
+                query->tcplen = 0;
+                if (!query->tcpbuf) {
+                        finish (query, EAI_MEMORY);
+                        return;
+                }
+
+                ask_server (query);
+                return;
+        }
+
+        switch (DNS_RCODE (flags)) {
+        case DNS_RCODE_NOERROR:
+                if (read_answers (query, i, msg, len, &offset,
+                                  get16 (msg + 6)) < 0) {
+                        try_next_server (query);
+                        return;
+                }
+                if (query->found[i].naddrs == 0)
+                        read_negative_ttl (query, msg, len, offset,
+                                           get16 (msg + 8));
+                break;
+
+        case DNS_RCODE_NXDOMAIN:
+                /* The name does not exist, whatever the type asked for */
+                read_negative_ttl (query, msg, len, offset, get16 (msg + 8));
+                query->name++;
+                ask_next_name (query);
+                return;
+
+        default:
+                try_next_server (query);
+                return;
+        }
+
+        query->pending &= ~(1 << i);
+        if (query->pending != 0)
+                return;
+
+        for (i = 0; i != NQUERIES; i++) {
+                if (query->found[i].naddrs > 0) {
+                        finish (query, 0);
+                        return;
+                }
+        }
+
+        /* The name has no addresses at all */
+        query->name++;
+        ask_next_name (query);
+}
+
+/*
+ * Read the answers which have arrived on the socket, until there are no
+ * more, or the socket has been replaced.
+ */
+static void read_answers_udp (struct dns_query *query)
+{
+        unsigned char msg[DNS_UDP_LEN];
+        int fd = query->fd;
+        ssize_t len;
+
+        while (!query->done && query->fd == fd) {
+                len = recv (fd, msg, sizeof (msg), 0);
+                if (len < 0) {
+                        /* Refused (by an ICMP message) or failed */
+                        if (errno != EAGAIN && errno != EINTR)
+                                try_next_server (query);
+                        return;
+                }
+
+                handle_answer (query, msg, len);
+        }
+}
+
+static void read_answers_tcp (struct dns_query *query)
+{
+        int fd = query->fd;
+        ssize_t len;
+        size_t msglen;
+
+        while (!query->done && query->fd == fd) {
+                len = recv (fd, query->tcpbuf + query->tcplen,
+                            DNS_TCP_LEN - query->tcplen, 0);
+                if (len <= 0) {
+                        if (len == 0 || (errno != EAGAIN && errno != EINTR))
+                                try_next_server (query);
+                        return;
+                }
+                query->tcplen += len;
+
+                while (query->tcplen >= 2) {
+                        msglen = get16 (query->tcpbuf);
+                        if (query->tcplen < 2 + msglen)
+                                break;
+
+                        handle_answer (query, query->tcpbuf + 2, msglen);
+                        if (query->done || query->fd != fd)
+                                return;
+
+                        query->tcplen -= 2 + msglen;
+                        memmove (query->tcpbuf, query->tcpbuf + 2 + msglen,
+                                 query->tcplen);
+                }
+        }
+}
+
+/*
+ * Look the host up in the hosts file.
+ *
+ * Returns 1 if it was found, and 0 otherwise.
+ */
+static int read_hosts (const char *host, struct dns_answer *answer)
+{
+        char line[1024], *p, *addr, *name, *hash;
+        struct dns_addr *found;
+        FILE *fp;
+
+        answer->naddrs = 0;
+
+        fp = fopen (HOSTS_FILE, "r");
+        if (!fp)
+                return 0;
+
+        while (answer->naddrs < DNS_MAX_ADDRS
+               && fgets (line, sizeof (line), fp)) {
+                hash = strchr (line, '#');
+                if (hash)
+                        *hash = '\0';
+
+                p = line;
+                addr = next_word (&p);
+                if (!addr)
+                        continue;
+
+                while ((name = next_word (&p))) {
+                        if (strcasecmp (name, host) == 0)
+                                break;
+                }
+                if (!name)
+                        continue;
+
+                found = &answer->addrs[answer->naddrs];
+                if (inet_pton (AF_INET, addr, &found->u.v4) == 1)
+                        found->family = AF_INET;
+                else if (inet_pton (AF_INET6, addr, &found->u.v6) == 1)
+                        found->family = AF_INET6;
+                else
+                        continue;
+
+                answer->naddrs++;
+        }
+
+        fclose (fp);
+        return answer->naddrs > 0;
+}
+
+/*
+ * Start looking up the addresses of the host.  Numeric addresses and the
+ * hosts in the hosts file are found at once.
+ *
+ * Returns the lookup, or NULL if there is no memory for it.
+ */
+struct dns_query *dns_query_start (const char *host)
+{
+        struct dns_query *query;
+        struct dns_answer *answer;
+        size_t len;
+
+        assert (host != NULL);
+
+        query = (struct dns_query *) safecalloc (1, sizeof (*query));
+        if (!query)
+                return NULL;
+
+        query->fd = query->fd_server = -1;
+        query->ttl = query->negative_ttl = DNS_MAX_TTL;
+
+        len = strlcpy (query->host, host, DNS_NAME_LEN);
+        if (len == 0 || len >= DNS_NAME_LEN) {
+                finish (query, EAI_NONAME);
+                return query;
+        }
+        if (query->host[len - 1] == '.') {
+                query->host[len - 1] = '\0';
+                query->absolute = TRUE;
+        }
+
+        answer = &query->found[QUERY_A];
+        if (inet_pton (AF_INET, query->host, &answer->addrs[0].u.v4) == 1) {
+                answer->addrs[0].family = AF_INET;
+                answer->naddrs = 1;
+                finish (query, 0);
+                return query;
+        }
+        if (inet_pton (AF_INET6, query->host, &answer->addrs[0].u.v6) == 1) {
+                answer->addrs[0].family = AF_INET6;
+                answer->naddrs = 1;
+                finish (query, 0);
+                return query;
+        }
+
+        if (read_hosts (query->host, answer)) {
+                finish (query, 0);
+                return query;
+        }
+
+        ask_next_name (query);
+        return query;
+}
+
+/*
+ * Carry on with the lookup, once the socket is ready for the events
+ * asked for, or the timeout has passed.
+ *
+ * Returns 1 if the lookup has finished, and 0 otherwise.
+ */
+int dns_query_step (struct dns_query *query, unsigned int events)
+{
+        struct timeval now;
+
+        if (query->done)
+                return 1;
+
+        if (query->connecting && events != 0) {
+                if (check_sock_connected (query->fd) != 0) {
+                        try_next_server (query);
+                } else {
+                        query->connecting = FALSE;
+                        if (send_queries (query) < 0)
+                                try_next_server (query);
+                }
+        } else if (events & (POLLER_READ | POLLER_ERROR)) {
+                if (query->tcp)
+                        read_answers_tcp (query);
+                else
+                        read_answers_udp (query);
+        }
+
+        if (query->done)
+                return 1;
+
+        get_time (&now);
+        if (!timercmp (&now, &query->deadline, <))
+                try_next_server (query);
+
+        return query->done;
+}
+
+int dns_query_fd (const struct dns_query *query)
+{
+        return query->fd;
+}
+
+unsigned int dns_query_events (const struct dns_query *query)
+{
+        return query->connecting ? POLLER_WRITE : POLLER_READ;
+}
+
+/*
+ * The number of milliseconds until the current name server is given up
+ * on.
+ */
+int dns_query_timeout (const struct dns_query *query)
+{
+        struct timeval now, left;
+
+        if (query->done)
+                return 0;
+
+        get_time (&now);
+        if (!timercmp (&now, &query->deadline, <))
+                return 0;
+
+        timersub (&query->deadline, &now, &left);
+        return left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+}
+
+/*
+ * The result of a finished lookup: the addresses, with the IPv4 ones
+ * first, and for how many seconds the answer may be kept for.
+ *
+ * Returns 0, or the EAI_ error the lookup failed with.
+ */
+int dns_query_result (const struct dns_query *query,
+                      struct dns_answer *answer, unsigned int *ttl)
+{
+        unsigned int nv4, nv6;
+
+        assert (query->done);
+
+        nv4 = query->found[QUERY_A].naddrs;
+        nv6 = query->found[QUERY_AAAA].naddrs;
+
+        /* Keep some of each, if there are too many */
+        if (nv4 + nv6 > DNS_MAX_ADDRS) {
+                if (nv6 < DNS_MAX_ADDRS / 2)
+                        nv4 = DNS_MAX_ADDRS - nv6;
+                else if (nv4 < DNS_MAX_ADDRS / 2)
+                        nv6 = DNS_MAX_ADDRS - nv4;
+                else
+                        nv4 = nv6 = DNS_MAX_ADDRS / 2;
+        }
+
+        answer->family = AF_UNSPEC;
+        answer->naddrs = nv4 + nv6;
+        memcpy (answer->addrs, query->found[QUERY_A].addrs,
+                nv4 * sizeof (struct dns_addr));
+        memcpy (answer->addrs + nv4, query->found[QUERY_AAAA].addrs,
+                nv6 * sizeof (struct dns_addr));
+
+        if (ttl)
+                *ttl = query->error == EAI_NONAME ? query->negative_ttl
+                    : query->ttl;
+
+        return query->error;
+}
+
+void dns_query_free (struct dns_query *query)
+{
+        if (!query)
+                return;
+
+        if (query->fd >= 0)
+                close (query->fd);
+        safefree (query->tcpbuf);
+        safefree (query);
+}
+
+/*
+ * Look up the addresses of the host, waiting until it is done.
+ *
+ * Returns 0, or the EAI_ error the lookup failed with.
+ */
+int dns_resolve (const char *host, struct dns_answer *answer,
+                 unsigned int *ttl)
+{
+        struct dns_query *query;
+        struct poller *poller;
+        struct poller_event ev;
+        unsigned int events = 0;
+        int error, n;
+
+        query = dns_query_start (host);
+        if (!query)
+                return EAI_MEMORY;
+
+        while (!dns_query_step (query, events)) {
+                poller = poller_create (1);
+                if (!poller) {
+                        dns_query_free (query);
+                        return EAI_MEMORY;
+                }
+
+                n = poller_set (poller, dns_query_fd (query),
+                                dns_query_events (query));
+                if (n == 0)
+                        n = poller_wait (poller, &ev, 1,
+                                         dns_query_timeout (query));
+                poller_delete (poller);
+
+                if (n < 0 && errno != EINTR) {
+                        dns_query_free (query);
+                        return EAI_SYSTEM;
+                }
+
+                events = n > 0 ? ev.events : 0;
+        }
+
+        error = dns_query_result (query, answer, ttl);
+        dns_query_free (query);
+
+        return error;
+}
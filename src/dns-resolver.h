@@ -0,0 +1,53 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'dns-resolver.c' for detailed information. */
+
+#ifndef TINYPROXY_DNS_RESOLVER_H
+#define TINYPROXY_DNS_RESOLVER_H
+
+#include "dns-cache.h"
+
+/*
+ * The TTL reported for answers which do not come with one, such as those
+ * from the hosts file: as long as the cache keeps anything.
+ */
+#define DNS_MAX_TTL (7 * 24 * 60 * 60)
+
+struct dns_query;
+
+extern void dns_resolver_init (void);
+
+/*
+ * A lookup in progress.  The caller waits for dns_query_events() on
+ * dns_query_fd(), for at most dns_query_timeout() milliseconds, and then
+ * calls dns_query_step() with the events which occurred (0 for none),
+ * until it returns 1.  The descriptor can change between the steps.
+ */
+extern struct dns_query *dns_query_start (const char *host);
+extern int dns_query_step (struct dns_query *query, unsigned int events);
+extern int dns_query_fd (const struct dns_query *query);
+extern unsigned int dns_query_events (const struct dns_query *query);
+extern int dns_query_timeout (const struct dns_query *query);
+extern int dns_query_result (const struct dns_query *query,
+                             struct dns_answer *answer, unsigned int *ttl);
+extern void dns_query_free (struct dns_query *query);
+
+extern int dns_resolve (const char *host, struct dns_answer *answer,
+                        unsigned int *ttl);
+
+#endif
@@ -0,0 +1,1659 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The event-driven worker ("WorkerMode event").  Instead of pinning one
+ * process to every connection, each worker process multiplexes many
+ * connections through a single epoll loop.  Every connection walks
+ * through an explicit state machine:
+ *
+ *   EV_READ_REQUEST   waiting for the complete request line and headers
+ *   EV_RESOLVING      the server's address is being looked up
+ *   EV_CONNECTING     non-blocking connects to the server's addresses
+ *                     are in progress
+ *   EV_SOCKS          negotiating with a SOCKS upstream proxy
+ *   EV_READ_RESPONSE  waiting for the complete response headers, while
+ *                     any request body is relayed to the server
+ *   EV_RELAY          relaying the data in both directions
+ *   EV_FLUSH          one side is finished, flush what is still buffered
+ *   EV_FAILED         sending the error (or statistics) page, then closing
+ *
+ * A client which keeps its connection goes back to EV_READ_REQUEST once
+ * the response has been flushed.  Until the next request arrives, it
+ * sits on a list of its own, with the shorter KeepAliveTimeout.
+ *
+ * The header processing itself is shared with the prefork children (see
+ * the steps exported by reqs.c.)  It is only started once the whole header
+ * block has arrived, so it never has to wait for the network.  What it
+ * writes, and the pages tinyproxy makes up itself, go out through the
+ * connection's client_out and server_out streams, which keep whatever the
+ * socket does not take until it is writable again.
+ */
+
+#include "main.h"
+
+#include "buffer.h"
+#include "child.h"
+#include "conns.h"
+#include "dns-cache.h"
+#include "dns-resolver.h"
+#include "event-worker.h"
+#include "hashmap.h"
+#include "heap.h"
+#include "http-parser.h"
+#include "log.h"
+#include "poller.h"
+#include "reqs.h"
+#include "server-pool.h"
+#include "sock.h"
+#include "stats.h"
+#include "conf.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define MAX_EVENTS 256
+
+/*
+ * How long to stop accepting new connections if we run out of file
+ * descriptors.
+ */
+#define ACCEPT_PAUSE 1
+
+typedef enum {
+        EV_READ_REQUEST,
+        EV_RESOLVING,
+        EV_CONNECTING,
+        EV_SOCKS,
+        EV_READ_RESPONSE,
+        EV_RELAY,
+        EV_FLUSH,
+        EV_FAILED,
+        EV_CLOSED
+} ev_state_t;
+
+struct evconn;
+
+/*
+ * A list of connections, ordered by the time of their last activity, so
+ * the idle sweep only has to look at the head.
+ */
+struct evlist {
+        struct evconn *head;
+        struct evconn *tail;
+};
+
+/*
+ * Each registered file descriptor points back at one of these, so an
+ * event can be mapped to the connection (and the side of it.)
+ */
+struct evhandle {
+        struct evconn *ec;      /* NULL for the listening sockets */
+        int fd;
+        unsigned int events;    /* currently registered events */
+        unsigned int registered;        /* boolean */
+        unsigned int hangup;    /* boolean: the peer has gone away */
+};
+
+struct evconn {
+        struct conn_s *connptr;
+        struct request_s *request;
+        hashmap_t hashofheaders;
+
+        ev_state_t state;
+        unsigned int client_eof;        /* boolean */
+
+        /*
+         * The lookup of the server's address, which uses the server
+         * handle while it runs, or the attempts to connect to the
+         * addresses, with a handle each.
+         */
+        struct dns_query *query;
+        struct addrinfo *addrs;
+        struct connect_race *race;
+        struct evhandle attempts[SOCK_MAX_ATTEMPTS];
+
+        /*
+         * The addresses of the server itself, for a SOCKS 4 proxy.  They
+         * are looked up before the proxy's own.
+         */
+        struct dns_answer socks_answer;
+        unsigned int socks_lookup;      /* boolean: being looked up */
+        unsigned int socks_resolved;    /* boolean */
+
+        /* The request is being sent again (see evconn_resend) */
+        unsigned int resending;         /* boolean */
+
+        /* The other connections waiting for a timeout of their own */
+        struct evconn *timer_prev;
+        struct evconn *timer_next;
+
+        struct evhandle client;
+        struct evhandle server;
+
+        /* The list this connection is on */
+        time_t last_access;
+        struct evlist *list;
+        struct evconn *prev;
+        struct evconn *next;
+
+        /* Once closed, until the memory is freed */
+        struct evconn *closed_next;
+};
+
+static int epfd = -1;
+
+/*
+ * The connections being served, and the persistent client connections
+ * waiting for their next request.
+ */
+static struct evlist active_list, idle_list;
+static struct evconn *closed_list;
+
+static struct evhandle *listeners;
+static ssize_t nlisteners;
+static time_t accept_paused;
+
+/* The connections resolving or connecting, which have timeouts */
+static struct evconn *timers;
+
+/*
+ * The hostname being looked up again ahead of its expiry in the DNS
+ * cache, if any.
+ */
+static struct dns_query *prefetch_query;
+static char prefetch_host[DNS_HOST_LEN];
+static struct evhandle prefetch_handle;
+
+static void evconn_unlink (struct evconn *ec)
+{
+        struct evlist *list = ec->list;
+
+        if (!list)
+                return;
+
+        if (ec->prev)
+                ec->prev->next = ec->next;
+        else
+                list->head = ec->next;
+
+        if (ec->next)
+                ec->next->prev = ec->prev;
+        else
+                list->tail = ec->prev;
+
+        ec->prev = ec->next = NULL;
+        ec->list = NULL;
+}
+
+/*
+ * Note the activity on the connection, moving it to the end of the list.
+ */
+static void evconn_move (struct evconn *ec, struct evlist *list)
+{
+        ec->last_access = time (NULL);
+
+        if (ec->list == list && list->tail == ec)
+                return;
+
+        evconn_unlink (ec);
+
+        ec->list = list;
+        ec->prev = list->tail;
+        if (list->tail)
+                list->tail->next = ec;
+        else
+                list->head = ec;
+        list->tail = ec;
+}
+
+static void evconn_touch (struct evconn *ec)
+{
+        evconn_move (ec, &active_list);
+}
+
+/*
+ * Change the events we are interested in for one file descriptor.
+ */
+static int evhandle_set (struct evhandle *h, unsigned int events)
+{
+        struct epoll_event ev;
+        int op;
+
+        if (h->fd < 0 || h->hangup)
+                return 0;
+
+        if (h->registered && h->events == events)
+                return 0;
+
+        memset (&ev, 0, sizeof (ev));
+        ev.events = events;
+        ev.data.ptr = h;
+
+        op = h->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl (epfd, op, h->fd, &ev) < 0) {
+                log_message (LOG_ERR, "epoll_ctl failed on fd %d: %s",
+                             h->fd, strerror (errno));
+                return -1;
+        }
+
+        h->registered = TRUE;
+        h->events = events;
+        return 0;
+}
+
+/*
+ * Stop watching a socket whose peer has gone away.  Otherwise epoll keeps
+ * reporting the hangup, even when no events are requested.
+ */
+static void evhandle_hangup (struct evhandle *h)
+{
+        if (h->registered)
+                epoll_ctl (epfd, EPOLL_CTL_DEL, h->fd, NULL);
+
+        h->registered = FALSE;
+        h->hangup = TRUE;
+}
+
+/*
+ * Wait for what a lookup waits for.  The resolver may have moved on to
+ * another socket, which is then registered afresh; the old one has been
+ * closed, and so dropped from the epoll set.
+ */
+static int evhandle_query (struct evhandle *h, struct dns_query *query)
+{
+        int fd = dns_query_fd (query);
+
+        if (fd != h->fd) {
+                h->fd = fd;
+                h->registered = FALSE;
+                h->hangup = FALSE;
+        }
+
+        return evhandle_set (h, (dns_query_events (query) & POLLER_WRITE)
+                             ? EPOLLOUT : EPOLLIN);
+}
+
+/*
+ * Wait for one connect attempt each, as the race moves on.  The sockets
+ * of attempts which have failed have been closed, and so dropped from
+ * the epoll set.
+ */
+static int evhandle_race (struct evhandle *attempts,
+                          struct connect_race *race)
+{
+        unsigned int i;
+        int fd;
+
+        for (i = 0; i != SOCK_MAX_ATTEMPTS; i++) {
+                struct evhandle *h = &attempts[i];
+
+                fd = connect_race_fd (race, i);
+                if (fd != h->fd) {
+                        h->fd = fd;
+                        h->registered = FALSE;
+                        h->hangup = FALSE;
+                }
+
+                if (evhandle_set (h, EPOLLOUT) < 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+static int evhandle_is_attempt (struct evhandle *h)
+{
+        return h >= h->ec->attempts
+            && h < h->ec->attempts + SOCK_MAX_ATTEMPTS;
+}
+
+/*
+ * Put the connection on the list of those with a timeout, while it
+ * resolves or connects.
+ */
+static void evconn_timer_start (struct evconn *ec)
+{
+        ec->timer_prev = NULL;
+        ec->timer_next = timers;
+        if (timers)
+                timers->timer_prev = ec;
+        timers = ec;
+}
+
+static void evconn_timer_done (struct evconn *ec)
+{
+        if (ec->timer_prev)
+                ec->timer_prev->timer_next = ec->timer_next;
+        else if (timers == ec)
+                timers = ec->timer_next;
+
+        if (ec->timer_next)
+                ec->timer_next->timer_prev = ec->timer_prev;
+
+        ec->timer_prev = ec->timer_next = NULL;
+}
+
+/*
+ * The milliseconds until the timeout of the lookup or connect in
+ * progress, or -1 if there is none.
+ */
+static int evconn_timeout (const struct evconn *ec)
+{
+        if (ec->state == EV_RESOLVING)
+                return dns_query_timeout (ec->query);
+        if (ec->state == EV_CONNECTING)
+                return connect_race_timeout (ec->race);
+        return -1;
+}
+
+static unsigned int poller_events (unsigned int events)
+{
+        return ((events & EPOLLIN) ? POLLER_READ : 0)
+            | ((events & EPOLLOUT) ? POLLER_WRITE : 0)
+            | ((events & (EPOLLERR | EPOLLHUP)) ? POLLER_ERROR : 0);
+}
+
+/*
+ * Is there anything waiting to be written to the client (or the server)?
+ */
+static int client_output (struct conn_s *connptr)
+{
+        return buffer_size (connptr->sbuffer) > 0
+            || ostream_pending (&connptr->client_out) > 0;
+}
+
+static int server_output (struct conn_s *connptr)
+{
+        return request_body_buffered (connptr)
+            || ostream_pending (&connptr->server_out) > 0;
+}
+
+/*
+ * Work out which events each side of the connection has to wait for in
+ * the current state.
+ */
+static int evconn_update (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+        unsigned int cev = 0, sev = 0;
+
+        switch (ec->state) {
+        case EV_READ_REQUEST:
+                cev = EPOLLIN;
+                break;
+
+        case EV_RESOLVING:
+                if (evhandle_set (&ec->client, 0) < 0)
+                        return -1;
+                return evhandle_query (&ec->server, ec->query);
+
+        case EV_CONNECTING:
+                if (evhandle_set (&ec->client, 0) < 0)
+                        return -1;
+                return evhandle_race (ec->attempts, ec->race);
+
+        case EV_SOCKS:
+                sev = EPOLLIN;
+                if (ostream_pending (&connptr->server_out) > 0)
+                        sev |= EPOLLOUT;
+                break;
+
+        /*
+         * Once the whole request body has been sent, whatever the client
+         * sends is its next request, which is left alone until then.
+         */
+        case EV_READ_RESPONSE:
+                sev = EPOLLIN;
+                if (server_output (connptr))
+                        sev |= EPOLLOUT;
+                if (!ec->client_eof && request_body_wanted (connptr))
+                        cev = EPOLLIN;
+                if (ostream_pending (&connptr->client_out) > 0)
+                        cev |= EPOLLOUT;
+                break;
+
+        case EV_RELAY:
+                if (client_output (connptr))
+                        cev |= EPOLLOUT;
+                if (buffer_size (connptr->sbuffer) < SERVER_READ_ROOM)
+                        sev |= EPOLLIN;
+                if (server_output (connptr))
+                        sev |= EPOLLOUT;
+                if (request_body_wanted (connptr))
+                        cev |= EPOLLIN;
+                break;
+
+        case EV_FLUSH:
+                if (client_output (connptr))
+                        cev = EPOLLOUT;
+                if (server_output (connptr))
+                        sev = EPOLLOUT;
+                break;
+
+        case EV_FAILED:
+                cev = EPOLLOUT;
+                break;
+
+        case EV_CLOSED:
+                return 0;
+        }
+
+        ec->client.fd = connptr->client_fd;
+        ec->server.fd = connptr->server_fd;
+
+        if (evhandle_set (&ec->client, cev) < 0
+            || evhandle_set (&ec->server, sev) < 0)
+                return -1;
+
+        return 0;
+}
+
+/*
+ * Release the connection.  The memory is only freed once the current
+ * batch of events has been handled, since later events in the batch may
+ * still point at it.
+ */
+static void evconn_close (struct evconn *ec)
+{
+        if (ec->state == EV_CLOSED)
+                return;
+
+        if (ec->state == EV_RELAY || ec->state == EV_FLUSH)
+                log_message (LOG_INFO,
+                             "Closed connection between local client (fd:%d) "
+                             "and remote client (fd:%d)",
+                             ec->connptr->client_fd, ec->connptr->server_fd);
+
+        ec->state = EV_CLOSED;
+        evconn_unlink (ec);
+        child_scoreboard_close ();
+
+        evconn_timer_done (ec);
+        connect_race_free (ec->race);
+        if (ec->addrs)
+                free_sock_addrs (ec->addrs);
+
+        free_request_struct (ec->request);
+        if (ec->hashofheaders)
+                hashmap_delete (ec->hashofheaders);
+
+        /*
+         * Closing the client socket also removes it from the epoll set.
+         * The server socket may be kept in the pool instead.
+         */
+        evhandle_hangup (&ec->server);
+        if (ec->query)
+                dns_query_free (ec->query);
+        destroy_conn (ec->connptr);
+
+        ec->closed_next = closed_list;
+        closed_list = ec;
+}
+
+static void free_closed_connections (void)
+{
+        struct evconn *ec;
+
+        while (closed_list) {
+                ec = closed_list;
+                closed_list = ec->closed_next;
+                safefree (ec);
+        }
+}
+
+/*
+ * Send the error (or statistics) page to the client and close the
+ * connection, once all of the page has gone out.  Nothing more is sent
+ * to, or read from, the server.
+ */
+static void evconn_fail (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+
+        connection_failed (connptr);
+        if (ostream_pending (&connptr->client_out) == 0) {
+                evconn_close (ec);
+                return;
+        }
+
+        evhandle_hangup (&ec->server);
+        ec->state = EV_FAILED;
+        if (evconn_update (ec) < 0)
+                evconn_close (ec);
+}
+
+/*
+ * Read what has arrived on the socket into the buffer for that side, and
+ * check whether the buffer now holds the whole header block.  The header
+ * parsing code then takes the block from the buffer, and leaves whatever
+ * follows it to the relay.
+ *
+ * Returns: 1 if the header block is complete
+ *          0 if more data is needed
+ *          -1 if the peer closed the connection, an error occurred, or
+ *          the header block is too large.  The caller lets the header
+ *          parsing code report the problem.
+ */
+static int header_block_complete (int fd, struct buffer_s *buffptr)
+{
+        ssize_t ret, len;
+
+        ret = read_buffer (fd, buffptr);
+
+        len = find_header_block (buffptr);
+        if (len > 0)
+                return 1;
+        if (len < 0 || ret < 0)
+                return -1;
+
+        return 0;
+}
+
+static void evconn_connected (struct evconn *ec);
+static void evconn_send_request (struct evconn *ec);
+static void
+evconn_resolved (struct evconn *ec, int ret, struct dns_answer *answer);
+static void evconn_resolve (struct evconn *ec, unsigned int events);
+static void evconn_race (struct evconn *ec, int fd, unsigned int events);
+
+/*
+ * The name being looked up: the server's own for a SOCKS 4 proxy, or that
+ * of the host to connect to.
+ */
+static void
+evconn_lookup_host (struct evconn *ec, const char **host, int *port)
+{
+        get_server_address (ec->connptr, ec->request, host, port);
+        if (ec->socks_lookup)
+                *host = ec->request->host;
+}
+
+/*
+ * Start looking up the address to connect to, after the server's own if
+ * a SOCKS 4 proxy needs it.
+ */
+static void evconn_lookup (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+        struct dns_answer answer;
+        struct dns_query *query;
+        const char *host;
+        int port, ret;
+
+        ec->socks_lookup = !ec->socks_resolved
+            && socks_lookup_host (connptr, ec->request) != NULL;
+        evconn_lookup_host (ec, &host, &port);
+
+        if (!ec->socks_lookup)
+                log_message (LOG_INFO, "opensock: opening connection to "
+                             "%s:%d", host, port);
+
+        ret = dns_cache_lookup (host, &answer);
+        if (ret != 1) {
+                evconn_resolved (ec, ret, &answer);
+                return;
+        }
+
+        query = dns_query_start (host);
+        if (!query) {
+                evconn_resolved (ec, -1, &answer);
+                return;
+        }
+
+        ec->query = query;
+        ec->state = EV_RESOLVING;
+        evconn_timer_start (ec);
+        evconn_resolve (ec, 0);
+}
+
+/*
+ * Take a connection to the server from the pool, or start opening one.
+ */
+static void evconn_open_server (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+
+        if (take_pooled_server (connptr, ec->request)) {
+                ec->server.registered = FALSE;
+                ec->server.hangup = FALSE;
+                evconn_connected (ec);
+                return;
+        }
+
+        evconn_lookup (ec);
+}
+
+/*
+ * The complete request has arrived: process it, and open the connection
+ * to the server.
+ */
+static void evconn_request_ready (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+
+        if (read_request (connptr, &ec->hashofheaders) < 0) {
+                evconn_fail (ec);
+                return;
+        }
+
+        ec->request = prepare_request (connptr, ec->hashofheaders);
+        if (!ec->request) {
+                evconn_fail (ec);
+                return;
+        }
+
+        evconn_open_server (ec);
+}
+
+/*
+ * The server could not be reached: try the next upstream proxy, if there
+ * is one, or send the error page.
+ */
+static void evconn_connect_failed (struct evconn *ec, int error)
+{
+        if (next_upstream_proxy (ec->connptr, ec->request)) {
+                evconn_open_server (ec);
+                return;
+        }
+
+        indicate_connect_error (ec->connptr, error);
+        evconn_fail (ec);
+}
+
+/*
+ * The addresses of the server have been found (ret is 0), or not (ret
+ * is -1): start connecting to them.
+ */
+static void
+evconn_resolved (struct evconn *ec, int ret, struct dns_answer *answer)
+{
+        struct conn_s *connptr = ec->connptr;
+        const char *host;
+        int port;
+
+        evconn_lookup_host (ec, &host, &port);
+
+        /* The server's addresses are kept for the SOCKS 4 proxy */
+        if (ec->socks_lookup) {
+                ec->socks_lookup = FALSE;
+                if (ret < 0) {
+                        log_message (LOG_ERR, "Could not look up %s for the "
+                                     "SOCKS 4 proxy", host);
+                        indicate_connect_error (connptr, EHOSTUNREACH);
+                        evconn_fail (ec);
+                        return;
+                }
+
+                ec->socks_answer = *answer;
+                ec->socks_resolved = TRUE;
+                evconn_lookup (ec);
+                return;
+        }
+
+        if (ret < 0 || make_sock_addrs (answer, port, &ec->addrs) < 0) {
+                log_message (LOG_ERR,
+                             "opensock: Could not retrieve info for %s", host);
+                ec->addrs = NULL;
+                evconn_connect_failed (ec, EHOSTUNREACH);
+                return;
+        }
+
+        log_message (LOG_INFO, "opensock: resolved %s:%d", host, port);
+
+        ec->race = connect_race_start (ec->addrs, connptr->server_ip_addr);
+        if (!ec->race) {
+                evconn_close (ec);
+                return;
+        }
+
+        ec->state = EV_CONNECTING;
+        evconn_timer_start (ec);
+        evconn_race (ec, -1, 0);
+}
+
+/*
+ * Carry on looking up the server's address, after the events on the
+ * resolver's socket (or none, when its timeout has passed.)
+ */
+static void evconn_resolve (struct evconn *ec, unsigned int events)
+{
+        struct dns_answer answer;
+        const char *host;
+        unsigned int ttl;
+        int error, port;
+
+        if (!dns_query_step (ec->query, events)) {
+                if (evconn_update (ec) < 0)
+                        evconn_close (ec);
+                return;
+        }
+
+        error = dns_query_result (ec->query, &answer, &ttl);
+
+        /* Closing the socket has dropped it from the epoll set */
+        evconn_timer_done (ec);
+        dns_query_free (ec->query);
+        ec->query = NULL;
+        ec->server.fd = -1;
+        ec->server.registered = FALSE;
+
+        evconn_lookup_host (ec, &host, &port);
+        evconn_resolved (ec, dns_cache_store (host, error, &answer, ttl),
+                         &answer);
+}
+
+/*
+ * Carry on connecting to the server's addresses, after the events on the
+ * socket of one of the attempts (or none, when the delay before the next
+ * attempt has passed.)
+ */
+static void evconn_race (struct evconn *ec, int fd, unsigned int events)
+{
+        struct conn_s *connptr = ec->connptr;
+        const char *host;
+        int port, family, error;
+        unsigned int i;
+
+        if (!connect_race_step (ec->race, fd, events)) {
+                if (evconn_update (ec) < 0)
+                        evconn_close (ec);
+                return;
+        }
+
+        fd = connect_race_result (ec->race, &family);
+        error = errno;
+
+        /*
+         * The winner is about to be registered as the server socket; the
+         * others are dropped from the epoll set as they are closed.
+         */
+        for (i = 0; i != SOCK_MAX_ATTEMPTS; i++) {
+                struct evhandle *h = &ec->attempts[i];
+
+                if (fd >= 0 && h->fd == fd)
+                        evhandle_hangup (h);
+                h->fd = -1;
+                h->registered = FALSE;
+                h->hangup = FALSE;
+        }
+
+        evconn_timer_done (ec);
+        connect_race_free (ec->race);
+        ec->race = NULL;
+        free_sock_addrs (ec->addrs);
+        ec->addrs = NULL;
+
+        get_server_address (connptr, ec->request, &host, &port);
+
+        if (fd < 0) {
+                log_message (LOG_ERR,
+                             "opensock: Could not establish a connection "
+                             "to %s", host);
+                evconn_connect_failed (ec, error);
+                return;
+        }
+
+        dns_cache_connected (host, family);
+
+        connptr->server_fd = fd;
+        ec->server.fd = fd;
+        ec->server.registered = FALSE;
+        ec->server.hangup = FALSE;
+        evconn_connected (ec);
+}
+
+/*
+ * The connection to the server is up: negotiate with the SOCKS proxy
+ * first, if the server is behind one.
+ */
+static void evconn_connected (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+        int ret;
+
+        /* A connection from the pool has been made blocking */
+        if (socket_nonblocking (connptr->server_fd) != 0) {
+                evconn_close (ec);
+                return;
+        }
+
+        ret = socks_start (connptr, ec->request, &ec->socks_answer);
+        if (ret < 0) {
+                indicate_connect_error (connptr, ECONNREFUSED);
+                evconn_fail (ec);
+                return;
+        }
+        if (ret == 1) {
+                evconn_send_request (ec);
+                return;
+        }
+
+        ec->state = EV_SOCKS;
+        if (evconn_update (ec) < 0)
+                evconn_close (ec);
+}
+
+/*
+ * Carry on with the SOCKS negotiation, after the events on the server
+ * socket.
+ */
+static void evconn_socks (struct evconn *ec, unsigned int sev)
+{
+        struct conn_s *connptr = ec->connptr;
+        int ret = 0;
+
+        if ((sev & EPOLLOUT)
+            && ostream_flush (&connptr->server_out, FALSE) < 0)
+                ret = -1;
+        if (ret == 0 && (sev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            && read_buffer (connptr->server_fd, connptr->sbuffer) < 0)
+                ret = -1;
+        if (ret == 0)
+                ret = socks_step (connptr, ec->request);
+
+        if (ret < 0) {
+                log_message (LOG_ERR, "SOCKS negotiation failed (fd:%d)",
+                             connptr->server_fd);
+                indicate_connect_error (connptr, ECONNREFUSED);
+                evconn_fail (ec);
+                return;
+        }
+        if (ret == 1) {
+                evconn_send_request (ec);
+                return;
+        }
+
+        if (evconn_update (ec) < 0)
+                evconn_close (ec);
+}
+
+/*
+ * Send the request headers to the server, and wait for its response, or
+ * answer a CONNECT request right away.  Whatever the sockets do not take
+ * goes out as they become writable.
+ */
+static void evconn_send_request (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+
+        /* The headers have been put together already */
+        if (ec->resending) {
+                ec->resending = FALSE;
+                connptr->server_out.fd = connptr->server_fd;
+                if (iolist_queue (&connptr->request_head,
+                                  &connptr->server_out, FALSE) < 0) {
+                        evconn_close (ec);
+                        return;
+                }
+
+                ec->state = EV_READ_RESPONSE;
+                if (evconn_update (ec) < 0)
+                        evconn_close (ec);
+                return;
+        }
+
+        if (server_connected (connptr, ec->request) < 0) {
+                indicate_connect_error (connptr, errno);
+                evconn_fail (ec);
+                return;
+        }
+
+        if (process_client_headers (connptr, ec->hashofheaders) < 0) {
+                update_stats (STAT_BADCONN);
+                evconn_fail (ec);
+                return;
+        }
+
+        if (expects_response_headers (connptr)) {
+                ec->state = EV_READ_RESPONSE;
+        } else {
+                if (send_ssl_response (connptr) < 0) {
+                        log_message (LOG_ERR,
+                                     "handle_connection: Could not send SSL greeting "
+                                     "to client.");
+                        update_stats (STAT_BADCONN);
+                        evconn_close (ec);
+                        return;
+                }
+
+                ec->state = EV_RELAY;
+        }
+
+        if (evconn_update (ec) < 0)
+                evconn_close (ec);
+}
+
+/*
+ * A pooled connection may have been closed by the server just as the
+ * request went out: send the request again over a new one, if it may be
+ * (see request_resendable.)
+ *
+ * Returns 0 if the request is on its way again.
+ */
+static int evconn_resend (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+
+        if (!request_resendable (connptr, ec->request))
+                return -1;
+
+        log_message (LOG_INFO, "Server connection (fd:%d) to %s was "
+                     "closed, sending the request again",
+                     connptr->server_fd, connptr->server_key);
+
+        evhandle_hangup (&ec->server);
+        close (connptr->server_fd);
+        connptr->server_fd = -1;
+        connptr->server_reused = FALSE;
+        ostream_free (&connptr->server_out);
+        ostream_init (&connptr->server_out, -1);
+        ec->server.fd = -1;
+        ec->server.registered = FALSE;
+        ec->server.hangup = FALSE;
+
+        ec->resending = TRUE;
+        evconn_lookup (ec);
+        return 0;
+}
+
+/*
+ * The server's response headers have arrived: pass them on to the
+ * client, and start relaying the body.
+ */
+static void evconn_response_ready (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+        int ret;
+
+        ret = process_server_headers (connptr);
+        if (ret < 0) {
+                update_stats (STAT_BADCONN);
+                evconn_fail (ec);
+                return;
+        }
+
+        /* After an interim response, the final one is still to come */
+        if (ret == 1) {
+                if (find_header_block (connptr->sbuffer) != 0)
+                        evconn_response_ready (ec);
+                return;
+        }
+
+        /* The whole body may already have arrived with the headers */
+        if (connptr->content_length.server == 0)
+                ec->state = EV_FLUSH;
+        else
+                ec->state = EV_RELAY;
+}
+
+/*
+ * Write what there is for the client: first what is left of the headers
+ * and pages tinyproxy has put together itself, then what has come from
+ * the server.  Returns what write_buffer() does.
+ */
+static ssize_t evconn_write_client (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+
+        if (ostream_flush (&connptr->client_out, FALSE) < 0)
+                return -1;
+        if (ostream_pending (&connptr->client_out) > 0)
+                return 0;
+
+        return write_buffer (connptr->client_fd, connptr->sbuffer);
+}
+
+/*
+ * Flush as much of the request headers, and then of the request body, to
+ * the server as the socket takes.
+ */
+static int evconn_write_server (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+        ssize_t ret;
+
+        if (ostream_flush (&connptr->server_out, FALSE) < 0)
+                return -1;
+        if (ostream_pending (&connptr->server_out) > 0)
+                return 0;
+
+        while (request_body_buffered (connptr)) {
+                ret = send_request_body (connptr);
+                if (ret < 0)
+                        return -1;
+                if (ret == 0)
+                        break;
+        }
+
+        return 0;
+}
+
+/*
+ * One step of the relay.  This mirrors a single pass through the select()
+ * loop of relay_connection() in reqs.c.
+ */
+static void
+evconn_relay (struct evconn *ec, unsigned int cev, unsigned int sev)
+{
+        struct conn_s *connptr = ec->connptr;
+        ssize_t bytes_received;
+        ssize_t from_server = 0, from_client = 0;
+
+        if (sev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                bytes_received = read_server_body (connptr);
+                if (bytes_received < 0)
+                        goto flush;
+
+                from_server = bytes_received;
+                child_scoreboard_bytes (bytes_received);
+                if (connptr->content_length.server == 0)
+                        goto flush;
+        }
+        if (connptr->request_framed && (cev & (EPOLLHUP | EPOLLERR))) {
+                /* Nobody left to send the rest of the response to */
+                evconn_close (ec);
+                return;
+        }
+        if (cev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                bytes_received = read_request_body (connptr);
+                if (bytes_received < 0)
+                        goto flush;
+
+                from_client = bytes_received;
+                child_scoreboard_bytes (bytes_received);
+        }
+
+        /* Forward what was just read without waiting for EPOLLOUT */
+        if (((sev & EPOLLOUT) || from_client > 0)
+            && evconn_write_server (ec) < 0) {
+                goto flush;
+        }
+        if (((cev & EPOLLOUT) || from_server > 0)
+            && evconn_write_client (ec) < 0) {
+                goto flush;
+        }
+
+        return;
+
+flush:
+        ec->state = EV_FLUSH;
+}
+
+/*
+ * Check whether everything to be flushed has been written.  What the
+ * client has sent after a complete request is its next request, and
+ * stays.
+ */
+static int evconn_flushed (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+
+        return !client_output (connptr) && !server_output (connptr);
+}
+
+/*
+ * The response has been sent.  Unless the client keeps its connection for
+ * another request, and the request and the response have been complete,
+ * that is the end of it.  Otherwise the server side is closed, and the connection waits
+ * for the next request, which may already be in the buffer.
+ */
+static void evconn_finish (struct evconn *ec)
+{
+        struct conn_s *connptr = ec->connptr;
+
+        if (!connptr->keep_alive || connptr->content_length.server != 0
+            || connptr->content_length.client > 0 || config.quit) {
+                evconn_close (ec);
+                return;
+        }
+
+        log_message (LOG_INFO,
+                     "Closed connection between local client (fd:%d) "
+                     "and remote client (fd:%d)",
+                     connptr->client_fd, connptr->server_fd);
+
+        free_request_struct (ec->request);
+        ec->request = NULL;
+        hashmap_delete (ec->hashofheaders);
+        ec->hashofheaders = NULL;
+        ec->client_eof = FALSE;
+        ec->socks_resolved = FALSE;
+        ec->resending = FALSE;
+
+        /* The server socket may be kept in the pool rather than closed */
+        evhandle_hangup (&ec->server);
+        reset_conn (connptr);
+        ec->server.fd = -1;
+        ec->server.registered = FALSE;
+        ec->server.hangup = FALSE;
+
+        ec->state = EV_READ_REQUEST;
+        evconn_move (ec, &idle_list);
+
+        if (find_header_block (connptr->cbuffer) != 0) {
+                evconn_touch (ec);
+                evconn_request_ready (ec);
+                return;
+        }
+
+        if (evconn_update (ec) < 0)
+                evconn_close (ec);
+}
+
+/*
+ * Write out whatever is still buffered once the relay has finished.
+ */
+static void
+evconn_flush (struct evconn *ec, unsigned int cev, unsigned int sev)
+{
+        struct conn_s *connptr = ec->connptr;
+
+        if ((cev & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            && evconn_write_client (ec) < 0) {
+                evconn_close (ec);
+                return;
+        }
+        if (server_output (connptr)
+            && (sev & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            && evconn_write_server (ec) < 0) {
+                evconn_close (ec);
+                return;
+        }
+
+        if (evconn_flushed (ec)) {
+                evconn_finish (ec);
+                return;
+        }
+
+        /* Nothing more to send to a side which has hung up */
+        if (cev & (EPOLLERR | EPOLLHUP))
+                evhandle_hangup (&ec->client);
+        if (sev & (EPOLLERR | EPOLLHUP))
+                evhandle_hangup (&ec->server);
+}
+
+/*
+ * Drive the state machine for an event on one side of the connection.
+ */
+static void evconn_handle (struct evconn *ec, int server_side,
+                           unsigned int events)
+{
+        struct conn_s *connptr = ec->connptr;
+        unsigned int cev = server_side ? 0 : events;
+        unsigned int sev = server_side ? events : 0;
+        ssize_t bytes;
+        int ret;
+
+        /* An earlier event in the same batch may have closed it */
+        if (ec->state == EV_CLOSED)
+                return;
+
+        evconn_touch (ec);
+
+        switch (ec->state) {
+        case EV_READ_REQUEST:
+                ret = header_block_complete (connptr->client_fd,
+                                             connptr->cbuffer);
+                if (ret == 0)
+                        return;
+                if (ret < 0 && connptr->requests > 0
+                    && buffer_size (connptr->cbuffer) == 0) {
+                        /* The client is done with its connection */
+                        evconn_close (ec);
+                        return;
+                }
+                evconn_request_ready (ec);
+                return;
+
+        case EV_RESOLVING:
+                if (cev & (EPOLLERR | EPOLLHUP)) {
+                        /* Nobody left to connect for */
+                        evconn_close (ec);
+                        return;
+                }
+                if (sev)
+                        evconn_resolve (ec, poller_events (sev));
+                return;
+
+        case EV_CONNECTING:
+        case EV_SOCKS:
+                if (cev & (EPOLLERR | EPOLLHUP)) {
+                        /* Nobody left to connect for */
+                        evconn_close (ec);
+                        return;
+                }
+                if (ec->state == EV_SOCKS && sev)
+                        evconn_socks (ec, sev);
+                return;
+
+        case EV_READ_RESPONSE:
+                if (cev & (EPOLLERR | EPOLLHUP)) {
+                        /* Nobody left to send the response to */
+                        evconn_close (ec);
+                        return;
+                }
+                if (cev & EPOLLIN) {
+                        bytes = read_request_body (connptr);
+                        if (bytes < 0)
+                                ec->client_eof = TRUE;
+                        else
+                                child_scoreboard_bytes (bytes);
+                }
+                if ((cev & EPOLLOUT)
+                    && ostream_flush (&connptr->client_out, FALSE) < 0) {
+                        evconn_close (ec);
+                        return;
+                }
+                if (evconn_write_server (ec) < 0) {
+                        if (evconn_resend (ec) < 0)
+                                evconn_close (ec);
+                        return;
+                }
+                if (!(sev & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                        break;
+                ret = header_block_complete (connptr->server_fd,
+                                             connptr->sbuffer);
+                if (ret < 0 && evconn_resend (ec) == 0)
+                        return;
+                if (ret != 0)
+                        evconn_response_ready (ec);
+                break;
+
+        case EV_RELAY:
+                evconn_relay (ec, cev, sev);
+                break;
+
+        case EV_FLUSH:
+                evconn_flush (ec, cev, sev);
+                break;
+
+        case EV_FAILED:
+                if (!cev)
+                        break;
+                if ((cev & EPOLLERR)
+                    || ostream_flush (&connptr->client_out, FALSE) < 0
+                    || ostream_pending (&connptr->client_out) == 0) {
+                        evconn_close (ec);
+                        return;
+                }
+                break;
+
+        case EV_CLOSED:
+                return;
+        }
+
+        if (ec->state == EV_CLOSED)
+                return;
+
+        /* Nothing left to flush once the relay has finished? */
+        if (ec->state == EV_FLUSH && evconn_flushed (ec)) {
+                evconn_finish (ec);
+                return;
+        }
+
+        /* A buffer which has drained goes back to the pool meanwhile */
+        buffer_release (connptr->cbuffer);
+        buffer_release (connptr->sbuffer);
+
+        if (evconn_update (ec) < 0)
+                evconn_close (ec);
+}
+
+/*
+ * Set up the state for a newly accepted client.
+ */
+static void evconn_create (int fd)
+{
+        struct evconn *ec;
+        unsigned int i;
+
+#ifndef HAVE_ACCEPT4
+        if (socket_nonblocking (fd) != 0) {
+                log_message (LOG_ERR, "Failed to set the client socket "
+                             "to non-blocking: %s", strerror (errno));
+                close (fd);
+                return;
+        }
+#endif
+
+        ec = (struct evconn *) safecalloc (1, sizeof (struct evconn));
+        if (!ec) {
+                close (fd);
+                return;
+        }
+
+        ec->connptr = prepare_connection (fd);
+        if (!ec->connptr) {
+                safefree (ec);
+                return;
+        }
+
+        child_scoreboard_open ();
+
+        ec->client.ec = ec->server.ec = ec;
+        ec->client.fd = ec->server.fd = -1;
+        for (i = 0; i != SOCK_MAX_ATTEMPTS; i++) {
+                ec->attempts[i].ec = ec;
+                ec->attempts[i].fd = -1;
+        }
+        ec->state = EV_READ_REQUEST;
+        evconn_touch (ec);
+
+        if (ec->connptr->error_variables) {
+                /* Refused by the access list */
+                evconn_fail (ec);
+                return;
+        }
+
+        if (evconn_update (ec) < 0)
+                evconn_close (ec);
+}
+
+static void pause_accepting (int pause)
+{
+        ssize_t i;
+        unsigned int events = EPOLLIN;
+
+#ifdef EPOLLEXCLUSIVE
+        /* Only wake up one of the workers for a new connection */
+        events |= EPOLLEXCLUSIVE;
+#endif
+
+        for (i = 0; i < nlisteners; i++) {
+                if (pause) {
+                        epoll_ctl (epfd, EPOLL_CTL_DEL, listeners[i].fd,
+                                   NULL);
+                        listeners[i].registered = FALSE;
+                } else {
+                        evhandle_set (&listeners[i], events);
+                }
+        }
+
+        accept_paused = pause ? time (NULL) : 0;
+}
+
+/*
+ * Accept all the pending connections on a listening socket.
+ */
+static void accept_connections (int listenfd)
+{
+        struct sockaddr_storage cliaddr;
+        socklen_t clilen;
+        int connfd;
+
+        for (;;) {
+                clilen = sizeof (cliaddr);
+#ifdef HAVE_ACCEPT4
+                connfd = accept4 (listenfd, (struct sockaddr *) &cliaddr,
+                                  &clilen, SOCK_NONBLOCK);
+#else
+                connfd = accept (listenfd, (struct sockaddr *) &cliaddr,
+                                 &clilen);
+#endif
+                if (connfd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        if (errno == EMFILE || errno == ENFILE) {
+                                log_message (LOG_WARNING,
+                                             "Out of file descriptors, not "
+                                             "accepting connections for %d "
+                                             "second(s).", ACCEPT_PAUSE);
+                                pause_accepting (TRUE);
+                        } else if (errno != EAGAIN) {
+                                log_message (LOG_ERR,
+                                             "Accept returned an error (%s) ... retrying.",
+                                             strerror (errno));
+                        }
+                        return;
+                }
+
+                evconn_create (connfd);
+        }
+}
+
+/*
+ * Close the connections which have been idle for too long.
+ */
+static void sweep_idle_connections (void)
+{
+        time_t now = time (NULL);
+        double tdiff;
+
+        while (active_list.head) {
+                tdiff = difftime (now, active_list.head->last_access);
+                if (tdiff <= config.idletimeout)
+                        break;
+
+                log_message (LOG_INFO,
+                             "Idle Timeout (event worker) as %g > %u.",
+                             tdiff, config.idletimeout);
+                evconn_close (active_list.head);
+        }
+
+        while (idle_list.head) {
+                tdiff = difftime (now, idle_list.head->last_access);
+                if (tdiff < config.keepalive_timeout)
+                        break;
+
+                log_message (LOG_INFO, "Keep-alive timeout on client "
+                             "connection (fd:%d)",
+                             idle_list.head->connptr->client_fd);
+                evconn_close (idle_list.head);
+        }
+
+        free_closed_connections ();
+        server_pool_expire ();
+
+        if (accept_paused && difftime (now, accept_paused) >= ACCEPT_PAUSE)
+                pause_accepting (FALSE);
+}
+
+/*
+ * Move on with the lookups and connects whose timeout has passed.
+ */
+static void expire_timers (void)
+{
+        struct evconn *ec, *next;
+
+        for (ec = timers; ec; ec = next) {
+                next = ec->timer_next;
+                if (evconn_timeout (ec) != 0)
+                        continue;
+
+                if (ec->state == EV_RESOLVING)
+                        evconn_resolve (ec, 0);
+                else
+                        evconn_race (ec, -1, 0);
+        }
+}
+
+/*
+ * Look up the hostnames in demand ahead of their expiry in the DNS cache,
+ * one at a time, alongside the connections.
+ */
+static void prefetch_step (unsigned int events)
+{
+        struct dns_answer answer;
+        unsigned int ttl;
+        int error;
+
+        for (;;) {
+                if (!prefetch_query) {
+                        if (!dns_cache_next_prefetch (prefetch_host))
+                                return;
+
+                        prefetch_query = dns_query_start (prefetch_host);
+                        if (!prefetch_query)
+                                return;
+                        events = 0;
+                }
+
+                if (!dns_query_step (prefetch_query, events)) {
+                        evhandle_query (&prefetch_handle, prefetch_query);
+                        return;
+                }
+
+                error = dns_query_result (prefetch_query, &answer, &ttl);
+                dns_cache_refreshed (prefetch_host, error, &answer, ttl);
+
+                dns_query_free (prefetch_query);
+                prefetch_query = NULL;
+                prefetch_handle.fd = -1;
+                prefetch_handle.registered = FALSE;
+        }
+}
+
+/*
+ * How long epoll_wait() may wait: until the earliest of the resolver's
+ * and connects' timeouts, and at most a second, for the idle sweep.
+ */
+static int wait_timeout (void)
+{
+        struct evconn *ec;
+        int timeout = 1000, t;
+
+        for (ec = timers; ec; ec = ec->timer_next) {
+                t = evconn_timeout (ec);
+                if (t >= 0 && t < timeout)
+                        timeout = t;
+        }
+
+        if (prefetch_query) {
+                t = dns_query_timeout (prefetch_query);
+                if (t < timeout)
+                        timeout = t;
+        }
+
+        return timeout;
+}
+
+/*
+ * Allow each worker to use as many descriptors as the hard limit permits,
+ * since every connection needs two of them.
+ */
+static void raise_fd_limit (void)
+{
+        struct rlimit rl;
+
+        if (getrlimit (RLIMIT_NOFILE, &rl) != 0)
+                return;
+
+        if (rl.rlim_cur < rl.rlim_max) {
+                rl.rlim_cur = rl.rlim_max;
+                if (setrlimit (RLIMIT_NOFILE, &rl) != 0)
+                        log_message (LOG_WARNING,
+                                     "Could not raise the file descriptor "
+                                     "limit: %s", strerror (errno));
+        }
+}
+
+/*
+ * The main loop of an event worker.  Returns when tinyproxy is asked to
+ * quit, or on a fatal error.
+ */
+int event_worker_main (vector_t listen_fds)
+{
+        struct epoll_event events[MAX_EVENTS];
+        struct evhandle *h;
+        ssize_t i;
+        int n;
+
+        raise_fd_limit ();
+
+        epfd = epoll_create (MAX_EVENTS);
+        if (epfd < 0) {
+                log_message (LOG_ERR, "epoll_create failed: %s",
+                             strerror (errno));
+                return -1;
+        }
+
+        nlisteners = vector_length (listen_fds);
+        listeners = (struct evhandle *)
+                safecalloc (nlisteners, sizeof (struct evhandle));
+        if (!listeners)
+                return -1;
+
+        for (i = 0; i < nlisteners; i++) {
+                int *fd = (int *) vector_getentry (listen_fds, i, NULL);
+
+                if (socket_nonblocking (*fd) != 0) {
+                        log_message (LOG_ERR, "Failed to set the listening "
+                                     "socket %d to non-blocking: %s",
+                                     *fd, strerror (errno));
+                        return -1;
+                }
+
+                listeners[i].fd = *fd;
+        }
+
+        pause_accepting (FALSE);
+        prefetch_handle.fd = -1;
+
+        while (!config.quit) {
+                n = epoll_wait (epfd, events, MAX_EVENTS, wait_timeout ());
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log_message (LOG_ERR, "error calling epoll_wait: %s",
+                                     strerror (errno));
+                        return -1;
+                }
+
+                for (i = 0; i < n; i++) {
+                        h = (struct evhandle *) events[i].data.ptr;
+
+                        if (h == &prefetch_handle) {
+                                prefetch_step (poller_events
+                                               (events[i].events));
+                                continue;
+                        }
+
+                        if (h->ec == NULL) {
+                                accept_connections (h->fd);
+                                continue;
+                        }
+
+                        if (evhandle_is_attempt (h)) {
+                                if (h->fd >= 0
+                                    && h->ec->state == EV_CONNECTING)
+                                        evconn_race (h->ec, h->fd,
+                                                     poller_events
+                                                     (events[i].events));
+                                continue;
+                        }
+
+                        evconn_handle (h->ec, h == &h->ec->server,
+                                       events[i].events);
+                }
+
+                expire_timers ();
+                sweep_idle_connections ();
+                prefetch_step (0);
+        }
+
+        return 0;
+}
+
+#else /* HAVE_SYS_EPOLL_H */
+
+int event_worker_main (vector_t listen_fds)
+{
+        log_message (LOG_ERR, "The event worker mode is not supported "
+                     "on this platform.");
+        return -1;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
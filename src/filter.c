@@ -28,6 +28,7 @@
 #include "heap.h"
 #include "log.h"
 #include "reqs.h"
+#include "text.h"
 #include "conf.h"
 
 #define FILTER_BUFFER_LEN (512)
@@ -44,6 +45,31 @@ static struct filter_list *fl = NULL;
 static int already_init = 0;
 static filter_policy_t default_policy = FILTER_DEFAULT_ALLOW;
 
+/*
+ * The decisions for the most recently checked domains or URLs, so a busy
+ * site is not matched against every rule on every request.  The threads
+ * of the threaded worker mode all share it.  Names too long to fit are
+ * simply not cached.
+ */
+#define FILTER_CACHE_SIZE    256
+#define FILTER_CACHE_NAMELEN 128
+
+struct filter_cache_entry {
+        char name[FILTER_CACHE_NAMELEN];        /* empty if unused */
+        int result;
+};
+
+static struct filter_cache_entry filter_cache[FILTER_CACHE_SIZE];
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t filter_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define FILTER_CACHE_LOCK()   pthread_mutex_lock (&filter_cache_lock)
+#  define FILTER_CACHE_UNLOCK() pthread_mutex_unlock (&filter_cache_lock)
+#else
+#  define FILTER_CACHE_LOCK()   do { } while (0)
+#  define FILTER_CACHE_UNLOCK() do { } while (0)
+#endif
+
 /*
  * Initializes a linked list of strings containing hosts/urls to be filtered
  */
@@ -149,6 +175,10 @@ void filter_destroy (void)
                 fl = NULL;
                 already_init = 0;
         }
+
+        FILTER_CACHE_LOCK ();
+        memset (filter_cache, 0, sizeof (filter_cache));
+        FILTER_CACHE_UNLOCK ();
 }
 
 /**
@@ -163,60 +193,70 @@ void filter_reload (void)
         }
 }
 
-/* Return 0 to allow, non-zero to block */
-int filter_domain (const char *host)
+static struct filter_cache_entry *filter_cache_slot (const char *name)
 {
-        struct filter_list *p;
-        int result;
+        unsigned int hash = 5381;
+        const unsigned char *p;
 
-        if (!fl || !already_init)
-                goto COMMON_EXIT;
+        for (p = (const unsigned char *) name; *p; p++)
+                hash = hash * 33 + *p;
 
-        for (p = fl; p; p = p->next) {
-                result =
-                    regexec (p->cpat, host, (size_t) 0, (regmatch_t *) 0, 0);
-
-                if (result == 0) {
-                        if (default_policy == FILTER_DEFAULT_ALLOW)
-                                return 1;
-                        else
-                                return 0;
-                }
-        }
-
-COMMON_EXIT:
-        if (default_policy == FILTER_DEFAULT_ALLOW)
-                return 0;
-        else
-                return 1;
+        return &filter_cache[hash % FILTER_CACHE_SIZE];
 }
 
-/* returns 0 to allow, non-zero to block */
-int filter_url (const char *url)
+/*
+ * Match name against the filter rules, or look up the earlier decision.
+ * Returns 0 to allow, non-zero to block.
+ */
+static int filter_match (const char *name)
 {
+        struct filter_cache_entry *entry;
         struct filter_list *p;
-        int result;
+        int result = default_policy == FILTER_DEFAULT_ALLOW ? 0 : 1;
+        int cacheable = strlen (name) < FILTER_CACHE_NAMELEN;
 
         if (!fl || !already_init)
-                goto COMMON_EXIT;
+                return result;
+
+        entry = filter_cache_slot (name);
+        if (cacheable) {
+                FILTER_CACHE_LOCK ();
+                if (strcmp (entry->name, name) == 0) {
+                        result = entry->result;
+                        FILTER_CACHE_UNLOCK ();
+                        return result;
+                }
+                FILTER_CACHE_UNLOCK ();
+        }
 
         for (p = fl; p; p = p->next) {
-                result =
-                    regexec (p->cpat, url, (size_t) 0, (regmatch_t *) 0, 0);
-
-                if (result == 0) {
-                        if (default_policy == FILTER_DEFAULT_ALLOW)
-                                return 1;
-                        else
-                                return 0;
+                if (regexec (p->cpat, name, (size_t) 0, (regmatch_t *) 0,
+                             0) == 0) {
+                        result = !result;
+                        break;
                 }
         }
 
-COMMON_EXIT:
-        if (default_policy == FILTER_DEFAULT_ALLOW)
-                return 0;
-        else
-                return 1;
+        if (cacheable) {
+                FILTER_CACHE_LOCK ();
+                strlcpy (entry->name, name, FILTER_CACHE_NAMELEN);
+                entry->result = result;
+                FILTER_CACHE_UNLOCK ();
+        }
+
+        return result;
+}
+
+/* Return 0 to allow, non-zero to block */
+int filter_domain (const char *host)
+{
+        return filter_match (host);
+}
+
+/* returns 0 to allow, non-zero to block */
+int filter_url (const char *url)
+{
+        return filter_match (url);
 }
 
 /*
@@ -23,6 +23,12 @@
  * to the data when a key is searched for, so take care in modifying the
  * data as it's modifying the data stored in the hashmap.  (In other words,
  * don't try to free the data, or realloc the memory. :)
+ *
+ * The entries are kept in a plain array, in the order they were inserted,
+ * so an iterator is simply a position in it, and headers go back out in
+ * the order they came in.  Lookups go through an open-addressed index of
+ * entry numbers next to the array, with the hash of every key worked out
+ * once, when it is inserted.  A key may be in the map more than once.
  */
 
 #include "main.h"
@@ -31,122 +37,174 @@
 #include "heap.h"
 
 /*
- * These structures are the storage for the hashmap.  Entries are stored in
- * struct hashentry_s (the key, data, and length), and all the "buckets" are
- * grouped together in hashmap_s.  The hashmap_s.size member is for
- * internal use.  It stores the number of buckets the hashmap was created
- * with.
+ * The entries, in the order of insertion, and the index into them.  Each
+ * slot of the index holds an entry number plus one, or 0 if it is free.
+ * The index has at least twice as many slots as there is room for
+ * entries, and its size is a power of two.  Both live in one block of
+ * memory, the index right after the entries.
  */
 struct hashentry_s {
         char *key;
         void *data;
         size_t len;
-
-        struct hashentry_s *prev, *next;
-};
-
-struct hashbucket_s {
-        struct hashentry_s *head, *tail;
+        uint32_t hash;
+        unsigned int borrowed;  /* boolean: key and data were not copied */
 };
 
 struct hashmap_s {
         uint32_t seed;
-        unsigned int size;
-        hashmap_iter end_iterator;
 
-        struct hashbucket_s *buckets;
+        struct hashentry_s *entries;
+        unsigned int count;
+        unsigned int capacity;
+
+        unsigned int *index;
+        unsigned int mask;      /* the number of index slots, less one */
+
+        struct arena *arena;    /* see hashmap_arena() */
 };
 
+static struct pool_s map_pool =
+        POOL_INITIALIZER ("hashmap", sizeof (struct hashmap_s), 0);
+
 /*
- * A NULL terminated string is passed to this function and a "hash" value
- * is produced within the range of [0 .. size)  (In other words, 0 to one
- * less than size.)
- * The contents of the key are converted to lowercase, so this function
- * is not case-sensitive.
+ * A NULL terminated string is passed to this function and a hash value is
+ * produced.  Setting the 0x20 bit makes the letters lowercase, so this
+ * function is not case-sensitive.  (It also puts a few other characters
+ * together, which only costs a string comparison now and then.)
  *
  * This is Dan Bernstein's hash function as described, for example, here:
  * http://www.cse.yorku.ca/~oz/hash.html
- *
- * If any of the arguments are invalid a negative number is returned.
  */
-static int hashfunc (const char *key, unsigned int size, uint32_t seed)
+static uint32_t hashfunc (const char *key, uint32_t seed)
 {
         uint32_t hash;
 
-        if (key == NULL)
-                return -EINVAL;
-        if (size == 0)
-                return -ERANGE;
+        for (hash = seed; *key != '\0'; key++)
+                hash = ((hash << 5) + hash) ^ (*key | 0x20);
+
+        return hash;
+}
+
+/*
+ * Put entry number i into the first free slot of the index, starting at
+ * the one its hash points to.
+ */
+static void index_entry (hashmap_t map, unsigned int i)
+{
+        unsigned int slot = map->entries[i].hash & map->mask;
+
+        while (map->index[slot] != 0)
+                slot = (slot + 1) & map->mask;
+
+        map->index[slot] = i + 1;
+}
+
+static void rebuild_index (hashmap_t map)
+{
+        unsigned int i;
+
+        memset (map->index, 0, (map->mask + 1) * sizeof (unsigned int));
+        for (i = 0; i != map->count; i++)
+                index_entry (map, i);
+}
+
+/*
+ * Make room for capacity entries, moving the entries into a new block.
+ *
+ * Returns: 0 on success
+ *          -ENOMEM if there is not enough memory
+ */
+static int hashmap_resize (hashmap_t map, unsigned int capacity)
+{
+        struct hashentry_s *entries;
+        unsigned int slots;
+
+        for (slots = 8; slots < capacity * 2; slots <<= 1)
+                continue;
+
+        entries = (struct hashentry_s *)
+            safemalloc (capacity * sizeof (struct hashentry_s)
+                        + slots * sizeof (unsigned int));
+        if (!entries)
+                return -ENOMEM;
+
+        if (map->count > 0)
+                memcpy (entries, map->entries,
+                        map->count * sizeof (struct hashentry_s));
+        safefree (map->entries);
+
+        map->entries = entries;
+        map->capacity = capacity;
+        map->index = (unsigned int *) (entries + capacity);
+        map->mask = slots - 1;
+        rebuild_index (map);
 
-        for (hash = seed; *key != '\0'; key++) {
-                hash = ((hash << 5) + hash) ^ tolower (*key);
+        return 0;
+}
+
+/*
+ * Find the first entry for the key, in the order of insertion.  Since
+ * entries are only ever added at the end of the probe sequence, that is
+ * also the first one the probe comes to.
+ *
+ * Returns: the entry number, or -1 if the key is not in the map
+ */
+static int lookup_entry (hashmap_t map, const char *key, uint32_t hash)
+{
+        struct hashentry_s *entry;
+        unsigned int slot;
+
+        if (map->count == 0)
+                return -1;
+
+        for (slot = hash & map->mask; map->index[slot] != 0;
+             slot = (slot + 1) & map->mask) {
+                entry = &map->entries[map->index[slot] - 1];
+                if (entry->hash == hash && strcasecmp (entry->key, key) == 0)
+                        return map->index[slot] - 1;
         }
 
-        /* Keep the hash within the table limits */
-        return hash % size;
+        return -1;
 }
 
 /*
- * Create a hashmap with the requested number of buckets.  If "nbuckets" is
- * not greater than zero a NULL is returned; otherwise, a _token_ to the
- * hashmap is returned.
+ * Create a hashmap with room for the expected number of entries, which is
+ * no limit.  If "nentries" is not greater than zero a NULL is returned;
+ * otherwise, a _token_ to the hashmap is returned.
  *
  * NULLs are also returned if memory could not be allocated for hashmap.
  */
-hashmap_t hashmap_create (unsigned int nbuckets)
+hashmap_t hashmap_create (unsigned int nentries)
 {
         struct hashmap_s *ptr;
 
-        if (nbuckets == 0)
+        if (nentries == 0)
                 return NULL;
 
-        ptr = (struct hashmap_s *) safecalloc (1, sizeof (struct hashmap_s));
+        ptr = (struct hashmap_s *) pool_alloc (&map_pool);
         if (!ptr)
                 return NULL;
 
         ptr->seed = (uint32_t)rand();
-        ptr->size = nbuckets;
-        ptr->buckets = (struct hashbucket_s *) safecalloc (nbuckets,
-                                                           sizeof (struct
-                                                                   hashbucket_s));
-        if (!ptr->buckets) {
-                safefree (ptr);
+        ptr->entries = NULL;
+        ptr->count = 0;
+        ptr->arena = NULL;
+
+        if (hashmap_resize (ptr, nentries) < 0) {
+                pool_free (&map_pool, ptr);
                 return NULL;
         }
 
-        /* This points to "one" past the end of the hashmap. */
-        ptr->end_iterator = 0;
-
         return ptr;
 }
 
-/*
- * Follow the chain of hashentries and delete them (including the data and
- * the key.)
- *
- * Returns: 0 if the function completed successfully
- *          negative number is returned if "entry" was NULL
- */
-static int delete_hashbucket (struct hashbucket_s *bucket)
+static void free_hashentry (struct hashentry_s *ptr)
 {
-        struct hashentry_s *nextptr;
-        struct hashentry_s *ptr;
-
-        if (bucket == NULL || bucket->head == NULL)
-                return -EINVAL;
-
-        ptr = bucket->head;
-        while (ptr) {
-                nextptr = ptr->next;
-
+        if (!ptr->borrowed) {
                 safefree (ptr->key);
                 safefree (ptr->data);
-                safefree (ptr);
-
-                ptr = nextptr;
         }
-
-        return 0;
 }
 
 /*
@@ -162,18 +220,40 @@ int hashmap_delete (hashmap_t map)
         if (map == NULL)
                 return -EINVAL;
 
-        for (i = 0; i != map->size; i++) {
-                if (map->buckets[i].head != NULL) {
-                        delete_hashbucket (&map->buckets[i]);
-                }
-        }
+        for (i = 0; i != map->count; i++)
+                free_hashentry (&map->entries[i]);
 
-        safefree (map->buckets);
-        safefree (map);
+        safefree (map->entries);
+        arena_delete (map->arena);
+        pool_free (&map_pool, map);
 
         return 0;
 }
 
+/*
+ * Add an entry after all the others.
+ */
+static int hashmap_link (hashmap_t map, char *key, void *data, size_t len,
+                         unsigned int borrowed)
+{
+        struct hashentry_s *ptr;
+
+        if (map->count == map->capacity
+            && hashmap_resize (map, map->capacity * 2) < 0)
+                return -ENOMEM;
+
+        ptr = &map->entries[map->count];
+        ptr->key = key;
+        ptr->data = data;
+        ptr->len = len;
+        ptr->hash = hashfunc (key, map->seed);
+        ptr->borrowed = borrowed;
+
+        index_entry (map, map->count);
+        map->count++;
+        return 0;
+}
+
 /*
  * Inserts a NULL terminated string (as the key), plus any arbitrary "data"
  * of "len" bytes.  Both the key and the data are copied, so the original
@@ -187,10 +267,9 @@ int hashmap_delete (hashmap_t map)
 int
 hashmap_insert (hashmap_t map, const char *key, const void *data, size_t len)
 {
-        struct hashentry_s *ptr;
-        int hash;
         char *key_copy;
         void *data_copy;
+        int ret;
 
         assert (map != NULL);
         assert (key != NULL);
@@ -202,10 +281,6 @@ hashmap_insert (hashmap_t map, const char *key, const void *data, size_t len)
         if (!data || len < 1)
                 return -ERANGE;
 
-        hash = hashfunc (key, map->size, map->seed);
-        if (hash < 0)
-                return hash;
-
         /*
          * First make copies of the key and data in case there is a memory
          * problem later.
@@ -221,31 +296,47 @@ hashmap_insert (hashmap_t map, const char *key, const void *data, size_t len)
         }
         memcpy (data_copy, data, len);
 
-        ptr = (struct hashentry_s *) safemalloc (sizeof (struct hashentry_s));
-        if (!ptr) {
+        ret = hashmap_link (map, key_copy, data_copy, len, FALSE);
+        if (ret < 0) {
                 safefree (key_copy);
                 safefree (data_copy);
-                return -ENOMEM;
         }
 
-        ptr->key = key_copy;
-        ptr->data = data_copy;
-        ptr->len = len;
+        return ret;
+}
 
-        /*
-         * Now add the entry to the end of the bucket chain.
-         */
-        ptr->next = NULL;
-        ptr->prev = map->buckets[hash].tail;
-        if (map->buckets[hash].tail)
-                map->buckets[hash].tail->next = ptr;
+/*
+ * Like hashmap_insert(), but the key and the data are not copied.  They
+ * have to stay valid for as long as the hashmap exists, which is easiest
+ * to arrange by allocating them from hashmap_arena().
+ */
+int hashmap_insert_ref (hashmap_t map, char *key, void *data, size_t len)
+{
+        assert (map != NULL);
+        assert (key != NULL);
+        assert (data != NULL);
+        assert (len > 0);
 
-        map->buckets[hash].tail = ptr;
-        if (!map->buckets[hash].head)
-                map->buckets[hash].head = ptr;
+        if (map == NULL || key == NULL)
+                return -EINVAL;
+        if (!data || len < 1)
+                return -ERANGE;
 
-        map->end_iterator++;
-        return 0;
+        return hashmap_link (map, key, data, len, TRUE);
+}
+
+/*
+ * Return an arena which is deleted together with the hashmap, created
+ * when it is first asked for.  Returns NULL if no memory is left.
+ */
+struct arena *hashmap_arena (hashmap_t map)
+{
+        assert (map != NULL);
+
+        if (!map->arena)
+                map->arena = arena_create ();
+
+        return map->arena;
 }
 
 /*
@@ -260,7 +351,7 @@ hashmap_iter hashmap_first (hashmap_t map)
         if (!map)
                 return -EINVAL;
 
-        if (map->end_iterator == 0)
+        if (map->count == 0)
                 return -1;
         else
                 return 0;
@@ -280,7 +371,7 @@ int hashmap_is_end (hashmap_t map, hashmap_iter iter)
         if (!map || iter < 0)
                 return -EINVAL;
 
-        if (iter == map->end_iterator)
+        if ((unsigned int) iter >= map->count)
                 return 1;
         else
                 return 0;
@@ -296,9 +387,7 @@ int hashmap_is_end (hashmap_t map, hashmap_iter iter)
  */
 hashmap_iter hashmap_find (hashmap_t map, const char *key)
 {
-        unsigned int i;
-        hashmap_iter iter = 0;
-        struct hashentry_s *ptr;
+        int i;
 
         assert (map != NULL);
         assert (key != NULL);
@@ -306,25 +395,8 @@ hashmap_iter hashmap_find (hashmap_t map, const char *key)
         if (!map || !key)
                 return -EINVAL;
 
-        /*
-         * Loop through all the keys and look for the first occurrence
-         * of a particular key.
-         */
-        for (i = 0; i != map->size; i++) {
-                ptr = map->buckets[i].head;
-
-                while (ptr) {
-                        if (strcasecmp (ptr->key, key) == 0) {
-                                /* Found it, so return the current count */
-                                return iter;
-                        }
-
-                        iter++;
-                        ptr = ptr->next;
-                }
-        }
-
-        return iter;
+        i = lookup_entry (map, key, hashfunc (key, map->seed));
+        return i < 0 ? (hashmap_iter) map->count : i;
 }
 
 /*
@@ -336,35 +408,20 @@ hashmap_iter hashmap_find (hashmap_t map, const char *key)
 ssize_t
 hashmap_return_entry (hashmap_t map, hashmap_iter iter, char **key, void **data)
 {
-        unsigned int i;
-        struct hashentry_s *ptr;
-        hashmap_iter count = 0;
-
         assert (map != NULL);
         assert (iter >= 0);
-        assert (iter != map->end_iterator);
+        assert ((unsigned int) iter < map->count);
         assert (key != NULL);
         assert (data != NULL);
 
         if (!map || iter < 0 || !key || !data)
                 return -EINVAL;
+        if ((unsigned int) iter >= map->count)
+                return -EFAULT;
 
-        for (i = 0; i != map->size; i++) {
-                ptr = map->buckets[i].head;
-                while (ptr) {
-                        if (count == iter) {
-                                /* This is the data so return it */
-                                *key = ptr->key;
-                                *data = ptr->data;
-                                return ptr->len;
-                        }
-
-                        ptr = ptr->next;
-                        count++;
-                }
-        }
-
-        return -EFAULT;
+        *key = map->entries[iter].key;
+        *data = map->entries[iter].data;
+        return map->entries[iter].len;
 }
 
 /*
@@ -376,26 +433,21 @@ hashmap_return_entry (hashmap_t map, hashmap_iter iter, char **key, void **data)
  */
 ssize_t hashmap_search (hashmap_t map, const char *key)
 {
-        int hash;
-        struct hashentry_s *ptr;
+        struct hashentry_s *entry;
+        unsigned int slot;
+        uint32_t hash;
         ssize_t count = 0;
 
         if (map == NULL || key == NULL)
                 return -EINVAL;
 
-        hash = hashfunc (key, map->size, map->seed);
-        if (hash < 0)
-                return hash;
+        hash = hashfunc (key, map->seed);
 
-        ptr = map->buckets[hash].head;
-
-        /* All right, there is an entry here, now see if it's the one we want */
-        while (ptr) {
-                if (strcasecmp (ptr->key, key) == 0)
+        for (slot = hash & map->mask; map->index[slot] != 0;
+             slot = (slot + 1) & map->mask) {
+                entry = &map->entries[map->index[slot] - 1];
+                if (entry->hash == hash && strcasecmp (entry->key, key) == 0)
                         ++count;
-
-                /* This entry didn't contain the key; move to the next one */
-                ptr = ptr->next;
         }
 
         return count;
@@ -411,32 +463,23 @@ ssize_t hashmap_search (hashmap_t map, const char *key)
  */
 ssize_t hashmap_entry_by_key (hashmap_t map, const char *key, void **data)
 {
-        int hash;
-        struct hashentry_s *ptr;
+        int i;
 
         if (!map || !key || !data)
                 return -EINVAL;
 
-        hash = hashfunc (key, map->size, map->seed);
-        if (hash < 0)
-                return hash;
-
-        ptr = map->buckets[hash].head;
-
-        while (ptr) {
-                if (strcasecmp (ptr->key, key) == 0) {
-                        *data = ptr->data;
-                        return ptr->len;
-                }
-
-                ptr = ptr->next;
-        }
+        i = lookup_entry (map, key, hashfunc (key, map->seed));
+        if (i < 0)
+                return 0;
 
-        return 0;
+        *data = map->entries[i].data;
+        return map->entries[i].len;
 }
 
 /*
- * Go through the hashmap and remove the particular key.
+ * Go through the hashmap and remove the particular key.  The entries
+ * after the removed ones move up, so they stay in order, and the index is
+ * built again.
  * NOTE: This will invalidate any iterators which have been created.
  *
  * Remove: negative upon error
@@ -445,52 +488,34 @@ ssize_t hashmap_entry_by_key (hashmap_t map, const char *key, void **data)
  */
 ssize_t hashmap_remove (hashmap_t map, const char *key)
 {
-        int hash;
-        struct hashentry_s *ptr, *next;
-        short int deleted = 0;
+        struct hashentry_s *entry;
+        unsigned int i, kept;
+        uint32_t hash;
+        ssize_t deleted = 0;
 
         if (map == NULL || key == NULL)
                 return -EINVAL;
 
-        hash = hashfunc (key, map->size, map->seed);
-        if (hash < 0)
-                return hash;
-
-        ptr = map->buckets[hash].head;
-        while (ptr) {
-                if (strcasecmp (ptr->key, key) == 0) {
-                        /*
-                         * Found the data, now need to remove everything
-                         * and update the hashmap.
-                         */
-                        next = ptr->next;
-
-                        if (ptr->prev)
-                                ptr->prev->next = ptr->next;
-                        if (ptr->next)
-                                ptr->next->prev = ptr->prev;
-
-                        if (map->buckets[hash].head == ptr)
-                                map->buckets[hash].head = ptr->next;
-                        if (map->buckets[hash].tail == ptr)
-                                map->buckets[hash].tail = ptr->prev;
-
-                        safefree (ptr->key);
-                        safefree (ptr->data);
-                        safefree (ptr);
+        hash = hashfunc (key, map->seed);
+        if (lookup_entry (map, key, hash) < 0)
+                return 0;
 
+        for (i = kept = 0; i != map->count; i++) {
+                entry = &map->entries[i];
+                if (entry->hash == hash && strcasecmp (entry->key, key) == 0) {
+                        free_hashentry (entry);
                         ++deleted;
-                        --map->end_iterator;
-
-                        ptr = next;
                         continue;
                 }
 
-                /* This entry didn't contain the key; move to the next one */
-                ptr = ptr->next;
+                if (kept != i)
+                        map->entries[kept] = *entry;
+                kept++;
         }
 
-        /* The key was not found, so return 0 */
+        map->count = kept;
+        rebuild_index (map);
+
         return deleted;
 }
 
@@ -28,14 +28,17 @@
  * hash map.  Sure, it's a pointer, but the struct is hidden in the C file.
  * So, just use the hashmap_t like it's a cookie. :)
  */
+struct arena;
+
 typedef struct hashmap_s *hashmap_t;
 typedef int hashmap_iter;
 
 /*
- * hashmap_create() takes one argument, which is the number of buckets to
- * use internally.  hashmap_delete() is self explanatory.
+ * hashmap_create() takes one argument, which is the number of entries to
+ * make room for up front; the map grows beyond it as needed.
+ * hashmap_delete() is self explanatory.
  */
-extern hashmap_t hashmap_create (unsigned int nbuckets);
+extern hashmap_t hashmap_create (unsigned int nentries);
 extern int hashmap_delete (hashmap_t map);
 
 /*
@@ -51,7 +54,17 @@ extern int hashmap_insert (hashmap_t map, const char *key,
                            const void *data, size_t len);
 
 /*
- * Get an iterator to the first entry.
+ * hashmap_insert_ref() inserts the key and data without copying them, so
+ * they must outlive the hashmap.  Memory allocated from hashmap_arena()
+ * is released along with the hashmap.
+ */
+extern int hashmap_insert_ref (hashmap_t map, char *key, void *data,
+                               size_t len);
+extern struct arena *hashmap_arena (hashmap_t map);
+
+/*
+ * Get an iterator to the first entry.  The entries are in the order they
+ * were inserted in, and the next one is at the iterator plus one.
  *
  * Returns: an negative value upon error.
  */
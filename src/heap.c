@@ -155,3 +155,265 @@ void *calloc_shared_memory (size_t nmemb, size_t size)
 
         return ptr;
 }
+
+/*
+ * The size of the slabs the small objects of a pool are carved from, and
+ * the alignment of each object within them.
+ */
+#define POOL_SLAB_SIZE (16 * 1024)
+#define POOL_ALIGN 16
+
+#ifdef HAVE_PTHREAD
+#  define POOL_LOCK(pool) pthread_mutex_lock (&(pool)->lock)
+#  define POOL_UNLOCK(pool) pthread_mutex_unlock (&(pool)->lock)
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+#  define POOL_LOCK(pool) do { } while (0)
+#  define POOL_UNLOCK(pool) do { } while (0)
+#endif
+
+static struct pool_s *pools;
+
+static size_t pool_object_size (const struct pool_s *pool)
+{
+        size_t size = max (pool->size, sizeof (void *));
+
+        return (size + POOL_ALIGN - 1) & ~((size_t) POOL_ALIGN - 1);
+}
+
+/*
+ * Add a pool to the list shown on the statistics page, the first time it
+ * needs memory.  Must be called with the pool locked.
+ */
+static void pool_enlist (struct pool_s *pool)
+{
+        if (pool->listed)
+                return;
+
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock (&pools_lock);
+#endif
+        pool->next = pools;
+        pools = pool;
+        pool->listed = TRUE;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock (&pools_lock);
+#endif
+}
+
+/*
+ * Put a new slab of objects on the free list.  Must be called with the
+ * pool locked.
+ */
+static int pool_grow (struct pool_s *pool)
+{
+        size_t size = pool_object_size (pool);
+        size_t count = POOL_SLAB_SIZE / size;
+        unsigned char *slab;
+
+        if (count < 2)
+                count = 1;
+
+        slab = (unsigned char *) safemalloc (count * size);
+        if (!slab)
+                return -1;
+
+        pool_enlist (pool);
+        pool->resident += count * size;
+
+        while (count-- > 0) {
+                *(void **) (slab + count * size) = pool->free_list;
+                pool->free_list = slab + count * size;
+                pool->nfree++;
+        }
+
+        return 0;
+}
+
+/*
+ * Take an object from the pool.  Its contents are undefined, as with
+ * malloc().  Returns NULL if no memory is left.
+ */
+void *pool_alloc (struct pool_s *pool)
+{
+        void *ptr;
+
+        assert (pool != NULL);
+
+        POOL_LOCK (pool);
+        if (pool->free_list) {
+                pool->hits++;
+        } else {
+                pool->misses++;
+                if (pool_grow (pool) != 0) {
+                        POOL_UNLOCK (pool);
+                        return NULL;
+                }
+        }
+
+        ptr = pool->free_list;
+        pool->free_list = *(void **) ptr;
+        pool->nfree--;
+        POOL_UNLOCK (pool);
+
+        return ptr;
+}
+
+/*
+ * Give an object back to the pool it was taken from.  NULL is ignored.
+ */
+void pool_free (struct pool_s *pool, void *ptr)
+{
+        size_t size;
+
+        assert (pool != NULL);
+
+        if (!ptr)
+                return;
+
+        size = pool_object_size (pool);
+
+        POOL_LOCK (pool);
+        if (size * 2 > POOL_SLAB_SIZE && pool->nfree >= pool->keep) {
+                /* a slab of its own, which nothing else points into */
+                pool->resident -= size;
+                POOL_UNLOCK (pool);
+                safefree (ptr);
+                return;
+        }
+
+        *(void **) ptr = pool->free_list;
+        pool->free_list = ptr;
+        pool->nfree++;
+        POOL_UNLOCK (pool);
+}
+
+/*
+ * Return the first of the pools which have allocated any memory so far.
+ * The rest follow through the "next" member.  The counters are read
+ * without any locking, so they are only a snapshot.
+ */
+const struct pool_s *pool_list (void)
+{
+        return pools;
+}
+
+/*
+ * The chunks of an arena come from a pool, apart from those for requests
+ * too large to share a chunk.  The arena itself lives in its first chunk.
+ */
+#define ARENA_CHUNK_SIZE 4096
+#define ARENA_ALIGN 8
+
+struct arena_chunk {
+        struct arena_chunk *next;
+        size_t size;            /* usable bytes following the header */
+        size_t used;
+        int pooled;             /* boolean */
+};
+
+struct arena {
+        struct arena_chunk *chunks;     /* the one in use comes first */
+};
+
+static struct pool_s arena_pool =
+        POOL_INITIALIZER ("arena", ARENA_CHUNK_SIZE, 0);
+
+#define ARENA_ROUND(size) \
+        (((size) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+#define ARENA_CHUNK_DATA(chunk) ((unsigned char *) (chunk) \
+                                 + ARENA_ROUND (sizeof (struct arena_chunk)))
+#define ARENA_CHUNK_SPACE (ARENA_CHUNK_SIZE \
+                           - ARENA_ROUND (sizeof (struct arena_chunk)))
+
+static struct arena_chunk *arena_chunk_new (void)
+{
+        struct arena_chunk *chunk;
+
+        chunk = (struct arena_chunk *) pool_alloc (&arena_pool);
+        if (!chunk)
+                return NULL;
+
+        chunk->next = NULL;
+        chunk->size = ARENA_CHUNK_SPACE;
+        chunk->used = 0;
+        chunk->pooled = TRUE;
+
+        return chunk;
+}
+
+struct arena *arena_create (void)
+{
+        struct arena_chunk *chunk;
+        struct arena *arena;
+
+        chunk = arena_chunk_new ();
+        if (!chunk)
+                return NULL;
+
+        arena = (struct arena *) ARENA_CHUNK_DATA (chunk);
+        chunk->used = ARENA_ROUND (sizeof (struct arena));
+        arena->chunks = chunk;
+
+        return arena;
+}
+
+/*
+ * Allocate size bytes from the arena.  Returns NULL if no memory is left.
+ */
+void *arena_alloc (struct arena *arena, size_t size)
+{
+        struct arena_chunk *chunk = arena->chunks;
+
+        size = ARENA_ROUND (size > 0 ? size : 1);
+
+        if (chunk->size - chunk->used >= size) {
+                chunk->used += size;
+                return ARENA_CHUNK_DATA (chunk) + chunk->used - size;
+        }
+
+        if (size > ARENA_CHUNK_SPACE / 2) {
+                /* A chunk of its own, kept behind the one in use */
+                chunk = (struct arena_chunk *)
+                        safemalloc (ARENA_ROUND (sizeof (struct arena_chunk))
+                                    + size);
+                if (!chunk)
+                        return NULL;
+
+                chunk->size = chunk->used = size;
+                chunk->pooled = FALSE;
+                chunk->next = arena->chunks->next;
+                arena->chunks->next = chunk;
+
+                return ARENA_CHUNK_DATA (chunk);
+        }
+
+        chunk = arena_chunk_new ();
+        if (!chunk)
+                return NULL;
+
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        chunk->used = size;
+
+        return ARENA_CHUNK_DATA (chunk);
+}
+
+/*
+ * Release all the memory of the arena, including the arena itself.
+ */
+void arena_delete (struct arena *arena)
+{
+        struct arena_chunk *chunk, *next;
+
+        if (!arena)
+                return;
+
+        for (chunk = arena->chunks; chunk; chunk = next) {
+                next = chunk->next;
+                if (chunk->pooled)
+                        pool_free (&arena_pool, chunk);
+                else
+                        safefree (chunk);
+        }
+}
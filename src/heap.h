@@ -58,4 +58,59 @@ extern char *debugging_strdup (const char *s, const char *file,
 extern void *malloc_shared_memory (size_t size);
 extern void *calloc_shared_memory (size_t nmemb, size_t size);
 
+/*
+ * A pool of objects of one fixed size, which are kept on a free list once
+ * they are released instead of going back to malloc(), so the objects of
+ * one connection are reused by the next.  A pool needs no setup: define
+ * it with POOL_INITIALIZER, usually as a static variable of the module
+ * whose objects it holds.
+ *
+ * Small objects are carved out of larger slabs, which are never given
+ * back.  Objects too big to share a slab are allocated one by one, and
+ * only "keep" of them are kept once freed.
+ *
+ * The counters are those of the current process only.
+ */
+struct pool_s {
+        const char *name;
+        size_t size;
+        unsigned int keep;
+
+        void *free_list;
+        unsigned int nfree;
+
+        unsigned long hits;     /* allocations from the free list */
+        unsigned long misses;   /* allocations which needed malloc() */
+        size_t resident;        /* bytes taken from malloc() */
+
+        struct pool_s *next;    /* the list of pools which were used */
+        int listed;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_t lock;
+#endif
+};
+
+#ifdef HAVE_PTHREAD
+#  define POOL_LOCK_INITIALIZER , PTHREAD_MUTEX_INITIALIZER
+#else
+#  define POOL_LOCK_INITIALIZER
+#endif
+
+#define POOL_INITIALIZER(name, size, keep) \
+        { name, size, keep, NULL, 0, 0, 0, 0, NULL, 0 POOL_LOCK_INITIALIZER }
+
+extern void *pool_alloc (struct pool_s *pool);
+extern void pool_free (struct pool_s *pool, void *ptr);
+extern const struct pool_s *pool_list (void);
+
+/*
+ * An arena hands out memory which is only ever released all at once, when
+ * the arena is deleted.  It suits the many small pieces of a request.
+ */
+struct arena;
+
+extern struct arena *arena_create (void);
+extern void *arena_alloc (struct arena *arena, size_t size);
+extern void arena_delete (struct arena *arena);
+
 #endif
@@ -35,13 +35,13 @@
  * Add an error number -> filename mapping to the errorpages list.
  */
 #define ERRORNUM_BUFSIZE 8      /* this is more than required */
-#define ERRPAGES_BUCKETCOUNT 16
+#define ERRPAGES_ENTRIES 16
 
 int add_new_errorpage (char *filepath, unsigned int errornum)
 {
         char errornbuf[ERRORNUM_BUFSIZE];
 
-        config.errorpages = hashmap_create (ERRPAGES_BUCKETCOUNT);
+        config.errorpages = hashmap_create (ERRPAGES_ENTRIES);
         if (!config.errorpages)
                 return (-1);
 
@@ -85,10 +85,12 @@ static char *get_html_file (unsigned int errornum)
 
 /*
  * Send an already-opened file to the client with variable substitution.
+ * The text is only buffered; the caller flushes the client stream.
  */
 int
 send_html_file (FILE *infile, struct conn_s *connptr)
 {
+        struct ostream *out = &connptr->client_out;
         char *inbuf;
         char *varstart = NULL;
         char *p;
@@ -109,12 +111,11 @@ send_html_file (FILE *infile, struct conn_s *connptr)
                                                                  varstart);
                                         if (!varval)
                                                 varval = "(unknown)";
-                                        r = write_message (connptr->client_fd,
-                                                           "%s", varval);
+                                        r = ostream_write (out, varval,
+                                                           strlen (varval));
                                         in_variable = 0;
                                 } else {
-                                        r = write_message (connptr->client_fd,
-                                                           "%c", *p);
+                                        r = ostream_write (out, p, 1);
                                 }
 
                                 break;
@@ -135,8 +136,7 @@ send_html_file (FILE *infile, struct conn_s *connptr)
                                 /* FALL THROUGH */
                         default:
                                 if (!in_variable) {
-                                        r = write_message (connptr->client_fd,
-                                                           "%c", *p);
+                                        r = ostream_write (out, p, 1);
                                 }
                         }
 
@@ -172,9 +172,9 @@ int send_http_headers (struct conn_s *connptr, int code, const char *message)
            a Proxy-Authenticate header field. */
         const char *add = code == 407 ? auth_str : "";
 
-        return (write_message (connptr->client_fd, headers,
-                               code, message, PACKAGE, VERSION,
-                               add));
+        return (ostream_printf (&connptr->client_out, headers,
+                                code, message, PACKAGE, VERSION,
+                                add));
 }
 
 /*
@@ -184,7 +184,6 @@ int send_http_error_message (struct conn_s *connptr)
 {
         char *error_file;
         FILE *infile;
-        int ret;
         const char *fallback_error =
             "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
             "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.1//EN\" "
@@ -204,23 +203,25 @@ int send_http_error_message (struct conn_s *connptr)
         error_file = get_html_file (connptr->error_number);
         if (!(infile = fopen (error_file, "r"))) {
                 char *detail = lookup_variable (connptr->error_variables, "detail");
-                return (write_message (connptr->client_fd, fallback_error,
-                                       connptr->error_number,
-                                       connptr->error_string,
-                                       connptr->error_string,
-                                       detail, PACKAGE, VERSION));
+                ostream_printf (&connptr->client_out, fallback_error,
+                                connptr->error_number,
+                                connptr->error_string,
+                                connptr->error_string,
+                                detail, PACKAGE, VERSION);
+        } else {
+                send_html_file (infile, connptr);
+                fclose (infile);
         }
 
-        ret = send_html_file (infile, connptr);
-        fclose (infile);
-        return (ret);
+        /* The headers and the page leave together */
+        return (ostream_flush (&connptr->client_out, FALSE));
 }
 
 /*
  * Add a key -> value mapping for HTML file substitution.
  */
 
-#define ERRVAR_BUCKETCOUNT 16
+#define ERRVAR_ENTRIES 16
 
 int
 add_error_variable (struct conn_s *connptr, const char *key, const char *val)
@@ -228,7 +229,7 @@ add_error_variable (struct conn_s *connptr, const char *key, const char *val)
         if (!connptr->error_variables)
                 if (!
                     (connptr->error_variables =
-                     hashmap_create (ERRVAR_BUCKETCOUNT)))
+                     hashmap_create (ERRVAR_ENTRIES)))
                         return (-1);
 
         return hashmap_insert (connptr->error_variables, key, val,
@@ -251,6 +252,7 @@ int add_standard_vars (struct conn_s *connptr)
         char errnobuf[16];
         char timebuf[30];
         time_t global_time;
+        struct tm tm;
 
         snprintf (errnobuf, sizeof errnobuf, "%d", connptr->error_number);
         ADD_VAR_RET ("errno", errnobuf);
@@ -258,7 +260,7 @@ int add_standard_vars (struct conn_s *connptr)
         ADD_VAR_RET ("cause", connptr->error_string);
         ADD_VAR_RET ("request", connptr->request_line);
         ADD_VAR_RET ("clientip", connptr->client_ip_addr);
-        ADD_VAR_RET ("clienthost", connptr->client_string_addr);
+        ADD_VAR_RET ("clienthost", get_client_hostname (connptr));
 
         /* The following value parts are all non-NULL and will
          * trigger warnings in ADD_VAR_RET(), so we use
@@ -267,7 +269,7 @@ int add_standard_vars (struct conn_s *connptr)
 
         global_time = time (NULL);
         strftime (timebuf, sizeof (timebuf), "%a, %d %b %Y %H:%M:%S GMT",
-                  gmtime (&global_time));
+                  gmtime_r (&global_time, &tm));
         add_error_variable (connptr, "date", timebuf);
 
         add_error_variable (connptr, "website",
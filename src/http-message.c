@@ -225,12 +225,14 @@ http_message_add_headers (http_message_t msg, const char **headers,
 }
 
 /*
- * Send the completed HTTP message via the supplied file descriptor.
+ * Send the completed HTTP message via the supplied output stream.  It
+ * is flushed, so the message leaves in one go unless the body is large.
  */
-int http_message_send (http_message_t msg, int fd)
+int http_message_send (http_message_t msg, struct ostream *out)
 {
         char timebuf[30];
         time_t global_time;
+        struct tm tm;
         unsigned int i;
 
         assert (is_http_message_valid (msg));
@@ -238,34 +240,34 @@ int http_message_send (http_message_t msg, int fd)
         /* Check for valid arguments */
         if (msg == NULL)
                 return -EFAULT;
-        if (fd < 1)
+        if (out == NULL || out->fd < 0)
                 return -EBADF;
         if (!is_http_message_valid (msg))
                 return -EINVAL;
 
         /* Write the response line */
-        write_message (fd, "HTTP/1.0 %d %s\r\n",
-                       msg->response.code, msg->response.string);
+        ostream_printf (out, "HTTP/1.0 %d %s\r\n",
+                        msg->response.code, msg->response.string);
 
         /* Go through all the headers */
         for (i = 0; i != msg->headers.used; ++i)
-                write_message (fd, "%s\r\n", msg->headers.strings[i]);
+                ostream_printf (out, "%s\r\n", msg->headers.strings[i]);
 
         /* Output the date */
         global_time = time (NULL);
         strftime (timebuf, sizeof (timebuf), "%a, %d %b %Y %H:%M:%S GMT",
-                  gmtime (&global_time));
-        write_message (fd, "Date: %s\r\n", timebuf);
+                  gmtime_r (&global_time, &tm));
+        ostream_printf (out, "Date: %s\r\n", timebuf);
 
         /* Output the content-length */
-        write_message (fd, "Content-length: %u\r\n", msg->body.length);
+        ostream_printf (out, "Content-length: %u\r\n", msg->body.length);
 
         /* Write the separator between the headers and body */
-        safe_write (fd, "\r\n", 2);
+        ostream_write (out, "\r\n", 2);
 
         /* If there's a body, send it! */
         if (msg->body.length > 0)
-                safe_write (fd, msg->body.text, msg->body.length);
+                ostream_write (out, msg->body.text, msg->body.length);
 
-        return 0;
+        return ostream_flush (out, FALSE);
 }
@@ -65,10 +65,11 @@ extern http_message_t http_message_create (int response_code,
 extern int http_message_destroy (http_message_t msg);
 
 /*
- * Send an HTTP message via the supplied file descriptor.  This function
+ * Send an HTTP message via the supplied output stream.  This function
  * will add the "Date" header before it's sent.
  */
-extern int http_message_send (http_message_t msg, int fd);
+struct ostream;
+extern int http_message_send (http_message_t msg, struct ostream *out);
 
 /*
  * Change the internal state of the HTTP message.  Either set the
@@ -0,0 +1,228 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Parsing of the header block of a request or response: the request or
+ * status line, the header fields, and the empty line ending them.
+ *
+ * The block is collected in the connection's buffer until it is complete,
+ * then taken out of the buffer in one piece, into the arena of the
+ * hashmap receiving the headers.  It is parsed in a single pass right
+ * there: the names and values are terminated in place, and the hashmap
+ * entries point into the block instead of holding copies.  Whatever
+ * follows the block stays in the buffer, for the relay.
+ */
+
+#include "main.h"
+
+#include "buffer.h"
+#include "hashmap.h"
+#include "heap.h"
+#include "http-parser.h"
+
+/*
+ * Define maximum number of headers that we accept.
+ * This should be big enough to handle legitimate cases,
+ * but limited to avoid DoS.
+ */
+#define MAX_HEADERS 10000
+
+/*
+ * Look for a complete header block at the front of the buffer.  Empty
+ * lines in front of the first line are part of the block.
+ *
+ * Returns: the length of the block, up to and including the empty line
+ *          0 if more data is needed
+ *          -1 if the block does not fit into the buffer
+ */
+ssize_t find_header_block (struct buffer_s *buffptr)
+{
+        unsigned char next[2];
+        ssize_t nl, len;
+        size_t i = 0;
+
+        while (copy_from_buffer (buffptr, i, next, 1) == 1
+               && (next[0] == '\r' || next[0] == '\n'))
+                i++;
+
+        while ((nl = buffer_find (buffptr, i, '\n')) >= 0) {
+                len = copy_from_buffer (buffptr, nl + 1, next, 2);
+
+                if (len >= 1 && next[0] == '\n')
+                        return nl + 2;
+                if (len == 2 && next[0] == '\r' && next[1] == '\n')
+                        return nl + 3;
+
+                i = nl + 1;
+        }
+
+        return (buffer_size (buffptr) == MAXBUFFSIZE) ? -1 : 0;
+}
+
+/*
+ * Read from the socket into the buffer until it holds a complete header
+ * block.  Returns the length of the block, or -1 if the connection was
+ * closed or failed first, or the block is too large.
+ */
+ssize_t read_header_block (int fd, struct buffer_s *buffptr)
+{
+        ssize_t len, ret;
+
+        while ((len = find_header_block (buffptr)) == 0) {
+                ret = read_buffer (fd, buffptr);
+                if (ret < 0 || (ret == 0 && errno != EINTR))
+                        return -1;
+        }
+
+        return len;
+}
+
+/*
+ * Find the end of the line starting at "line".  *eol is pointed at the
+ * line's CR LF (or bare LF.)  Returns the start of the next line, or NULL
+ * if there is no complete line before "end".
+ */
+static char *next_line (char *line, char *end, char **eol)
+{
+        char *nl;
+
+        nl = (char *) memchr (line, '\n', end - line);
+        if (!nl)
+                return NULL;
+
+        *eol = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+        return nl + 1;
+}
+
+/*
+ * Take the header block of "len" bytes (see find_header_block()) off the
+ * front of the buffer and parse it, adding the header fields to the
+ * hashmap.  A field folded over several lines (obs-fold) has each line
+ * break replaced by a single space.
+ *
+ * Returns the first line (the request or status line) without its line
+ * break, which lives as long as the hashmap; or NULL if the block is
+ * malformed or no memory was left.
+ */
+char *parse_header_block (struct buffer_s *buffptr, size_t len,
+                          hashmap_t headers)
+{
+        struct arena *arena;
+        char *block, *end, *line, *next, *eol, *first;
+        char *name = NULL, *value = NULL, *tail = NULL;
+        unsigned int count;
+        unsigned int double_cgi = FALSE;        /* boolean */
+
+        arena = hashmap_arena (headers);
+        if (!arena)
+                return NULL;
+
+        block = (char *) arena_alloc (arena, len + 1);
+        if (!block)
+                return NULL;
+
+        remove_from_buffer (buffptr, (unsigned char *) block, len);
+        block[len] = '\0';
+        end = block + len;
+
+        /* Skip any empty lines in front of the first line */
+        line = block;
+        while (line < end && (*line == '\r' || *line == '\n'))
+                line++;
+
+        next = next_line (line, end, &eol);
+        if (!next)
+                return NULL;
+
+        *eol = '\0';
+        first = line;
+
+        for (count = 0; count < MAX_HEADERS; count++) {
+                line = next;
+                next = next_line (line, end, &eol);
+                if (!next)
+                        return NULL;
+
+                if (double_cgi) {
+                        if (eol == line)
+                                return first;
+                        continue;
+                }
+
+                /*
+                 * A continuation line is joined to the value of the field
+                 * before it.  The value only ever moves towards the front
+                 * of the block, over the line breaks it is rid of.
+                 */
+                if (eol > line && (*line == ' ' || *line == '\t')) {
+                        if (!name)
+                                return NULL;
+
+                        while (line < eol && (*line == ' ' || *line == '\t'))
+                                line++;
+                        if (tail > value && line < eol)
+                                *tail++ = ' ';
+
+                        memmove (tail, line, eol - line);
+                        tail += eol - line;
+                        continue;
+                }
+
+                /* Any other line ends the field before it */
+                if (name) {
+                        *tail = '\0';
+                        if (hashmap_insert_ref (headers, name, value,
+                                                tail - value + 1) < 0)
+                                return NULL;
+                        name = NULL;
+                }
+
+                /* The empty line ends the headers */
+                if (eol == line)
+                        return first;
+
+                /*
+                 * BUG FIX: The following code detects a "Double CGI"
+                 * situation so that we can handle the nonconforming system.
+                 * This problem was found when accessing cgi.ebay.com, and it
+                 * turns out to be a wider spread problem as well.
+                 *
+                 * If "Double CGI" is in effect, duplicate headers are
+                 * ignored.
+                 *
+                 * FIXME: Might need to change this to a more robust check.
+                 */
+                if (eol - line >= 5 && strncasecmp (line, "HTTP/", 5) == 0) {
+                        double_cgi = TRUE;
+                        continue;
+                }
+
+                value = (char *) memchr (line, ':', eol - line);
+                if (!value)
+                        return NULL;
+
+                /* Blank out colons, spaces, and tabs. */
+                while (value < eol
+                       && (*value == ':' || *value == ' ' || *value == '\t'))
+                        *value++ = '\0';
+
+                name = line;
+                tail = eol;
+        }
+
+        /* Reached MAX_HEADERS; bail out */
+        return NULL;
+}
@@ -0,0 +1,31 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'http-parser.c' for detailed information. */
+
+#ifndef TINYPROXY_HTTP_PARSER_H
+#define TINYPROXY_HTTP_PARSER_H
+
+#include "buffer.h"
+#include "hashmap.h"
+
+extern ssize_t find_header_block (struct buffer_s *buffptr);
+extern ssize_t read_header_block (int fd, struct buffer_s *buffptr);
+extern char *parse_header_block (struct buffer_s *buffptr, size_t len,
+                                 hashmap_t headers);
+
+#endif
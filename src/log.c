@@ -102,6 +102,24 @@ void set_log_level (int level)
         log_level = level;
 }
 
+/*
+ * Would a message of this level be logged?  Callers can skip the work of
+ * putting together a message which would not be.
+ */
+int log_enabled (int level)
+{
+#ifdef NDEBUG
+        if (log_level == LOG_CONN)
+                return level != LOG_INFO;
+        else if (log_level == LOG_INFO)
+                return level <= LOG_INFO || level == LOG_CONN;
+        else
+                return level <= log_level;
+#else
+        return TRUE;
+#endif
+}
+
 /*
  * This routine logs messages to either the log file or the syslog function.
  */
@@ -109,25 +127,15 @@ void log_message (int level, const char *fmt, ...)
 {
         va_list args;
         time_t nowtime;
+        struct tm tm;
 
         char time_string[TIME_LENGTH];
         char str[STRING_LENGTH];
 
         ssize_t ret;
 
-#ifdef NDEBUG
-        /*
-         * Figure out if we should write the message or not.
-         */
-        if (log_level == LOG_CONN) {
-                if (level == LOG_INFO)
-                        return;
-        } else if (log_level == LOG_INFO) {
-                if (level > LOG_INFO && level != LOG_CONN)
-                        return;
-        } else if (level > log_level)
+        if (!log_enabled (level))
                 return;
-#endif
 
         if (config.syslog && level == LOG_CONN)
                 level = LOG_INFO;
@@ -177,7 +185,7 @@ void log_message (int level, const char *fmt, ...)
                 nowtime = time (NULL);
                 /* Format is month day hour:minute:second (24 time) */
                 strftime (time_string, TIME_LENGTH, "%b %d %H:%M:%S",
-                          localtime (&nowtime));
+                          localtime_r (&nowtime, &tm));
 
                 snprintf (str, STRING_LENGTH, "%-9s %s [%ld]: ",
                           syslog_level[level], time_string,
@@ -236,15 +244,8 @@ static void send_stored_logs (void)
                 ptr = strchr (string, ' ') + 1;
                 level = atoi (string);
 
-#ifdef NDEBUG
-                if (log_level == LOG_CONN && level == LOG_INFO)
-                        continue;
-                else if (log_level == LOG_INFO) {
-                        if (level > LOG_INFO && level != LOG_CONN)
-                                continue;
-                } else if (level > log_level)
+                if (!log_enabled (level))
                         continue;
-#endif
 
                 log_message (level, "%s", ptr);
         }
@@ -104,6 +104,7 @@
 extern int open_log_file (const char *file);
 extern void close_log_file (void);
 
+extern int log_enabled (int level);
 extern void log_message (int level, const char *fmt, ...);
 extern void set_log_level (int level);
 
@@ -35,6 +35,8 @@
 #include "buffer.h"
 #include "conf.h"
 #include "daemon.h"
+#include "dns-cache.h"
+#include "dns-resolver.h"
 #include "heap.h"
 #include "filter.h"
 #include "child.h"
@@ -300,6 +302,18 @@ static void initialize_config_defaults (struct config_s *conf)
         conf->errorpages = NULL;
         conf->stathost = safestrdup (TINYPROXY_STATHOST);
         conf->idletimeout = MAX_IDLE_TIME;
+        conf->keepalive_timeout = KEEPALIVE_TIME;
+        conf->max_keepalive_requests = MAX_KEEPALIVE_REQUESTS;
+        conf->server_pool_size = SERVER_POOL_SIZE;
+        conf->server_pool_per_host = SERVER_POOL_PER_HOST;
+        conf->server_idle_timeout = SERVER_IDLE_TIME;
+        conf->dns_cache_size = DNS_CACHE_SIZE;
+        conf->dns_cache_ttl = DNS_CACHE_TTL;
+        conf->dns_negative_ttl = DNS_NEGATIVE_TTL;
+        conf->dns_stale_time = DNS_STALE_TIME;
+        conf->dns_port = DNS_PORT;
+        conf->connect_attempt_delay = CONNECT_ATTEMPT_DELAY;
+        conf->connect_timeout = CONNECT_TIMEOUT;
         conf->logf_name = NULL;
         conf->pidpath = NULL;
 }
@@ -350,6 +364,8 @@ main (int argc, char **argv)
         }
 
         init_stats ();
+        dns_cache_init ();
+        dns_resolver_init ();
 
         /* If ANONYMOUS is turned on, make sure that Content-Length is
          * in the list of allowed headers, since it is required in a
@@ -27,6 +27,18 @@
 /* Global variables for the main controls of the program */
 #define MAXBUFFSIZE     ((size_t)(1024 * 96))   /* Max size of buffer */
 #define MAX_IDLE_TIME   (60 * 10)       /* 10 minutes of no activity */
+#define KEEPALIVE_TIME  5       /* seconds to wait for the next request */
+#define MAX_KEEPALIVE_REQUESTS  100     /* requests per client connection */
+#define SERVER_POOL_SIZE        16      /* idle server connections kept */
+#define SERVER_POOL_PER_HOST    4       /* ... of them for one server */
+#define SERVER_IDLE_TIME        4       /* seconds they are kept for */
+#define DNS_CACHE_SIZE          1024    /* hostnames in the DNS cache */
+#define DNS_CACHE_TTL           60      /* seconds an answer is used */
+#define DNS_NEGATIVE_TTL        5       /* ... or a failed lookup */
+#define DNS_STALE_TIME          300     /* ... or an expired answer */
+#define DNS_PORT                53
+#define CONNECT_ATTEMPT_DELAY   250     /* ms before the next address */
+#define CONNECT_TIMEOUT         10      /* seconds before it is given up */
 
 /* Global Structures used in the program */
 extern struct config_s config;
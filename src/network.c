@@ -18,9 +18,11 @@
 
 /* The functions found here are used for communicating across a
  * network.  They include both safe reading and writing (which are
- * the basic building blocks) along with two functions for
- * easily reading a line of text from the network, and a function
- * to write an arbitrary amount of data to the network.
+ * the basic building blocks) along with a function to write an
+ * arbitrary amount of data to the network.  Header blocks are read
+ * through the connection's buffer (see http-parser.c.)  What tinyproxy
+ * sends itself is put together first, either as an iolist of pieces, or
+ * in the buffer of an output stream.
  */
 
 #include "main.h"
@@ -64,6 +66,255 @@ ssize_t safe_write (int fd, const void *buf, size_t count)
         return count;
 }
 
+#ifndef MSG_MORE
+#  define MSG_MORE 0
+#endif
+
+/* Whether a non-blocking socket could not take any more for now */
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+#  define WOULD_BLOCK(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+#else
+#  define WOULD_BLOCK(err) ((err) == EAGAIN)
+#endif
+
+/*
+ * The number of pieces an iolist starts out with, and the most passed to
+ * a single writev().
+ */
+#define IOLIST_INITIAL 64
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+void iolist_init (struct iolist *list)
+{
+        list->iov = NULL;
+        list->count = list->size = 0;
+        list->arena = NULL;
+}
+
+/*
+ * Release the memory of the message, and make it empty again.
+ */
+void iolist_free (struct iolist *list)
+{
+        arena_delete (list->arena);
+        iolist_init (list);
+}
+
+static int iolist_reserve (struct iolist *list)
+{
+        struct iovec *iov;
+        int size;
+
+        if (!list->arena) {
+                list->arena = arena_create ();
+                if (!list->arena)
+                        return -1;
+        }
+
+        if (list->count < list->size)
+                return 0;
+
+        /* The old array stays in the arena until the message is freed */
+        size = list->size ? list->size * 2 : IOLIST_INITIAL;
+        iov = (struct iovec *) arena_alloc (list->arena,
+                                            size * sizeof (struct iovec));
+        if (!iov)
+                return -1;
+
+        if (list->count > 0)
+                memcpy (iov, list->iov, list->count * sizeof (struct iovec));
+        list->iov = iov;
+        list->size = size;
+
+        return 0;
+}
+
+/*
+ * Append len bytes at data to the message, without copying them.
+ */
+int iolist_add (struct iolist *list, const void *data, size_t len)
+{
+        if (len == 0)
+                return 0;
+
+        if (iolist_reserve (list) < 0)
+                return -1;
+
+        /* iov_base is not const, even though sendmsg() only reads it */
+        memcpy (&list->iov[list->count].iov_base, &data, sizeof (data));
+        list->iov[list->count].iov_len = len;
+        list->count++;
+
+        return 0;
+}
+
+/*
+ * Append formatted text to the message.
+ */
+int iolist_printf (struct iolist *list, const char *fmt, ...)
+{
+        char buf[512], *text;
+        va_list ap;
+        int n;
+
+        if (iolist_reserve (list) < 0)
+                return -1;
+
+        va_start (ap, fmt);
+        n = vsnprintf (buf, sizeof (buf), fmt, ap);
+        va_end (ap);
+        if (n < 0)
+                return -1;
+
+        text = (char *) arena_alloc (list->arena, n + 1);
+        if (!text)
+                return -1;
+
+        if ((size_t) n < sizeof (buf)) {
+                memcpy (text, buf, n);
+        } else {
+                va_start (ap, fmt);
+                vsnprintf (text, n + 1, fmt, ap);
+                va_end (ap);
+        }
+
+        return iolist_add (list, text, n);
+}
+
+/*
+ * Send the message from its start until all of it has gone, or the
+ * socket fails.  The number of bytes sent is left in sent.  Returns 0, or
+ * a negative errno value.
+ */
+static int iolist_push (struct iolist *list, int fd, int more, size_t *sent)
+{
+        struct msghdr msg;
+        struct iovec *iov = list->iov;
+        struct iovec *cut = NULL, saved;
+        int count = list->count, ret = 0;
+        ssize_t len;
+
+        assert (fd >= 0);
+
+        *sent = 0;
+        while (count > 0) {
+                memset (&msg, 0, sizeof (msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = min (count, IOV_MAX);
+
+                /* sendmsg() rather than writev(), for MSG_NOSIGNAL */
+                len = sendmsg (fd, &msg,
+                               MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        ret = -errno;
+                        break;
+                }
+
+                *sent += len;
+
+                /* Skip what was sent, and pick up after it */
+                while (count > 0 && (size_t) len >= iov->iov_len) {
+                        len -= iov->iov_len;
+                        iov++;
+                        count--;
+                }
+                if (count > 0 && len > 0) {
+                        /* Only ever the first piece left is cut short */
+                        if (cut != iov) {
+                                if (cut)
+                                        *cut = saved;
+                                cut = iov;
+                                saved = *iov;
+                        }
+                        iov->iov_base = (char *) iov->iov_base + len;
+                        iov->iov_len -= len;
+                }
+        }
+
+        if (cut)
+                *cut = saved;
+        return ret;
+}
+
+/*
+ * Send the whole message.  The message is left as it was, so it can be
+ * sent again, on another connection.  If more is set, something else
+ * follows right away, and the kernel may hold back the last partial
+ * segment for it.  Returns the number of bytes sent, or a negative errno
+ * value.
+ */
+ssize_t iolist_send (struct iolist *list, int fd, int more)
+{
+        size_t sent;
+        int ret;
+
+        ret = iolist_push (list, fd, more, &sent);
+        if (ret < 0)
+                return ret;
+
+        return sent;
+}
+
+#ifdef HAVE_SPLICE
+int splice_pipe_open (struct splice_pipe *p)
+{
+        p->pending = 0;
+        return pipe (p->fd);
+}
+
+void splice_pipe_close (struct splice_pipe *p)
+{
+        close (p->fd[0]);
+        close (p->fd[1]);
+}
+
+/*
+ * Move up to count bytes from the socket into the pipe, without copying
+ * them through user space.  Returns the number of bytes moved, 0 at the
+ * end of the stream, or -1 with errno set (EAGAIN if there is nothing to
+ * read yet.)
+ */
+ssize_t splice_in (int fd, struct splice_pipe *p, size_t count)
+{
+        ssize_t len;
+
+        do {
+                len = splice (fd, NULL, p->fd[1], NULL, count,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (len < 0 && errno == EINTR);
+
+        if (len > 0)
+                p->pending += len;
+
+        return len;
+}
+
+/*
+ * Matched pair for splice_in(): move what is in the pipe out to the
+ * socket.  Returns the number of bytes moved, or -1 with errno set.
+ */
+ssize_t splice_out (struct splice_pipe *p, int fd)
+{
+        ssize_t len;
+
+        assert (p->pending > 0);
+
+        do {
+                len = splice (p->fd[0], NULL, fd, NULL, p->pending,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (len < 0 && errno == EINTR);
+
+        if (len > 0)
+                p->pending -= len;
+
+        return len;
+}
+#endif /* HAVE_SPLICE */
+
 /*
  * Matched pair for safe_write(). If an EINTR occurs, pick up and try
  * again.
@@ -80,172 +331,267 @@ ssize_t safe_read (int fd, void *buffer, size_t count)
 }
 
 /*
- * Send a "message" to the file descriptor provided. This handles the
- * differences between the various implementations of vsnprintf. This code
- * was basically stolen from the snprintf() man page of Debian Linux
- * (although I did fix a memory leak. :)
+ * The output buffer of a stream.  A message tinyproxy generates itself is
+ * usually much smaller, and goes out in a single send().  Only what a
+ * non-blocking socket has not taken yet can need more room than this.
  */
-int write_message (int fd, const char *fmt, ...)
+#define OSTREAM_SIZE (8 * 1024)
+
+static struct pool_s ostream_pool =
+        POOL_INITIALIZER ("output stream", OSTREAM_SIZE, 16);
+
+void ostream_init (struct ostream *os, int fd)
 {
-        ssize_t n;
-        size_t size = (1024 * 8);       /* start with 8 KB and go from there */
-        char *buf, *tmpbuf;
-        va_list ap;
+        os->fd = fd;
+        os->buf = NULL;
+        os->len = os->size = 0;
+        os->error = 0;
+}
 
-        if ((buf = (char *) safemalloc (size)) == NULL)
-                return -1;
+static void ostream_release (struct ostream *os)
+{
+        if (os->size == OSTREAM_SIZE)
+                pool_free (&ostream_pool, os->buf);
+        else if (os->buf)
+                safefree (os->buf);
+        os->buf = NULL;
+        os->size = 0;
+}
 
-        while (1) {
-                va_start (ap, fmt);
-                n = vsnprintf (buf, size, fmt, ap);
-                va_end (ap);
+/*
+ * Give the buffer back.  Anything not flushed yet is dropped.
+ */
+void ostream_free (struct ostream *os)
+{
+        ostream_release (os);
+        os->len = 0;
+}
 
-                /* If that worked, break out so we can send the buffer */
-                if (n > -1 && (size_t) n < size)
-                        break;
+/*
+ * Make sure there is room for len more bytes in the buffer.
+ */
+static int ostream_reserve (struct ostream *os, size_t len)
+{
+        size_t size = OSTREAM_SIZE;
+        char *buf;
 
-                /* Else, try again with more space */
-                if (n > -1)
-                        /* precisely what is needed (glibc2.1) */
-                        size = n + 1;
-                else
-                        /* twice the old size (glibc2.0) */
-                        size *= 2;
+        if (os->len + len <= os->size)
+                return 0;
 
-                if ((tmpbuf = (char *) saferealloc (buf, size)) == NULL) {
-                        safefree (buf);
-                        return -1;
-                } else
-                        buf = tmpbuf;
-        }
+        while (size < os->len + len)
+                size *= 2;
 
-        if (safe_write (fd, buf, n) < 0) {
-                safefree (buf);
+        if (size == OSTREAM_SIZE)
+                buf = (char *) pool_alloc (&ostream_pool);
+        else
+                buf = (char *) safemalloc (size);
+        if (!buf) {
+                os->error = ENOMEM;
                 return -1;
         }
 
-        safefree (buf);
+        if (os->len > 0)
+                memcpy (buf, os->buf, os->len);
+        ostream_release (os);
+        os->buf = buf;
+        os->size = size;
+
         return 0;
 }
 
 /*
- * Read in a "line" from the socket. It might take a few loops through
- * the read sequence. The full string is allocate off the heap and stored
- * at the whole_buffer pointer. The caller needs to free the memory when
- * it is no longer in use. The returned line is NULL terminated.
- *
- * Returns the length of the buffer on success (not including the NULL
- * termination), 0 if the socket was closed, and -1 on all other errors.
+ * Append len bytes at data to the buffer, without sending anything.
  */
-#define SEGMENT_LEN (512)
-#define MAXIMUM_BUFFER_LENGTH (128 * 1024)
-ssize_t readline (int fd, char **whole_buffer)
+static int ostream_append (struct ostream *os, const void *data, size_t len)
 {
-        ssize_t whole_buffer_len;
-        char buffer[SEGMENT_LEN];
-        char *ptr;
-
-        ssize_t ret;
-        ssize_t diff;
-
-        struct read_lines_s {
-                char *data;
-                size_t len;
-                struct read_lines_s *next;
-        };
-        struct read_lines_s *first_line, *line_ptr;
-
-        first_line =
-            (struct read_lines_s *) safecalloc (sizeof (struct read_lines_s),
-                                                1);
-        if (!first_line)
-                return -ENOMEM;
-
-        line_ptr = first_line;
-
-        whole_buffer_len = 0;
-        for (;;) {
-                ret = recv (fd, buffer, SEGMENT_LEN, MSG_PEEK);
-                if (ret <= 0)
-                        goto CLEANUP;
-
-                ptr = (char *) memchr (buffer, '\n', ret);
-                if (ptr)
-                        diff = ptr - buffer + 1;
-                else
-                        diff = ret;
-
-                whole_buffer_len += diff;
+        if (ostream_reserve (os, len) < 0)
+                return -1;
 
-                /*
-                 * Don't allow the buffer to grow without bound. If we
-                 * get to more than MAXIMUM_BUFFER_LENGTH close.
-                 */
-                if (whole_buffer_len > MAXIMUM_BUFFER_LENGTH) {
-                        ret = -ERANGE;
-                        goto CLEANUP;
-                }
+        memcpy (os->buf + os->len, data, len);
+        os->len += len;
 
-                line_ptr->data = (char *) safemalloc (diff);
-                if (!line_ptr->data) {
-                        ret = -ENOMEM;
-                        goto CLEANUP;
-                }
+        return 0;
+}
 
-                ret = recv (fd, line_ptr->data, diff, 0);
-                if (ret == -1) {
-                        goto CLEANUP;
-                }
+/*
+ * Send what is buffered, followed by len bytes at data, with as few
+ * sendmsg() calls as the socket allows.  What a non-blocking socket does
+ * not take is kept in the buffer, to be sent by the next flush.
+ */
+static int ostream_send (struct ostream *os, const void *data, size_t len,
+                         int flags)
+{
+        struct msghdr msg;
+        struct iovec iov[2], *next = iov;
+        int count = 0, buffered = os->len > 0;
+        ssize_t n;
 
-                line_ptr->len = diff;
+        if (os->len > 0) {
+                iov[count].iov_base = os->buf;
+                iov[count].iov_len = os->len;
+                count++;
+        }
+        if (len > 0) {
+                memcpy (&iov[count].iov_base, &data, sizeof (data));
+                iov[count].iov_len = len;
+                count++;
+        }
 
-                if (ptr) {
-                        line_ptr->next = NULL;
-                        break;
+        while (count > 0) {
+                memset (&msg, 0, sizeof (msg));
+                msg.msg_iov = next;
+                msg.msg_iovlen = count;
+
+                n = sendmsg (os->fd, &msg, flags | MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (WOULD_BLOCK (errno))
+                                break;
+                        os->error = errno;
+                        os->len = 0;
+                        return -1;
                 }
 
-                line_ptr->next =
-                    (struct read_lines_s *)
-                    safecalloc (sizeof (struct read_lines_s), 1);
-                if (!line_ptr->next) {
-                        ret = -ENOMEM;
-                        goto CLEANUP;
+                while (count > 0 && (size_t) n >= next->iov_len) {
+                        n -= next->iov_len;
+                        next++;
+                        count--;
+                }
+                if (count > 0) {
+                        next->iov_base = (char *) next->iov_base + n;
+                        next->iov_len -= n;
                 }
-                line_ptr = line_ptr->next;
         }
 
-        *whole_buffer = (char *) safemalloc (whole_buffer_len + 1);
-        if (!*whole_buffer) {
-                ret = -ENOMEM;
-                goto CLEANUP;
+        /* The rest of the buffer moves to its start, and the data after */
+        os->len = 0;
+        if (count > 0 && buffered && next == iov) {
+                memmove (os->buf, next->iov_base, next->iov_len);
+                os->len = next->iov_len;
+                next++;
+                count--;
         }
+        if (count > 0)
+                return ostream_append (os, next->iov_base, next->iov_len);
 
-        *(*whole_buffer + whole_buffer_len) = '\0';
+        /* A buffer grown for a slow socket is not kept */
+        if (os->size > OSTREAM_SIZE)
+                ostream_release (os);
 
-        whole_buffer_len = 0;
-        line_ptr = first_line;
-        while (line_ptr) {
-                memcpy (*whole_buffer + whole_buffer_len, line_ptr->data,
-                        line_ptr->len);
-                whole_buffer_len += line_ptr->len;
+        return 0;
+}
 
-                line_ptr = line_ptr->next;
-        }
+/*
+ * Append len bytes at data to the stream.  Once the buffer would overflow,
+ * it is sent along with the data, telling the kernel that more is to
+ * come.  Returns -1 if this, or any earlier write to the stream, failed.
+ */
+int ostream_write (struct ostream *os, const void *data, size_t len)
+{
+        if (os->error)
+                return -1;
 
-        ret = whole_buffer_len;
+        if (os->len + len > OSTREAM_SIZE)
+                return ostream_send (os, data, len, MSG_MORE);
 
-CLEANUP:
-        do {
-                line_ptr = first_line->next;
-                if (first_line->data)
-                        safefree (first_line->data);
-                safefree (first_line);
-                first_line = line_ptr;
-        } while (first_line);
+        return ostream_append (os, data, len);
+}
+
+/*
+ * Append formatted text to the stream.
+ */
+int ostream_printf (struct ostream *os, const char *fmt, ...)
+{
+        char buf[512], *text;
+        va_list ap;
+        int n, ret;
+
+        va_start (ap, fmt);
+        n = vsnprintf (buf, sizeof (buf), fmt, ap);
+        va_end (ap);
+        if (n < 0)
+                return -1;
+
+        if ((size_t) n < sizeof (buf))
+                return ostream_write (os, buf, n);
+
+        text = (char *) safemalloc (n + 1);
+        if (!text)
+                return -1;
+
+        va_start (ap, fmt);
+        vsnprintf (text, n + 1, fmt, ap);
+        va_end (ap);
+
+        ret = ostream_write (os, text, n);
+        safefree (text);
 
         return ret;
 }
 
+/*
+ * Send everything buffered.  If more is set, the message is not complete
+ * yet, and the kernel may hold back a partial segment until it is.  On a
+ * non-blocking socket, some of it may still be left (see
+ * ostream_pending.)  Returns -1 if this or any earlier write to the
+ * stream failed.
+ */
+int ostream_flush (struct ostream *os, int more)
+{
+        if (os->error)
+                return -1;
+        if (os->len == 0)
+                return 0;
+
+        return ostream_send (os, NULL, 0, more ? MSG_MORE : 0);
+}
+
+/*
+ * Return the number of bytes still waiting to be sent.
+ */
+size_t ostream_pending (const struct ostream *os)
+{
+        return os->len;
+}
+
+/*
+ * Send the message like iolist_send(), but after anything the stream
+ * still holds.  What a non-blocking socket does not take right away is
+ * copied into the stream, to go out with its next flush.  Returns -1 if
+ * this or any earlier write to the stream failed.
+ */
+int iolist_queue (struct iolist *list, struct ostream *os, int more)
+{
+        size_t sent = 0, len;
+        int i, ret, queued = os->len > 0;
+
+        if (os->error)
+                return -1;
+
+        if (!queued) {
+                ret = iolist_push (list, os->fd, more, &sent);
+                if (ret < 0 && !WOULD_BLOCK (-ret)) {
+                        os->error = -ret;
+                        return -1;
+                }
+        }
+
+        for (i = 0; i < list->count; i++) {
+                len = list->iov[i].iov_len;
+                if (sent >= len) {
+                        sent -= len;
+                        continue;
+                }
+                if (ostream_append (os, (char *) list->iov[i].iov_base
+                                    + sent, len - sent) < 0)
+                        return -1;
+                sent = 0;
+        }
+
+        return queued ? ostream_flush (os, more) : 0;
+}
+
 /*
  * Convert the network address into either a dotted-decimal or an IPv6
  * hex string.
@@ -24,8 +24,61 @@
 extern ssize_t safe_write (int fd, const void *buf, size_t count);
 extern ssize_t safe_read (int fd, void *buf, size_t count);
 
-extern int write_message (int fd, const char *fmt, ...);
-extern ssize_t readline (int fd, char **whole_buffer);
+/*
+ * A message put together from pieces and sent with as few writev() calls
+ * as possible.  A piece is either referenced where it is, in which case
+ * it has to stay there until the message is sent, or formatted into the
+ * message's own arena.
+ */
+struct iolist {
+        struct iovec *iov;
+        int count, size;
+        struct arena *arena;
+};
+
+extern void iolist_init (struct iolist *list);
+extern void iolist_free (struct iolist *list);
+extern int iolist_add (struct iolist *list, const void *data, size_t len);
+extern int iolist_printf (struct iolist *list, const char *fmt, ...);
+extern ssize_t iolist_send (struct iolist *list, int fd, int more);
+
+/*
+ * A buffered output stream to a socket, for the messages tinyproxy
+ * generates itself.  Nothing is sent until the buffer fills up or the
+ * stream is flushed.  What a non-blocking socket does not take stays in
+ * the buffer until the next flush.  An error sticks, so a caller may
+ * check only the final flush.
+ */
+struct ostream {
+        int fd;
+        char *buf;
+        size_t len;
+        size_t size;            /* of buf */
+        int error;              /* errno of the first failure */
+};
+
+extern void ostream_init (struct ostream *os, int fd);
+extern void ostream_free (struct ostream *os);
+extern int ostream_write (struct ostream *os, const void *data, size_t len);
+extern int ostream_printf (struct ostream *os, const char *fmt, ...);
+extern int ostream_flush (struct ostream *os, int more);
+extern size_t ostream_pending (const struct ostream *os);
+extern int iolist_queue (struct iolist *list, struct ostream *os, int more);
+
+#ifdef HAVE_SPLICE
+/*
+ * A pipe used to move data between two sockets with splice().
+ */
+struct splice_pipe {
+        int fd[2];
+        size_t pending;         /* bytes sitting in the pipe */
+};
+
+extern int splice_pipe_open (struct splice_pipe *p);
+extern void splice_pipe_close (struct splice_pipe *p);
+extern ssize_t splice_in (int fd, struct splice_pipe *p, size_t count);
+extern ssize_t splice_out (struct splice_pipe *p, int fd);
+#endif
 
 extern const char *get_ip_string (struct sockaddr *sa, char *buf, size_t len);
 extern int full_inet_pton (const char *ip, void *dst);
@@ -0,0 +1,280 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A small interface for waiting until descriptors are ready, used instead
+ * of select() so that a child is not limited to descriptors below
+ * FD_SETSIZE, and so the set is not rebuilt and rescanned on every call.
+ *
+ * There are two backends: epoll where it is available, and poll()
+ * everywhere.  Small sets, such as the two sockets of a relay, always use
+ * poll(), which needs no setup at all.  Larger sets use epoll, if it can
+ * be had.  POLLER_EDGE is only honoured by the epoll backend, so a caller
+ * asking for it has to cope with level-triggered events as well.
+ *
+ * The descriptors are looked up by a linear search, which is fine for the
+ * few, mostly static descriptors of a child.  A descriptor registered
+ * with no events is suspended: nothing is reported for it, not even an
+ * error, until it is given some events again.
+ */
+
+#include "main.h"
+
+#include <poll.h>
+
+#include "heap.h"
+#include "poller.h"
+
+/*
+ * The number of descriptors from which on epoll is used.
+ */
+#define POLLER_EPOLL_MIN 8
+
+#define POLLER_MAX_EVENTS 64
+
+struct poller_fd {
+        int fd;
+        unsigned int events;    /* as passed to poller_set() */
+};
+
+struct poller {
+        struct poller_fd *fds;
+        struct pollfd *pfds;    /* the poll() backend, same order as fds */
+        unsigned int nfds, size;
+        int epfd;               /* -1 for the poll() backend */
+};
+
+/*
+ * Create a poller for about nfds descriptors.  More can be added later.
+ */
+struct poller *poller_create (unsigned int nfds)
+{
+        struct poller *p;
+
+        p = (struct poller *) safecalloc (1, sizeof (struct poller));
+        if (!p)
+                return NULL;
+
+        p->size = nfds > 0 ? nfds : 2;
+        p->fds = (struct poller_fd *)
+                safecalloc (p->size, sizeof (struct poller_fd));
+        p->pfds = (struct pollfd *)
+                safecalloc (p->size, sizeof (struct pollfd));
+        if (!p->fds || !p->pfds) {
+                poller_delete (p);
+                return NULL;
+        }
+
+        p->epfd = -1;
+#ifdef HAVE_SYS_EPOLL_H
+        /* If epoll is not available after all, poll() will do */
+        if (nfds >= POLLER_EPOLL_MIN)
+                p->epfd = epoll_create (nfds);
+#endif
+
+        return p;
+}
+
+void poller_delete (struct poller *p)
+{
+        if (p->epfd >= 0)
+                close (p->epfd);
+
+        safefree (p->fds);
+        safefree (p->pfds);
+        safefree (p);
+}
+
+static short to_poll_events (unsigned int events)
+{
+        short pev = 0;
+
+        if (events & POLLER_READ)
+                pev |= POLLIN;
+        if (events & POLLER_WRITE)
+                pev |= POLLOUT;
+
+        return pev;
+}
+
+/*
+ * Translate what was reported back.  As with select(), a failed
+ * descriptor is also reported ready for whatever it was waited for, so
+ * the caller finds out about the error from the next read or write.
+ */
+static unsigned int from_revents (unsigned int wanted, int readable,
+                                  int writable, int failed)
+{
+        unsigned int events = 0;
+
+        if (readable)
+                events |= POLLER_READ;
+        if (writable)
+                events |= POLLER_WRITE;
+        if (failed)
+                events |= POLLER_ERROR | POLLER_READ | POLLER_WRITE;
+
+        return events & (wanted | POLLER_ERROR);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_set (struct poller *p, unsigned int i, unsigned int events)
+{
+        struct epoll_event ev;
+        unsigned int old = p->fds[i].events;
+        int op;
+
+        memset (&ev, 0, sizeof (ev));
+        if (events & POLLER_READ)
+                ev.events |= EPOLLIN;
+        if (events & POLLER_WRITE)
+                ev.events |= EPOLLOUT;
+        if (events & POLLER_EDGE)
+                ev.events |= EPOLLET;
+        ev.data.u32 = i;
+
+        if (old == 0)
+                op = EPOLL_CTL_ADD;
+        else if (events == 0)
+                op = EPOLL_CTL_DEL;
+        else
+                op = EPOLL_CTL_MOD;
+
+        return epoll_ctl (p->epfd, op, p->fds[i].fd, &ev);
+}
+#endif
+
+/*
+ * Wait for the given events (a combination of POLLER_READ, POLLER_WRITE
+ * and POLLER_EDGE) on fd, replacing the events it was waited for so far.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int poller_set (struct poller *p, int fd, unsigned int events)
+{
+        unsigned int i;
+
+        assert (fd >= 0);
+
+        for (i = 0; i != p->nfds; i++) {
+                if (p->fds[i].fd == fd)
+                        break;
+        }
+
+        if (i == p->nfds) {
+                if (events == 0)
+                        return 0;
+
+                if (p->nfds == p->size) {
+                        struct poller_fd *fds;
+                        struct pollfd *pfds;
+
+                        fds = (struct poller_fd *)
+                                saferealloc (p->fds, 2 * p->size
+                                             * sizeof (struct poller_fd));
+                        if (!fds)
+                                return -1;
+                        p->fds = fds;
+
+                        pfds = (struct pollfd *)
+                                saferealloc (p->pfds, 2 * p->size
+                                             * sizeof (struct pollfd));
+                        if (!pfds)
+                                return -1;
+                        p->pfds = pfds;
+
+                        p->size *= 2;
+                }
+
+                p->fds[i].fd = fd;
+                p->fds[i].events = 0;
+                p->pfds[i].fd = -1;
+                p->pfds[i].events = p->pfds[i].revents = 0;
+                p->nfds++;
+        }
+
+        if (p->fds[i].events == events)
+                return 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+        if (p->epfd >= 0 && epoll_set (p, i, events) < 0)
+                return -1;
+#endif
+
+        /* poll() skips the negative descriptors */
+        p->pfds[i].fd = events ? fd : -1;
+        p->pfds[i].events = to_poll_events (events);
+        p->fds[i].events = events;
+
+        return 0;
+}
+
+/*
+ * Wait for up to timeout milliseconds (for ever if negative) until one of
+ * the descriptors is ready.  Returns the number of events stored, 0 on a
+ * timeout, or -1 with errno set.
+ */
+int poller_wait (struct poller *p, struct poller_event *events,
+                 int maxevents, int timeout)
+{
+        unsigned int i;
+        int n, ret;
+
+        assert (maxevents > 0);
+
+#ifdef HAVE_SYS_EPOLL_H
+        if (p->epfd >= 0) {
+                struct epoll_event ev[POLLER_MAX_EVENTS];
+
+                ret = epoll_wait (p->epfd, ev, min (maxevents,
+                                                    POLLER_MAX_EVENTS),
+                                  timeout);
+
+                for (n = 0; n < ret; n++) {
+                        struct poller_fd *pfd = &p->fds[ev[n].data.u32];
+
+                        events[n].fd = pfd->fd;
+                        events[n].events =
+                            from_revents (pfd->events,
+                                          ev[n].events & EPOLLIN,
+                                          ev[n].events & EPOLLOUT,
+                                          ev[n].events & (EPOLLERR
+                                                          | EPOLLHUP));
+                }
+
+                return ret;
+        }
+#endif
+
+        ret = poll (p->pfds, p->nfds, timeout);
+        if (ret <= 0)
+                return ret;
+
+        for (i = 0, n = 0; i != p->nfds && n < maxevents; i++) {
+                short revents = p->pfds[i].revents;
+
+                if (p->pfds[i].fd < 0 || revents == 0)
+                        continue;
+
+                events[n].fd = p->fds[i].fd;
+                events[n].events =
+                    from_revents (p->fds[i].events, revents & POLLIN,
+                                  revents & POLLOUT,
+                                  revents & (POLLERR | POLLHUP | POLLNVAL));
+                n++;
+        }
+
+        return n;
+}
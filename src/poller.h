@@ -0,0 +1,47 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* See 'poller.c' for detailed information. */
+
+#ifndef TINYPROXY_POLLER_H
+#define TINYPROXY_POLLER_H
+
+/*
+ * The events a descriptor can be waited for.  POLLER_ERROR is only ever
+ * reported, together with the events asked for, when the descriptor has
+ * failed or the peer has hung up.  POLLER_EDGE asks for edge-triggered
+ * notification where the backend supports it.
+ */
+#define POLLER_READ     0x01
+#define POLLER_WRITE    0x02
+#define POLLER_ERROR    0x04
+#define POLLER_EDGE     0x08
+
+struct poller;
+
+struct poller_event {
+        int fd;
+        unsigned int events;
+};
+
+extern struct poller *poller_create (unsigned int nfds);
+extern void poller_delete (struct poller *p);
+extern int poller_set (struct poller *p, int fd, unsigned int events);
+extern int poller_wait (struct poller *p, struct poller_event *events,
+                        int maxevents, int timeout);
+
+#endif
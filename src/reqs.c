@@ -30,14 +30,20 @@
 #include "acl.h"
 #include "anonymous.h"
 #include "buffer.h"
+#include "child.h"
+#include "chunked.h"
 #include "conns.h"
+#include "dns-cache.h"
 #include "filter.h"
 #include "hashmap.h"
 #include "heap.h"
 #include "html-error.h"
+#include "http-parser.h"
 #include "log.h"
 #include "network.h"
+#include "poller.h"
 #include "reqs.h"
+#include "server-pool.h"
 #include "sock.h"
 #include "stats.h"
 #include "text.h"
@@ -69,61 +75,13 @@
 #  define UPSTREAM_IS_HTTP(up) (0)
 #endif
 
-/*
- * Codify the test for the carriage return and new line characters.
- */
-#define CHECK_CRLF(header, len)                                 \
-  (((len) == 1 && header[0] == '\n') ||                         \
-   ((len) == 2 && header[0] == '\r' && header[1] == '\n'))
-
-/*
- * Codify the test for header fields folded over multiple lines.
- */
-#define CHECK_LWS(header, len)                                  \
-  ((len) > 0 && (header[0] == ' ' || header[0] == '\t'))
-
-/*
- * Read in the first line from the client (the request line for HTTP
- * connections. The request line is allocated from the heap, but it must
- * be freed in another function.
- */
-static int read_request_line (struct conn_s *connptr)
-{
-        ssize_t len;
-
-retry:
-        len = readline (connptr->client_fd, &connptr->request_line);
-        if (len <= 0) {
-                log_message (LOG_ERR,
-                             "read_request_line: Client (file descriptor: %d) "
-                             "closed socket before read.", connptr->client_fd);
-
-                return -1;
-        }
-
-        /*
-         * Strip the new line and carriage return from the string.
-         */
-        if (chomp (connptr->request_line, len) == len) {
-                /*
-                 * If the number of characters removed is the same as the
-                 * length then it was a blank line. Free the buffer and
-                 * try again (since we're looking for a request line.)
-                 */
-                safefree (connptr->request_line);
-                goto retry;
-        }
-
-        log_message (LOG_CONN, "Request (file descriptor %d): %s",
-                     connptr->client_fd, connptr->request_line);
-
-        return 0;
-}
+static struct pool_s request_pool =
+        POOL_INITIALIZER ("request", sizeof (struct request_s), 0);
 
 /*
  * Free all the memory allocated in a request.
  */
-static void free_request_struct (struct request_s *request)
+void free_request_struct (struct request_s *request)
 {
         if (!request)
                 return;
@@ -136,7 +94,7 @@ static void free_request_struct (struct request_s *request)
         if (request->path)
                 safefree (request->path);
 
-        safefree (request);
+        pool_free (&request_pool, request);
 }
 
 /*
@@ -247,13 +205,17 @@ ERROR_EXIT:
 }
 
 /*
- * Create a connection for HTTP connections.
+ * Start the request for the server: the request line, and the headers we
+ * always send.  It is sent along with the client's headers by
+ * process_client_headers().  The server is asked to keep the connection
+ * open if it can go back to the pool afterwards.
  */
 static int
 establish_http_connection (struct conn_s *connptr, struct request_s *request)
 {
         char portbuff[7];
         char dst[sizeof(struct in6_addr)];
+        const char *connection = connptr->server_key ? "keep-alive" : "close";
 
         /* Build a port string if it's not a standard port */
         if (request->port != HTTP_PORT && request->port != HTTP_PORT_SSL)
@@ -264,30 +226,30 @@ establish_http_connection (struct conn_s *connptr, struct request_s *request)
         if (inet_pton(AF_INET6, request->host, dst) > 0) {
                 /* host is an IPv6 address literal, so surround it with
                  * [] */
-                return write_message (connptr->server_fd,
-                                      "%s %s HTTP/1.0\r\n"
+                return iolist_printf (&connptr->request_head,
+                                      "%s %s HTTP/1.1\r\n"
                                       "Host: [%s]%s\r\n"
-                                      "Connection: close\r\n",
+                                      "Connection: %s\r\n",
                                       request->method, request->path,
-                                      request->host, portbuff);
+                                      request->host, portbuff, connection);
         } else if (connptr->upstream_proxy &&
                    connptr->upstream_proxy->type == PT_HTTP &&
                    connptr->upstream_proxy->ua.authstr) {
-                return write_message (connptr->server_fd,
-                                      "%s %s HTTP/1.0\r\n"
+                return iolist_printf (&connptr->request_head,
+                                      "%s %s HTTP/1.1\r\n"
                                       "Host: %s%s\r\n"
-                                      "Connection: close\r\n"
+                                      "Connection: %s\r\n"
                                       "Proxy-Authorization: Basic %s\r\n",
                                       request->method, request->path,
-                                      request->host, portbuff,
+                                      request->host, portbuff, connection,
                                       connptr->upstream_proxy->ua.authstr);
         } else {
-                return write_message (connptr->server_fd,
-                                      "%s %s HTTP/1.0\r\n"
+                return iolist_printf (&connptr->request_head,
+                                      "%s %s HTTP/1.1\r\n"
                                       "Host: %s%s\r\n"
-                                      "Connection: close\r\n",
+                                      "Connection: %s\r\n",
                                       request->method, request->path,
-                                      request->host, portbuff);
+                                      request->host, portbuff, connection);
         }
 }
 
@@ -297,16 +259,28 @@ establish_http_connection (struct conn_s *connptr, struct request_s *request)
 #define SSL_CONNECTION_RESPONSE "HTTP/1.0 200 Connection established"
 #define PROXY_AGENT "Proxy-agent: " PACKAGE "/" VERSION
 
+
+/*
+ * Does the server answer with response headers which we have to process?
+ * This is not the case for a CONNECT tunnel we establish ourselves.
+ */
+int expects_response_headers (struct conn_s *connptr)
+{
+        return !connptr->connect_method || UPSTREAM_IS_HTTP (connptr);
+}
+
 /*
  * Send the appropriate response to the client to establish a SSL
  * connection.
  */
-static int send_ssl_response (struct conn_s *connptr)
+int send_ssl_response (struct conn_s *connptr)
 {
-        return write_message (connptr->client_fd,
-                              "%s\r\n"
-                              "%s\r\n"
-                              "\r\n", SSL_CONNECTION_RESPONSE, PROXY_AGENT);
+        ostream_printf (&connptr->client_out,
+                        "%s\r\n"
+                        "%s\r\n"
+                        "\r\n", SSL_CONNECTION_RESPONSE, PROXY_AGENT);
+
+        return ostream_flush (&connptr->client_out, FALSE);
 }
 
 /*
@@ -322,10 +296,10 @@ static struct request_s *process_request (struct conn_s *connptr,
         size_t request_len;
 
         /* NULL out all the fields so frees don't cause segfaults. */
-        request =
-            (struct request_s *) safecalloc (1, sizeof (struct request_s));
+        request = (struct request_s *) pool_alloc (&request_pool);
         if (!request)
                 return NULL;
+        memset (request, 0, sizeof (struct request_s));
 
         request_len = strlen (connptr->request_line) + 1;
 
@@ -502,77 +476,76 @@ fail:
 }
 
 /*
- * pull_client_data is used to pull across any client data (like in a
- * POST) which needs to be handled before an error can be reported, or
- * server headers can be processed.
- *	- rjkaes
+ * The request body is relayed to the server through the client's buffer,
+ * along with the response, rather than ahead of it.  When its length is
+ * known, content_length.client counts down what is still to be sent, and
+ * anything the buffer holds beyond that is the client's next request.
+ * Otherwise everything the client sends goes to the server.
  */
-static int pull_client_data (struct conn_s *connptr, long int length)
-{
-        char *buffer;
-        ssize_t len;
-        int ret;
-
-        buffer =
-            (char *) safemalloc (min (MAXBUFFSIZE, (unsigned long int) length));
-        if (!buffer)
-                return -1;
 
-        do {
-                len = safe_read (connptr->client_fd, buffer,
-                                 min (MAXBUFFSIZE, (unsigned long int) length));
-                if (len <= 0)
-                        goto ERROR_EXIT;
+/*
+ * Is there more of the request body to read from the client, and room
+ * for it in the buffer?
+ */
+int request_body_wanted (struct conn_s *connptr)
+{
+        size_t buffered = buffer_size (connptr->cbuffer);
 
-                if (!connptr->error_variables) {
-                        if (safe_write (connptr->server_fd, buffer, len) < 0)
-                                goto ERROR_EXIT;
-                }
+        if (buffered >= MAXBUFFSIZE)
+                return FALSE;
+        if (!connptr->request_framed)
+                return TRUE;
 
-                length -= len;
-        } while (length > 0);
+        return connptr->content_length.client > (long int) buffered;
+}
 
-        /*
-         * BUG FIX: Internet Explorer will leave two bytes (carriage
-         * return and line feed) at the end of a POST message.  These
-         * need to be eaten for tinyproxy to work correctly.
-         */
-        ret = socket_nonblocking (connptr->client_fd);
-        if (ret != 0) {
-                log_message(LOG_ERR, "Failed to set the client socket "
-                            "to non-blocking: %s", strerror(errno));
-                goto ERROR_EXIT;
-        }
+/*
+ * Is some of the request body waiting in the buffer to be sent?
+ */
+int request_body_buffered (struct conn_s *connptr)
+{
+        if (buffer_size (connptr->cbuffer) == 0)
+                return FALSE;
 
-        len = recv (connptr->client_fd, buffer, 2, MSG_PEEK);
+        return !connptr->request_framed
+            || connptr->content_length.client > 0;
+}
 
-        ret = socket_blocking (connptr->client_fd);
-        if (ret != 0) {
-                log_message(LOG_ERR, "Failed to set the client socket "
-                            "to blocking: %s", strerror(errno));
-                goto ERROR_EXIT;
-        }
+/*
+ * Read what the client has sent of the request body, and no further.
+ * Returns what read_buffer() does.
+ */
+ssize_t read_request_body (struct conn_s *connptr)
+{
+        size_t buffered = buffer_size (connptr->cbuffer);
 
-        if (len < 0 && errno != EAGAIN)
-                goto ERROR_EXIT;
+        if (!connptr->request_framed)
+                return read_buffer (connptr->client_fd, connptr->cbuffer);
+        if (connptr->content_length.client <= (long int) buffered)
+                return 0;
 
-        if ((len == 2) && CHECK_CRLF (buffer, len)) {
-                ssize_t bytes_read;
+        return read_buffer_max (connptr->client_fd, connptr->cbuffer,
+                                connptr->content_length.client - buffered);
+}
 
-                bytes_read = read (connptr->client_fd, buffer, 2);
-                if (bytes_read == -1) {
-                        log_message
-                                (LOG_WARNING,
-                                 "Could not read two bytes from POST message");
-                }
-        }
+/*
+ * Send the buffered part of the request body to the server.  Returns
+ * what write_buffer() does.
+ */
+ssize_t send_request_body (struct conn_s *connptr)
+{
+        ssize_t len;
 
-        safefree (buffer);
-        return 0;
+        if (!connptr->request_framed)
+                return write_buffer (connptr->server_fd, connptr->cbuffer);
+        if (connptr->content_length.client <= 0)
+                return 0;
 
-ERROR_EXIT:
-        safefree (buffer);
-        return -1;
+        len = write_buffer_max (connptr->server_fd, connptr->cbuffer,
+                                connptr->content_length.client);
+        if (len > 0)
+                connptr->content_length.client -= len;
+        return len;
 }
 
 #ifdef XTINYPROXY_ENABLE
@@ -584,137 +557,11 @@ ERROR_EXIT:
 static int add_xtinyproxy_header (struct conn_s *connptr)
 {
         assert (connptr && connptr->server_fd >= 0);
-        return write_message (connptr->server_fd,
+        return iolist_printf (&connptr->request_head,
                               "X-Tinyproxy: %s\r\n", connptr->client_ip_addr);
 }
 #endif /* XTINYPROXY */
 
-/*
- * Take a complete header line and break it apart (into a key and the data.)
- * Now insert this information into the hashmap for the connection so it
- * can be retrieved and manipulated later.
- */
-static int
-add_header_to_connection (hashmap_t hashofheaders, char *header, size_t len)
-{
-        char *sep;
-
-        /* Get rid of the new line and return at the end */
-        len -= chomp (header, len);
-
-        sep = strchr (header, ':');
-        if (!sep)
-                return -1;
-
-        /* Blank out colons, spaces, and tabs. */
-        while (*sep == ':' || *sep == ' ' || *sep == '\t')
-                *sep++ = '\0';
-
-        /* Calculate the new length of just the data */
-        len -= sep - header - 1;
-
-        return hashmap_insert (hashofheaders, header, sep, len);
-}
-
-/*
- * Define maximum number of headers that we accept.
- * This should be big enough to handle legitimate cases,
- * but limited to avoid DoS.
- */
-#define MAX_HEADERS 10000
-
-/*
- * Read all the headers from the stream
- */
-static int get_all_headers (int fd, hashmap_t hashofheaders)
-{
-        char *line = NULL;
-        char *header = NULL;
-        int count;
-        char *tmp;
-        ssize_t linelen;
-        ssize_t len = 0;
-        unsigned int double_cgi = FALSE;        /* boolean */
-
-        assert (fd >= 0);
-        assert (hashofheaders != NULL);
-
-        for (count = 0; count < MAX_HEADERS; count++) {
-                if ((linelen = readline (fd, &line)) <= 0) {
-                        safefree (header);
-                        safefree (line);
-                        return -1;
-                }
-
-                /*
-                 * If we received a CR LF or a non-continuation line, then add
-                 * the accumulated header field, if any, to the hashmap, and
-                 * reset it.
-                 */
-                if (CHECK_CRLF (line, linelen) || !CHECK_LWS (line, linelen)) {
-                        if (!double_cgi
-                            && len > 0
-                            && add_header_to_connection (hashofheaders, header,
-                                                         len) < 0) {
-                                safefree (header);
-                                safefree (line);
-                                return -1;
-                        }
-
-                        len = 0;
-                }
-
-                /*
-                 * If we received just a CR LF on a line, the headers are
-                 * finished.
-                 */
-                if (CHECK_CRLF (line, linelen)) {
-                        safefree (header);
-                        safefree (line);
-                        return 0;
-                }
-
-                /*
-                 * BUG FIX: The following code detects a "Double CGI"
-                 * situation so that we can handle the nonconforming system.
-                 * This problem was found when accessing cgi.ebay.com, and it
-                 * turns out to be a wider spread problem as well.
-                 *
-                 * If "Double CGI" is in effect, duplicate headers are
-                 * ignored.
-                 *
-                 * FIXME: Might need to change this to a more robust check.
-                 */
-                if (linelen >= 5 && strncasecmp (line, "HTTP/", 5) == 0) {
-                        double_cgi = TRUE;
-                }
-
-                /*
-                 * Append the new line to the current header field.
-                 */
-                tmp = (char *) saferealloc (header, len + linelen);
-                if (tmp == NULL) {
-                        safefree (header);
-                        safefree (line);
-                        return -1;
-                }
-
-                header = tmp;
-                memcpy (header + len, line, linelen);
-                len += linelen;
-
-                safefree (line);
-        }
-
-        /*
-         * If we get here, this means we reached MAX_HEADERS count.
-         * Bail out with error.
-         */
-        safefree (header);
-        safefree (line);
-        return -1;
-}
-
 /*
  * Extract the headers to remove.  These headers were listed in the Connection
  * and Proxy-Connection headers.
@@ -768,34 +615,180 @@ static int remove_connection_headers (hashmap_t hashofheaders)
         return 0;
 }
 
+#define CONTENT_LENGTH_INVALID -2
+
 /*
  * If there is a Content-Length header, then return the value; otherwise, return
- * a negative number.
+ * -1.  The header may be repeated, or list the value more than once, but
+ * only ever with the same value.  Anything but digits, or differing values,
+ * make the length unknowable, and return CONTENT_LENGTH_INVALID.
  */
 static long get_content_length (hashmap_t hashofheaders)
 {
-        ssize_t len;
+        hashmap_iter iter;
+        char *key, *data, *end;
+        long value, content_length = -1;
+
+        for (iter = hashmap_first (hashofheaders);
+             iter >= 0 && !hashmap_is_end (hashofheaders, iter); iter++) {
+                if (hashmap_return_entry (hashofheaders, iter, &key,
+                                          (void **) &data) < 0)
+                        return CONTENT_LENGTH_INVALID;
+                if (strcasecmp (key, "content-length") != 0)
+                        continue;
+
+                for (;;) {
+                        data += strspn (data, " \t");
+                        if (!isdigit ((unsigned char) *data))
+                                return CONTENT_LENGTH_INVALID;
+
+                        errno = 0;
+                        value = strtol (data, &end, 10);
+                        if (errno == ERANGE)
+                                return CONTENT_LENGTH_INVALID;
+                        if (content_length >= 0 && value != content_length)
+                                return CONTENT_LENGTH_INVALID;
+                        content_length = value;
+
+                        data = end + strspn (end, " \t");
+                        if (*data == '\0')
+                                break;
+                        if (*data++ != ',')
+                                return CONTENT_LENGTH_INVALID;
+                }
+        }
+
+        return content_length;
+}
+
+/*
+ * Check whether a comma separated header value, such as that of the
+ * Connection header, lists the token.
+ */
+static int header_has_token (const char *value, const char *token)
+{
+        size_t len = strlen (token);
+
+        while (*value) {
+                value += strspn (value, " \t,");
+                if (strncasecmp (value, token, len) == 0
+                    && strchr (" \t,", value[len]))
+                        return TRUE;
+                value += strcspn (value, ",");
+        }
+
+        return FALSE;
+}
+
+/*
+ * Is "chunked" the last of the transfer codings listed?  Only then does
+ * the body end where its chunks say.
+ */
+static int chunked_last (const char *value)
+{
+        const char *last = strrchr (value, ',');
+
+        last = last ? last + 1 : value;
+        last += strspn (last, " \t");
+        if (strncasecmp (last, "chunked", 7) != 0)
+                return FALSE;
+
+        return last[7 + strspn (last + 7, " \t")] == '\0';
+}
+
+/*
+ * Does the client speak HTTP/1.1 (or later)?
+ */
+static int client_is_http11 (struct conn_s *connptr)
+{
+        return connptr->protocol.major > 1
+            || (connptr->protocol.major == 1 && connptr->protocol.minor >= 1);
+}
+
+/*
+ * Check whether the client connection can be kept open for another
+ * request after this one.  HTTP/1.1 clients keep their connections
+ * unless they ask us to close them, HTTP/1.0 clients only if they ask
+ * for it.
+ */
+static int client_keep_alive (struct conn_s *connptr, hashmap_t hashofheaders)
+{
+        static const char *headers[] = {
+                "connection",
+                "proxy-connection"
+        };
+
+        int keep_alive;
         char *data;
-        long content_length = -1;
+        unsigned int i;
 
-        len =
-            hashmap_entry_by_key (hashofheaders, "content-length",
-                                  (void **) &data);
-        if (len > 0)
-                content_length = atol (data);
+        if (config.keepalive_timeout == 0)
+                return FALSE;
 
-        return content_length;
+        if (config.max_keepalive_requests != 0
+            && connptr->requests >= config.max_keepalive_requests)
+                return FALSE;
+
+        keep_alive = client_is_http11 (connptr);
+
+        for (i = 0; i != (sizeof (headers) / sizeof (char *)); i++) {
+                if (hashmap_entry_by_key (hashofheaders, headers[i],
+                                          (void **) &data) <= 0)
+                        continue;
+
+                if (header_has_token (data, "close"))
+                        return FALSE;
+                if (header_has_token (data, "keep-alive"))
+                        keep_alive = TRUE;
+        }
+
+        return keep_alive;
+}
+
+/*
+ * Check whether the server keeps its connection open after the response.
+ * HTTP/1.1 servers do unless they say otherwise, HTTP/1.0 servers only if
+ * they say so.
+ */
+static int
+server_keeps_connection (hashmap_t hashofheaders, const char *response_line)
+{
+        static const char *headers[] = {
+                "connection",
+                "proxy-connection"
+        };
+
+        unsigned int major, minor;
+        char *data;
+        unsigned int i;
+
+        for (i = 0; i != (sizeof (headers) / sizeof (char *)); i++) {
+                if (hashmap_entry_by_key (hashofheaders, headers[i],
+                                          (void **) &data) <= 0)
+                        continue;
+
+                if (header_has_token (data, "close"))
+                        return FALSE;
+                if (header_has_token (data, "keep-alive"))
+                        return TRUE;
+        }
+
+        if (sscanf (response_line, "HTTP/%u.%u", &major, &minor) != 2)
+                return FALSE;
+
+        return major > 1 || (major == 1 && minor >= 1);
 }
 
 /*
- * Search for Via header in a hash of headers and either write a new Via
- * header, or append our information to the end of an existing Via header.
+ * Search for Via header in a hash of headers and either add a new Via
+ * header to the message, or append our information to the end of an
+ * existing Via header.
  *
  * FIXME: Need to add code to "hide" our internal information for security
  * purposes.
  */
 static int
-write_via_header (int fd, hashmap_t hashofheaders,
+write_via_header (struct iolist *out, hashmap_t hashofheaders,
                   unsigned int major, unsigned int minor)
 {
         ssize_t len;
@@ -820,14 +813,14 @@ write_via_header (int fd, hashmap_t hashofheaders,
          */
         len = hashmap_entry_by_key (hashofheaders, "via", (void **) &data);
         if (len > 0) {
-                ret = write_message (fd,
+                ret = iolist_printf (out,
                                      "Via: %s, %hu.%hu %s (%s/%s)\r\n",
                                      data, major, minor, hostname, PACKAGE,
                                      VERSION);
 
                 hashmap_remove (hashofheaders, "via");
         } else {
-                ret = write_message (fd,
+                ret = iolist_printf (out,
                                      "Via: %hu.%hu %s (%s/%s)\r\n",
                                      major, minor, hostname, PACKAGE, VERSION);
         }
@@ -837,9 +830,26 @@ done:
 }
 
 /*
- * Number of buckets to use internally in the hashmap.
+ * Add a header field to the message, referring to the name and the value
+ * where they are rather than copying them.
+ */
+static int
+add_header_field (struct iolist *out, const char *name, const char *value)
+{
+        if (iolist_add (out, name, strlen (name)) < 0
+            || iolist_add (out, ": ", 2) < 0
+            || iolist_add (out, value, strlen (value)) < 0
+            || iolist_add (out, "\r\n", 2) < 0)
+                return -1;
+
+        return 0;
+}
+
+/*
+ * The number of headers to make room for in the hashmap up front, which
+ * is plenty for most requests and responses.
  */
-#define HEADER_BUCKETS 256
+#define HEADER_ENTRIES 32
 
 /*
  * Here we loop through all the headers the client is sending. If we
@@ -847,7 +857,7 @@ done:
  * (plus a few which are required for various methods).
  *	- rjkaes
  */
-static int
+int
 process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
 {
         static const char *skipheaders[] = {
@@ -877,10 +887,9 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
         }
 
         /*
-         * See if there is a "Content-Length" header.  If so, again we need
-         * to do a bit of processing.
+         * The "Content-Length" header was checked along with the request.
          */
-        connptr->content_length.client = get_content_length (hashofheaders);
+        connptr->request_body = connptr->content_length.client > 0;
 
         /*
          * See if there is a "Connection" header.  If so, we need to do a bit
@@ -895,22 +904,15 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
                 hashmap_remove (hashofheaders, skipheaders[i]);
         }
 
-        /* Send, or add the Via header */
-        ret = write_via_header (connptr->server_fd, hashofheaders,
+        /* Add the Via header */
+        ret = write_via_header (&connptr->request_head, hashofheaders,
                                 connptr->protocol.major,
                                 connptr->protocol.minor);
-        if (ret < 0) {
-                indicate_http_error (connptr, 503,
-                                     "Could not send data to remote server",
-                                     "detail",
-                                     "A network error occurred while "
-                                     "trying to write data to the remote web server.",
-                                     NULL);
-                goto PULL_CLIENT_DATA;
-        }
+        if (ret < 0)
+                goto ERROR_EXIT;
 
         /*
-         * Output all the remaining headers to the remote machine.
+         * Add all the remaining headers, as they came from the client.
          */
         iter = hashmap_first (hashofheaders);
         if (iter >= 0) {
@@ -920,19 +922,10 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
 
                         if (!is_anonymous_enabled ()
                             || anonymous_search (data) > 0) {
-                                ret =
-                                    write_message (connptr->server_fd,
-                                                   "%s: %s\r\n", data, header);
-                                if (ret < 0) {
-                                        indicate_http_error (connptr, 503,
-                                                             "Could not send data to remote server",
-                                                             "detail",
-                                                             "A network error occurred while "
-                                                             "trying to write data to the "
-                                                             "remote web server.",
-                                                             NULL);
-                                        goto PULL_CLIENT_DATA;
-                                }
+                                ret = add_header_field (&connptr->request_head,
+                                                        data, header);
+                                if (ret < 0)
+                                        goto ERROR_EXIT;
                         }
                 }
         }
@@ -941,81 +934,268 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders)
                 add_xtinyproxy_header (connptr);
 #endif
 
-        /* Write the final "blank" line to signify the end of the headers */
-        if (safe_write (connptr->server_fd, "\r\n", 2) < 0)
-                return -1;
-
         /*
-         * Spin here pulling the data from the client.
+         * The final "blank" line signifies the end of the headers.  Send
+         * the request line and all the headers at once; what a
+         * non-blocking socket does not take is left in server_out.  They
+         * are kept until the request is done with, in case they have to
+         * be sent again (see resend_request.)
          */
-PULL_CLIENT_DATA:
-        if (connptr->content_length.client > 0) {
-                ret = pull_client_data (connptr,
-                                        connptr->content_length.client);
-        }
+        connptr->server_out.fd = connptr->server_fd;
+        ret = iolist_add (&connptr->request_head, "\r\n", 2);
+        if (ret == 0
+            && iolist_queue (&connptr->request_head, &connptr->server_out,
+                             FALSE) < 0)
+                ret = -1;
+        if (ret < 0)
+                goto ERROR_EXIT;
 
-        return ret;
+        return 0;
+
+ERROR_EXIT:
+        iolist_free (&connptr->request_head);
+        indicate_http_error (connptr, 503,
+                             "Could not send data to remote server",
+                             "detail",
+                             "A network error occurred while "
+                             "trying to write data to the remote web server.",
+                             NULL);
+        return -1;
 }
 
 /*
- * Loop through all the headers (including the response code) from the
- * server.
+ * The most read from the server at once when the response body has to
+ * go through the chunked stage.
  */
-static int process_server_headers (struct conn_s *connptr)
-{
-        static const char *skipheaders[] = {
-                "keep-alive",
-                "proxy-authenticate",
-                "proxy-authorization",
-                "proxy-connection",
-        };
+#define CHUNKED_READ_SIZE (16 * 1024)
 
-        char *response_line;
+/*
+ * Pass a piece of the response body, as it came from the server, into
+ * the buffer for the client, through the chunked stage the relay mode
+ * calls for (see chunked.c).  Once the end of the body has gone through,
+ * content_length.server drops to 0.  Anything after the end is dropped,
+ * and the server connection is not kept.  The buffer must have room for
+ * len + CHUNK_OVERHEAD bytes.
+ *
+ * Returns 0, or -1 if the body is malformed.
+ */
+static int relay_body_data (struct conn_s *connptr, char *data, size_t len)
+{
+        static unsigned char crlf[] = "\r\n";
+        char head[CHUNK_OVERHEAD];
+        ssize_t used;
+        size_t out;
 
-        hashmap_t hashofheaders;
-        hashmap_iter iter;
-        char *data, *header;
-        ssize_t len;
-        int i;
-        int ret;
+        if (connptr->relay_mode == RELAY_ENCHUNK) {
+                if (len == 0)
+                        return 0;
+                if (add_to_buffer (connptr->sbuffer, (unsigned char *) head,
+                                   chunked_head (head, len)) < 0
+                    || add_to_buffer (connptr->sbuffer,
+                                      (unsigned char *) data, len) < 0
+                    || add_to_buffer (connptr->sbuffer, crlf, 2) < 0)
+                        return -1;
+                return 0;
+        }
 
-#ifdef REVERSE_SUPPORT
-        struct reversepath *reverse = config.reversepath_list;
-#endif
+        used = chunked_parse (&connptr->chunked, data, len,
+                              connptr->relay_mode == RELAY_DECHUNK, &out);
+        if (used < 0) {
+                log_message (LOG_WARNING, "Malformed chunked response body "
+                             "from the server (fd:%d)", connptr->server_fd);
+                return -1;
+        }
 
-        /* Get the response line from the remote server. */
-retry:
-        len = readline (connptr->server_fd, &response_line);
-        if (len <= 0)
+        if (out > 0
+            && add_to_buffer (connptr->sbuffer, (unsigned char *) data,
+                              out) < 0)
                 return -1;
 
-        /*
-         * Strip the new line and character return from the string.
-         */
-        if (chomp (response_line, len) == len) {
-                /*
-                 * If the number of characters removed is the same as the
-                 * length then it was a blank line. Free the buffer and
-                 * try again (since we're looking for a request line.)
-                 */
-                safefree (response_line);
-                goto retry;
+        if (chunked_done (&connptr->chunked)) {
+                connptr->content_length.server = 0;
+                if ((size_t) used < len)
+                        connptr->server_keep_alive = FALSE;
+        }
+
+        return 0;
+}
+
+/*
+ * Pass the part of the body which arrived along with the headers, and is
+ * already in the buffer, through the chunked stage.
+ */
+static int relay_buffered_body (struct conn_s *connptr)
+{
+        size_t len = buffer_size (connptr->sbuffer);
+        char *data;
+        int ret;
+
+        if (len == 0)
+                return 0;
+
+        data = (char *) safemalloc (len);
+        if (!data)
+                return -1;
+
+        remove_from_buffer (connptr->sbuffer, (unsigned char *) data, len);
+        ret = relay_body_data (connptr, data, len);
+        safefree (data);
+
+        return ret;
+}
+
+/*
+ * Read the next part of the response body from the server into the
+ * buffer for the client.  Nothing after the end of the response is
+ * relayed: a body of known length is read up to its end only, and a
+ * chunked one is passed through the chunked stage, which finds its end.
+ * content_length.server drops to 0 at the end either way.
+ *
+ * Returns what read_buffer() does.
+ */
+ssize_t read_server_body (struct conn_s *connptr)
+{
+        static unsigned char last_chunk[] = "0\r\n\r\n";
+        char data[CHUNKED_READ_SIZE];
+        size_t room;
+        ssize_t len;
+
+        if (connptr->relay_mode == RELAY_PLAIN) {
+                if (connptr->content_length.server < 0)
+                        return read_buffer (connptr->server_fd,
+                                            connptr->sbuffer);
+                if (connptr->content_length.server == 0)
+                        return -1;
+
+                len = read_buffer_max (connptr->server_fd, connptr->sbuffer,
+                                       connptr->content_length.server);
+                if (len > 0)
+                        connptr->content_length.server -= len;
+                return len;
+        }
+
+        room = MAXBUFFSIZE - buffer_size (connptr->sbuffer);
+        if (room <= CHUNK_OVERHEAD)
+                return 0;
+
+        len = recv (connptr->server_fd, data,
+                    min (room - CHUNK_OVERHEAD, sizeof (data)), 0);
+        if (len < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                        return 0;
+                log_message (LOG_ERR, "read_server_body: recv() failed on "
+                             "fd %d: %s", connptr->server_fd,
+                             strerror (errno));
+                return -1;
+        }
+
+        if (len == 0) {
+                /* An open-ended body ends with the connection */
+                if (connptr->relay_mode == RELAY_ENCHUNK
+                    && add_to_buffer (connptr->sbuffer, last_chunk, 5) == 0)
+                        connptr->content_length.server = 0;
+                return -1;
         }
 
-        hashofheaders = hashmap_create (HEADER_BUCKETS);
-        if (!hashofheaders) {
-                safefree (response_line);
+        if (relay_body_data (connptr, data, len) < 0)
                 return -1;
+
+        return len;
+}
+
+/*
+ * Pass an interim (1xx) response on to the client, without the headers
+ * which only concern the connection to the server.
+ */
+static int send_interim_response (struct conn_s *connptr,
+                                  const char *response_line,
+                                  hashmap_t hashofheaders)
+{
+        struct iolist out;
+        hashmap_iter iter;
+        char *data, *header;
+        int ret;
+
+        remove_connection_headers (hashofheaders);
+        hashmap_remove (hashofheaders, "keep-alive");
+        hashmap_remove (hashofheaders, "proxy-connection");
+
+        iolist_init (&out);
+
+        ret = iolist_add (&out, response_line, strlen (response_line));
+        if (ret == 0)
+                ret = iolist_add (&out, "\r\n", 2);
+
+        iter = hashmap_first (hashofheaders);
+        if (iter >= 0) {
+                for (; ret == 0 && !hashmap_is_end (hashofheaders, iter);
+                     ++iter) {
+                        hashmap_return_entry (hashofheaders,
+                                              iter, &data, (void **) &header);
+                        ret = add_header_field (&out, data, header);
+                }
         }
 
+        if (ret == 0)
+                ret = iolist_add (&out, "\r\n", 2);
+        if (ret == 0 && iolist_queue (&out, &connptr->client_out, FALSE) < 0)
+                ret = -1;
+
+        iolist_free (&out);
+        return ret;
+}
+
+/*
+ * Loop through all the headers (including the response code) from the
+ * server.
+ *
+ * Returns 0, or -1 on failure.  Returns 1 if an interim response was
+ * read; the final response is still to come.
+ */
+int process_server_headers (struct conn_s *connptr)
+{
+        static const char *skipheaders[] = {
+                "keep-alive",
+                "proxy-authenticate",
+                "proxy-authorization",
+                "proxy-connection",
+        };
+
+        char *response_line;
+        struct iolist out;
+
+        hashmap_t hashofheaders;
+        hashmap_iter iter;
+        char *data, *header;
+        ssize_t len;
+        unsigned int status;
+        int coded, chunked, conflicting, framed, overrun, declined;
+        int i;
+        int ret;
+
+#ifdef REVERSE_SUPPORT
+        struct reversepath *reverse = config.reversepath_list;
+#endif
+
+        /* Get the response line and the headers from the remote server. */
+        len = read_header_block (connptr->server_fd, connptr->sbuffer);
+        if (len < 0 && buffer_size (connptr->sbuffer) == 0)
+                return -1;
+
+        hashofheaders = hashmap_create (HEADER_ENTRIES);
+        if (!hashofheaders)
+                return -1;
+
         /*
-         * Get all the headers from the remote server in a big hash
+         * Parse the response line and all the headers into a big hash.
+         * The response line lives as long as the hash.
          */
-        if (get_all_headers (connptr->server_fd, hashofheaders) < 0) {
+        response_line = len > 0 ? parse_header_block (connptr->sbuffer, len,
+                                                      hashofheaders) : NULL;
+        if (!response_line) {
                 log_message (LOG_WARNING,
                              "Could not retrieve all the headers from the remote server.");
                 hashmap_delete (hashofheaders);
-                safefree (response_line);
 
                 indicate_http_error (connptr, 503,
                                      "Could not retrieve all the headers",
@@ -1026,6 +1206,41 @@ retry:
                 return -1;
         }
 
+        /*
+         * An interim (1xx) response is passed on to a client which
+         * understands it, or asked for it, and the final one read next.
+         * (101 Switching Protocols would be final, but the Upgrade header
+         * it answers is never passed on.)
+         */
+        if (sscanf (response_line, "HTTP/%*u.%*u %u", &status) != 1)
+                status = 0;
+        if (status >= 100 && status < 200 && status != 101) {
+                ret = 0;
+                if (client_is_http11 (connptr) || connptr->expect_continue)
+                        ret = send_interim_response (connptr, response_line,
+                                                     hashofheaders);
+                hashmap_delete (hashofheaders);
+                return ret < 0 ? -1 : 1;
+        }
+
+        /*
+         * A final answer before all of the body has been sent, to a
+         * client which waited to be asked for the body, means the server
+         * does not want it.  Whether the client sends it anyway is up to
+         * the client, so neither connection can be kept.
+         */
+        declined = connptr->expect_continue && !connptr->connect_method
+            && (request_body_wanted (connptr)
+                || request_body_buffered (connptr));
+        if (declined) {
+                log_message (LOG_INFO, "The server answered before the "
+                             "request body was sent, not sending the rest "
+                             "(fd:%d)", connptr->client_fd);
+                connptr->request_framed = TRUE;
+                connptr->content_length.client = 0;
+                connptr->keep_alive = FALSE;
+        }
+
         /*
          * At this point we've received the response line and all the
          * headers.  However, if this is a simple HTTP/0.9 request we
@@ -1034,21 +1249,124 @@ retry:
          */
         if (connptr->protocol.major < 1) {
                 hashmap_delete (hashofheaders);
-                safefree (response_line);
                 return 0;
         }
 
-        /* Send the saved response line first */
-        ret = write_message (connptr->client_fd, "%s\r\n", response_line);
-        safefree (response_line);
-        if (ret < 0)
-                goto ERROR_EXIT;
+        iolist_init (&out);
 
         /*
          * If there is a "Content-Length" header, retrieve the information
-         * from it for later use.
+         * from it for later use.  A chunked body ends where its chunks
+         * say, whatever the Content-Length says, which is not passed on.
          */
         connptr->content_length.server = get_content_length (hashofheaders);
+        coded = hashmap_entry_by_key (hashofheaders, "transfer-encoding",
+                                      (void **) &data) > 0;
+        chunked = coded && header_has_token (data, "chunked");
+
+        /*
+         * A length which is unknowable, or given along with a
+         * Transfer-Encoding, is not trusted: the body then ends where the
+         * encoding says, or with the connection.
+         */
+        conflicting = connptr->content_length.server
+            == CONTENT_LENGTH_INVALID
+            || (coded && connptr->content_length.server >= 0);
+        if (conflicting) {
+                log_message (LOG_WARNING, "Invalid response length from "
+                             "the server (fd:%d)", connptr->server_fd);
+                connptr->content_length.server = -1;
+                hashmap_remove (hashofheaders, "content-length");
+        }
+
+        /*
+         * Responses to a HEAD request, and 204 and 304 responses, have no
+         * body, whatever their headers say.
+         */
+        if (!connptr->connect_method
+            && (connptr->head_method || status == 204 || status == 304)) {
+                connptr->content_length.server = 0;
+                coded = chunked = conflicting = FALSE;
+        }
+
+        if (chunked) {
+                connptr->content_length.server = -1;
+                hashmap_remove (hashofheaders, "content-length");
+        }
+
+        /*
+         * The body of a tunnel is open ended, whatever the proxy says.
+         * Otherwise part of the body may have arrived along with the
+         * headers; it is still in the buffer, and no longer expected.
+         * More than the whole body means the server is confused.
+         */
+        overrun = FALSE;
+        if (connptr->connect_method) {
+                connptr->content_length.server = -1;
+        } else if (connptr->content_length.server >= 0) {
+                overrun = buffer_size (connptr->sbuffer)
+                    > (size_t) connptr->content_length.server;
+                connptr->content_length.server -=
+                    min ((size_t) connptr->content_length.server,
+                         buffer_size (connptr->sbuffer));
+        }
+
+        /*
+         * Either connection can only be kept open if the end of the
+         * response is known from its headers.  Interim (1xx) responses
+         * are followed by another one, which is not looked at.
+         */
+        framed = status >= 200
+            && (chunked || (connptr->content_length.server >= 0 && !coded));
+        connptr->server_keep_alive = framed && !overrun && !declined
+            && !conflicting
+            && connptr->server_key && connptr->request_framed
+            && server_keeps_connection (hashofheaders, response_line);
+
+        /*
+         * A chunked body is passed on as it is to a HTTP/1.1 client; a
+         * HTTP/1.0 client gets the data only, up to the end of the
+         * connection.  An open-ended body is sent to a HTTP/1.1 client
+         * in chunks, so that its connection can still be kept.
+         */
+        if (chunked && client_is_http11 (connptr)) {
+                connptr->relay_mode = RELAY_CHUNKED;
+        } else if (chunked) {
+                connptr->relay_mode = RELAY_DECHUNK;
+                connptr->keep_alive = FALSE;
+                hashmap_remove (hashofheaders, "transfer-encoding");
+        } else if (!framed && !coded && status >= 200
+                   && connptr->keep_alive && client_is_http11 (connptr)
+                   && !connptr->connect_method) {
+                connptr->relay_mode = RELAY_ENCHUNK;
+        } else if (!framed) {
+                connptr->keep_alive = FALSE;
+        }
+
+        if (connptr->relay_mode != RELAY_PLAIN) {
+                chunked_init (&connptr->chunked);
+                if (relay_buffered_body (connptr) < 0)
+                        goto ERROR_EXIT;
+        }
+
+        /*
+         * The response for the client is put together in one piece,
+         * starting with the saved response line.  Our own version goes
+         * with a body we chunk ourselves.
+         */
+        if (connptr->relay_mode == RELAY_ENCHUNK) {
+                ret = iolist_printf (&out, "HTTP/1.1%s\r\n", response_line
+                                     + strcspn (response_line, " "));
+                if (ret == 0)
+                        ret = add_header_field (&out, "Transfer-Encoding",
+                                                "chunked");
+        } else {
+                ret = iolist_add (&out, response_line, strlen (response_line));
+                if (ret == 0)
+                        ret = iolist_add (&out, "\r\n", 2);
+        }
+        if (ret < 0)
+                goto ERROR_EXIT;
 
         /*
          * See if there is a connection header.  If so, we need to to a bit of
@@ -1063,17 +1381,23 @@ retry:
                 hashmap_remove (hashofheaders, skipheaders[i]);
         }
 
-        /* Send, or add the Via header */
-        ret = write_via_header (connptr->client_fd, hashofheaders,
+        /* Add the Via header */
+        ret = write_via_header (&out, hashofheaders,
                                 connptr->protocol.major,
                                 connptr->protocol.minor);
         if (ret < 0)
                 goto ERROR_EXIT;
 
+        /* Tell the client whether its connection stays open */
+        ret = add_header_field (&out, "Connection",
+                                connptr->keep_alive ? "keep-alive" : "close");
+        if (ret < 0)
+                goto ERROR_EXIT;
+
 #ifdef REVERSE_SUPPORT
         /* Write tracking cookie for the magical reverse proxy path hack */
         if (config.reversemagic && connptr->reversepath) {
-                ret = write_message (connptr->client_fd,
+                ret = iolist_printf (&out,
                                      "Set-Cookie: " REVERSE_COOKIE
                                      "=%s; path=/\r\n", connptr->reversepath);
                 if (ret < 0)
@@ -1097,7 +1421,7 @@ retry:
 
                 if (reverse) {
                         ret =
-                            write_message (connptr->client_fd,
+                            iolist_printf (&out,
                                            "Location: %s%s%s\r\n",
                                            config.reversebaseurl,
                                            (reverse->path + 1), (header + len));
@@ -1114,7 +1438,8 @@ retry:
 #endif
 
         /*
-         * All right, output all the remaining headers to the client.
+         * All right, add all the remaining headers, as they came from the
+         * server.
          */
         iter = hashmap_first (hashofheaders);
         if (iter >= 0) {
@@ -1122,21 +1447,31 @@ retry:
                         hashmap_return_entry (hashofheaders,
                                               iter, &data, (void **) &header);
 
-                        ret = write_message (connptr->client_fd,
-                                             "%s: %s\r\n", data, header);
+                        ret = add_header_field (&out, data, header);
                         if (ret < 0)
                                 goto ERROR_EXIT;
                 }
         }
-        hashmap_delete (hashofheaders);
 
-        /* Write the final blank line to signify the end of the headers */
-        if (safe_write (connptr->client_fd, "\r\n", 2) < 0)
-                return -1;
+        /*
+         * The final blank line signifies the end of the headers.  Send it
+         * all (or, on a non-blocking socket, copy what is left into
+         * client_out) before the headers it refers to are deleted.
+         * Whatever part of the body came along is relayed straight after,
+         * so it may share the last segment.
+         */
+        ret = iolist_add (&out, "\r\n", 2);
+        if (ret == 0
+            && iolist_queue (&out, &connptr->client_out,
+                             buffer_size (connptr->sbuffer) > 0) < 0)
+                ret = -1;
 
-        return 0;
+        iolist_free (&out);
+        hashmap_delete (hashofheaders);
+        return ret;
 
 ERROR_EXIT:
+        iolist_free (&out);
         hashmap_delete (hashofheaders);
         return -1;
 }
@@ -1149,68 +1484,307 @@ ERROR_EXIT:
  * tinyproxy oh so long ago...)
  *	- rjkaes
  */
+/*
+ * Wait until the client or the server socket of a relay is ready, or
+ * until the idle timeout expires.  cev and sev pass in the events wanted
+ * for the client and the server, and return the events which happened.
+ * Returns what poller_wait() does.
+ */
+static int relay_wait (struct poller *p, struct conn_s *connptr,
+                       unsigned int *cev, unsigned int *sev,
+                       time_t last_access)
+{
+        struct poller_event ev[2];
+        double timeout;
+        int i, n;
+
+        if (poller_set (p, connptr->client_fd, *cev) < 0
+            || poller_set (p, connptr->server_fd, *sev) < 0)
+                return -1;
+
+        timeout = config.idletimeout - difftime (time (NULL), last_access);
+        if (timeout < 0)
+                timeout = 0;
+
+        n = poller_wait (p, ev, 2, (int) timeout * 1000);
+
+        *cev = *sev = 0;
+        for (i = 0; i < n; i++) {
+                if (ev[i].fd == connptr->client_fd)
+                        *cev = ev[i].events;
+                else
+                        *sev = ev[i].events;
+        }
+
+        return n;
+}
+
+#ifdef HAVE_SPLICE
+#define SPLICE_UNSUPPORTED(err) ((err) == EINVAL || (err) == ENOSYS)
+
+/*
+ * The payload of a CONNECT tunnel, or of a response with a known length,
+ * is never looked at.  Rather than copying it into our buffers and out
+ * again, move it from socket to socket through a pair of pipes with
+ * splice().  Both sockets must already be non-blocking.
+ *
+ * Returns -1, without having relayed anything, if splice() can not be
+ * used here, so the caller can fall back to the buffered relay.
+ */
+static int relay_connection_spliced (struct conn_s *connptr)
+{
+        struct splice_pipe up, down;    /* to the server, to the client */
+        struct poller *poller;
+        unsigned int cev, sev;
+        time_t last_access;
+        int ret;
+        double tdiff;
+        int relayed = FALSE;
+        ssize_t len;
+        size_t count;
+
+        poller = poller_create (2);
+        if (!poller)
+                return -1;
+
+        if (splice_pipe_open (&up) < 0) {
+                poller_delete (poller);
+                return -1;
+        }
+        if (splice_pipe_open (&down) < 0) {
+                splice_pipe_close (&up);
+                poller_delete (poller);
+                return -1;
+        }
+
+        last_access = time (NULL);
+
+        for (;;) {
+                /*
+                 * A pipe is only filled again once it has been drained,
+                 * so we never wait for a socket we can not read into.
+                 * Once the whole request has been sent, what the client
+                 * sends is its next request, which is left alone.
+                 */
+                cev = up.pending > 0 || connptr->request_framed
+                    ? 0 : POLLER_READ;
+                sev = down.pending > 0 ? 0 : POLLER_READ;
+                if (down.pending > 0)
+                        cev |= POLLER_WRITE;
+                if (up.pending > 0)
+                        sev |= POLLER_WRITE;
+
+                ret = relay_wait (poller, connptr, &cev, &sev, last_access);
+
+                if (ret == 0) {
+                        tdiff = difftime (time (NULL), last_access);
+                        if (tdiff > config.idletimeout) {
+                                log_message (LOG_INFO,
+                                             "Idle Timeout (after poll) as %g > %u.",
+                                             tdiff, config.idletimeout);
+                                goto done;
+                        } else {
+                                continue;
+                        }
+                } else if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log_message (LOG_ERR,
+                                     "relay_connection: poll error \"%s\". "
+                                     "Closing connection (client_fd:%d, server_fd:%d)",
+                                     strerror (errno), connptr->client_fd,
+                                     connptr->server_fd);
+                        goto done;
+                } else {
+                        last_access = time (NULL);
+                }
+
+                if (sev & POLLER_READ) {
+                        count = MAXBUFFSIZE;
+                        if (connptr->content_length.server >= 0
+                            && (size_t) connptr->content_length.server < count)
+                                count = connptr->content_length.server;
+
+                        len = splice_in (connptr->server_fd, &down, count);
+                        if (len < 0 && errno != EAGAIN) {
+                                if (!relayed && SPLICE_UNSUPPORTED (errno))
+                                        goto unsupported;
+                                break;
+                        }
+                        if (len == 0)
+                                break;
+                        if (len > 0) {
+                                relayed = TRUE;
+                                child_scoreboard_bytes (len);
+                                if (connptr->content_length.server >= 0) {
+                                        connptr->content_length.server -= len;
+                                        if (connptr->content_length.server == 0)
+                                                break;
+                                }
+                        }
+                }
+                if (cev & POLLER_READ) {
+                        len = splice_in (connptr->client_fd, &up, MAXBUFFSIZE);
+                        if (len < 0 && errno != EAGAIN) {
+                                if (!relayed && SPLICE_UNSUPPORTED (errno))
+                                        goto unsupported;
+                                break;
+                        }
+                        if (len == 0)
+                                break;
+                        if (len > 0) {
+                                relayed = TRUE;
+                                child_scoreboard_bytes (len);
+                        }
+                }
+                if ((sev & POLLER_WRITE)
+                    && splice_out (&up, connptr->server_fd) < 0
+                    && errno != EAGAIN)
+                        break;
+                if ((cev & POLLER_WRITE)
+                    && splice_out (&down, connptr->client_fd) < 0
+                    && errno != EAGAIN)
+                        break;
+        }
+
+        /*
+         * Write what is still in the pipes, as relay_connection() does
+         * with the buffers.
+         */
+        if (socket_blocking (connptr->client_fd) == 0) {
+                while (down.pending > 0) {
+                        if (splice_out (&down, connptr->client_fd) < 0)
+                                break;
+                }
+                if (!connptr->keep_alive)
+                        shutdown (connptr->client_fd, SHUT_WR);
+        }
+        if (down.pending > 0)
+                connptr->keep_alive = FALSE;
+
+        if (socket_blocking (connptr->server_fd) == 0) {
+                while (up.pending > 0) {
+                        if (splice_out (&up, connptr->server_fd) < 0)
+                                break;
+                }
+        }
+
+done:
+        splice_pipe_close (&up);
+        splice_pipe_close (&down);
+        poller_delete (poller);
+        return 0;
+
+unsupported:
+        /* Nothing has been moved yet, so the data can still be copied */
+        log_message (LOG_INFO, "relay_connection: splice() is not "
+                     "supported here, copying the data instead.");
+        splice_pipe_close (&up);
+        splice_pipe_close (&down);
+        poller_delete (poller);
+        return -1;
+}
+#endif /* HAVE_SPLICE */
+
 static void relay_connection (struct conn_s *connptr)
 {
-        fd_set rset, wset;
-        struct timeval tv;
+        struct poller *poller;
+        unsigned int cev, sev;
         time_t last_access;
         int ret;
         double tdiff;
-        int maxfd = max (connptr->client_fd, connptr->server_fd) + 1;
         ssize_t bytes_received;
+        ssize_t from_server, from_client;
+
+#ifdef HAVE_SPLICE
+        /*
+         * Whatever was read along with the headers is written out while
+         * the sockets are still blocking, so the rest can be spliced.
+         * (After a complete request, the rest of the client's buffer is
+         * its next request, not something for this server.)
+         */
+        if (connptr->connect_method || connptr->content_length.server > 0) {
+                while (buffer_size (connptr->sbuffer) > 0) {
+                        if (write_buffer (connptr->client_fd,
+                                          connptr->sbuffer) < 0)
+                                break;
+                }
+                while (request_body_buffered (connptr)) {
+                        if (send_request_body (connptr) < 0)
+                                break;
+                }
+        }
+#endif
 
         ret = socket_nonblocking (connptr->client_fd);
         if (ret != 0) {
                 log_message(LOG_ERR, "Failed to set the client socket "
                             "to non-blocking: %s", strerror(errno));
-                return;
+                goto fail;
         }
 
         ret = socket_nonblocking (connptr->server_fd);
         if (ret != 0) {
                 log_message(LOG_ERR, "Failed to set the server socket "
                             "to non-blocking: %s", strerror(errno));
-                return;
+                goto fail;
         }
 
-        last_access = time (NULL);
+#ifdef HAVE_SPLICE
+        if ((connptr->connect_method || connptr->content_length.server > 0)
+            && buffer_size (connptr->sbuffer) == 0
+            && !request_body_buffered (connptr)
+            && (!connptr->request_framed
+                || connptr->content_length.client <= 0)
+            && relay_connection_spliced (connptr) == 0)
+                goto done;
+#endif
 
-        for (;;) {
-                FD_ZERO (&rset);
-                FD_ZERO (&wset);
+        poller = poller_create (2);
+        if (!poller)
+                goto fail;
 
-                tv.tv_sec =
-                    config.idletimeout - difftime (time (NULL), last_access);
-                tv.tv_usec = 0;
+        last_access = time (NULL);
 
+        /*
+         * The whole body may already have arrived with the headers.  A
+         * client which has sent all of its request has nothing more for
+         * this server, so it is only written to.
+         */
+        while (connptr->content_length.server != 0) {
+                cev = sev = 0;
                 if (buffer_size (connptr->sbuffer) > 0)
-                        FD_SET (connptr->client_fd, &wset);
-                if (buffer_size (connptr->cbuffer) > 0)
-                        FD_SET (connptr->server_fd, &wset);
-                if (buffer_size (connptr->sbuffer) < MAXBUFFSIZE)
-                        FD_SET (connptr->server_fd, &rset);
-                if (buffer_size (connptr->cbuffer) < MAXBUFFSIZE)
-                        FD_SET (connptr->client_fd, &rset);
+                        cev |= POLLER_WRITE;
+                if (buffer_size (connptr->sbuffer) < SERVER_READ_ROOM)
+                        sev |= POLLER_READ;
+                if (request_body_buffered (connptr))
+                        sev |= POLLER_WRITE;
+                if (request_body_wanted (connptr))
+                        cev |= POLLER_READ;
 
-                ret = select (maxfd, &rset, &wset, NULL, &tv);
+                ret = relay_wait (poller, connptr, &cev, &sev, last_access);
 
                 if (ret == 0) {
                         tdiff = difftime (time (NULL), last_access);
                         if (tdiff > config.idletimeout) {
                                 log_message (LOG_INFO,
-                                             "Idle Timeout (after select) as %g > %u.",
+                                             "Idle Timeout (after poll) as %g > %u.",
                                              tdiff, config.idletimeout);
-                                return;
+                                poller_delete (poller);
+                                goto done;
                         } else {
                                 continue;
                         }
                 } else if (ret < 0) {
+                        if (errno == EINTR)
+                                continue;
                         log_message (LOG_ERR,
-                                     "relay_connection: select() error \"%s\". "
+                                     "relay_connection: poll error \"%s\". "
                                      "Closing connection (client_fd:%d, server_fd:%d)",
                                      strerror (errno), connptr->client_fd,
                                      connptr->server_fd);
-                        return;
+                        poller_delete (poller);
+                        goto done;
                 } else {
                         /*
                          * All right, something was actually selected so mark it.
@@ -1218,30 +1792,45 @@ static void relay_connection (struct conn_s *connptr)
                         last_access = time (NULL);
                 }
 
-                if (FD_ISSET (connptr->server_fd, &rset)) {
-                        bytes_received =
-                            read_buffer (connptr->server_fd, connptr->sbuffer);
+                from_server = from_client = 0;
+
+                if (sev & POLLER_READ) {
+                        bytes_received = read_server_body (connptr);
                         if (bytes_received < 0)
                                 break;
 
-                        connptr->content_length.server -= bytes_received;
+                        from_server = bytes_received;
+                        child_scoreboard_bytes (bytes_received);
                         if (connptr->content_length.server == 0)
                                 break;
                 }
-                if (FD_ISSET (connptr->client_fd, &rset)
-                    && read_buffer (connptr->client_fd, connptr->cbuffer) < 0) {
-                        break;
+                if (cev & POLLER_READ) {
+                        bytes_received = read_request_body (connptr);
+                        if (bytes_received < 0)
+                                break;
+
+                        from_client = bytes_received;
+                        child_scoreboard_bytes (bytes_received);
                 }
-                if (FD_ISSET (connptr->server_fd, &wset)
-                    && write_buffer (connptr->server_fd, connptr->cbuffer) < 0) {
+
+                /*
+                 * What has just been read is written out straight away
+                 * rather than a poll round later, since the other
+                 * side is usually ready for it.  write_buffer() sends all
+                 * that is buffered in one go.
+                 */
+                if (((sev & POLLER_WRITE) || from_client > 0)
+                    && send_request_body (connptr) < 0) {
                         break;
                 }
-                if (FD_ISSET (connptr->client_fd, &wset)
+                if (((cev & POLLER_WRITE) || from_server > 0)
                     && write_buffer (connptr->client_fd, connptr->sbuffer) < 0) {
                         break;
                 }
         }
 
+        poller_delete (poller);
+
         /*
          * Here the server has closed the connection... write the
          * remainder to the client and then exit.
@@ -1251,255 +1840,785 @@ static void relay_connection (struct conn_s *connptr)
                 log_message(LOG_ERR,
                             "Failed to set client socket to blocking: %s",
                             strerror(errno));
+                goto fail;
+        }
+
+        while (buffer_size (connptr->sbuffer) > 0) {
+                if (write_buffer (connptr->client_fd, connptr->sbuffer) < 0)
+                        break;
+        }
+
+        /* The rest of an unfinished request body would come next */
+        if (buffer_size (connptr->sbuffer) > 0
+            || connptr->content_length.client > 0)
+                connptr->keep_alive = FALSE;
+        if (!connptr->keep_alive)
+                shutdown (connptr->client_fd, SHUT_WR);
+        if (!request_body_buffered (connptr))
+                goto done;
+
+        /*
+         * Try to send any remaining data to the server if we can.
+         */
+        ret = socket_blocking (connptr->server_fd);
+        if (ret != 0) {
+                log_message(LOG_ERR,
+                            "Failed to set server socket to blocking: %s",
+                            strerror(errno));
+                return;
+        }
+
+        while (request_body_buffered (connptr)) {
+                if (send_request_body (connptr) < 0)
+                        break;
+        }
+
+        return;
+
+fail:
+        connptr->keep_alive = FALSE;
+        connptr->server_keep_alive = FALSE;
+        return;
+
+done:
+        /*
+         * The connections are only kept if the whole response has made
+         * it, and the sockets are blocking again for the next request.
+         */
+        if (connptr->content_length.server != 0
+            || socket_blocking (connptr->client_fd) != 0)
+                connptr->keep_alive = FALSE;
+        if (connptr->content_length.server != 0
+            || socket_blocking (connptr->server_fd) != 0)
+                connptr->server_keep_alive = FALSE;
+}
+
+/*
+ * The negotiation with a SOCKS upstream proxy goes one message at a time:
+ * socks_start() queues the first one in connptr->server_out, and
+ * socks_step() takes each reply from connptr->sbuffer once all of it has
+ * arrived, and queues the next message.  The proxy sends nothing else
+ * until the request has gone through it, so the buffer is empty again
+ * once it has connected.
+ */
+
+/*
+ * Send a SOCKS message, or as much of it as the socket takes.
+ */
+static int socks_send (struct conn_s *connptr, const void *msg, size_t len)
+{
+        if (ostream_write (&connptr->server_out, msg, len) < 0)
+                return -1;
+
+        return ostream_flush (&connptr->server_out, FALSE);
+}
+
+/*
+ * Ask a SOCKS 5 proxy to connect to the server.
+ */
+static int socks5_connect (struct conn_s *connptr, struct request_s *request)
+{
+        unsigned char buff[7 + 255];
+        unsigned short port;
+        size_t len;
+
+        len = strlen (request->host);
+        if (len > 255)
+                return -1;
+
+        buff[0] = 5;            /* socks version */
+        buff[1] = 1;            /* connect */
+        buff[2] = 0;            /* reserved */
+        buff[3] = 3;            /* domainname */
+        buff[4] = len;          /* length of domainname */
+        memcpy (&buff[5], request->host, len);
+        port = htons (request->port);
+        memcpy (&buff[5 + len], &port, 2);      /* dest port */
+
+        connptr->socks_state = SOCKS5_REPLY;
+        return socks_send (connptr, buff, 7 + len);
+}
+
+/*
+ * Log in to a SOCKS 5 proxy with the user name and password.
+ */
+static int socks5_login (struct conn_s *connptr)
+{
+        struct upstream *cur_upstream = connptr->upstream_proxy;
+        unsigned char buff[3 + 255 + 255], *cur = buff;
+        size_t len;
+
+        *cur++ = 1;             /* version */
+        len = cur_upstream->ua.user ? strlen (cur_upstream->ua.user) : 0;
+        len &= 0xFF;
+        *cur++ = len;
+        if (len)
+                memcpy (cur, cur_upstream->ua.user, len);
+        cur += len;
+        len = cur_upstream->pass ? strlen (cur_upstream->pass) : 0;
+        len &= 0xFF;
+        *cur++ = len;
+        if (len)
+                memcpy (cur, cur_upstream->pass, len);
+        cur += len;
+
+        connptr->socks_state = SOCKS5_AUTH;
+        return socks_send (connptr, buff, cur - buff);
+}
+
+/*
+ * Is there a negotiation to be had with a SOCKS proxy?  Not if the
+ * upstream proxy is not a SOCKS one, or the connection has been taken from
+ * the pool, and is through already.
+ */
+static int socks_needed (struct conn_s *connptr)
+{
+        struct upstream *cur_upstream = connptr->upstream_proxy;
+
+        return cur_upstream && cur_upstream->type != PT_HTTP
+            && !connptr->server_reused && connptr->socks_state != SOCKS_DONE;
+}
+
+/*
+ * A SOCKS 4 proxy only takes the address of the server, which has to be
+ * looked up first.  Returns the name to look up, or NULL if there is none.
+ */
+const char *socks_lookup_host (struct conn_s *connptr,
+                               struct request_s *request)
+{
+        if (!socks_needed (connptr)
+            || connptr->upstream_proxy->type != PT_SOCKS4)
+                return NULL;
+
+        return request->host;
+}
+
+/*
+ * Start the negotiation with the SOCKS proxy on connptr->server_fd, if
+ * there is one to be had.  For a SOCKS 4 proxy, answer holds the
+ * addresses of the server (see socks_lookup_host.)
+ *
+ * Returns 0 if the negotiation has started, 1 if there is none, or -1 on
+ * an error.
+ */
+int socks_start (struct conn_s *connptr, struct request_s *request,
+                 const struct dns_answer *answer)
+{
+        unsigned char buff[9];
+        unsigned short port;
+        unsigned int i;
+        int n_methods;
+        struct upstream *cur_upstream = connptr->upstream_proxy;
+
+        if (!socks_needed (connptr))
+                return 1;
+
+        log_message (LOG_CONN,
+                     "Established connection to %s proxy \"%s\" using "
+                     "file descriptor %d.", proxy_type_name (cur_upstream->type),
+                     cur_upstream->host, connptr->server_fd);
+
+        connptr->server_out.fd = connptr->server_fd;
+
+        if (cur_upstream->type == PT_SOCKS4) {
+                buff[0] = 4;    /* socks version */
+                buff[1] = 1;    /* connect command */
+                port = htons (request->port);
+                memcpy (&buff[2], &port, 2);    /* dest port */
+
+                /* SOCKS4 only takes an IPv4 address */
+                for (i = 0; i < answer->naddrs; i++)
+                        if (answer->addrs[i].family == AF_INET)
+                                break;
+                if (i == answer->naddrs) {
+                        log_message (LOG_ERR, "%s has no IPv4 address for "
+                                     "the SOCKS 4 proxy", request->host);
+                        return -1;
+                }
+                memcpy (&buff[4], &answer->addrs[i].u.v4, 4);   /* dest ip */
+                buff[8] = 0;    /* user */
+
+                connptr->socks_state = SOCKS4_REPLY;
+                return socks_send (connptr, buff, 9);
+        }
+
+        if (cur_upstream->type == PT_SOCKS5) {
+                /* Offer to log in if there is a user name to log in with */
+                n_methods = cur_upstream->ua.user
+                    && *cur_upstream->ua.user ? 2 : 1;
+                buff[0] = 5;    /* socks version */
+                buff[1] = n_methods;    /* number of methods */
+                buff[2] = 0;    /* no auth method */
+                buff[3] = 2;    /* auth method -> username / password */
+
+                connptr->socks_state = SOCKS5_METHOD;
+                return socks_send (connptr, buff, 2 + n_methods);
+        }
+
+        return -1;
+}
+
+/*
+ * Take the proxy's reply from connptr->sbuffer, if all of it is there,
+ * and go on to the next step.
+ *
+ * Returns 1 once the proxy has connected to the server, 0 if more is
+ * to come from it, or -1 if it has refused.
+ */
+int socks_step (struct conn_s *connptr, struct request_s *request)
+{
+        unsigned char buff[4 + 1 + 255 + 2];
+        size_t need;
+
+        for (;;) {
+                switch (connptr->socks_state) {
+                case SOCKS4_REPLY:
+                        need = 8;
+                        break;
+
+                case SOCKS5_METHOD:
+                case SOCKS5_AUTH:
+                        need = 2;
+                        break;
+
+                /* The reply ends with the address the proxy connected from */
+                case SOCKS5_REPLY:
+                        need = 5;
+                        if (copy_from_buffer (connptr->sbuffer, 0, buff,
+                                              5) < 5)
+                                break;
+                        if (buff[0] != 5 || buff[1] != 0)
+                                return -1;
+                        switch (buff[3]) {
+                        case 1: need = 4 + 4 + 2; break;        /* ip v4 */
+                        case 4: need = 4 + 16 + 2; break;       /* ip v6 */
+                        case 3: need = 4 + 1 + buff[4] + 2; break;
+                        default: return -1;
+                        }
+                        break;
+
+                case SOCKS_DONE:
+                        return 1;
+
+                default:
+                        return -1;
+                }
+
+                if (buffer_size (connptr->sbuffer) < need)
+                        return 0;
+                remove_from_buffer (connptr->sbuffer, buff, need);
+
+                switch (connptr->socks_state) {
+                case SOCKS4_REPLY:
+                        if (buff[0] != 0 || buff[1] != 90)
+                                return -1;
+                        connptr->socks_state = SOCKS_DONE;
+                        break;
+
+                case SOCKS5_METHOD:
+                        if (buff[0] != 5 || (buff[1] != 0 && buff[1] != 2))
+                                return -1;
+                        if (buff[1] == 2 && socks5_login (connptr) < 0)
+                                return -1;
+                        if (buff[1] == 0
+                            && socks5_connect (connptr, request) < 0)
+                                return -1;
+                        break;
+
+                case SOCKS5_AUTH:
+                        if (buff[1] != 0 || !(buff[0] == 5 || buff[0] == 1))
+                                return -1;
+                        if (socks5_connect (connptr, request) < 0)
+                                return -1;
+                        break;
+
+                case SOCKS5_REPLY:
+                        connptr->socks_state = SOCKS_DONE;
+                        break;
+
+                default:
+                        return -1;
+                }
+        }
+}
+
+/*
+ * Negotiate with the SOCKS proxy on connptr->server_fd, a blocking socket,
+ * until it has connected to the server.
+ */
+static int
+connect_to_upstream_proxy (struct conn_s *connptr, struct request_s *request)
+{
+        struct dns_answer answer;
+        const char *host;
+        int ret;
+
+        host = socks_lookup_host (connptr, request);
+        if (host && dns_cache_resolve (host, &answer) < 0) {
+                log_message (LOG_ERR, "Could not look up %s for the SOCKS "
+                             "4 proxy", host);
+                return -1;
+        }
+
+        ret = socks_start (connptr, request, &answer);
+        while (ret == 0) {
+                if (read_buffer (connptr->server_fd, connptr->sbuffer) < 0)
+                        return -1;
+                ret = socks_step (connptr, request);
+        }
+
+        return ret < 0 ? -1 : 0;
+}
+
+
+#ifdef UPSTREAM_SUPPORT
+/*
+ * Talk to the upstream proxy once the connection to it has been made:
+ * negotiate with a SOCKS proxy (unless a pooled connection has been done
+ * so already), or send the request line to a HTTP proxy.
+ */
+static int
+upstream_connected (struct conn_s *connptr, struct request_s *request)
+{
+        char *combined_string;
+        int len;
+
+        struct upstream *cur_upstream = connptr->upstream_proxy;
+
+        if (cur_upstream->type != PT_HTTP) {
+                if (connect_to_upstream_proxy (connptr, request) < 0)
+                        return -1;
+                if (connptr->connect_method)
+                        return 0;
+                return establish_http_connection (connptr, request);
+        }
+
+        log_message (LOG_CONN,
+                     "Established connection to upstream proxy \"%s\" "
+                     "using file descriptor %d.",
+                     cur_upstream->host, connptr->server_fd);
+
+        /*
+         * We need to re-write the "path" part of the request so that we
+         * can reuse the establish_http_connection() function. It expects a
+         * method and path.
+         */
+        if (connptr->connect_method) {
+                len = strlen (request->host) + 7;
+
+                combined_string = (char *) safemalloc (len);
+                if (!combined_string) {
+                        return -1;
+                }
+
+                snprintf (combined_string, len, "%s:%d", request->host,
+                          request->port);
+        } else {
+                len = strlen (request->host) + strlen (request->path) + 14;
+                combined_string = (char *) safemalloc (len);
+                if (!combined_string) {
+                        return -1;
+                }
+
+                snprintf (combined_string, len, "http://%s:%d%s", request->host,
+                          request->port, request->path);
+        }
+
+        if (request->path)
+                safefree (request->path);
+        request->path = combined_string;
+
+        return establish_http_connection (connptr, request);
+}
+#endif
+
+/*
+ * Fill in the error page for a connection to the remote server (or the
+ * upstream proxy) which could not be established.
+ */
+void indicate_connect_error (struct conn_s *connptr, int error)
+{
+        if (connptr->upstream_proxy != NULL) {
+                log_message (LOG_WARNING,
+                             "Could not connect to upstream proxy.");
+                indicate_http_error (connptr, 404,
+                                     "Unable to connect to upstream proxy",
+                                     "detail",
+                                     "A network error occurred while trying to "
+                                     "connect to the upstream web proxy.",
+                                     NULL);
+        } else {
+                indicate_http_error (connptr, 500, "Unable to connect",
+                                     "detail",
+                                     PACKAGE_NAME " "
+                                     "was unable to connect to the remote web server.",
+                                     "error", strerror (error), NULL);
+        }
+}
+
+/*
+ * The upstream proxy could not be connected to: move on to the next one
+ * which the rules pick for the host, if there is one.  Any name for the
+ * server pool belonged to the old one.
+ *
+ * Returns TRUE if there is another upstream proxy to try.
+ */
+int next_upstream_proxy (struct conn_s *connptr, struct request_s *request)
+{
+#ifdef UPSTREAM_SUPPORT
+        struct upstream *up;
+
+        if (connptr->upstream_proxy == NULL)
+                return FALSE;
+
+        up = upstream_get (request->host, connptr->upstream_proxy->next);
+        if (up == NULL)
+                return FALSE;
+
+        log_message (LOG_WARNING,
+                     "Could not connect to upstream proxy %s:%d, "
+                     "trying %s:%d instead",
+                     connptr->upstream_proxy->host,
+                     connptr->upstream_proxy->port, up->host, up->port);
+
+        connptr->upstream_proxy = up;
+        safefree (connptr->server_key);
+        return TRUE;
+#else
+        return FALSE;
+#endif
+}
+
+/*
+ * Return the host and port the server side of the connection has to be
+ * opened to: either the upstream proxy, or the requested host itself.
+ */
+void
+get_server_address (struct conn_s *connptr, struct request_s *request,
+                    const char **host, int *port)
+{
+#ifdef UPSTREAM_SUPPORT
+        if (connptr->upstream_proxy != NULL) {
+                *host = connptr->upstream_proxy->host;
+                *port = connptr->upstream_proxy->port;
                 return;
         }
+#endif
+        *host = request->host;
+        *port = request->port;
+}
+
+/*
+ * Called once the connection to the server (or upstream proxy) in
+ * connptr->server_fd has been made.  Sends the request line to the
+ * server, or performs the upstream proxy negotiation.
+ */
+int server_connected (struct conn_s *connptr, struct request_s *request)
+{
+#ifdef UPSTREAM_SUPPORT
+        if (connptr->upstream_proxy != NULL)
+                return upstream_connected (connptr, request);
+#endif
+
+        log_message (LOG_CONN,
+                     "Established connection to host \"%s\" using "
+                     "file descriptor %d.", request->host,
+                     connptr->server_fd);
+
+        if (!connptr->connect_method)
+                return establish_http_connection (connptr, request);
+
+        return 0;
+}
+
+/*
+ * Name the server for the pool (see server-pool.c), and take an idle
+ * connection to it from there if there is one.  The name covers all the
+ * connection depends on: the address it goes to, the server behind a
+ * SOCKS proxy, and the local address.  Only complete requests (not
+ * CONNECT) are sent over connections which are kept.
+ *
+ * Returns TRUE if connptr->server_fd now holds a pooled connection.
+ */
+int take_pooled_server (struct conn_s *connptr, struct request_s *request)
+{
+        const char *host, *bind_to, *from;
+        int port;
+        size_t len;
+
+        if (config.server_pool_size == 0 || !connptr->request_framed)
+                return FALSE;
+
+        get_server_address (connptr, request, &host, &port);
+
+        bind_to = connptr->server_ip_addr ? connptr->server_ip_addr
+                                          : config.bind_address;
+        from = bind_to ? " from " : "";
+        if (!bind_to)
+                bind_to = "";
+
+        len = strlen (host) + strlen (request->host) + strlen (bind_to) + 40;
+        connptr->server_key = (char *) safemalloc (len);
+        if (!connptr->server_key)
+                return FALSE;
+
+#ifdef UPSTREAM_SUPPORT
+        if (connptr->upstream_proxy != NULL
+            && connptr->upstream_proxy->type != PT_HTTP)
+                snprintf (connptr->server_key, len, "%s:%d via %s:%d%s%s",
+                          request->host, request->port, host, port,
+                          from, bind_to);
+        else if (connptr->upstream_proxy != NULL)
+                snprintf (connptr->server_key, len, "proxy %s:%d%s%s",
+                          host, port, from, bind_to);
+        else
+#endif
+                snprintf (connptr->server_key, len, "%s:%d%s%s",
+                          host, port, from, bind_to);
+
+        connptr->server_fd = server_pool_get (connptr->server_key);
+        if (connptr->server_fd < 0)
+                return FALSE;
+
+        if (socket_blocking (connptr->server_fd) != 0) {
+                close (connptr->server_fd);
+                connptr->server_fd = -1;
+                return FALSE;
+        }
+
+        log_message (LOG_CONN, "Reusing server connection (fd:%d) to %s",
+                     connptr->server_fd, connptr->server_key);
+        connptr->server_reused = TRUE;
+        return TRUE;
+}
+
+/*
+ * Open the (blocking) connection to the remote server or upstream proxy,
+ * unless there is an idle one in the pool.  If an upstream proxy cannot
+ * be reached, the next one for the host is tried.
+ */
+static int connect_to_server (struct conn_s *connptr, struct request_s *request)
+{
+        const char *host;
+        int port, error;
+
+        for (;;) {
+                if (take_pooled_server (connptr, request))
+                        return server_connected (connptr, request);
+
+                get_server_address (connptr, request, &host, &port);
+
+                connptr->server_fd = opensock (host, port,
+                                               connptr->server_ip_addr);
+                if (connptr->server_fd >= 0)
+                        return server_connected (connptr, request);
+
+                error = errno;
+                if (!next_upstream_proxy (connptr, request))
+                        break;
+        }
+
+        indicate_connect_error (connptr, error);
+        return -1;
+}
+
+/*
+ * Send the request body to the server until all of it has gone, or until
+ * the server starts to answer.  A server usually reads the whole body
+ * first, but it may answer early: with a 100 (Continue) response, to a
+ * client which waits for one before it sends the body, or with an error,
+ * so that the rest of the body need not be sent at all.
+ *
+ * Returns 0, or -1 if either side went away or the client stopped
+ * sending for longer than the idle timeout.
+ */
+static int relay_request_body (struct conn_s *connptr)
+{
+        struct poller *poller;
+        unsigned int cev, sev;
+        time_t last_access;
+        ssize_t len;
+        int ret = -1;
+
+        if (socket_nonblocking (connptr->client_fd) != 0
+            || socket_nonblocking (connptr->server_fd) != 0) {
+                log_message (LOG_ERR, "Failed to set the sockets to "
+                             "non-blocking: %s", strerror (errno));
+                goto out;
+        }
+
+        poller = poller_create (2);
+        if (!poller)
+                goto out;
+
+        last_access = time (NULL);
+
+        while (request_body_wanted (connptr)
+               || request_body_buffered (connptr)) {
+                cev = request_body_wanted (connptr) ? POLLER_READ : 0;
+                sev = POLLER_READ;
+                if (request_body_buffered (connptr))
+                        sev |= POLLER_WRITE;
+
+                len = relay_wait (poller, connptr, &cev, &sev, last_access);
+                if (len < 0 && errno == EINTR)
+                        continue;
+                if (len < 0)
+                        goto done;
+                if (len == 0) {
+                        if (difftime (time (NULL), last_access)
+                            <= config.idletimeout)
+                                continue;
+                        log_message (LOG_INFO, "Idle Timeout while relaying "
+                                     "the request body (client_fd:%d)",
+                                     connptr->client_fd);
+                        goto done;
+                }
+                last_access = time (NULL);
 
-        while (buffer_size (connptr->sbuffer) > 0) {
-                if (write_buffer (connptr->client_fd, connptr->sbuffer) < 0)
+                /* The response is on its way */
+                if (sev & POLLER_READ)
                         break;
-        }
-        shutdown (connptr->client_fd, SHUT_WR);
 
-        /*
-         * Try to send any remaining data to the server if we can.
-         */
-        ret = socket_blocking (connptr->server_fd);
-        if (ret != 0) {
-                log_message(LOG_ERR,
-                            "Failed to set server socket to blocking: %s",
-                            strerror(errno));
-                return;
+                if (cev & POLLER_READ) {
+                        len = read_request_body (connptr);
+                        if (len < 0)
+                                goto done;
+                        child_scoreboard_bytes (len);
+                }
+                if (request_body_buffered (connptr)
+                    && send_request_body (connptr) < 0)
+                        goto done;
         }
+        ret = 0;
 
-        while (buffer_size (connptr->cbuffer) > 0) {
-                if (write_buffer (connptr->server_fd, connptr->cbuffer) < 0)
-                        break;
-        }
+done:
+        poller_delete (poller);
 
-        return;
+out:
+        if (socket_blocking (connptr->client_fd) != 0
+            || socket_blocking (connptr->server_fd) != 0)
+                ret = -1;
+        return ret;
 }
 
-static int
-connect_to_upstream_proxy(struct conn_s *connptr, struct request_s *request)
+/*
+ * Read the response headers from the server and pass them on, along with
+ * any interim responses, while the request body is sent.
+ */
+static int read_response (struct conn_s *connptr)
 {
-	unsigned len;
-	unsigned char buff[512]; /* won't use more than 7 + 255 */
-	unsigned short port;
-	size_t ulen, passlen;
-
-	struct hostent *host;
-	struct upstream *cur_upstream = connptr->upstream_proxy;
-
-	ulen = cur_upstream->ua.user ? strlen(cur_upstream->ua.user) : 0;
-	passlen = cur_upstream->pass ? strlen(cur_upstream->pass) : 0;
-
-
-	log_message(LOG_CONN,
-		    "Established connection to %s proxy \"%s\" using file descriptor %d.",
-		    proxy_type_name(cur_upstream->type), cur_upstream->host, connptr->server_fd);
-
-	if (cur_upstream->type == PT_SOCKS4) {
-
-		buff[0] = 4; /* socks version */
-		buff[1] = 1; /* connect command */
-		port = htons(request->port);
-		memcpy(&buff[2], &port, 2); /* dest port */
-		host = gethostbyname(request->host);
-		memcpy(&buff[4], host->h_addr_list[0], 4); /* dest ip */
-		buff[8] = 0; /* user */
-		if (9 != safe_write(connptr->server_fd, buff, 9))
-			return -1;
-		if (8 != safe_read(connptr->server_fd, buff, 8))
-			return -1;
-		if (buff[0]!=0 || buff[1]!=90)
-			return -1;
-
-	} else if (cur_upstream->type == PT_SOCKS5) {
-
-		/* init */
-		int n_methods = ulen ? 2 : 1;
-		buff[0] = 5; /* socks version */
-		buff[1] = n_methods; /* number of methods  */
-		buff[2] = 0; /* no auth method */
-		if (ulen) buff[3] = 2;  /* auth method -> username / password */
-		if (2+n_methods != safe_write(connptr->server_fd, buff, 2+n_methods))
-			return -1;
-		if (2 != safe_read(connptr->server_fd, buff, 2))
-			return -1;
-		if (buff[0] != 5 || (buff[1] != 0 && buff[1] != 2))
-			return -1;
-
-		if (buff[1] == 2) {
-			/* authentication */
-			char in[2];
-			char out[515];
-			char *cur = out;
-			size_t c;
-			*cur++ = 1;	/* version */
-			c = ulen & 0xFF;
-			*cur++ = c;
-			memcpy(cur, cur_upstream->ua.user, c);
-			cur += c;
-			c = passlen & 0xFF;
-			*cur++ = c;
-			memcpy(cur, cur_upstream->pass, c);
-			cur += c;
-
-			if((cur - out) != safe_write(connptr->server_fd, out, cur - out))
-				return -1;
-
-			if(2 != safe_read(connptr->server_fd, in, 2))
-				return -1;
-			if(in[1] != 0 || !(in[0] == 5 || in[0] == 1)) {
-				return -1;
-			}
-		}
-		/* connect */
-		buff[0] = 5; /* socks version */
-		buff[1] = 1; /* connect */
-		buff[2] = 0; /* reserved */
-		buff[3] = 3; /* domainname */
-		len=strlen(request->host);
-		if(len>255)
-			return -1;
-		buff[4] = len; /* length of domainname */
-		memcpy(&buff[5], request->host, len); /* dest ip */
-		port = htons(request->port);
-		memcpy(&buff[5+len], &port, 2); /* dest port */
-		if (7+len != safe_write(connptr->server_fd, buff, 7+len))
-			return -1;
-		if (4 != safe_read(connptr->server_fd, buff, 4))
-			return -1;
-		if (buff[0]!=5 || buff[1]!=0)
-			return -1;
-		switch(buff[3]) {
-			case 1: len=4; break; /* ip v4 */
-			case 4: len=16; break; /* ip v6 */
-			case 3: /* domainname */
-				if (1 != safe_read(connptr->server_fd, buff, 1))
-					return -1;
-				len = buff[0]; /* max = 255 */
-				break;
-			default: return -1;
-		}
-		if (2+len != safe_read(connptr->server_fd, buff, 2+len))
-			return -1;
-	} else {
-		return -1;
-	}
-
-	if (connptr->connect_method)
-		return 0;
-
-	return establish_http_connection(connptr, request);
-}
+        int ret;
 
+        do {
+                if (!connptr->connect_method
+                    && (request_body_wanted (connptr)
+                        || request_body_buffered (connptr))
+                    && relay_request_body (connptr) < 0)
+                        return -1;
+
+                ret = process_server_headers (connptr);
+        } while (ret == 1);
+
+        return ret;
+}
 
 /*
- * Establish a connection to the upstream proxy server.
+ * A pooled connection may have been closed by the server just as the
+ * request went out.  The request may be sent once more over a new
+ * connection if nothing at all has come back, there was no request body
+ * which would have to be sent again, and the method is idempotent (RFC
+ * 9110, section 9.2.2), so that it does no harm if the server did act on
+ * the first one after all.
  */
-static int
-connect_to_upstream (struct conn_s *connptr, struct request_s *request)
+int request_resendable (struct conn_s *connptr, struct request_s *request)
 {
-#ifndef UPSTREAM_SUPPORT
-        /*
-         * This function does nothing if upstream support was not compiled
-         * into tinyproxy.
-         */
-        return -1;
-#else
-        char *combined_string;
-        int len;
+        static const char *const methods[] = {
+                "GET", "HEAD", "OPTIONS", "TRACE", "PUT", "DELETE"
+        };
+        unsigned int i;
 
-        struct upstream *cur_upstream = connptr->upstream_proxy;
+        if (!connptr->server_reused || connptr->request_body
+            || buffer_size (connptr->sbuffer) > 0 || connptr->error_variables)
+                return FALSE;
 
-        if (!cur_upstream) {
-                log_message (LOG_WARNING,
-                             "No upstream proxy defined for %s.",
-                             request->host);
-                indicate_http_error (connptr, 404,
-                                     "Unable to connect to upstream proxy.");
-                return -1;
-        }
+        for (i = 0; i != sizeof (methods) / sizeof (methods[0]); i++)
+                if (strcmp (request->method, methods[i]) == 0)
+                        return TRUE;
 
-        connptr->server_fd =
-            opensock (cur_upstream->host, cur_upstream->port,
-                      connptr->server_ip_addr);
+        return FALSE;
+}
 
-        if (connptr->server_fd < 0) {
-                log_message (LOG_WARNING,
-                             "Could not connect to upstream proxy.");
-                indicate_http_error (connptr, 404,
-                                     "Unable to connect to upstream proxy",
-                                     "detail",
-                                     "A network error occurred while trying to "
-                                     "connect to the upstream web proxy.",
-                                     NULL);
-                return -1;
-        }
+/*
+ * Send the request once more over a new connection, if it may be (see
+ * request_resendable.)
+ *
+ * Returns 0 if the request has been sent again.
+ */
+static int resend_request (struct conn_s *connptr, struct request_s *request)
+{
+        const char *host;
+        int port;
 
-	if (cur_upstream->type != PT_HTTP)
-		return connect_to_upstream_proxy(connptr, request);
+        if (!request_resendable (connptr, request))
+                return -1;
 
-        log_message (LOG_CONN,
-                     "Established connection to upstream proxy \"%s\" "
-                     "using file descriptor %d.",
-                     cur_upstream->host, connptr->server_fd);
+        log_message (LOG_INFO, "Server connection (fd:%d) to %s was "
+                     "closed, sending the request again",
+                     connptr->server_fd, connptr->server_key);
 
-        /*
-         * We need to re-write the "path" part of the request so that we
-         * can reuse the establish_http_connection() function. It expects a
-         * method and path.
-         */
-        if (connptr->connect_method) {
-                len = strlen (request->host) + 7;
+        close (connptr->server_fd);
+        connptr->server_reused = FALSE;
+        ostream_free (&connptr->server_out);
+        ostream_init (&connptr->server_out, -1);
 
-                combined_string = (char *) safemalloc (len);
-                if (!combined_string) {
-                        return -1;
-                }
+        get_server_address (connptr, request, &host, &port);
 
-                snprintf (combined_string, len, "%s:%d", request->host,
-                          request->port);
-        } else {
-                len = strlen (request->host) + strlen (request->path) + 14;
-                combined_string = (char *) safemalloc (len);
-                if (!combined_string) {
-                        return -1;
-                }
+        connptr->server_fd = opensock (host, port, connptr->server_ip_addr);
+        if (connptr->server_fd < 0) {
+                indicate_connect_error (connptr, errno);
+                return -1;
+        }
 
-                snprintf (combined_string, len, "http://%s:%d%s", request->host,
-                          request->port, request->path);
+#ifdef UPSTREAM_SUPPORT
+        if (connptr->upstream_proxy != NULL
+            && connptr->upstream_proxy->type != PT_HTTP
+            && connect_to_upstream_proxy (connptr, request) < 0) {
+                indicate_connect_error (connptr, ECONNREFUSED);
+                return -1;
         }
+#endif
 
-        if (request->path)
-                safefree (request->path);
-        request->path = combined_string;
+        if (iolist_send (&connptr->request_head, connptr->server_fd,
+                         FALSE) < 0)
+                return -1;
 
-        return establish_http_connection (connptr, request);
-#endif
+        return 0;
 }
 
 static int
 get_request_entity(struct conn_s *connptr)
 {
         int ret;
-        fd_set rset;
-        struct timeval tv;
+        struct poller *poller;
+        struct poller_event ev;
+
+        poller = poller_create (1);
+        if (!poller)
+                return -1;
 
-        FD_ZERO (&rset);
-        FD_SET (connptr->client_fd, &rset);
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
-        ret = select (connptr->client_fd + 1, &rset, NULL, NULL, &tv);
+        ret = poller_set (poller, connptr->client_fd, POLLER_READ);
+        if (ret == 0)
+                ret = poller_wait (poller, &ev, 1, 0);
+        poller_delete (poller);
 
         if (ret == -1) {
                 log_message (LOG_ERR,
-                             "Error calling select on client fd %d: %s",
+                             "Error calling poll on client fd %d: %s",
                              connptr->client_fd, strerror(errno));
         } else if (ret == 0) {
                log_message (LOG_INFO, "no entity");
-        } else if (ret == 1 && FD_ISSET (connptr->client_fd, &rset)) {
+        } else if (ret == 1 && (ev.events & POLLER_READ)) {
                 ssize_t nread;
                 nread = read_buffer (connptr->client_fd, connptr->cbuffer);
                 if (nread < 0) {
@@ -1514,7 +2633,7 @@ get_request_entity(struct conn_s *connptr)
                         ret = 0;
                 }
         } else {
-                log_message (LOG_ERR, "strange situation after select: "
+                log_message (LOG_ERR, "strange situation after poll: "
                              "ret = %d, but client_fd (%d) is not readable...",
                              ret, connptr->client_fd);
                 ret = -1;
@@ -1525,79 +2644,94 @@ get_request_entity(struct conn_s *connptr)
 
 
 /*
- * This is the main drive for each connection. As you can tell, for the
- * first few steps we are using a blocking socket. If you remember the
- * older tinyproxy code, this use to be a very confusing state machine.
- * Well, no more! :) The sockets are only switched into nonblocking mode
- * when we start the relay portion. This makes most of the original
- * tinyproxy code, which was confusing, redundant. Hail progress.
- * 	- rjkaes
+ * Set up the connection structure for a freshly accepted client and
+ * check it against the access list.  If the client is not allowed, the
+ * error is recorded in the connection (see connection_failed().)
+ *
+ * Returns NULL (with the socket closed) if no memory was available.
  */
-void handle_connection (int fd)
+struct conn_s *prepare_connection (int fd)
 {
-        ssize_t i;
         struct conn_s *connptr;
-        struct request_s *request = NULL;
-        hashmap_t hashofheaders = NULL;
 
         char sock_ipaddr[IP_LENGTH];
         char peer_ipaddr[IP_LENGTH];
-        char peer_string[HOSTNAME_LENGTH];
 
-        getpeer_information (fd, peer_ipaddr, peer_string);
+        getpeer_information (fd, peer_ipaddr);
 
         if (config.bindsame)
                 getsock_ip (fd, sock_ipaddr);
 
-        log_message (LOG_CONN, config.bindsame ?
-                     "Connect (file descriptor %d): %s [%s] at [%s]" :
-                     "Connect (file descriptor %d): %s [%s]",
-                     fd, peer_string, peer_ipaddr, sock_ipaddr);
-
-        connptr = initialize_conn (fd, peer_ipaddr, peer_string,
+        connptr = initialize_conn (fd, peer_ipaddr,
                                    config.bindsame ? sock_ipaddr : NULL);
         if (!connptr) {
                 close (fd);
-                return;
+                return NULL;
         }
 
-        if (check_acl (peer_ipaddr, peer_string, config.access_list) <= 0) {
+        log_message (LOG_CONN, config.bindsame ?
+                     "Connect (file descriptor %d): %s at [%s]" :
+                     "Connect (file descriptor %d): %s",
+                     fd, peer_ipaddr, sock_ipaddr);
+
+        if (check_acl (peer_ipaddr, config.access_list) <= 0) {
                 update_stats (STAT_DENIED);
                 indicate_http_error (connptr, 403, "Access denied",
                                      "detail",
                                      "The administrator of this proxy has not configured "
                                      "it to service requests from your host.",
                                      NULL);
-                goto fail;
         }
 
-        if (read_request_line (connptr) < 0) {
+        return connptr;
+}
+
+/*
+ * Read the request line and all the headers from the client.  The headers
+ * are returned in a newly created hashmap.
+ */
+int read_request (struct conn_s *connptr, hashmap_t *hashofheaders)
+{
+        const char *request_line;
+        ssize_t len;
+
+        len = read_header_block (connptr->client_fd, connptr->cbuffer);
+        if (len < 0 && buffer_size (connptr->cbuffer) == 0) {
+                log_message (LOG_ERR,
+                             "read_request: Client (file descriptor: %d) "
+                             "closed socket before read.", connptr->client_fd);
                 update_stats (STAT_BADCONN);
                 indicate_http_error (connptr, 408, "Timeout",
                                      "detail",
                                      "Server timeout waiting for the HTTP request "
                                      "from the client.", NULL);
-                goto fail;
+                return -1;
         }
 
         /*
          * The "hashofheaders" store the client's headers.
          */
-        hashofheaders = hashmap_create (HEADER_BUCKETS);
-        if (hashofheaders == NULL) {
+        *hashofheaders = hashmap_create (HEADER_ENTRIES);
+        if (*hashofheaders == NULL) {
                 update_stats (STAT_BADCONN);
                 indicate_http_error (connptr, 503, "Internal error",
                                      "detail",
                                      "An internal server error occurred while processing "
                                      "your request. Please contact the administrator.",
                                      NULL);
-                goto fail;
+                return -1;
         }
 
         /*
-         * Get all the headers from the client in a big hash.
+         * Parse the request line and all the headers from the client
+         * into a big hash.
          */
-        if (get_all_headers (connptr->client_fd, hashofheaders) < 0) {
+        request_line = len > 0 ? parse_header_block (connptr->cbuffer, len,
+                                                     *hashofheaders) : NULL;
+        if (request_line)
+                connptr->request_line = safestrdup (request_line);
+
+        if (!connptr->request_line) {
                 log_message (LOG_WARNING,
                              "Could not retrieve all the headers from the client");
                 indicate_http_error (connptr, 400, "Bad Request",
@@ -1605,9 +2739,35 @@ void handle_connection (int fd)
                                      "Could not retrieve all the headers from "
                                      "the client.", NULL);
                 update_stats (STAT_BADCONN);
-                goto fail;
+                return -1;
         }
 
+        log_message (LOG_CONN, "Request (file descriptor %d): %s",
+                     connptr->client_fd, connptr->request_line);
+        child_scoreboard_request (connptr->request_line);
+
+        /* The first request was counted along with the connection */
+        if (++connptr->requests > 1)
+                update_stats (STAT_REQUEST);
+
+        return 0;
+}
+
+/*
+ * Authenticate the client, add the configured headers and work out where
+ * the request has to be sent to (including the upstream proxy to use.)
+ *
+ * Returns NULL if the request can not be served; the reason is recorded
+ * in the connection.
+ */
+struct request_s *
+prepare_request (struct conn_s *connptr, hashmap_t hashofheaders)
+{
+        struct request_s *request;
+        void *data;
+        ssize_t i;
+        int coded;
+
         if (config.basicauth_list != NULL) {
                 ssize_t len;
                 char *authstring;
@@ -1621,7 +2781,7 @@ void handle_connection (int fd)
                                              "detail",
                                              "This proxy requires authentication.",
                                              NULL);
-                        goto fail;
+                        return NULL;
                 }
                 if ( /* currently only "basic" auth supported */
                         (strncmp(authstring, "Basic ", 6) == 0 ||
@@ -1635,7 +2795,7 @@ void handle_connection (int fd)
                                              "The administrator of this proxy has not configured "
                                              "it to service requests from you.",
                                              NULL);
-                        goto fail;
+                        return NULL;
                 }
                 hashmap_remove (hashofheaders, "proxy-authorization");
         }
@@ -1658,65 +2818,73 @@ void handle_connection (int fd)
                 if (!connptr->show_stats) {
                         update_stats (STAT_BADCONN);
                 }
-                goto fail;
+                return NULL;
         }
 
         connptr->upstream_proxy = UPSTREAM_HOST (request->host);
-        if (connptr->upstream_proxy != NULL) {
-                if (connect_to_upstream (connptr, request) < 0) {
-                        goto fail;
-                }
-        } else {
-                connptr->server_fd = opensock (request->host, request->port,
-                                               connptr->server_ip_addr);
-                if (connptr->server_fd < 0) {
-                        indicate_http_error (connptr, 500, "Unable to connect",
-                                             "detail",
-                                             PACKAGE_NAME " "
-                                             "was unable to connect to the remote web server.",
-                                             "error", strerror (errno), NULL);
-                        goto fail;
-                }
 
-                log_message (LOG_CONN,
-                             "Established connection to host \"%s\" using "
-                             "file descriptor %d.", request->host,
-                             connptr->server_fd);
+        connptr->head_method = (strcmp (request->method, "HEAD") == 0);
 
-                if (!connptr->connect_method)
-                        establish_http_connection (connptr, request);
+        /*
+         * The end of the request body is known from its Content-Length,
+         * or from its chunks when chunked is the last transfer coding.
+         * Otherwise, and if both are given, where the request ends can
+         * not be told, so it is refused and the connection closed.
+         */
+        connptr->content_length.client = get_content_length (hashofheaders);
+        coded = hashmap_entry_by_key (hashofheaders, "transfer-encoding",
+                                      &data) > 0;
+        if (connptr->content_length.client == CONTENT_LENGTH_INVALID
+            || (coded && (connptr->content_length.client >= 0
+                          || !chunked_last ((const char *) data)))) {
+                log_message (LOG_WARNING, "Invalid request length from %s",
+                             connptr->client_ip_addr);
+                indicate_http_error (connptr, 400, "Bad Request",
+                                     "detail",
+                                     "The length of the request could not "
+                                     "be determined.", NULL);
+                connptr->keep_alive = FALSE;
+                free_request_struct (request);
+                return NULL;
         }
 
-        if (process_client_headers (connptr, hashofheaders) < 0) {
-                update_stats (STAT_BADCONN);
-                goto fail;
-        }
+        /* Repeats of the same length are passed on as one */
+        if (connptr->content_length.client >= 0) {
+                char length[32];
 
-        if (!connptr->connect_method || UPSTREAM_IS_HTTP(connptr)) {
-                if (process_server_headers (connptr) < 0) {
-                        update_stats (STAT_BADCONN);
-                        goto fail;
-                }
-        } else {
-                if (send_ssl_response (connptr) < 0) {
-                        log_message (LOG_ERR,
-                                     "handle_connection: Could not send SSL greeting "
-                                     "to client.");
-                        update_stats (STAT_BADCONN);
-                        goto fail;
-                }
+                snprintf (length, sizeof (length), "%ld",
+                          connptr->content_length.client);
+                hashmap_remove (hashofheaders, "content-length");
+                hashmap_insert (hashofheaders, "Content-Length", length,
+                                strlen (length) + 1);
         }
 
-        relay_connection (connptr);
+        /*
+         * Neither connection can be kept unless the end of the request
+         * is known from its length, which it is not for a chunked
+         * request body.
+         */
+        connptr->request_framed = !connptr->connect_method && !coded;
+        connptr->keep_alive = connptr->request_framed
+            && client_keep_alive (connptr, hashofheaders);
 
-        log_message (LOG_INFO,
-                     "Closed connection between local client (fd:%d) "
-                     "and remote client (fd:%d)",
-                     connptr->client_fd, connptr->server_fd);
+        /*
+         * The client may wait for a 100 (Continue) response before it
+         * sends the body.  The server gives one, or its final answer.
+         */
+        connptr->expect_continue =
+            hashmap_entry_by_key (hashofheaders, "expect", &data) > 0
+            && header_has_token ((const char *) data, "100-continue");
 
-        goto done;
+        return request;
+}
 
-fail:
+/*
+ * Send the response for a connection which could not be served: either
+ * the error page recorded in the connection, or the statistics page.
+ */
+void connection_failed (struct conn_s *connptr)
+{
         /*
          * First, get the body if there is one.
          * If we don't read all there is from the socket first,
@@ -1738,6 +2906,134 @@ fail:
         } else if (connptr->show_stats) {
                 showstats (connptr);
         }
+}
+
+/*
+ * Wait for the next request on a persistent client connection, for at
+ * most KeepAliveTimeout seconds.  A pipelined request may already be in
+ * the buffer.
+ *
+ * Returns TRUE once some of the request has arrived, or FALSE if the
+ * client closed the connection or left it idle for too long.
+ */
+static int wait_for_request (struct conn_s *connptr)
+{
+        struct poller *poller;
+        struct poller_event ev;
+        int ret;
+
+        if (buffer_size (connptr->cbuffer) > 0)
+                return TRUE;
+
+        poller = poller_create (1);
+        if (!poller)
+                return FALSE;
+
+        ret = poller_set (poller, connptr->client_fd, POLLER_READ);
+        if (ret == 0) {
+                do {
+                        ret = poller_wait (poller, &ev, 1,
+                                           config.keepalive_timeout * 1000);
+                } while (ret < 0 && errno == EINTR && !config.quit);
+        }
+        poller_delete (poller);
+
+        if (ret == 0)
+                log_message (LOG_INFO, "Keep-alive timeout on client "
+                             "connection (fd:%d)", connptr->client_fd);
+        if (ret <= 0)
+                return FALSE;
+
+        /* Closing the connection is not a request */
+        return read_buffer (connptr->client_fd, connptr->cbuffer) > 0;
+}
+
+/*
+ * This is the main drive for each connection. As you can tell, for the
+ * first few steps we are using a blocking socket. If you remember the
+ * older tinyproxy code, this use to be a very confusing state machine.
+ * Well, no more! :) The sockets are only switched into nonblocking mode
+ * when we start the relay portion. This makes most of the original
+ * tinyproxy code, which was confusing, redundant. Hail progress.
+ * 	- rjkaes
+ *
+ * (The event-driven workers in event-worker.c drive the same steps from
+ * their own state machine.)
+ */
+void handle_connection (int fd)
+{
+        struct conn_s *connptr;
+        struct request_s *request = NULL;
+        hashmap_t hashofheaders = NULL;
+
+        connptr = prepare_connection (fd);
+        if (!connptr)
+                return;
+
+        if (connptr->error_variables)
+                goto fail;
+
+        /*
+         * A persistent client connection comes back here for every
+         * further request.
+         */
+        for (;;) {
+                if (read_request (connptr, &hashofheaders) < 0)
+                        goto fail;
+
+                request = prepare_request (connptr, hashofheaders);
+                if (!request)
+                        goto fail;
+
+                if (connect_to_server (connptr, request) < 0)
+                        goto fail;
+
+                if (process_client_headers (connptr, hashofheaders) < 0) {
+                        update_stats (STAT_BADCONN);
+                        goto fail;
+                }
+
+                if (expects_response_headers (connptr)) {
+                        if (read_response (connptr) < 0
+                            && (resend_request (connptr, request) < 0
+                                || read_response (connptr) < 0)) {
+                                update_stats (STAT_BADCONN);
+                                goto fail;
+                        }
+                } else {
+                        if (send_ssl_response (connptr) < 0) {
+                                log_message (LOG_ERR,
+                                             "handle_connection: Could not send SSL greeting "
+                                             "to client.");
+                                update_stats (STAT_BADCONN);
+                                goto fail;
+                        }
+                }
+
+                relay_connection (connptr);
+
+                log_message (LOG_INFO,
+                             "Closed connection between local client (fd:%d) "
+                             "and remote client (fd:%d)",
+                             connptr->client_fd, connptr->server_fd);
+
+                if (!connptr->keep_alive || config.quit)
+                        break;
+
+                free_request_struct (request);
+                request = NULL;
+                hashmap_delete (hashofheaders);
+                hashofheaders = NULL;
+                reset_conn (connptr);
+
+                if (!wait_for_request (connptr))
+                        break;
+        }
+
+        goto done;
+
+fail:
+        connection_failed (connptr);
 
 done:
         free_request_struct (request);
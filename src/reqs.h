@@ -23,6 +23,8 @@
 #define _TINYPROXY_REQS_H_
 
 #include "common.h"
+#include "chunked.h"
+#include "hashmap.h"
 
 /*
  * Port constants for HTTP (80) and SSL (443)
@@ -30,6 +32,12 @@
 #define HTTP_PORT 80
 #define HTTP_PORT_SSL 443
 
+/*
+ * The server is only read from while its buffer has room for more than
+ * the chunk framing read_server_body() may add.
+ */
+#define SERVER_READ_ROOM (MAXBUFFSIZE - CHUNK_OVERHEAD)
+
 /*
  * This structure holds the information pulled from a URL request.
  */
@@ -43,6 +51,47 @@ struct request_s {
         char *path;
 };
 
+struct conn_s;
+struct dns_answer;
+
 extern void handle_connection (int fd);
 
+/*
+ * The individual steps of handle_connection(), for callers which drive
+ * the connection from their own (non-blocking) loop.
+ */
+extern struct conn_s *prepare_connection (int fd);
+extern int read_request (struct conn_s *connptr, hashmap_t *hashofheaders);
+extern struct request_s *prepare_request (struct conn_s *connptr,
+                                          hashmap_t hashofheaders);
+extern void get_server_address (struct conn_s *connptr,
+                                struct request_s *request,
+                                const char **host, int *port);
+extern void indicate_connect_error (struct conn_s *connptr, int error);
+extern int next_upstream_proxy (struct conn_s *connptr,
+                                struct request_s *request);
+extern int take_pooled_server (struct conn_s *connptr,
+                               struct request_s *request);
+extern const char *socks_lookup_host (struct conn_s *connptr,
+                                      struct request_s *request);
+extern int socks_start (struct conn_s *connptr, struct request_s *request,
+                        const struct dns_answer *answer);
+extern int socks_step (struct conn_s *connptr, struct request_s *request);
+extern int server_connected (struct conn_s *connptr,
+                             struct request_s *request);
+extern int request_resendable (struct conn_s *connptr,
+                               struct request_s *request);
+extern int process_client_headers (struct conn_s *connptr,
+                                   hashmap_t hashofheaders);
+extern int request_body_wanted (struct conn_s *connptr);
+extern int request_body_buffered (struct conn_s *connptr);
+extern ssize_t read_request_body (struct conn_s *connptr);
+extern ssize_t send_request_body (struct conn_s *connptr);
+extern int process_server_headers (struct conn_s *connptr);
+extern ssize_t read_server_body (struct conn_s *connptr);
+extern int expects_response_headers (struct conn_s *connptr);
+extern int send_ssl_response (struct conn_s *connptr);
+extern void connection_failed (struct conn_s *connptr);
+extern void free_request_struct (struct request_s *request);
+
 #endif
@@ -0,0 +1,211 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The idle connections to servers (and upstream proxies) which are kept
+ * open once a response has been relayed, so the next request for the
+ * same server does not have to connect again.
+ *
+ * Each worker process has its own pool; the threads of a threaded worker
+ * share theirs under a lock.  A connection is found again by its key,
+ * which the caller makes up from everything the connection depends on:
+ * the address connected to, the upstream proxy and the local address.
+ *
+ * The most recently parked connections come first, since those are the
+ * least likely to have been closed by the server meanwhile.  Connections
+ * idle for longer than ServerIdleTimeout are closed whenever the pool is
+ * used, and by the workers' idle ticks (see server_pool_expire), and one
+ * the server has closed (or sent something unasked on) is noticed before
+ * it is handed out.
+ */
+
+#include "main.h"
+
+#include "conf.h"
+#include "heap.h"
+#include "log.h"
+#include "server-pool.h"
+
+struct pooled_conn {
+        struct pooled_conn *next;
+        char *key;
+        int fd;
+        time_t since;
+};
+
+static struct pooled_conn *idle_conns;
+static unsigned int nidle;
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#  define LOCK()   pthread_mutex_lock (&pool_lock)
+#  define UNLOCK() pthread_mutex_unlock (&pool_lock)
+#else
+#  define LOCK()   do { } while (0)
+#  define UNLOCK() do { } while (0)
+#endif
+
+/*
+ * Unlink the entry *link points to, close its connection and free it.
+ */
+static void drop_entry (struct pooled_conn **link)
+{
+        struct pooled_conn *entry = *link;
+
+        *link = entry->next;
+        nidle--;
+
+        if (entry->fd >= 0)
+                close (entry->fd);
+        safefree (entry->key);
+        safefree (entry);
+}
+
+/*
+ * Close the connections which have been idle for too long.
+ */
+static void expire_entries (time_t now)
+{
+        struct pooled_conn **link = &idle_conns;
+
+        while (*link) {
+                if (difftime (now, (*link)->since)
+                    >= config.server_idle_timeout)
+                        drop_entry (link);
+                else
+                        link = &(*link)->next;
+        }
+}
+
+/*
+ * Close the connections which have been idle for too long, even when no
+ * requests come along to use the pool.  The workers call this about once
+ * a second.
+ */
+void server_pool_expire (void)
+{
+        if (config.server_pool_size == 0)
+                return;
+
+        LOCK ();
+        expire_entries (time (NULL));
+        UNLOCK ();
+}
+
+/*
+ * An idle connection should have nothing to read.  If it has, the server
+ * has closed it, or failed it, or sent something it should not have.
+ */
+static int still_idle (int fd)
+{
+        char c;
+
+        return recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0
+            && errno == EAGAIN;
+}
+
+/*
+ * Take an idle connection for the key out of the pool.  Returns the
+ * socket, or -1 if there is none.
+ */
+int server_pool_get (const char *key)
+{
+        struct pooled_conn **link;
+        int fd = -1;
+
+        if (config.server_pool_size == 0)
+                return -1;
+
+        LOCK ();
+        expire_entries (time (NULL));
+
+        link = &idle_conns;
+        while (*link) {
+                if (strcmp ((*link)->key, key) != 0) {
+                        link = &(*link)->next;
+                        continue;
+                }
+
+                if (still_idle ((*link)->fd)) {
+                        fd = (*link)->fd;
+                        (*link)->fd = -1;
+                }
+                drop_entry (link);
+
+                if (fd >= 0)
+                        break;
+        }
+        UNLOCK ();
+
+        return fd;
+}
+
+/*
+ * Park the connection to a server in the pool, or close it if the pool
+ * is disabled.  Once the pool, or the share of it one server may have,
+ * is full, the connection which has been idle for longest makes room.
+ */
+void server_pool_put (const char *key, int fd)
+{
+        struct pooled_conn *entry;
+        struct pooled_conn **link, **oldest, **oldest_same;
+        unsigned int same = 0;
+        time_t now;
+
+        if (config.server_pool_size == 0) {
+                close (fd);
+                return;
+        }
+
+        entry = (struct pooled_conn *) safemalloc (sizeof (*entry));
+        if (entry)
+                entry->key = safestrdup (key);
+        if (!entry || !entry->key) {
+                safefree (entry);
+                close (fd);
+                return;
+        }
+
+        now = time (NULL);
+        entry->fd = fd;
+        entry->since = now;
+
+        LOCK ();
+        expire_entries (now);
+
+        oldest = oldest_same = NULL;
+        for (link = &idle_conns; *link; link = &(*link)->next) {
+                oldest = link;
+                if (strcmp ((*link)->key, key) == 0) {
+                        oldest_same = link;
+                        same++;
+                }
+        }
+
+        if (config.server_pool_per_host != 0
+            && same >= config.server_pool_per_host)
+                drop_entry (oldest_same);
+        else if (nidle >= config.server_pool_size)
+                drop_entry (oldest);
+
+        entry->next = idle_conns;
+        idle_conns = entry;
+        nidle++;
+        UNLOCK ();
+
+        log_message (LOG_CONN, "Keeping server connection (fd:%d) to %s "
+                     "for reuse", fd, key);
+}
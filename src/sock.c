@@ -27,9 +27,12 @@
 
 #include "main.h"
 
+#include "dns-cache.h"
 #include "log.h"
 #include "heap.h"
 #include "network.h"
+#include "poller.h"
+#include "stats.h"
 #include "sock.h"
 #include "text.h"
 #include "conf.h"
@@ -71,74 +74,602 @@ bind_socket (int sockfd, const char *addr, int family)
 }
 
 /*
- * Open a connection to a remote host.  It's been re-written to use
- * the getaddrinfo() library function, which allows for a protocol
- * independent implementation (mostly for IPv4 and IPv6 addresses.)
+ * Create a socket for the given address and bind it to the outgoing
+ * address (either the supplied one, or the configured "Bind" address.)
+ *
+ * Returns the socket upon success, -1 upon error.
  */
-int opensock (const char *host, int port, const char *bind_to)
+static int create_bound_socket (struct addrinfo *ai, const char *bind_to)
 {
-        int sockfd, n;
-        struct addrinfo hints, *res, *ressave;
-        char portstr[6];
+        int sockfd;
 
-        assert (host != NULL);
-        assert (port > 0);
+        sockfd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sockfd < 0)
+                return -1;
 
-        log_message(LOG_INFO,
-                    "opensock: opening connection to %s:%d", host, port);
+        if (!bind_to)
+                bind_to = config.bind_address;
 
-        memset (&hints, 0, sizeof (struct addrinfo));
-        hints.ai_family = AF_UNSPEC;
-        hints.ai_socktype = SOCK_STREAM;
+        if (bind_to && bind_socket (sockfd, bind_to, ai->ai_family) < 0) {
+                close (sockfd);
+                return -1;
+        }
 
-        snprintf (portstr, sizeof (portstr), "%d", port);
+        return sockfd;
+}
+
+/*
+ * Put the addresses in the order they are to be tried in: taking turns
+ * between the two families, starting with the one which connected the
+ * last time, or with IPv6 (RFC 8305.)
+ */
+static void order_addrs (const struct dns_answer *answer,
+                         const struct dns_addr **order)
+{
+        const struct dns_addr *first[DNS_MAX_ADDRS], *second[DNS_MAX_ADDRS];
+        unsigned int i, nfirst = 0, nsecond = 0, n = 0;
+        int family;
+
+        family = answer->family != AF_UNSPEC ? answer->family : AF_INET6;
+        for (i = 0; i != answer->naddrs; i++) {
+                if (answer->addrs[i].family == family)
+                        first[nfirst++] = &answer->addrs[i];
+                else
+                        second[nsecond++] = &answer->addrs[i];
+        }
+
+        for (i = 0; i < nfirst || i < nsecond; i++) {
+                if (i < nfirst)
+                        order[n++] = first[i];
+                if (i < nsecond)
+                        order[n++] = second[i];
+        }
+}
+
+/*
+ * Turn the addresses found for a host into a list of addresses with the
+ * port, as getaddrinfo() would return it, in the order they should be
+ * tried in.  The list must be freed with free_sock_addrs().
+ *
+ * Returns 0 upon success, -1 upon error.
+ */
+int make_sock_addrs (const struct dns_answer *answer, int port,
+                     struct addrinfo **res)
+{
+        const struct dns_addr *order[DNS_MAX_ADDRS];
+        struct addrinfo *ai, **tail;
+        unsigned int i;
+
+        order_addrs (answer, order);
+
+        *res = NULL;
+        tail = res;
+        for (i = 0; i != answer->naddrs; i++) {
+                const struct dns_addr *addr = order[i];
+
+                /* The address is kept in the same block as the node */
+                ai = (struct addrinfo *)
+                    safecalloc (1, sizeof (struct addrinfo)
+                                + sizeof (struct sockaddr_storage));
+                if (!ai) {
+                        free_sock_addrs (*res);
+                        return -1;
+                }
+                ai->ai_family = addr->family;
+                ai->ai_socktype = SOCK_STREAM;
+                ai->ai_addr = (struct sockaddr *) (ai + 1);
+
+                if (addr->family == AF_INET) {
+                        struct sockaddr_in *sin =
+                            (struct sockaddr_in *) ai->ai_addr;
+
+                        sin->sin_family = AF_INET;
+                        sin->sin_port = htons (port);
+                        sin->sin_addr = addr->u.v4;
+                        ai->ai_addrlen = sizeof (struct sockaddr_in);
+                } else {
+                        struct sockaddr_in6 *sin6 =
+                            (struct sockaddr_in6 *) ai->ai_addr;
+
+                        sin6->sin6_family = AF_INET6;
+                        sin6->sin6_port = htons (port);
+                        sin6->sin6_addr = addr->u.v6;
+                        ai->ai_addrlen = sizeof (struct sockaddr_in6);
+                }
+
+                *tail = ai;
+                tail = &ai->ai_next;
+        }
 
-        n = getaddrinfo (host, portstr, &hints, &res);
-        if (n != 0) {
+        return 0;
+}
+
+/*
+ * Look up the addresses for a host/port pair, through the DNS cache.  The
+ * returned list must be freed with free_sock_addrs().
+ *
+ * Returns 0 upon success, -1 upon error.
+ */
+int resolve_sock (const char *host, int port, struct addrinfo **res)
+{
+        struct dns_answer answer;
+
+        assert (host != NULL);
+        assert (port > 0);
+        assert (res != NULL);
+
+        if (dns_cache_resolve (host, &answer) < 0) {
                 log_message (LOG_ERR,
                              "opensock: Could not retrieve info for %s", host);
                 return -1;
         }
 
+        if (make_sock_addrs (&answer, port, res) < 0)
+                return -1;
+
         log_message(LOG_INFO,
-                    "opensock: getaddrinfo returned for %s:%d", host, port);
+                    "opensock: resolved %s:%d", host, port);
 
-        ressave = res;
-        do {
-                sockfd =
-                    socket (res->ai_family, res->ai_socktype, res->ai_protocol);
-                if (sockfd < 0)
-                        continue;       /* ignore this one */
-
-                /* Bind to the specified address */
-                if (bind_to) {
-                        if (bind_socket (sockfd, bind_to,
-                                         res->ai_family) < 0) {
-                                close (sockfd);
-                                continue;       /* can't bind, so try again */
-                        }
-                } else if (config.bind_address) {
-                        if (bind_socket (sockfd, config.bind_address,
-                                         res->ai_family) < 0) {
-                                close (sockfd);
-                                continue;       /* can't bind, so try again */
-                        }
-                }
+        return 0;
+}
 
-                if (connect (sockfd, res->ai_addr, res->ai_addrlen) == 0)
-                        break;  /* success */
+/*
+ * Free the list of addresses returned by resolve_sock().
+ */
+void free_sock_addrs (struct addrinfo *addrs)
+{
+        struct addrinfo *next;
+
+        for (; addrs; addrs = next) {
+                next = addrs->ai_next;
+                safefree (addrs);
+        }
+}
+
+/*
+ * Start a non-blocking connect to a single address.  The socket is
+ * returned even if the connect is still in progress; the caller must wait
+ * for it to become writable and then check SO_ERROR (see
+ * check_sock_connected().)
+ *
+ * Returns the socket upon success, -1 upon error.
+ */
+int connect_sock_nonblocking (struct addrinfo *ai, const char *bind_to)
+{
+        int sockfd;
 
+        assert (ai != NULL);
+
+        sockfd = create_bound_socket (ai, bind_to);
+        if (sockfd < 0)
+                return -1;
+
+        if (socket_nonblocking (sockfd) != 0) {
                 close (sockfd);
-        } while ((res = res->ai_next) != NULL);
+                return -1;
+        }
 
-        freeaddrinfo (ressave);
-        if (res == NULL) {
+        if (connect (sockfd, ai->ai_addr, ai->ai_addrlen) < 0
+            && errno != EINPROGRESS && errno != EINTR) {
+                close (sockfd);
+                return -1;
+        }
+
+        return sockfd;
+}
+
+/*
+ * Check whether a non-blocking connect has completed successfully.
+ *
+ * Returns 0 if the socket is connected, otherwise the (positive) error
+ * number of the failed connect.
+ */
+int check_sock_connected (int sockfd)
+{
+        int error = 0;
+        socklen_t len = sizeof (error);
+
+        assert (sockfd >= 0);
+
+        if (getsockopt (sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+                return errno;
+
+        return error;
+}
+
+/*
+ * Connecting to the addresses of a server in turn, without waiting for
+ * each one to fail before the next is tried (RFC 8305, "Happy
+ * Eyeballs".)  The next address is tried if the earlier ones have not
+ * connected within ConnectAttemptDelay milliseconds, or as soon as they
+ * have all failed, while the earlier attempts carry on.  The first one
+ * to connect wins, and the others are closed.
+ *
+ * An attempt which has not connected within ConnectTimeout seconds is
+ * given up, like one which failed.
+ *
+ * Each address is tried once, so the socket of attempt i is only ever
+ * opened and closed once; the caller can follow them by their number.
+ */
+struct connect_race {
+        struct addrinfo *addrs[SOCK_MAX_ATTEMPTS];
+        int fds[SOCK_MAX_ATTEMPTS];
+        struct timeval deadlines[SOCK_MAX_ATTEMPTS];
+        unsigned int naddrs;
+        unsigned int next;      /* the next address to try */
+        unsigned int pending;   /* attempts in progress */
+        struct timeval started;
+        struct timeval next_attempt;
+        const char *bind_to;
+
+        int fd;                 /* the winner, or -1 */
+        int family;
+        int error;              /* of the last attempt which failed */
+        unsigned int done;      /* boolean */
+};
+
+static void timeval_add_ms (struct timeval *tv, const struct timeval *from,
+                            unsigned int ms)
+{
+        tv->tv_sec = from->tv_sec + ms / 1000;
+        tv->tv_usec = from->tv_usec + (ms % 1000) * 1000;
+        if (tv->tv_usec >= 1000000) {
+                tv->tv_sec++;
+                tv->tv_usec -= 1000000;
+        }
+}
+
+/*
+ * Milliseconds from now until tv, rounded up, or 0 if it has passed.
+ */
+static int timeval_ms_until (const struct timeval *tv,
+                             const struct timeval *now)
+{
+        struct timeval left;
+
+        if (!timercmp (now, tv, <))
+                return 0;
+
+        timersub (tv, now, &left);
+        return left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+}
+
+/*
+ * Give up on attempt i, which failed with the error.  The next attempt
+ * is due straight away.
+ */
+static void race_attempt_failed (struct connect_race *race, unsigned int i,
+                                 int error)
+{
+        close (race->fds[i]);
+        race->fds[i] = -1;
+        race->pending--;
+        race->error = error;
+        timerclear (&race->next_attempt);
+}
+
+/*
+ * The race is over, won by attempt i (if it is not negative.)
+ */
+static void race_finished (struct connect_race *race, int i)
+{
+        struct timeval now, took;
+
+        race->done = TRUE;
+
+        if (i < 0) {
+                update_stats (STAT_CONNECT_FAIL);
+                return;
+        }
+
+        race->fd = race->fds[i];
+        race->family = race->addrs[i]->ai_family;
+        race->fds[i] = -1;
+
+        gettimeofday (&now, NULL);
+        timersub (&now, &race->started, &took);
+        update_connect_stats (took.tv_sec * 1000 + took.tv_usec / 1000);
+}
+
+/*
+ * Start the attempts which are due: the next one if the delay since the
+ * last one has passed (or one has failed), and any number of them while
+ * none is in progress.
+ */
+static void race_start_attempts (struct connect_race *race)
+{
+        struct timeval now;
+        int fd;
+
+        gettimeofday (&now, NULL);
+
+        while (race->next < race->naddrs
+               && (race->pending == 0
+                   || !timercmp (&now, &race->next_attempt, <))) {
+                unsigned int i = race->next++;
+
+                fd = connect_sock_nonblocking (race->addrs[i], race->bind_to);
+                if (fd < 0) {
+                        race->error = errno;
+                        continue;
+                }
+
+                race->fds[i] = fd;
+                race->pending++;
+
+                timeval_add_ms (&race->next_attempt, &now,
+                                config.connect_attempt_delay);
+                timeval_add_ms (&race->deadlines[i], &now,
+                                config.connect_timeout * 1000);
+        }
+
+        if (race->pending == 0 && race->next == race->naddrs)
+                race_finished (race, -1);
+}
+
+/*
+ * Give up on the attempts which have run out of time.
+ */
+static void race_expire_attempts (struct connect_race *race)
+{
+        struct timeval now;
+        unsigned int i;
+
+        if (config.connect_timeout == 0)
+                return;
+
+        gettimeofday (&now, NULL);
+
+        for (i = 0; i != race->naddrs; i++) {
+                if (race->fds[i] < 0
+                    || timercmp (&now, &race->deadlines[i], <))
+                        continue;
+
+                log_message (LOG_INFO, "opensock: connect to fd %d timed "
+                             "out", race->fds[i]);
+                update_stats (STAT_CONNECT_TIMEOUT);
+                race_attempt_failed (race, i, ETIMEDOUT);
+        }
+}
+
+/*
+ * Start connecting to the addresses, in the order of the list, which is
+ * left to the caller, and must be kept until the race is freed.
+ *
+ * Returns the race, or NULL if there is no memory for it.
+ */
+struct connect_race *connect_race_start (struct addrinfo *addrs,
+                                         const char *bind_to)
+{
+        struct connect_race *race;
+        unsigned int i;
+
+        race = (struct connect_race *) safecalloc (1, sizeof (*race));
+        if (!race)
+                return NULL;
+
+        for (; addrs && race->naddrs < SOCK_MAX_ATTEMPTS;
+             addrs = addrs->ai_next)
+                race->addrs[race->naddrs++] = addrs;
+        for (i = 0; i != SOCK_MAX_ATTEMPTS; i++)
+                race->fds[i] = -1;
+
+        race->bind_to = bind_to;
+        race->fd = -1;
+        race->error = ECONNREFUSED;
+        gettimeofday (&race->started, NULL);
+
+        race_start_attempts (race);
+        return race;
+}
+
+/*
+ * Carry on with the race, after the events on the socket fd (or none,
+ * when the timeout has passed.)  A socket is only ready once it is
+ * reported writable (or failed.)
+ *
+ * Returns 1 once a connection has been made, or all the attempts have
+ * failed, and 0 otherwise.
+ */
+int connect_race_step (struct connect_race *race, int fd, unsigned int events)
+{
+        unsigned int i;
+        int error;
+
+        if (race->done)
+                return 1;
+
+        for (i = 0; events != 0 && i != race->naddrs; i++) {
+                if (race->fds[i] != fd)
+                        continue;
+
+                error = check_sock_connected (fd);
+                if (error == 0) {
+                        race_finished (race, i);
+                        return 1;
+                }
+
+                race_attempt_failed (race, i, error);
+                break;
+        }
+
+        race_expire_attempts (race);
+        race_start_attempts (race);
+        return race->done;
+}
+
+/*
+ * The socket of attempt i, or -1 if it has not started, or is over.
+ */
+int connect_race_fd (const struct connect_race *race, unsigned int i)
+{
+        assert (i < SOCK_MAX_ATTEMPTS);
+
+        return race->fds[i];
+}
+
+/*
+ * The number of milliseconds until the next attempt is due, or one runs
+ * out of time, or -1 if there is nothing to wait for.
+ */
+int connect_race_timeout (const struct connect_race *race)
+{
+        struct timeval now;
+        unsigned int i;
+        int timeout = -1, t;
+
+        if (race->done)
+                return -1;
+
+        gettimeofday (&now, NULL);
+
+        if (race->next != race->naddrs)
+                timeout = timeval_ms_until (&race->next_attempt, &now);
+
+        for (i = 0; config.connect_timeout != 0 && i != race->naddrs; i++) {
+                if (race->fds[i] < 0)
+                        continue;
+
+                t = timeval_ms_until (&race->deadlines[i], &now);
+                if (timeout < 0 || t < timeout)
+                        timeout = t;
+        }
+
+        return timeout;
+}
+
+/*
+ * The connected socket, which is now the caller's, and the family of its
+ * address.
+ *
+ * Returns the socket, or -1 with errno set to the error of the last
+ * attempt if none connected.
+ */
+int connect_race_result (struct connect_race *race, int *family)
+{
+        int fd = race->fd;
+
+        assert (race->done);
+
+        race->fd = -1;
+        if (fd < 0) {
+                errno = race->error;
+                return -1;
+        }
+
+        if (family)
+                *family = race->family;
+        return fd;
+}
+
+/*
+ * Free the race, closing the attempts still in progress.
+ */
+void connect_race_free (struct connect_race *race)
+{
+        unsigned int i;
+
+        if (!race)
+                return;
+
+        for (i = 0; i != race->naddrs; i++) {
+                if (race->fds[i] >= 0)
+                        close (race->fds[i]);
+        }
+        if (race->fd >= 0)
+                close (race->fd);
+
+        safefree (race);
+}
+
+/*
+ * Run the race, waiting until it is over.
+ *
+ * Returns the connected socket, or -1 with errno set.
+ */
+static int wait_connect_race (struct connect_race *race, int *family)
+{
+        struct poller_event ev[SOCK_MAX_ATTEMPTS];
+        struct poller *poller;
+        unsigned int i;
+        int n;
+
+        while (!connect_race_step (race, -1, 0)) {
+                poller = poller_create (1);
+                if (!poller)
+                        return -1;
+
+                n = 0;
+                for (i = 0; n == 0 && i != SOCK_MAX_ATTEMPTS; i++) {
+                        if (connect_race_fd (race, i) >= 0)
+                                n = poller_set (poller,
+                                                connect_race_fd (race, i),
+                                                POLLER_WRITE);
+                }
+                if (n == 0)
+                        n = poller_wait (poller, ev, SOCK_MAX_ATTEMPTS,
+                                         connect_race_timeout (race));
+                poller_delete (poller);
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                for (i = 0; i != (unsigned int) n; i++) {
+                        if (connect_race_step (race, ev[i].fd, ev[i].events))
+                                break;
+                }
+        }
+
+        return connect_race_result (race, family);
+}
+
+/*
+ * Open a connection to a remote host.  The addresses are raced against
+ * each other (see connect_race above), and the family which won is
+ * remembered for the next connection to the host.
+ */
+int opensock (const char *host, int port, const char *bind_to)
+{
+        struct connect_race *race;
+        struct addrinfo *res;
+        int sockfd, family, error;
+
+        assert (host != NULL);
+        assert (port > 0);
+
+        log_message(LOG_INFO,
+                    "opensock: opening connection to %s:%d", host, port);
+
+        if (resolve_sock (host, port, &res) < 0)
+                return -1;
+
+        race = connect_race_start (res, bind_to);
+        if (!race) {
+                free_sock_addrs (res);
+                return -1;
+        }
+
+        sockfd = wait_connect_race (race, &family);
+        error = errno;
+        connect_race_free (race);
+        free_sock_addrs (res);
+
+        if (sockfd < 0 || socket_blocking (sockfd) != 0) {
+                if (sockfd >= 0) {
+                        error = errno;
+                        close (sockfd);
+                }
                 log_message (LOG_ERR,
                              "opensock: Could not establish a connection to %s",
                              host);
+                errno = error;
                 return -1;
         }
 
+        dns_cache_connected (host, family);
         return sockfd;
 }
 
@@ -171,11 +702,13 @@ int socket_blocking (int sock)
 
 /**
  * Try to listen on one socket based on the addrinfo
- * as returned from getaddrinfo.
+ * as returned from getaddrinfo.  With reuseport set, the socket joins
+ * the group of SO_REUSEPORT sockets for the address, and the kernel
+ * spreads the incoming connections across them.
  *
  * Return the file descriptor upon success, -1 upon error.
  */
-static int listen_on_one_socket(struct addrinfo *ad)
+static int listen_on_one_socket(struct addrinfo *ad, int reuseport)
 {
         int listenfd;
         int ret;
@@ -210,6 +743,20 @@ static int listen_on_one_socket(struct addrinfo *ad)
                 return -1;
         }
 
+#ifdef SO_REUSEPORT
+        if (reuseport) {
+                ret = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on,
+                                 sizeof(on));
+                if (ret != 0) {
+                        log_message(LOG_ERR,
+                                    "setsockopt failed to set SO_REUSEPORT: %s",
+                                    strerror(errno));
+                        close(listenfd);
+                        return -1;
+                }
+        }
+#endif
+
         if (ad->ai_family == AF_INET6) {
                 ret = setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &on,
                                  sizeof(on));
@@ -251,7 +798,8 @@ static int listen_on_one_socket(struct addrinfo *ad)
  * Upon success, the listen-fds are added to the listen_fds list
  * and 0 is returned. Upon error,  -1 is returned.
  */
-int listen_sock (const char *addr, uint16_t port, vector_t listen_fds)
+int listen_sock (const char *addr, uint16_t port, vector_t listen_fds,
+                 int reuseport)
 {
         struct addrinfo hints, *result, *rp;
         char portstr[6];
@@ -280,7 +828,7 @@ int listen_sock (const char *addr, uint16_t port, vector_t listen_fds)
         for (rp = result; rp != NULL; rp = rp->ai_next) {
                 int listenfd;
 
-                listenfd = listen_on_one_socket(rp);
+                listenfd = listen_on_one_socket(rp, reuseport);
                 if (listenfd == -1) {
                         continue;
                 }
@@ -332,29 +880,63 @@ int getsock_ip (int fd, char *ipaddr)
 }
 
 /*
- * Return the peer's socket information.
+ * Return the peer's IP address.  Its name is only looked up if it is
+ * needed, with getpeer_hostname().
  */
-int getpeer_information (int fd, char *ipaddr, char *string_addr)
+int getpeer_information (int fd, char *ipaddr)
 {
         struct sockaddr_storage sa;
         socklen_t salen = sizeof sa;
 
         assert (fd >= 0);
         assert (ipaddr != NULL);
-        assert (string_addr != NULL);
 
-        /* Set the strings to default values */
         ipaddr[0] = '\0';
-        strlcpy (string_addr, "[unknown]", HOSTNAME_LENGTH);
 
-        /* Look up the IP address */
         if (getpeername (fd, (struct sockaddr *) &sa, &salen) != 0)
                 return -1;
 
         if (get_ip_string ((struct sockaddr *) &sa, ipaddr, IP_LENGTH) == NULL)
                 return -1;
 
-        /* Get the full host name */
-        return getnameinfo ((struct sockaddr *) &sa, salen,
-                            string_addr, HOSTNAME_LENGTH, NULL, 0, 0);
+        return 0;
+}
+
+/*
+ * Find the name of the peer at the IP address (as getpeer_information()
+ * returns it), through the DNS cache.  An address without a name stands
+ * for itself.  string_addr must have room for HOSTNAME_LENGTH characters.
+ */
+void getpeer_hostname (const char *ipaddr, char *string_addr)
+{
+        struct sockaddr_storage sa;
+        struct sockaddr_in *sin = (struct sockaddr_in *) &sa;
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &sa;
+        socklen_t salen;
+        int error;
+
+        assert (ipaddr != NULL);
+        assert (string_addr != NULL);
+
+        if (dns_cache_ptr_lookup (ipaddr, string_addr))
+                return;
+
+        memset (&sa, 0, sizeof (sa));
+        if (inet_pton (AF_INET, ipaddr, &sin->sin_addr) == 1) {
+                sin->sin_family = AF_INET;
+                salen = sizeof (struct sockaddr_in);
+        } else if (inet_pton (AF_INET6, ipaddr, &sin6->sin6_addr) == 1) {
+                sin6->sin6_family = AF_INET6;
+                salen = sizeof (struct sockaddr_in6);
+        } else {
+                strlcpy (string_addr, "[unknown]", HOSTNAME_LENGTH);
+                return;
+        }
+
+        error = getnameinfo ((struct sockaddr *) &sa, salen, string_addr,
+                             HOSTNAME_LENGTH, NULL, 0, NI_NAMEREQD);
+        if (error)
+                strlcpy (string_addr, ipaddr, HOSTNAME_LENGTH);
+
+        dns_cache_ptr_store (ipaddr, error, string_addr);
 }
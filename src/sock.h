@@ -28,15 +28,46 @@
 
 #define MAXLINE (1024 * 4)
 
+#include "dns-cache.h"
 #include "vector.h"
 
+/*
+ * The most addresses of a server tried by one connection.
+ */
+#define SOCK_MAX_ATTEMPTS DNS_MAX_ADDRS
+
+struct connect_race;
+
 extern int opensock (const char *host, int port, const char *bind_to);
-extern int listen_sock (const char *addr, uint16_t port, vector_t listen_fds);
+extern int make_sock_addrs (const struct dns_answer *answer, int port,
+                            struct addrinfo **res);
+extern int resolve_sock (const char *host, int port, struct addrinfo **res);
+extern void free_sock_addrs (struct addrinfo *addrs);
+extern int connect_sock_nonblocking (struct addrinfo *ai, const char *bind_to);
+extern int check_sock_connected (int sockfd);
+
+/*
+ * Connecting to several addresses at once.  The caller waits for any of
+ * the descriptors connect_race_fd() returns to be writable, for at most
+ * connect_race_timeout() milliseconds, and calls connect_race_step() with
+ * the one which was (or -1), until it returns 1.
+ */
+extern struct connect_race *connect_race_start (struct addrinfo *addrs,
+                                                const char *bind_to);
+extern int connect_race_step (struct connect_race *race, int fd,
+                              unsigned int events);
+extern int connect_race_fd (const struct connect_race *race, unsigned int i);
+extern int connect_race_timeout (const struct connect_race *race);
+extern int connect_race_result (struct connect_race *race, int *family);
+extern void connect_race_free (struct connect_race *race);
+extern int listen_sock (const char *addr, uint16_t port, vector_t listen_fds,
+                        int reuseport);
 
 extern int socket_nonblocking (int sock);
 extern int socket_blocking (int sock);
 
 extern int getsock_ip (int fd, char *ipaddr);
-extern int getpeer_information (int fd, char *ipaddr, char *string_addr);
+extern int getpeer_information (int fd, char *ipaddr);
+extern void getpeer_hostname (const char *ipaddr, char *string_addr);
 
 #endif
@@ -20,13 +20,17 @@
  * public API functions. The reason for the functions, rather than just a
  * external structure is that tinyproxy is now multi-threaded and we can
  * not allow more than one child to access the statistics at the same
- * time. This is prevented by a mutex. If there is a need for more
- * statistics in the future, just add to the structure, enum (in the header),
- * and the switch statement in update_stats().
+ * time. This is prevented by only changing the counters with atomic
+ * operations. If there is a need for more statistics in the future, just
+ * add to the structure, enum (in the header), and the switch statement in
+ * update_stats().  The stats page also shows the children's scoreboard
+ * (see child.h).
  */
 
 #include "main.h"
 
+#include "child.h"
+#include "dns-cache.h"
 #include "log.h"
 #include "heap.h"
 #include "html-error.h"
@@ -34,12 +38,20 @@
 #include "utils.h"
 #include "conf.h"
 
+/*
+ * The counters are shared by all the children, and only changed with
+ * atomic operations.
+ */
 struct stat_s {
-        unsigned long int num_reqs;
-        unsigned long int num_badcons;
-        unsigned long int num_open;
-        unsigned long int num_refused;
-        unsigned long int num_denied;
+        volatile unsigned long int num_reqs;
+        volatile unsigned long int num_badcons;
+        volatile unsigned long int num_open;
+        volatile unsigned long int num_refused;
+        volatile unsigned long int num_denied;
+        volatile unsigned long int num_connects;
+        volatile unsigned long int num_connect_fails;
+        volatile unsigned long int num_connect_timeouts;
+        volatile unsigned long int connect_ms;  /* taken by all connects */
 };
 
 static struct stat_s *stats;
@@ -56,14 +68,160 @@ void init_stats (void)
         memset (stats, 0, sizeof (struct stat_s));
 }
 
+/*
+ * Copy the text to the buffer, escaping the characters which are special
+ * in HTML.
+ */
+static size_t html_escape (char *buf, const char *text, size_t len)
+{
+        size_t i = 0;
+        const char *rep;
+
+        for (; *text && len > 0; text++, len--) {
+                switch (*text) {
+                case '<':
+                        rep = "&lt;";
+                        break;
+                case '>':
+                        rep = "&gt;";
+                        break;
+                case '&':
+                        rep = "&amp;";
+                        break;
+                case '"':
+                        rep = "&quot;";
+                        break;
+                default:
+                        buf[i++] = *text;
+                        continue;
+                }
+
+                memcpy (buf + i, rep, strlen (rep));
+                i += strlen (rep);
+        }
+
+        buf[i] = '\0';
+        return i;
+}
+
+/*
+ * Build an HTML table from the children's scoreboard.  The scoreboard is
+ * read without any locking, so the copy of each entry is only a snapshot.
+ * Returns a newly allocated string, or NULL.
+ */
+static char *scoreboard_table (unsigned int *busy, unsigned int *idle)
+{
+        const struct child_s *board;
+        struct child_s entry;
+        unsigned int slots, i;
+        size_t size, len;
+        char *table, age[32];
+        time_t now = time (NULL);
+        static const char *const states[] = { "empty", "waiting",
+                                               "connected" };
+
+        board = child_scoreboard (&slots);
+        *busy = *idle = 0;
+        if (!board)
+                return NULL;
+
+        /* every character of the request may need escaping */
+        size = (slots + 1) * (256 + 6 * SCOREBOARD_REQUEST_LEN);
+        table = (char *) safemalloc (size);
+        if (!table)
+                return NULL;
+
+        len = snprintf (table, size,
+                        "<table>\n"
+                        "<tr><th>Slot</th><th>PID</th><th>State</th>"
+                        "<th>Connections</th><th>Open</th><th>Bytes</th>"
+                        "<th>Request age</th><th>Request</th></tr>\n");
+
+        for (i = 0; i != slots; i++) {
+                memcpy (&entry, &board[i], sizeof (entry));
+                if (entry.status == T_EMPTY)
+                        continue;
+
+                if (entry.status == T_CONNECTED)
+                        ++*busy;
+                else
+                        ++*idle;
+
+                if (entry.request_started)
+                        snprintf (age, sizeof (age), "%lds",
+                                  (long) difftime (now,
+                                                   entry.request_started));
+                else
+                        strcpy (age, "-");
+
+                len += snprintf (table + len, size - len,
+                                 "<tr><td>%u</td><td>%ld</td><td>%s</td>"
+                                 "<td>%u</td><td>%u</td><td>%lu</td>"
+                                 "<td>%s</td><td>",
+                                 i + 1, (long) entry.tid,
+                                 states[entry.status], entry.connects,
+                                 entry.active, entry.bytes, age);
+                len += html_escape (table + len, entry.request,
+                                    SCOREBOARD_REQUEST_LEN - 1);
+                len += snprintf (table + len, size - len,
+                                 "</td></tr>\n");
+        }
+
+        snprintf (table + len, size - len, "</table>\n");
+        return table;
+}
+
+/*
+ * Build an HTML table of the memory pools of the process showing the
+ * page.  Returns a newly allocated string, or NULL.
+ */
+static char *pool_table (void)
+{
+        const struct pool_s *pool;
+        size_t size, len;
+        char *table;
+
+        size = 256;
+        for (pool = pool_list (); pool; pool = pool->next)
+                size += 128 + strlen (pool->name);
+
+        table = (char *) safemalloc (size);
+        if (!table)
+                return NULL;
+
+        len = snprintf (table, size,
+                        "<table>\n"
+                        "<tr><th>Pool</th><th>Object size</th><th>Hits</th>"
+                        "<th>Misses</th><th>Resident bytes</th></tr>\n");
+
+        for (pool = pool_list (); pool; pool = pool->next)
+                len += snprintf (table + len, size - len,
+                                 "<tr><td>%s</td><td>%lu</td><td>%lu</td>"
+                                 "<td>%lu</td><td>%lu</td></tr>\n",
+                                 pool->name, (unsigned long) pool->size,
+                                 pool->hits, pool->misses,
+                                 (unsigned long) pool->resident);
+
+        snprintf (table + len, size - len, "</table>\n");
+        return table;
+}
+
 /*
  * Display the statics of the tinyproxy server.
  */
 int
 showstats (struct conn_s *connptr)
 {
-        char *message_buffer;
+        char *message_buffer, *table, *pools;
         char opens[16], reqs[16], badconns[16], denied[16], refused[16];
+        char busy[16], idle[16];
+        char connects[16], connectfails[16], connecttimeouts[16];
+        char connecttime[16];
+        char dnshits[16], dnsmisses[16], dnsstale[16], dnsprefetches[16];
+        char dnsptrhits[16], dnsptrmisses[16];
+        struct dns_cache_stats dns;
+        unsigned int nbusy, nidle;
+        size_t size;
         FILE *statfile;
 
         snprintf (opens, sizeof (opens), "%lu", stats->num_open);
@@ -71,14 +229,42 @@ showstats (struct conn_s *connptr)
         snprintf (badconns, sizeof (badconns), "%lu", stats->num_badcons);
         snprintf (denied, sizeof (denied), "%lu", stats->num_denied);
         snprintf (refused, sizeof (refused), "%lu", stats->num_refused);
+        snprintf (connects, sizeof (connects), "%lu", stats->num_connects);
+        snprintf (connectfails, sizeof (connectfails), "%lu",
+                  stats->num_connect_fails);
+        snprintf (connecttimeouts, sizeof (connecttimeouts), "%lu",
+                  stats->num_connect_timeouts);
+        snprintf (connecttime, sizeof (connecttime), "%lu",
+                  stats->num_connects
+                  ? stats->connect_ms / stats->num_connects : 0);
+
+        dns_cache_stats (&dns);
+        snprintf (dnshits, sizeof (dnshits), "%lu", dns.hits);
+        snprintf (dnsmisses, sizeof (dnsmisses), "%lu", dns.misses);
+        snprintf (dnsstale, sizeof (dnsstale), "%lu", dns.stale);
+        snprintf (dnsprefetches, sizeof (dnsprefetches), "%lu",
+                  dns.prefetches);
+        snprintf (dnsptrhits, sizeof (dnsptrhits), "%lu", dns.ptr_hits);
+        snprintf (dnsptrmisses, sizeof (dnsptrmisses), "%lu",
+                  dns.ptr_misses);
+
+        table = scoreboard_table (&nbusy, &nidle);
+        snprintf (busy, sizeof (busy), "%u", nbusy);
+        snprintf (idle, sizeof (idle), "%u", nidle);
+        pools = pool_table ();
 
         if (!config.statpage || (!(statfile = fopen (config.statpage, "r")))) {
-                message_buffer = (char *) safemalloc (MAXBUFFSIZE);
-                if (!message_buffer)
+                size = MAXBUFFSIZE + (table ? strlen (table) : 0)
+                    + (pools ? strlen (pools) : 0);
+                message_buffer = (char *) safemalloc (size);
+                if (!message_buffer) {
+                        safefree (table);
+                        safefree (pools);
                         return -1;
+                }
 
                 snprintf
-                  (message_buffer, MAXBUFFSIZE,
+                  (message_buffer, size,
                    "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
                    "<!DOCTYPE html PUBLIC \"-//W3C//DTD XHTML 1.1//EN\" "
                    "\"http://www.w3.org/TR/xhtml11/DTD/xhtml11.dtd\">\n"
@@ -91,8 +277,19 @@ showstats (struct conn_s *connptr)
                    "Number of requests: %lu<br />\n"
                    "Number of bad connections: %lu<br />\n"
                    "Number of denied connections: %lu<br />\n"
-                   "Number of refused connections due to high load: %lu\n"
+                   "Number of refused connections due to high load: %lu<br />\n"
+                   "Number of busy children: %u<br />\n"
+                   "Number of idle children: %u<br />\n"
+                   "Server connections made: %lu, failed: %lu, "
+                   "addresses timed out: %lu, average time: %s ms<br />\n"
+                   "DNS cache hits: %lu, misses: %lu, expired answers "
+                   "served: %lu, prefetches: %lu<br />\n"
+                   "Client name cache hits: %lu, misses: %lu\n"
                    "</p>\n"
+                   "<h2>Scoreboard</h2>\n"
+                   "%s"
+                   "<h2>Memory pools of this worker</h2>\n"
+                   "%s"
                    "<hr />\n"
                    "<p><em>Generated by %s version %s.</em></p>\n" "</body>\n"
                    "</html>\n",
@@ -100,7 +297,15 @@ showstats (struct conn_s *connptr)
                    stats->num_open,
                    stats->num_reqs,
                    stats->num_badcons, stats->num_denied,
-                   stats->num_refused, PACKAGE, VERSION);
+                   stats->num_refused, nbusy, nidle,
+                   stats->num_connects, stats->num_connect_fails,
+                   stats->num_connect_timeouts, connecttime,
+                   dns.hits, dns.misses, dns.stale, dns.prefetches,
+                   dns.ptr_hits, dns.ptr_misses,
+                   table ? table : "", pools ? pools : "",
+                   PACKAGE, VERSION);
+                safefree (table);
+                safefree (pools);
 
                 if (send_http_message (connptr, 200, "OK",
                                        message_buffer) < 0) {
@@ -117,12 +322,28 @@ showstats (struct conn_s *connptr)
         add_error_variable (connptr, "badconns", badconns);
         add_error_variable (connptr, "deniedconns", denied);
         add_error_variable (connptr, "refusedconns", refused);
+        add_error_variable (connptr, "busychildren", busy);
+        add_error_variable (connptr, "idlechildren", idle);
+        add_error_variable (connptr, "connects", connects);
+        add_error_variable (connptr, "connectfails", connectfails);
+        add_error_variable (connptr, "connecttimeouts", connecttimeouts);
+        add_error_variable (connptr, "connecttime", connecttime);
+        add_error_variable (connptr, "dnshits", dnshits);
+        add_error_variable (connptr, "dnsmisses", dnsmisses);
+        add_error_variable (connptr, "dnsstale", dnsstale);
+        add_error_variable (connptr, "dnsprefetches", dnsprefetches);
+        add_error_variable (connptr, "dnsptrhits", dnsptrhits);
+        add_error_variable (connptr, "dnsptrmisses", dnsptrmisses);
+        add_error_variable (connptr, "scoreboard", table ? table : "");
+        add_error_variable (connptr, "pools", pools ? pools : "");
+        safefree (table);
+        safefree (pools);
         add_standard_vars (connptr);
         send_http_headers (connptr, 200, "Statistic requested");
         send_html_file (statfile, connptr);
         fclose (statfile);
 
-        return 0;
+        return ostream_flush (&connptr->client_out, FALSE);
 }
 
 /*
@@ -133,20 +354,29 @@ int update_stats (status_t update_level)
 {
         switch (update_level) {
         case STAT_BADCONN:
-                ++stats->num_badcons;
+                __sync_add_and_fetch (&stats->num_badcons, 1);
                 break;
         case STAT_OPEN:
-                ++stats->num_open;
-                ++stats->num_reqs;
+                __sync_add_and_fetch (&stats->num_open, 1);
+                __sync_add_and_fetch (&stats->num_reqs, 1);
+                break;
+        case STAT_REQUEST:
+                __sync_add_and_fetch (&stats->num_reqs, 1);
                 break;
         case STAT_CLOSE:
-                --stats->num_open;
+                __sync_sub_and_fetch (&stats->num_open, 1);
                 break;
         case STAT_REFUSE:
-                ++stats->num_refused;
+                __sync_add_and_fetch (&stats->num_refused, 1);
                 break;
         case STAT_DENIED:
-                ++stats->num_denied;
+                __sync_add_and_fetch (&stats->num_denied, 1);
+                break;
+        case STAT_CONNECT_FAIL:
+                __sync_add_and_fetch (&stats->num_connect_fails, 1);
+                break;
+        case STAT_CONNECT_TIMEOUT:
+                __sync_add_and_fetch (&stats->num_connect_timeouts, 1);
                 break;
         default:
                 return -1;
@@ -154,3 +384,12 @@ int update_stats (status_t update_level)
 
         return 0;
 }
+
+/*
+ * Count a connection made to a server, which took ms milliseconds.
+ */
+void update_connect_stats (unsigned long int ms)
+{
+        __sync_add_and_fetch (&stats->num_connects, 1);
+        __sync_add_and_fetch (&stats->connect_ms, ms);
+}
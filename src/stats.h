@@ -29,9 +29,12 @@
 typedef enum {
         STAT_BADCONN,           /* bad connection, for unknown reason */
         STAT_OPEN,              /* connection opened */
+        STAT_REQUEST,           /* another request on an open connection */
         STAT_CLOSE,             /* connection closed */
         STAT_REFUSE,            /* connection refused (to outside world) */
-        STAT_DENIED             /* connection denied to tinyproxy itself */
+        STAT_DENIED,            /* connection denied to tinyproxy itself */
+        STAT_CONNECT_FAIL,      /* no address of a server connected */
+        STAT_CONNECT_TIMEOUT    /* an address did not connect in time */
 } status_t;
 
 /*
@@ -40,5 +43,6 @@ typedef enum {
 extern void init_stats (void);
 extern int showstats (struct conn_s *connptr);
 extern int update_stats (status_t update_level);
+extern void update_connect_stats (unsigned long int ms);
 
 #endif
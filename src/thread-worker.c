@@ -0,0 +1,313 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The threaded worker ("WorkerMode thread").  A single worker process
+ * runs a fixed pool of threads, each handling one connection at a time
+ * just like a prefork child, but all of them sharing one copy of the
+ * configuration, the filter and the other caches.
+ *
+ * The main thread of the worker only accepts connections, and only as
+ * many as there are idle threads to hand them to.  The rest stay in the
+ * listen queue, where the kernel keeps them for us.
+ *
+ * The configuration is never reloaded inside the worker, since the
+ * threads read it without any locking.  On SIGHUP the parent reloads it
+ * and starts a new worker instead, and the old worker stops accepting,
+ * finishes the connections it has and exits.
+ */
+
+#include "main.h"
+
+#include "child.h"
+#include "daemon.h"
+#include "dns-cache.h"
+#include "heap.h"
+#include "log.h"
+#include "poller.h"
+#include "reqs.h"
+#include "server-pool.h"
+#include "sock.h"
+#include "thread-worker.h"
+#include "conf.h"
+
+#ifdef HAVE_PTHREAD
+
+/*
+ * The stack size of the connection threads.  A connection only ever
+ * keeps small buffers on the stack.
+ */
+#define THREAD_STACK_SIZE (512 * 1024)
+
+#define MAX_LISTEN_EVENTS 16
+
+static volatile sig_atomic_t draining;
+
+/*
+ * The connections accepted, but not yet picked up by a thread.  There are
+ * never more of them than there are idle threads.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t thread_idle = PTHREAD_COND_INITIALIZER;
+
+static int *pending;
+static unsigned int npending, pending_head;
+static unsigned int idle_threads, nthreads;
+
+static void thread_worker_sighup_handler (int sig)
+{
+        draining = TRUE;
+}
+
+static void *connection_thread (void *arg)
+{
+        int connfd;
+
+        child_scoreboard_attach ((struct child_s *) arg);
+
+        pthread_mutex_lock (&pool_lock);
+        while (1) {
+                while (npending == 0 && !draining) {
+                        idle_threads++;
+                        pthread_cond_signal (&thread_idle);
+                        pthread_cond_wait (&work_ready, &pool_lock);
+                        idle_threads--;
+                }
+
+                if (npending == 0)
+                        break;
+
+                connfd = pending[pending_head];
+                pending_head = (pending_head + 1) % nthreads;
+                npending--;
+                pthread_mutex_unlock (&pool_lock);
+
+                child_scoreboard_open ();
+                handle_connection (connfd);
+                dns_cache_prefetch ();
+                child_scoreboard_close ();
+
+                pthread_mutex_lock (&pool_lock);
+        }
+        pthread_mutex_unlock (&pool_lock);
+
+        return NULL;
+}
+
+/*
+ * Wait until at least one thread is idle, and return how many are.
+ * Returns 0 once the worker is draining.
+ */
+static unsigned int wait_for_idle_threads (void)
+{
+        unsigned int available;
+        struct timespec ts;
+
+        pthread_mutex_lock (&pool_lock);
+        while (idle_threads <= npending && !draining) {
+                /* Wake up every second to check for SIGHUP */
+                ts.tv_sec = time (NULL) + 1;
+                ts.tv_nsec = 0;
+                pthread_cond_timedwait (&thread_idle, &pool_lock, &ts);
+        }
+        available = draining ? 0 : idle_threads - npending;
+        pthread_mutex_unlock (&pool_lock);
+
+        return available;
+}
+
+static void queue_connection (int connfd)
+{
+        pthread_mutex_lock (&pool_lock);
+        pending[(pending_head + npending) % nthreads] = connfd;
+        npending++;
+        pthread_cond_signal (&work_ready);
+        pthread_mutex_unlock (&pool_lock);
+}
+
+/*
+ * Accept up to "available" connections from the listening sockets which
+ * were found readable.
+ */
+static void accept_connections (struct poller_event *ev, int nev,
+                                unsigned int available)
+{
+        struct sockaddr_storage cliaddr;
+        socklen_t clilen;
+        int i;
+        int connfd;
+
+        for (i = 0; i < nev && available > 0; i++) {
+                while (available > 0) {
+                        clilen = sizeof (cliaddr);
+#ifdef HAVE_ACCEPT4
+                        connfd = accept4 (ev[i].fd,
+                                          (struct sockaddr *) &cliaddr,
+                                          &clilen, 0);
+#else
+                        connfd = accept (ev[i].fd,
+                                         (struct sockaddr *) &cliaddr,
+                                         &clilen);
+                        if (connfd >= 0 && socket_blocking (connfd) != 0) {
+                                close (connfd);
+                                continue;
+                        }
+#endif
+                        if (connfd < 0) {
+                                if (errno == EINTR || errno == ECONNABORTED)
+                                        continue;
+                                if (errno != EAGAIN)
+                                        log_message (LOG_ERR,
+                                                     "Accept returned an error "
+                                                     "(%s) ... retrying.",
+                                                     strerror (errno));
+                                break;
+                        }
+
+                        queue_connection (connfd);
+                        available--;
+                }
+        }
+}
+
+/*
+ * The main loop of a threaded worker.  Returns when tinyproxy is asked to
+ * quit or the worker is told to drain, once all the connections it has
+ * accepted are finished.
+ */
+int thread_worker_main (vector_t listen_fds, struct child_s *board,
+                        unsigned int threads)
+{
+        pthread_t *tids;
+        pthread_attr_t attr;
+        sigset_t mask, oldmask;
+        struct poller *poller;
+        struct poller_event ev[MAX_LISTEN_EVENTS];
+        unsigned int started, available;
+        ssize_t i;
+        int ret;
+
+        set_signal_handler (SIGHUP, thread_worker_sighup_handler);
+
+        poller = poller_create (vector_length (listen_fds));
+        if (!poller)
+                return -1;
+
+        for (i = 0; i < vector_length (listen_fds); i++) {
+                int *fd = (int *) vector_getentry (listen_fds, i, NULL);
+
+                if (socket_nonblocking (*fd) != 0) {
+                        log_message (LOG_ERR, "Failed to set the listening "
+                                     "socket %d to non-blocking: %s",
+                                     *fd, strerror (errno));
+                        return -1;
+                }
+
+                if (poller_set (poller, *fd, POLLER_READ) != 0) {
+                        log_message (LOG_ERR, "Failed to wait for the "
+                                     "listening socket %d: %s",
+                                     *fd, strerror (errno));
+                        return -1;
+                }
+        }
+
+        nthreads = threads;
+        tids = (pthread_t *) safecalloc (nthreads, sizeof (pthread_t));
+        pending = (int *) safecalloc (nthreads, sizeof (int));
+        if (!tids || !pending) {
+                log_message (LOG_CRIT,
+                             "Could not allocate memory for the threads.");
+                return -1;
+        }
+
+        /*
+         * The signals are left to the main thread, so they interrupt
+         * the wait for connections below.
+         */
+        sigemptyset (&mask);
+        sigaddset (&mask, SIGHUP);
+        sigaddset (&mask, SIGTERM);
+        pthread_sigmask (SIG_BLOCK, &mask, &oldmask);
+
+        pthread_attr_init (&attr);
+        pthread_attr_setstacksize (&attr, THREAD_STACK_SIZE);
+
+        for (started = 0; started != nthreads; started++) {
+                ret = pthread_create (&tids[started], &attr,
+                                      connection_thread, &board[started]);
+                if (ret != 0) {
+                        log_message (LOG_WARNING,
+                                     "Could only create %u of %u threads: %s",
+                                     started, nthreads, strerror (ret));
+                        break;
+                }
+        }
+
+        pthread_attr_destroy (&attr);
+        pthread_sigmask (SIG_SETMASK, &oldmask, NULL);
+
+        log_message (LOG_INFO, "Started %u connection threads.", started);
+
+        while (started > 0 && !config.quit && !draining) {
+                available = wait_for_idle_threads ();
+                if (available == 0)
+                        continue;
+
+                ret = poller_wait (poller, ev, MAX_LISTEN_EVENTS, 1000);
+                if (ret == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        log_message (LOG_ERR, "error waiting for "
+                                     "connections: %s", strerror (errno));
+                        break;
+                } else if (ret == 0) {
+                        server_pool_expire ();
+                        continue;
+                }
+
+                accept_connections (ev, ret, available);
+        }
+
+        log_message (LOG_INFO, "Threaded worker is finishing its "
+                     "connections.");
+
+        pthread_mutex_lock (&pool_lock);
+        draining = TRUE;
+        pthread_cond_broadcast (&work_ready);
+        pthread_mutex_unlock (&pool_lock);
+
+        for (i = 0; i < (ssize_t) started; i++)
+                pthread_join (tids[i], NULL);
+
+        poller_delete (poller);
+        safefree (tids);
+        safefree (pending);
+
+        return started > 0 ? 0 : -1;
+}
+
+#else /* HAVE_PTHREAD */
+
+int thread_worker_main (vector_t listen_fds, struct child_s *board,
+                        unsigned int threads)
+{
+        log_message (LOG_ERR, "The threaded worker mode is not supported "
+                     "on this platform.");
+        return -1;
+}
+
+#endif /* HAVE_PTHREAD */
@@ -66,6 +66,7 @@ do_transparent_proxy (struct conn_s *connptr, hashmap_t hashofheaders,
         if (length <= 0) {
                 struct sockaddr_in dest_addr;
 
+                length = sizeof (dest_addr);
                 if (getsockname
                     (connptr->client_fd, (struct sockaddr *) &dest_addr,
                      &length) < 0) {
@@ -78,8 +79,9 @@ do_transparent_proxy (struct conn_s *connptr, hashmap_t hashofheaders,
                         return 0;
                 }
 
-                request->host = (char *) safemalloc (17);
-                strlcpy (request->host, inet_ntoa (dest_addr.sin_addr), 17);
+                request->host = (char *) safemalloc (INET_ADDRSTRLEN);
+                inet_ntop (AF_INET, &dest_addr.sin_addr, request->host,
+                           INET_ADDRSTRLEN);
 
                 request->port = ntohs (dest_addr.sin_port);
 
@@ -45,6 +45,7 @@ send_http_message (struct conn_s *connptr, int http_code,
         };
 
         http_message_t msg;
+        int ret;
 
         msg = http_message_create (http_code, error_title);
         if (msg == NULL)
@@ -52,10 +53,10 @@ send_http_message (struct conn_s *connptr, int http_code,
 
         http_message_add_headers (msg, headers, 3);
         http_message_set_body (msg, message, strlen (message));
-        http_message_send (msg, connptr->client_fd);
+        ret = http_message_send (msg, &connptr->client_out);
         http_message_destroy (msg);
 
-        return 0;
+        return ret;
 }
 
 /*
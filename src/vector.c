@@ -27,25 +27,41 @@
 #include "vector.h"
 
 /*
- * These structures are the storage for the "vector".  Entries are
- * stored in struct vectorentry_s (the data and the length), and the
- * "vector" structure is implemented as a linked-list.  The struct
- * vector_s stores a pointer to the first vector (vector[0]) and a
- * count of the number of entries (or how long the vector is.)
+ * These structures are the storage for the "vector".  The data of all the
+ * entries is stored back to back in one growing block, each entry
+ * starting on a boundary suitable for any type.  Where each entry is, and
+ * how long, is kept in a growing array in the order of the entries, so
+ * an entry is found by its position straight away.  (Prepending only
+ * moves the descriptions along; the data goes at the end of the block.)
  */
 struct vectorentry_s {
-        void *data;
+        size_t offset;
         size_t len;
-
-        struct vectorentry_s *next;
 };
 
 struct vector_s {
         size_t num_entries;
-        struct vectorentry_s *head;
-        struct vectorentry_s *tail;
+        size_t max_entries;
+        struct vectorentry_s *entries;
+
+        char *data;
+        size_t used;            /* bytes of data in use */
+        size_t size;            /* bytes allocated for the data */
+};
+
+/*
+ * Each entry is aligned like the most demanding of these.
+ */
+union vector_align {
+        long l;
+        double d;
+        void *p;
 };
 
+#define VECTOR_ALIGN(len) \
+        (((len) + sizeof (union vector_align) - 1) \
+         & ~(sizeof (union vector_align) - 1))
+
 /*
  * Create an vector.  The vector initially has no elements and no
  * storage has been allocated for the entries.
@@ -61,8 +77,10 @@ vector_t vector_create (void)
         if (!vector)
                 return NULL;
 
-        vector->num_entries = 0;
-        vector->head = vector->tail = NULL;
+        vector->num_entries = vector->max_entries = 0;
+        vector->entries = NULL;
+        vector->data = NULL;
+        vector->used = vector->size = 0;
 
         return vector;
 }
@@ -75,21 +93,52 @@ vector_t vector_create (void)
  */
 int vector_delete (vector_t vector)
 {
-        struct vectorentry_s *ptr, *next;
-
         if (!vector)
                 return -EINVAL;
 
-        ptr = vector->head;
-        while (ptr) {
-                next = ptr->next;
-                safefree (ptr->data);
-                safefree (ptr);
+        safefree (vector->entries);
+        safefree (vector->data);
+        safefree (vector);
+
+        return 0;
+}
 
-                ptr = next;
+/*
+ * Make room for one more entry of len bytes.
+ *
+ * Returns: 0 on success
+ *          -ENOMEM if there is not enough memory
+ */
+static int vector_grow (vector_t vector, size_t len)
+{
+        struct vectorentry_s *entries;
+        char *data;
+        size_t n;
+
+        if (vector->num_entries == vector->max_entries) {
+                n = vector->max_entries ? vector->max_entries * 2 : 8;
+                entries = (struct vectorentry_s *)
+                    saferealloc (vector->entries,
+                                 n * sizeof (struct vectorentry_s));
+                if (!entries)
+                        return -ENOMEM;
+
+                vector->entries = entries;
+                vector->max_entries = n;
         }
 
-        safefree (vector);
+        if (vector->size - vector->used < len) {
+                for (n = vector->size ? vector->size : 256;
+                     n - vector->used < len; n *= 2)
+                        continue;
+
+                data = (char *) saferealloc (vector->data, n);
+                if (!data)
+                        return -ENOMEM;
+
+                vector->data = data;
+                vector->size = n;
+        }
 
         return 0;
 }
@@ -122,34 +171,24 @@ vector_insert (vector_t      vector,
             (pos != INSERT_PREPEND && pos != INSERT_APPEND))
                 return -EINVAL;
 
-        entry =
-            (struct vectorentry_s *) safemalloc (sizeof (struct vectorentry_s));
-        if (!entry)
-                return -ENOMEM;
-
-        entry->data = safemalloc (len);
-        if (!entry->data) {
-                safefree (entry);
+        if (vector_grow (vector, VECTOR_ALIGN (len)) < 0)
                 return -ENOMEM;
-        }
 
-        memcpy (entry->data, data, len);
-        entry->len = len;
-        entry->next = NULL;
-
-        /* If there is no head or tail, create them */
-        if (!vector->head && !vector->tail)
-                vector->head = vector->tail = entry;
-        else if (pos == INSERT_PREPEND) {
+        if (pos == INSERT_PREPEND) {
                 /* prepend the entry */
-                entry->next = vector->head;
-                vector->head = entry;
+                memmove (vector->entries + 1, vector->entries,
+                         vector->num_entries * sizeof (*entry));
+                entry = &vector->entries[0];
         } else {
                 /* append the entry */
-                vector->tail->next = entry;
-                vector->tail = entry;
+                entry = &vector->entries[vector->num_entries];
         }
 
+        entry->offset = vector->used;
+        entry->len = len;
+        memcpy (vector->data + entry->offset, data, len);
+
+        vector->used += VECTOR_ALIGN (len);
         vector->num_entries++;
 
         return 0;
@@ -179,24 +218,13 @@ int vector_prepend (vector_t vector, void *data, size_t len)
  */
 void *vector_getentry (vector_t vector, size_t pos, size_t * size)
 {
-        struct vectorentry_s *ptr;
-        size_t loc;
-
         if (!vector || pos >= vector->num_entries)
                 return NULL;
 
-        loc = 0;
-        ptr = vector->head;
-
-        while (loc != pos) {
-                ptr = ptr->next;
-                loc++;
-        }
-
         if (size)
-                *size = ptr->len;
+                *size = vector->entries[pos].len;
 
-        return ptr->data;
+        return vector->data + vector->entries[pos].offset;
 }
 
 /*
@@ -39,6 +39,7 @@ extern int vector_delete (vector_t vector);
  * When you insert a piece of data into the vector, the data will be
  * duplicated, so you must free your copy if it was created on the heap.
  * The data must be non-NULL and the length must be greater than zero.
+ * The data of all the entries may move when an entry is inserted.
  *
  * Returns: negative on error
  *          0 upon successful insert.
@@ -55,7 +56,8 @@ extern int vector_prepend (vector_t vector, void *data, size_t len);
  * library doesn't take any steps to prevent you from messing up the
  * vector.  (A better rule is, don't modify the data since you'll
  * likely mess up the "length" parameter of the data.)  However, DON'T
- * try to realloc or free the data; doing so will break the vector.
+ * try to realloc or free the data; doing so will break the vector.  The
+ * pointer is only good until the next entry is inserted.
  *
  * If "size" is NULL the size of the data is not returned.
  *
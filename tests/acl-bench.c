@@ -0,0 +1,82 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Checks the access list with NRULES numeric rules, and prints how long
+ * check_acl() takes for a client which matches the first rule, the last
+ * one, and none.  Every connection goes through it.
+ */
+
+#include "main.h"
+
+#include "acl.h"
+#include "text.h"
+#include "vector.h"
+
+#include "check.h"
+
+#define NRULES 1000
+#define NCALLS 2000
+
+/*
+ * Time NCALLS calls for the client, after checking the answer once.
+ */
+static void bench (vector_t rules, const char *name, const char *ip,
+                   int expected)
+{
+        struct timespec start, end;
+        double ns;
+        int i;
+
+        CHECK (check_acl (ip, rules) == expected, name);
+
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        for (i = 0; i != NCALLS; i++)
+                check_acl (ip, rules);
+        clock_gettime (CLOCK_MONOTONIC, &end);
+
+        ns = (end.tv_sec - start.tv_sec) * 1e9
+            + (end.tv_nsec - start.tv_nsec);
+        printf ("%-24s %10.0f ns per check\n", name, ns / NCALLS);
+}
+
+int main (void)
+{
+        vector_t rules = NULL;
+        char location[64];
+        int i;
+
+        /* Deny 10.0.0.0/24 ... 10.3.230.0/24, then allow 192.168.0.0/16 */
+        for (i = 0; i != NRULES - 1; i++) {
+                snprintf (location, sizeof (location), "10.%d.%d.0/24",
+                          i / 256, i % 256);
+                CHECK (insert_acl (location, ACL_DENY, &rules) == 0,
+                       "insert rule");
+        }
+        strlcpy (location, "192.168.0.0/16", sizeof (location));
+        CHECK (insert_acl (location, ACL_ALLOW, &rules) == 0, "insert rule");
+        CHECK (vector_length (rules) == NRULES, "number of rules");
+
+        printf ("%d access rules\n", NRULES);
+        bench (rules, "first rule (denied)", "10.0.0.1", 0);
+        bench (rules, "last rule (allowed)", "192.168.1.1", 1);
+        bench (rules, "no rule (denied)", "172.16.0.1", 0);
+        bench (rules, "IPv6, no rule (denied)", "2001:db8::1", 0);
+
+        flush_access_list (rules);
+
+        return CHECK_RESULT ();
+}
@@ -0,0 +1,43 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The checks of the programs run by "make check".  Each program is a
+ * single file, which includes this once.
+ */
+
+#ifndef TINYPROXY_CHECK_H
+#define TINYPROXY_CHECK_H
+
+static int failures = 0;
+
+#define CHECK(cond, name) \
+        do { \
+                if (!(cond)) { \
+                        fprintf (stderr, "FAIL: %s: %s (line %d)\n", \
+                                 name, #cond, __LINE__); \
+                        failures++; \
+                } \
+        } while (0)
+
+/*
+ * The exit status of the program, after all the checks.
+ */
+#define CHECK_RESULT() \
+        (failures ? (fprintf (stderr, "%d checks failed\n", failures), \
+                     EXIT_FAILURE) : EXIT_SUCCESS)
+
+#endif
@@ -0,0 +1,188 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Checks for the chunked transfer coding decoder.  Every body is also fed
+ * through it split at each possible point, and one byte at a time, since
+ * that is how it arrives from the network.
+ */
+
+#include "main.h"
+
+#include "chunked.h"
+
+#include "check.h"
+
+/*
+ * Feed body through the decoder in pieces of at most step bytes, the
+ * first of which is first bytes long (if not 0).  The chunk data is
+ * stripped into out, which has room for len bytes.
+ *
+ * Returns the number of bytes which belong to the body, or -1 if it is
+ * malformed.  *done is set if the decoder reached its end.
+ */
+static ssize_t
+decode (const char *body, size_t first, size_t step,
+        char *out, size_t *outlen, int *done)
+{
+        struct chunked c;
+        char buf[256];
+        size_t len = strlen (body), off = 0, n, kept;
+        ssize_t used;
+
+        chunked_init (&c);
+        *outlen = 0;
+
+        while (off < len && !chunked_done (&c)) {
+                n = first ? first : step;
+                first = 0;
+                if (n > len - off)
+                        n = len - off;
+
+                memcpy (buf, body + off, n);
+                used = chunked_parse (&c, buf, n, TRUE, &kept);
+                if (used < 0)
+                        return -1;
+
+                memcpy (out + *outlen, buf, kept);
+                *outlen += kept;
+                off += used;
+                if ((size_t) used < n)
+                        break;
+        }
+
+        *done = chunked_done (&c);
+        return off;
+}
+
+/*
+ * The body must decode to data, whichever way it is split, ending
+ * exactly where the body does (anything in rest is left alone).
+ */
+static void
+check_body (const char *name, const char *body, const char *rest,
+            const char *data)
+{
+        char input[256], out[256];
+        size_t len = strlen (body), split, outlen;
+        ssize_t used;
+        int done;
+
+        snprintf (input, sizeof (input), "%s%s", body, rest);
+
+        for (split = 0; split < len; split++) {
+                used = decode (input, split, sizeof (input), out, &outlen,
+                               &done);
+                CHECK (used == (ssize_t) len, name);
+                CHECK (done, name);
+                CHECK (outlen == strlen (data)
+                       && memcmp (out, data, outlen) == 0, name);
+        }
+
+        used = decode (input, 0, 1, out, &outlen, &done);
+        CHECK (used == (ssize_t) len, name);
+        CHECK (done, name);
+        CHECK (outlen == strlen (data) && memcmp (out, data, outlen) == 0,
+               name);
+}
+
+/*
+ * The body must be rejected, whichever way it is split.
+ */
+static void check_malformed (const char *name, const char *body)
+{
+        char out[256];
+        size_t split, outlen;
+        int done;
+
+        for (split = 0; split < strlen (body); split++)
+                CHECK (decode (body, split, 256, out, &outlen, &done) < 0,
+                       name);
+        CHECK (decode (body, 0, 1, out, &outlen, &done) < 0, name);
+}
+
+/*
+ * The body is fine as far as it goes, but has not ended yet.
+ */
+static void check_incomplete (const char *name, const char *body)
+{
+        char out[256];
+        size_t outlen;
+        int done;
+
+        CHECK (decode (body, 0, 1, out, &outlen, &done)
+               == (ssize_t) strlen (body) && !done, name);
+}
+
+static void check_head (void)
+{
+        char buf[CHUNK_OVERHEAD];
+
+        CHECK (chunked_head (buf, 0) == 3 && strcmp (buf, "0\r\n") == 0,
+               "chunk head");
+        CHECK (chunked_head (buf, 0x1f00) == 6
+               && strcmp (buf, "1f00\r\n") == 0, "chunk head");
+}
+
+int main (void)
+{
+        check_body ("single chunk", "5\r\nhello\r\n0\r\n\r\n", "", "hello");
+        check_body ("several chunks",
+                    "5\r\nhello\r\n1\r\n \r\nA\r\n0123456789\r\n0\r\n\r\n",
+                    "", "hello 0123456789");
+        check_body ("upper and lower case hex",
+                    "a\r\n0123456789\r\nB\r\nabcdefghijk\r\n0\r\n\r\n", "",
+                    "0123456789abcdefghijk");
+        check_body ("leading zeros", "0005\r\nhello\r\n000\r\n\r\n", "",
+                    "hello");
+        check_body ("bare line feeds", "5\nhello\n0\n\n", "", "hello");
+        check_body ("empty body", "0\r\n\r\n", "", "");
+        check_body ("extensions",
+                    "5;name=value\r\nhello\r\n5 ; a=\"b;c\"\r\nworld\r\n"
+                    "0;last\r\n\r\n", "", "helloworld");
+        check_body ("trailers",
+                    "5\r\nhello\r\n0\r\nExpires: never\r\nX-A: b\r\n\r\n",
+                    "", "hello");
+        check_body ("trailers with bare line feeds",
+                    "5\nhello\n0\nX-A: b\n\n", "", "hello");
+        check_body ("the next message is left alone",
+                    "5\r\nhello\r\n0\r\n\r\n", "GET / HTTP/1.1\r\n\r\n",
+                    "hello");
+
+        check_malformed ("no size", "\r\nhello\r\n0\r\n\r\n");
+        check_malformed ("only an extension", ";ext\r\nhello\r\n0\r\n\r\n");
+        check_malformed ("bare line feed for a size", "\n");
+        check_malformed ("no size after a chunk", "5\r\nhello\r\n\r\n");
+        check_malformed ("no digit before a space", " 5\r\nhello\r\n");
+        check_malformed ("not hex", "5g\r\nhello\r\n0\r\n\r\n");
+        check_malformed ("sign", "+5\r\nhello\r\n0\r\n\r\n");
+        check_malformed ("missing line break after data",
+                         "5\r\nhelloX\r\n0\r\n\r\n");
+        check_malformed ("carriage return without line feed",
+                         "5\r\rhello\r\n0\r\n\r\n");
+        check_malformed ("overflow", "1000000000000000000\r\n");
+        check_malformed ("overflow in leading digits",
+                         "fffffffffffffffff\r\n");
+
+        check_incomplete ("size line", "5");
+        check_incomplete ("chunk data", "5\r\nhel");
+        check_incomplete ("trailer", "5\r\nhello\r\n0\r\nX-A: b\r\n");
+        check_incomplete ("large size", "ffffffff\r\n");
+
+        check_head ();
+
+        return CHECK_RESULT ();
+}
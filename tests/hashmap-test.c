@@ -0,0 +1,117 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Checks for the hashmap: the entries have to survive the table growing,
+ * keep the order they were put in, and be found whatever the case of
+ * their keys.
+ */
+
+#include "main.h"
+
+#include "hashmap.h"
+
+#include "check.h"
+
+#define NENTRIES 1000
+
+static void check_hashmap (void)
+{
+        hashmap_t map;
+        hashmap_iter iter;
+        char key[32], value[32], *k;
+        void *data;
+        ssize_t len;
+        int i, ok;
+
+        map = hashmap_create (4);
+        CHECK (map != NULL, "hashmap create");
+        CHECK (hashmap_first (map) < 0, "empty hashmap");
+
+        /* Many more entries than were made room for */
+        for (i = 0; i != NENTRIES; i++) {
+                snprintf (key, sizeof (key), "Key-%d", i);
+                snprintf (value, sizeof (value), "value %d", i);
+                CHECK (hashmap_insert (map, key, value, strlen (value) + 1)
+                       == 0, "hashmap insert");
+        }
+
+        /* In insertion order */
+        ok = TRUE;
+        i = 0;
+        for (iter = hashmap_first (map); !hashmap_is_end (map, iter);
+             iter++) {
+                snprintf (key, sizeof (key), "Key-%d", i);
+                snprintf (value, sizeof (value), "value %d", i);
+                len = hashmap_return_entry (map, iter, &k, &data);
+                if (len != (ssize_t) strlen (value) + 1 || strcmp (k, key)
+                    || strcmp ((char *) data, value))
+                        ok = FALSE;
+                i++;
+        }
+        CHECK (ok && i == NENTRIES, "hashmap order");
+
+        /* Keys are found whatever their case */
+        len = hashmap_entry_by_key (map, "KEY-500", &data);
+        CHECK (len > 0 && strcmp ((char *) data, "value 500") == 0,
+               "lookup in another case");
+        CHECK (hashmap_entry_by_key (map, "key-1000", &data) == 0,
+               "missing key");
+        CHECK (hashmap_is_end (map, hashmap_find (map, "nothing")),
+               "find missing key");
+
+        /* A key may be there more than once; the first one is found */
+        CHECK (hashmap_insert (map, "key-7", "again", 6) == 0,
+               "duplicate insert");
+        CHECK (hashmap_search (map, "KEY-7") == 2, "duplicate count");
+        len = hashmap_entry_by_key (map, "key-7", &data);
+        CHECK (len > 0 && strcmp ((char *) data, "value 7") == 0,
+               "first duplicate");
+
+        /* Removing keeps the order of the others */
+        CHECK (hashmap_remove (map, "Key-7") == 2, "remove duplicates");
+        CHECK (hashmap_remove (map, "key-7") == 0, "remove again");
+        CHECK (hashmap_search (map, "key-7") == 0, "removed key");
+        iter = hashmap_find (map, "key-8");
+        CHECK (!hashmap_is_end (map, iter), "key after the removed one");
+        ok = TRUE;
+        i = 0;
+        for (iter = hashmap_first (map); !hashmap_is_end (map, iter);
+             iter++) {
+                hashmap_return_entry (map, iter, &k, &data);
+                snprintf (key, sizeof (key), "Key-%d", i < 7 ? i : i + 1);
+                if (strcmp (k, key))
+                        ok = FALSE;
+                i++;
+        }
+        CHECK (ok && i == NENTRIES - 1, "order after remove");
+
+        /* Removed keys can be put back, at the end */
+        CHECK (hashmap_insert (map, "key-7", "back", 5) == 0,
+               "insert after remove");
+        len = hashmap_entry_by_key (map, "Key-7", &data);
+        CHECK (len == 5 && strcmp ((char *) data, "back") == 0,
+               "key put back");
+
+        CHECK (hashmap_delete (map) == 0, "hashmap delete");
+}
+
+int main (void)
+{
+        check_hashmap ();
+
+        return CHECK_RESULT ();
+}
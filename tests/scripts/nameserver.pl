@@ -0,0 +1,292 @@
+#!/usr/bin/perl -w
+
+# Simple name server.
+#
+# Answers A queries for every name below "test." with a fixed address, so
+# that tinyproxy's resolver can be tested without the system's one.
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 2 of the License, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+# FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+# more details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, see <http://www.gnu.org/licenses/>.
+
+
+use strict;
+
+use IO::Socket;
+use POSIX qw(setsid);
+use Errno;
+use Getopt::Long;
+use Pod::Usage;
+use Fcntl ':flock'; # import LOCK_* constants
+
+my $address = "127.0.0.1";
+my $port = 5353;
+my $answer_address = "127.0.0.3";
+my $ttl = 60;
+my $pid_file = "/tmp/nameserver.pid";
+my $log_dir = "/tmp";
+my $log_file;
+my $help = 0;
+
+use constant {
+	TYPE_A => 1,
+	TYPE_SOA => 6,
+	CLASS_IN => 1,
+	RCODE_FORMERR => 1,
+	RCODE_NXDOMAIN => 3,
+	RCODE_NOTIMP => 4,
+};
+
+sub logmsg {
+	print STDERR "[", scalar localtime, ", $$] $0: @_\n";
+}
+
+sub start_server($$) {
+	my $address = shift;
+	my $port = shift;
+	my $server;
+
+	$server = IO::Socket::INET->new(Proto => 'udp',
+					LocalAddr => $address,
+					LocalPort => $port,
+					ReuseAddr => 1)
+		or die "can't bind to $address:$port: $!";
+
+	return $server;
+}
+
+# Read the (uncompressed) name at the given offset, returning it and the
+# offset just past it.
+sub parse_name($$) {
+	my $packet = shift;
+	my $offset = shift;
+	my @labels = ();
+
+	while (1) {
+		return undef if ($offset >= length($packet));
+		my $len = ord(substr($packet, $offset, 1));
+		$offset++;
+		last if ($len == 0);
+		return undef if ($len > 63 or $offset + $len > length($packet));
+		push @labels, substr($packet, $offset, $len);
+		$offset += $len;
+	}
+
+	return (join(".", @labels), $offset);
+}
+
+sub header($$$$) {
+	my $id = shift;
+	my $flags = shift;
+	my $rcode = shift;
+	my $ancount = shift;
+
+	# QR, AA and RD copied from the query; no recursion available.
+	return pack("nnnnnn", $id, 0x8400 | ($flags & 0x0100) | $rcode,
+		    1, $ancount, $ancount ? 0 : 1, 0);
+}
+
+sub soa_record() {
+	# test. SOA ns.test. hostmaster.test. 1 3600 600 86400 60
+	my $rdata = pack("C/a* C/a* x", "ns", "test") .
+		    pack("C/a* C/a* x", "hostmaster", "test") .
+		    pack("NNNNN", 1, 3600, 600, 86400, $ttl);
+
+	return pack("C/a* x", "test") .
+	       pack("nnNn", TYPE_SOA, CLASS_IN, $ttl, length($rdata)) . $rdata;
+}
+
+sub answer($) {
+	my $query = shift;
+
+	return undef if (length($query) < 12);
+
+	my ($id, $flags, $qdcount) = unpack("nnn", $query);
+	return undef if ($flags & 0x8000);
+
+	if ($qdcount != 1 or ($flags & 0x7800)) {
+		return pack("nnnnnn", $id, 0x8000 |
+			    (($flags & 0x7800) ? RCODE_NOTIMP : RCODE_FORMERR),
+			    0, 0, 0, 0);
+	}
+
+	my ($name, $offset) = parse_name($query, 12);
+	return undef if (!defined($name) or $offset + 4 > length($query));
+
+	my ($qtype, $qclass) = unpack("nn", substr($query, $offset, 4));
+	my $question = substr($query, 12, $offset + 4 - 12);
+
+	logmsg "query for $name (type $qtype)";
+
+	if (lc($name) !~ /(^|\.)test$/ or $qclass != CLASS_IN) {
+		return header($id, $flags, RCODE_NXDOMAIN, 0) . $question .
+		       soa_record();
+	}
+
+	if ($qtype != TYPE_A) {
+		# the name exists, but has no records of this type
+		return header($id, $flags, 0, 0) . $question . soa_record();
+	}
+
+	return header($id, $flags, 0, 1) . $question .
+	       pack("nnnNn", 0xc00c, TYPE_A, CLASS_IN, $ttl, 4) .
+	       inet_aton($answer_address);
+}
+
+sub process_options() {
+	my $result = GetOptions("help|?" => \$help,
+				"address=s" => \$address,
+				"port=s" => \$port,
+				"answer=s" => \$answer_address,
+				"pid-file=s" => \$pid_file,
+				"log-dir=s" => \$log_dir);
+	die "Error reading cmdline options! $!" unless $result;
+
+	pod2usage(1) if $help;
+
+	# some post-processing:
+
+	($port) = $port =~ /^(\d+)$/ or die "invalid port";
+	inet_aton($answer_address) or die "invalid answer address";
+	$log_file = "$log_dir/nameserver.log";
+}
+
+sub daemonize() {
+	umask 0;
+	chdir "/" or die "daemonize: can't chdir to /: $!";
+	open STDIN, "/dev/null" or
+		die "daemonize: Can't read from /dev/null: $!";
+
+	my $pid = fork();
+	die "daemonize: can't fork: $!" if not defined($pid);
+	exit(0) if $pid != 0; # parent
+
+	# child (daemon)
+	setsid or die "daemonize: Can't create a new session: $!";
+}
+
+sub reopen_logs() {
+	open STDOUT, ">> $log_file" or
+		die "daemonize: Can't write to '$log_file': $!";
+	open STDERR, ">> $log_file" or
+		die "daemonize: Can't write to '$log_file': $!";
+}
+
+sub get_pid_lock() {
+	# first make sure the file exists
+	open(LOCKFILE_W, ">> $pid_file") or
+		die "Error opening pid file '$pid_file' for writing: $!";
+
+	# open for reading and try to lock:
+	open(LOCKFILE, "< $pid_file") or
+		die "Error opening pid file '$pid_file' for reading: $!";
+	unless (flock(LOCKFILE, LOCK_EX|LOCK_NB)) {
+		print "pid file '$pid_file' is already locked.\n";
+		my $other_pid = <LOCKFILE>;
+		if (!defined($other_pid)) {
+			print "Error reading from pid file.\n";
+		} else {
+			chomp($other_pid);
+			if (!$other_pid) {
+				print "pid file is empty.\n";
+			} else {
+				print "Nameserver is already running  with pid '$other_pid'.\n";
+			}
+		}
+		close LOCKFILE;
+		exit(0);
+	}
+
+	# now re-open for recreating the file and write our pid
+	close(LOCKFILE_W);
+	open(LOCKFILE_W, "> $pid_file") or
+		die "Error opening pid file '$pid_file' for writing: $!";
+	LOCKFILE_W->autoflush(1);
+	print LOCKFILE_W "$$";
+	close(LOCKFILE_W);
+}
+
+# "main" ...
+
+$|=1; # autoflush
+
+process_options();
+
+# bind before detaching, so that the caller can use the server right away
+my $server = start_server($address, $port);
+
+daemonize();
+get_pid_lock();
+reopen_logs();
+
+logmsg "server started listening on $address:$port";
+
+while (1) {
+	my $query;
+	my $peer = $server->recv($query, 512) or do {
+		next if ($!{EINTR});
+		die "recv: $!";
+	};
+
+	my $reply = answer($query);
+	next unless defined($reply);
+
+	$server->send($reply, 0, $peer) or logmsg "send: $!";
+}
+
+__END__
+
+=head1 nameserver.pl
+
+A simple name server written in perl.
+
+=head1 SYNOPSIS
+
+nameserver.pl [options]
+
+=head1 OPTIONS
+
+=over 8
+
+=item B<--help>
+
+Print a brief help message and exit.
+
+=item B<--address>
+
+Specify the address for the server to listen on.
+
+=item B<--port>
+
+Specify the UDP port number for the server to listen on.
+
+=item B<--answer>
+
+Specify the address returned for names below "test.".
+
+=item B<--log-dir>
+
+Specify the directory where the log file should be stored.
+
+=item B<--pid-file>
+
+Specify the location of the  pid lock file.
+
+=back
+
+=head1 DESCRIPTION
+
+This is a very simple name server. It answers A queries for every name in the
+"test." domain with the same address, says a name exists but has no records
+for other query types, and that any name outside the domain does not exist.
+
+=cut
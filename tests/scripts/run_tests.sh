@@ -46,6 +46,14 @@ WEBSERVER_LOG_DIR=$TESTENV_DIR/var/log/webserver
 WEBSERVER_BIN_FILE=webserver.pl
 WEBSERVER_BIN=$SCRIPTS_DIR/$WEBSERVER_BIN_FILE
 
+NAMESERVER_IP=127.0.0.4
+NAMESERVER_PORT=35353
+NAMESERVER_PID_DIR=$TESTENV_DIR/var/run/nameserver
+NAMESERVER_PID_FILE=$NAMESERVER_PID_DIR/nameserver.pid
+NAMESERVER_LOG_DIR=$TESTENV_DIR/var/log/nameserver
+NAMESERVER_BIN=$SCRIPTS_DIR/nameserver.pl
+NAMESERVER_TEST_HOST=web.test
+
 WEBCLIENT_LOG=$LOG_DIR/webclient.log
 WEBCLIENT_BIN=$SCRIPTS_DIR/webclient.pl
 
@@ -93,6 +101,8 @@ ViaProxyName "tinyproxy"
 #DisableViaHeader Yes
 ConnectPort 443
 ConnectPort 563
+DNSServer $NAMESERVER_IP
+DNSPort $NAMESERVER_PORT
 FilterURLs On
 Filter "$TINYPROXY_FILTER_FILE"
 XTinyproxy Yes
@@ -138,6 +148,27 @@ stop_webserver() {
 	fi
 }
 
+provision_nameserver() {
+	mkdir -p $NAMESERVER_PID_DIR
+	mkdir -p $NAMESERVER_LOG_DIR
+}
+
+start_nameserver() {
+	echo -n "starting name server..."
+	$NAMESERVER_BIN --address $NAMESERVER_IP --port $NAMESERVER_PORT --answer $WEBSERVER_IP --log-dir $NAMESERVER_LOG_DIR --pid-file $NAMESERVER_PID_FILE
+	echo " done (listening on $NAMESERVER_IP:$NAMESERVER_PORT)"
+}
+
+stop_nameserver() {
+	echo -n "killing nameserver..."
+	kill $(cat $NAMESERVER_PID_FILE)
+	if test "x$?" = "x0" ; then
+		echo " ok"
+	else
+		echo " error"
+	fi
+}
+
 wait_for_some_seconds() {
 	SECONDS=$1
 	if test "x$SECONDS" = "x" ; then
@@ -172,8 +203,10 @@ run_basic_webclient_request() {
 provision_initial
 provision_tinyproxy
 provision_webserver
+provision_nameserver
 
 start_webserver
+start_nameserver
 start_tinyproxy
 
 wait_for_some_seconds 3
@@ -188,6 +221,10 @@ echo -n "testing connection through tinyproxy..."
 run_basic_webclient_request "$TINYPROXY_IP:$TINYPROXY_PORT" "http://$WEBSERVER_IP:$WEBSERVER_PORT/"
 test "x$?" = "x0" || FAILED=$((FAILED + 1))
 
+echo -n "testing connection by name through tinyproxy..."
+run_basic_webclient_request "$TINYPROXY_IP:$TINYPROXY_PORT" "http://$NAMESERVER_TEST_HOST:$WEBSERVER_PORT/"
+test "x$?" = "x0" || FAILED=$((FAILED + 1))
+
 echo -n "requesting statspage via stathost url..."
 run_basic_webclient_request "$TINYPROXY_IP:$TINYPROXY_PORT" "http://$TINYPROXY_STATHOST_IP"
 test "x$?" = "x0" || FAILED=$((FAILED + 1))
@@ -201,6 +238,7 @@ if test "x$TINYPROXY_TESTS_WAIT" = "xyes"; then
 fi
 
 stop_tinyproxy
+stop_nameserver
 stop_webserver
 
 echo "done"
@@ -0,0 +1,80 @@
+/* tinyproxy - A fast light-weight HTTP proxy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Checks for the vector: the entries have to survive it growing, and keep
+ * the order they were put in.
+ */
+
+#include "main.h"
+
+#include "vector.h"
+
+#include "check.h"
+
+#define NENTRIES 1000
+
+static void check_vector (void)
+{
+        vector_t vector;
+        char buf[32], first[] = "first", *data;
+        size_t len;
+        int i, ok;
+
+        vector = vector_create ();
+        CHECK (vector != NULL, "vector create");
+        CHECK (vector_length (vector) == 0, "empty vector");
+        CHECK (vector_getentry (vector, 0, NULL) == NULL, "empty vector");
+
+        /* Entries of different sizes, at both ends, past any growth */
+        for (i = 0; i != NENTRIES; i++) {
+                snprintf (buf, sizeof (buf), "entry %d", i);
+                CHECK (vector_append (vector, buf, strlen (buf) + 1) == 0,
+                       "vector append");
+        }
+        CHECK (vector_prepend (vector, first, sizeof (first)) == 0, "vector prepend");
+        CHECK (vector_length (vector) == NENTRIES + 1, "vector length");
+
+        data = (char *) vector_getentry (vector, 0, &len);
+        CHECK (data && len == 6 && strcmp (data, "first") == 0,
+               "prepended entry");
+
+        ok = TRUE;
+        for (i = 0; i != NENTRIES; i++) {
+                snprintf (buf, sizeof (buf), "entry %d", i);
+                data = (char *) vector_getentry (vector, i + 1, &len);
+                if (!data || len != strlen (buf) + 1 || strcmp (data, buf))
+                        ok = FALSE;
+        }
+        CHECK (ok, "appended entries");
+        CHECK (vector_getentry (vector, NENTRIES + 1, NULL) == NULL,
+               "past the end");
+
+        CHECK (vector_append (vector, NULL, 1) < 0, "NULL data");
+        CHECK (vector_append (vector, buf, 0) < 0, "empty data");
+        CHECK (vector_length (vector) == NENTRIES + 1,
+               "length after errors");
+
+        CHECK (vector_delete (vector) == 0, "vector delete");
+        CHECK (vector_length (NULL) < 0, "NULL vector");
+}
+
+int main (void)
+{
+        check_vector ();
+
+        return CHECK_RESULT ();
+}